@@ -1,4 +1,5 @@
 cd "$(dirname "$0")"
 bash compile_init_full.sh
+bash compile_cmd_full.sh
 bash init_maker.sh
 bash iso_gen_big.sh
@@ -0,0 +1 @@
+x86_64-linux-gnu-gcc -static -pthread ../src/full/cmd.c -o ../rootfs/bin/cmd -lz
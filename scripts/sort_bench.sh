@@ -0,0 +1,55 @@
+# Generates a file of random lines and sorts it with SORT at a few /M
+# budgets, then with GNU sort -f -S at the same budgets, reporting wall time
+# and maximum RSS for each run. Every SORT output is checked against GNU's.
+#
+#   bash sort_bench.sh [size MB] [line length] [cmd binary]
+#                                   (default: 64 60, builds ../src/full/cmd.c)
+#
+# Line lengths are uniform in 1..2*length, letters in mixed case.
+cd "$(dirname "$0")"
+SIZE_MB=${1:-64}
+LINE=${2:-60}
+BUDGETS=${SORT_BUDGETS:-"8M 32M 64M"}
+work=$(mktemp -d "${TMPDIR:-/tmp}/sort_bench.XXXXXX")
+trap 'rm -rf "$work"' EXIT
+CMD=${3:-$work/cmd}
+if [ -z "$3" ]; then
+    gcc -O2 -pthread -o "$CMD" ../src/full/cmd.c -lz || exit 1
+fi
+
+awk -v bytes=$((SIZE_MB << 20)) -v len="$LINE" 'BEGIN {
+    srand(1)
+    chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    for (total = 0; total < bytes; total += n + 1) {
+        n = 1 + int(rand() * 2 * len); s = ""
+        for (i = 0; i < n; i++) s = s substr(chars, 1 + int(rand() * 52), 1)
+        print s
+    }
+}' > "$work/in"
+echo "$(wc -l < "$work/in") lines, $(wc -c < "$work/in") bytes, $(nproc) CPU(s)"
+
+# Runs a command; prints its wall time and the maximum RSS of the process.
+measure() {
+    python3 -c '
+import resource, subprocess, sys, time
+t = time.time()
+rc = subprocess.call(sys.argv[1:], stdout=subprocess.DEVNULL)
+ru = resource.getrusage(resource.RUSAGE_CHILDREN)
+print("%8.2f s %8.1f MB max RSS%s" % (time.time() - t, ru.ru_maxrss / 1024, "" if rc == 0 else "  (exit %d)" % rc))
+' "$@"
+}
+
+# SORT folds case and GNU sort -f too, but lines equal apart from case may
+# come out in either order; compare them folded.
+fail=0
+for m in $BUDGETS; do
+    printf '%-28s' "SORT /M:$m"
+    measure "$CMD" /C sort /M:$m /T:"$work" /O:"$work/out" "$work/in"
+    printf '%-28s' "sort -f -S $m"
+    measure env LC_ALL=C sort -f -S $m -T "$work" -o "$work/gnu" "$work/in"
+    if ! cmp -s <(tr a-z A-Z < "$work/out") <(tr a-z A-Z < "$work/gnu"); then
+        echo "FAIL: SORT /M:$m output differs from sort -f"
+        fail=1
+    fi
+done
+exit $fail
@@ -0,0 +1,58 @@
+# Regression test for XCOPY /D and /MIR: a destination file deleted,
+# replaced or overwritten in place between two syncs must be copied again,
+# even though the manifest from the first sync says the source has not
+# changed. The root's record must match the destination after the sync.
+#
+#   bash test_xcopy_sync.sh [cmd binary]   (default: builds ../src/full/cmd.c)
+cd "$(dirname "$0")"
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+CMD=${1:-$work/cmd}
+if [ -z "$1" ]; then
+    gcc -O2 -pthread -o "$CMD" ../src/full/cmd.c -lz || exit 1
+fi
+
+fail=0
+check() { # description, file, expected content
+    if [ "$(cat "$2" 2>/dev/null)" != "$3" ]; then
+        echo "FAIL: $1"
+        fail=1
+    else
+        echo "ok:   $1"
+    fi
+}
+
+for mode in /D /MIR; do
+    rm -rf "$work/src" "$work/dst"
+    mkdir -p "$work/src/sub"
+    echo alpha > "$work/src/a.txt"
+    echo beta > "$work/src/sub/b.txt"
+    "$CMD" /C xcopy $mode "$work/src" "$work/dst" > /dev/null
+    check "$mode first sync" "$work/dst/a.txt" alpha
+
+    rm "$work/dst/a.txt"
+    "$CMD" /C xcopy $mode "$work/src" "$work/dst" > /dev/null
+    check "$mode restores a deleted file" "$work/dst/a.txt" alpha
+
+    echo stale > "$work/dst/sub/b.new" && mv "$work/dst/sub/b.new" "$work/dst/sub/b.txt"
+    touch -d '2001-01-01' "$work/dst/sub/b.txt"
+    "$CMD" /C xcopy $mode "$work/src" "$work/dst" > /dev/null
+    check "$mode restores a replaced file" "$work/dst/sub/b.txt" beta
+
+    echo corrupted > "$work/dst/sub/b.txt"
+    "$CMD" /C xcopy $mode "$work/src" "$work/dst" > /dev/null
+    check "$mode restores a file overwritten in place" "$work/dst/sub/b.txt" beta
+
+    echo ALPHA > "$work/dst/a.txt" && touch -r "$work/src/a.txt" "$work/dst/a.txt"
+    "$CMD" /C xcopy $mode "$work/src" "$work/dst" > /dev/null
+    check "$mode restores a same-size overwrite with its mtime put back" "$work/dst/a.txt" alpha
+
+    stamp=$(awk '$NF == "." { print $5 }' "$work/dst/.xcopy-manifest" | sed 's/^0*//')
+    [ "$stamp" = "$(stat -c '%.9Y' "$work/dst")" ] && echo "ok:   $mode root record matches the destination" ||
+        { echo "FAIL: $mode root record matches the destination"; fail=1; }
+
+    "$CMD" /C xcopy $mode "$work/src" "$work/dst" > "$work/out"
+    grep -q "0 File(s) copied" "$work/out" && echo "ok:   $mode unchanged tree copies nothing" ||
+        { echo "FAIL: $mode unchanged tree copies nothing"; cat "$work/out"; fail=1; }
+done
+exit $fail
@@ -3,16 +3,19 @@
  *
  * A DOS-like command interpreter for Linux.
  * - Implements built-in commands like DIR, CD, COPY, etc.
- * - Uses the standard fork()/execvp() model to run any external system command
- *   found in the PATH (e.g., ls, busybox, cat).
+ * - Uses posix_spawn() to run any external system command found in the PATH
+ *   (e.g., ls, busybox, grep), with resolved paths cached between runs.
+ * - Runs .BAT scripts ("cmd file.bat") and single commands ("cmd /C ...").
  *
  * To compile:
- * gcc -static -o cmd cmd.c
+ * gcc -static -pthread -o cmd cmd.c -lz
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/wait.h>
@@ -22,12 +25,845 @@
 #include <time.h>
 #include <errno.h>
 #include <sys/utsname.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <spawn.h>
+#include <linux/perf_event.h>
+#include <sys/sysmacros.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // --- Definitions ---
-#define CMD_BUF_SIZE 256
+#define CMD_BUF_SIZE 1024
 #define MAX_ARGS 32
 #define PATH_MAX_LEN 1024
-#define FILE_BUF_SIZE 4096
+#define FILE_BUF_SIZE (1024 * 1024)
+#define FILE_BUF_ALIGN 4096
+#define COPY_CHUNK_SIZE (64 * 1024 * 1024)
+
+// --- Copy engine ---
+// Methods are tried in this order; each one picks up at the current file
+// offsets if the previous one gave up part-way through.
+enum copy_method { COPY_REFLINK, COPY_RANGE, COPY_SENDFILE, COPY_READWRITE };
+const char* copy_method_names[] = { "reflink (FICLONE)", "copy_file_range", "sendfile", "read/write" };
+
+#define COPY_VERBOSE 0x01
+
+// --- TYPE ---
+#define DOS_EOF_CHAR 0x1A // ^Z: text-mode TYPE stops here
+
+// --- DIR ---
+#define DIRENT_BUF_SIZE (64 * 1024)
+#define OUT_BUF_SIZE (256 * 1024)
+#define TIME_CACHE_SLOTS 64
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct dir_entry {
+    size_t name_off; // into dir_list.names, which may be reallocated
+    long long size, mtime;
+    unsigned char is_dir, is_link;
+    unsigned char hidden; // a directory kept for /S that the pattern does not match
+};
+
+struct dir_list {
+    struct dir_entry* items;
+    size_t count, cap;
+    char* names;
+    size_t names_len, names_cap;
+};
+
+struct dir_options {
+    char sort_key; // 0 (directory order), 'N', 'S' or 'D'
+    int reverse;
+    int recursive;
+    const struct wildcard* filter; // NULL: everything
+};
+
+struct dir_totals {
+    long long files, dirs, bytes;
+    long long shown; // entries listed, "." and ".." included
+};
+
+struct out_buf {
+    char* buf;
+    size_t len, cap;
+    int lines, page_lines;
+};
+
+// --- Wildcards ---
+// A DOS file pattern compiled once; the common shapes get a cheaper test
+// than the general matcher.
+enum wildcard_kind {
+    WILD_ALL,     // "*" or "*.*"
+    WILD_LITERAL, // no wildcards
+    WILD_PREFIX,  // "NAME*"
+    WILD_SUFFIX,  // "*.EXT"
+    WILD_NO_EXT,  // "*."
+    WILD_GENERIC
+};
+
+struct wildcard {
+    int kind;
+    size_t len;
+    char text[NAME_MAX + 1]; // folded: the fixed part, or the whole pattern
+};
+
+struct name_list {
+    char** names;
+    size_t count, cap;
+};
+
+// --- Built-in commands ---
+// One entry in the command registry (builtins[], after the prototypes).
+struct builtin {
+    const char* name;
+    int (*handler)(int argc, char** argv);
+    const char* spec; // NULL for DOS built-ins; getopt-style options for applets
+    int flags;
+};
+
+#define BUILTIN_RAW_LINE 0x01 // gets the unparsed rest of the line as argv[1] (SET)
+#define BUILTIN_PATHS    0x02 // arguments not typed as /switches are paths
+
+#define BUILTIN_SLOTS 128 // power of two, comfortably above 2x the entries
+#define PIPE_CHUNK_SIZE (1024 * 1024)
+
+// --- Command lines ---
+#define MAX_STAGES 8
+#define MAX_REDIRS 4
+
+enum redirect_mode { REDIR_IN = 1, REDIR_OUT, REDIR_APPEND, REDIR_DUP_STDOUT };
+
+struct redirect {
+    int fd;      // 0, 1 or 2
+    int mode;    // enum redirect_mode
+    char* path;  // NULL for 2>&1
+};
+
+struct stage {
+    char* argv[MAX_ARGS];
+    int argc;
+    unsigned int switches; // bit j: argv[j] was typed starting with '/'
+    struct redirect redirs[MAX_REDIRS];
+    int nredirs;
+};
+
+struct pipeline {
+    struct stage stages[MAX_STAGES];
+    int nstages;
+    char* storage; // all words, NUL-separated
+};
+
+// --- Batch files ---
+// A .BAT file is compiled once into a flat instruction list; labels become
+// instruction indexes, so GOTO and CALL :label are a table lookup instead of
+// a rescan of the file. Compiled scripts are cached by inode and mtime.
+enum batch_op { BOP_EXEC, BOP_GOTO, BOP_CALL, BOP_IF, BOP_SHIFT, BOP_EXIT };
+enum batch_cond { COND_ERRORLEVEL, COND_EXIST, COND_DEFINED, COND_EQUAL };
+
+#define BATCH_EOF (-1)     // GOTO :EOF
+#define BATCH_DYNAMIC (-2) // label contains %, looked up when reached
+#define BATCH_MAX_DEPTH 64
+
+struct batch_insn {
+    unsigned char op;      // enum batch_op
+    unsigned char quiet;   // line started with '@'
+    unsigned char cond;    // BOP_IF: enum batch_cond
+    unsigned char negate;  // BOP_IF: NOT
+    unsigned char nocase;  // BOP_IF: /I
+    unsigned char dynamic; // BOP_EXEC: expand and parse every time
+    unsigned char seen;    // BOP_EXEC: has run before, so worth keeping parsed
+    int target;            // BOP_GOTO, BOP_CALL: instruction index
+    int line;
+    long level;            // IF ERRORLEVEL n, EXIT /B n (-1: keep)
+    char* text;            // command, label, or first IF operand
+    char* text2;           // CALL arguments, or second IF operand
+    struct pipeline* parsed; // BOP_EXEC without %, kept once it runs twice
+    struct batch_insn* then; // BOP_IF: the command to run
+};
+
+struct batch_label {
+    char* name; // lower case, without the colon
+    int index;
+};
+
+struct batch_script {
+    char* path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    int refs;  // running invocations, plus one while cached
+    struct batch_insn* insns;
+    int ninsns, cap;
+    struct batch_label* labels; // open addressing, nlabel_slots is a power of two
+    int nlabel_slots;
+    struct batch_script* next;
+};
+
+// One level of CALL: its parameters (%0 is argv[shift]) and where to go back to.
+struct batch_frame {
+    char** argv;
+    int argc, shift;
+    int return_pc;
+};
+
+struct batch_run {
+    struct batch_script* script;
+    struct batch_frame* frames;
+    int depth, cap;
+    int pc;
+};
+
+#define BATCH_CACHE_MAX 32
+
+// --- FOR ---
+#define FOR_WINDOW_PER_JOB 4 // /P: iterations started ahead of the output, per running job
+
+// One FOR /P iteration; its output waits in the memfds until every earlier
+// iteration's output has been written.
+struct for_job {
+    pid_t pid;
+    int out_fd, err_fd;
+    int status;
+    int done;
+};
+
+// --- External commands ---
+struct hash_entry {
+    char* name;        // as typed
+    char* path;        // resolved executable
+    size_t dir_index;  // PATH directory it was found in
+    unsigned long hits;
+};
+
+struct path_dir {
+    char* path;
+    struct timespec mtime; // checked when there is no inotify watch
+    int wd;                // inotify watch descriptor, or -1
+};
+
+struct command_cache {
+    char* path_env;        // the PATH these dirs were built from
+    struct path_dir* dirs;
+    size_t ndirs;
+    struct hash_entry* slots; // open addressing, cap is a power of two
+    size_t cap, count;
+};
+
+struct command_cache command_cache;
+int dirwatch_fd = -2; // -2: not opened yet, -1: inotify unavailable
+
+// --- Case-insensitive path resolution ---
+// The names in one directory, hashed by their case-folded form.
+struct name_index {
+    char* dir;             // absolute path, as resolved
+    struct timespec mtime; // checked when there is no inotify watch
+    int wd;                // inotify watch descriptor, or -1
+    int stale;             // set by inotify: rebuild before the next lookup
+    char** names;          // open addressing, cap is a power of two
+    size_t cap, count;
+};
+
+struct path_index {
+    struct name_index** slots; // keyed by dir, open addressing
+    size_t cap, count;
+};
+
+#define PATH_INDEX_MAX_DIRS 256
+
+struct path_index path_index;
+
+// --- Work-stealing task pool ---
+struct task_pool;
+struct task {
+    void (*run)(struct task_pool* pool, struct task* self, int worker);
+};
+
+struct task_deque {
+    pthread_mutex_t lock;
+    struct task** items;
+    size_t head, tail, cap; // items[head..tail) are queued
+};
+
+struct task_pool {
+    int nworkers;
+    struct task_deque* deques;
+    long pending;           // pushed but not yet finished
+    long queued;            // pushed but not yet taken by a worker
+    int sleeping;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+};
+
+struct task_worker {
+    struct task_pool* pool;
+    int id;
+    pthread_t thread;
+};
+
+#define MAX_WORKERS 64
+
+// --- Parallel tree walk ---
+struct tree_walk;
+
+// A directory held open while any of its entries are still queued; released
+// (and closed) by whichever task finishes last. Walks that build a second
+// tree (XCOPY) keep the matching destination directory open beside it.
+struct walk_dir {
+    int fd, dst_fd; // dst_fd: -1 without a destination tree
+    dev_t dev;
+    ino_t ino;
+    int refs;
+    struct walk_dir* parent;
+    struct tree_walk* walk;
+    char path[]; // as reached from the walk's root argument
+};
+
+struct walk_task {
+    struct task base;
+    struct walk_dir* parent;
+    char name[];
+};
+
+struct walk_seen {
+    dev_t dev;
+    ino_t ino; // 0: empty slot
+};
+
+struct tree_walk {
+    const char* cmd;               // prefix for error messages
+    const struct wildcard* filter; // NULL: every file
+    // Never through a symlinked directory, and each directory only once
+    // (DEDUP, which must not pair a file with itself or leave the tree).
+    int physical;
+    pthread_mutex_t seen_lock;
+    struct walk_seen* seen; // physical: directories entered, open addressing
+    size_t nseen, seen_cap;
+    // Optional: opens (creating it first if needed) the destination
+    // directory for `name`; returns its fd, or -1 after reporting an error.
+    int (*enter_dir)(struct tree_walk* walk, struct walk_dir* parent, const char* name, const struct stat* st);
+    // Called from a task of its own for every matching non-directory.
+    void (*visit_file)(struct tree_walk* walk, struct walk_dir* dir, const char* name);
+    void* ctx;
+    long long dirs, errors;
+};
+
+// Serial depth-first walk in sorted order (MANIFEST, PACK).
+struct sorted_walk {
+    const char* cmd; // prefix for error messages
+    // Called for every entry with its lstat; returning 1 for a directory
+    // descends into it.
+    int (*visit)(struct sorted_walk* walk, int dirfd, const char* name, const char* path, const struct stat* st);
+    void* ctx;
+    long long errors;
+};
+
+// --- XCOPY ---
+struct xcopy_stats {
+    long long files, dirs, bytes, errors;
+    long long skipped, skipped_bytes, deleted;
+};
+
+#define XCOPY_NEWER  0x01 // /D: skip files whose size and mtime match
+#define XCOPY_MIRROR 0x02 // /MIR: /D plus delete destination extras
+
+#define XCOPY_MANIFEST_NAME ".xcopy-manifest"
+#define XCOPY_STAMP_FORMAT "%012lld.%09ld" // fixed width: the root's is patched after the rename
+#define XCOPY_MANIFEST_MAGIC "#TinyDOS-xcopy-manifest-v2"
+
+struct manifest_entry {
+    char type; // 'f' or 'd'
+    long long size, mtime_sec;
+    long mtime_nsec;
+    unsigned long long ino;
+    long long dst_sec; // after the sync: the destination's ctime (files) or mtime (directories)
+    long dst_nsec;
+    char* path;
+};
+
+struct manifest {
+    struct manifest_entry* slots; // open addressing, cap is a power of two
+    size_t cap, count;
+};
+
+struct xcopy_sync {
+    int flags;
+    const struct wildcard* filter; // NULL: every file
+    struct manifest old;
+    FILE* out;
+    long root_stamp; // offset of the root directory's destination stamp in out
+    struct xcopy_stats* stats;
+};
+
+// --- DEL /S and RD /S ---
+#define DELETE_RECURSIVE 0x01 // /S
+#define DELETE_QUIET     0x02 // /Q: no confirmation, no summary
+#define DELETE_DIRS      0x04 // RD /S: directories go too, the top one included
+#define DELETE_BACKGROUND 0x08 // /BG: rename away, reclaim in a background process
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_IDLE_VALUE (3 << 13) // IOPRIO_CLASS_IDLE, level 0
+
+struct rmtree_stats {
+    long long files, dirs, errors;
+};
+
+// A directory being emptied, held open while any of its subdirectories are
+// still queued. Whichever task drops the last reference closes it and, for
+// RD /S, removes it from its parent.
+struct rmtree_dir {
+    int fd;
+    int refs;
+    int flags;
+    const struct wildcard* filter; // NULL: every file
+    struct rmtree_dir* parent;
+    struct rmtree_stats* stats;
+    char name[]; // relative to parent->fd
+};
+
+struct rmtree_task {
+    struct task base;
+    struct rmtree_dir* parent;
+    char name[];
+};
+
+// --- TIMEIT ---
+enum timeit_metric {
+    TM_WALL, TM_USER, TM_SYS, TM_MAXRSS, TM_MINFLT, TM_MAJFLT, TM_VCSW, TM_IVCSW,
+    TM_CYCLES, TM_INSTRUCTIONS, TM_CACHE_MISSES, TM_BRANCH_MISSES, TM_COUNT
+};
+#define TM_FIRST_COUNTER TM_CYCLES
+#define TIMEIT_COUNTERS (TM_COUNT - TM_FIRST_COUNTER)
+#define TIMEIT_MAX_RUNS 1000
+
+const char* timeit_labels[TM_COUNT] = {
+    "Wall time", "User time", "Sys time", "Max RSS", "Minor faults", "Major faults",
+    "Voluntary switches", "Involuntary switches",
+    "Cycles", "Instructions", "Cache misses", "Branch misses",
+};
+const unsigned long long timeit_events[TIMEIT_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+// --- FINDSTR ---
+#define FINDSTR_IGNORE_CASE 0x01 // /I
+#define FINDSTR_LINE_NUMBERS 0x02 // /N
+#define FINDSTR_RECURSIVE 0x04 // /S
+#define FINDSTR_NAMES_ONLY 0x08 // /M
+#define FINDSTR_INVERT 0x10 // /V
+#define FINDSTR_SHOW_NAMES 0x20 // several files: prefix lines with the name
+
+struct findstr_pat {
+    char* text;  // lower case with /I
+    size_t len;
+    unsigned char first_lo, first_hi, last_lo, last_hi; // both cases with /I
+    int fold; // /I and the text has a letter: compare case-blind
+};
+
+typedef const char* (*findstr_kernel_fn)(const char* hay, size_t n, const struct findstr_pat* pat);
+
+struct findstr_job {
+    struct findstr_pat* pats;
+    int npats;
+    int flags;
+    findstr_kernel_fn find;
+    pthread_mutex_t out_lock; // held while a worker writes to stdout
+    long long matched_files;
+};
+
+struct findstr_task {
+    struct task base;
+    struct findstr_job* job;
+    const struct wildcard* pattern; // file name filter for directory tasks, else NULL
+    int is_dir;
+    char path[];
+};
+
+struct findstr_seed {
+    struct task base;
+    struct findstr_job* job;
+    char** args;
+    int nargs;
+    struct wildcard* patterns; // one per argument, compiled by the seed
+};
+
+// --- SORT ---
+#define SORT_DEFAULT_MEMORY (64LL << 20)
+#define SORT_MIN_MEMORY (1LL << 20)
+#define SORT_READ_CHUNK (256 * 1024)
+#define SORT_RUN_BUF_SIZE (64 * 1024) // per run while merging
+#define SORT_OUT_BUF_SIZE (1 << 20)
+
+// One line of a chunk being sorted. `prefix` holds the first eight key
+// bytes (folded unless /C) big-endian, so most comparisons are one integer
+// compare that never touches the line itself.
+struct sort_line {
+    uint64_t prefix;
+    const char* text;
+    size_t len;
+};
+
+struct sort_options {
+    int reverse;          // /R
+    int case_sensitive;   // /C
+    size_t column;        // /+n, 0-based
+    long long memory;     // /M
+    const char* temp_dir; // /T, then TMP, then /tmp
+};
+
+// Buffered writer for runs and the final output.
+struct sort_writer {
+    int fd;
+    char* buf;
+    size_t len;
+    int error;
+};
+
+// A sorted run being merged: a window of the temp file and its current line.
+struct sort_run {
+    int fd;
+    char* buf;
+    size_t cap, pos, len;
+    int eof;
+    struct sort_line line;
+};
+
+// Run generation state shared by the sorting threads. The input is read in
+// turns under `lock`; sorting and writing a chunk out happen outside it.
+struct sort_job {
+    const struct sort_options* opts;
+    int in_fd, out_fd;
+    pthread_mutex_t lock;
+    char* carry; // partial last line of the previous chunk
+    size_t carry_len, carry_cap;
+    int eof, chunks, error;
+    size_t chunk_size;
+    int* runs; // temp file fds
+    int nruns, runs_cap;
+};
+
+// --- DEDUP ---
+#define DEDUP_LINK    0x01 // /L: replace duplicates with hard links
+#define DEDUP_REFLINK 0x02 // /R: replace duplicates with reflinked copies
+#define DEDUP_SAMPLE 4096  // bytes hashed from each end in the first pass
+#define DEDUP_STRIPE 64
+#define DEDUP_BLOCK_STRIPES 16 // lanes are scrambled once per 1 KiB
+#define DEDUP_SECRET_WORDS 32
+
+#define DEDUP_PRIME32_1 0x9E3779B1ULL
+#define DEDUP_PRIME32_2 0x85EBCA77ULL
+#define DEDUP_PRIME32_3 0xC2B2AE3DULL
+#define DEDUP_PRIME64_1 0x9E3779B185EBCA87ULL
+#define DEDUP_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define DEDUP_PRIME64_3 0x165667B19E3779F9ULL
+#define DEDUP_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define DEDUP_PRIME64_5 0x27D4EB2F165667C5ULL
+
+typedef void (*dedup_accumulate_fn)(uint64_t* acc, const unsigned char* p, size_t stripes, const uint64_t* key);
+
+struct dedup_file {
+    long long size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    uint64_t hash; // 0, then the sample hash, then the full hash
+    int skip;      // cannot have a duplicate (or unreadable): sorted last
+    char* path;
+};
+
+struct dedup_job {
+    struct dedup_file* files;
+    size_t count, cap;
+    pthread_mutex_t lock; // held while the walk appends to files
+    long long bytes, bytes_read, errors;
+};
+
+struct dedup_task {
+    struct task base;
+    struct dedup_job* job;
+    struct dedup_file* file;
+    int full;
+};
+
+// The first task of a hashing pass: queues the others.
+struct dedup_seed {
+    struct task base;
+    struct dedup_task* tasks;
+    size_t count;
+};
+
+// --- MANIFEST ---
+#define MF_MAGIC "#TinyDOS-tree-manifest-v1"
+#define MF_WINDOW 4096 // entries in flight between the walk and the output
+#define MF_OUT_BUF_SIZE (1 << 20)
+
+// One manifest line: "type mode size mtime hash path". Paths are relative
+// to the tree's root and sorted in walk order (see mf_path_compare).
+struct mf_record {
+    char type;         // 'f' file, 'd' directory, 'l' symlink, 'o' other
+    unsigned int mode; // permission bits
+    long long size;    // files and symlinks, else 0
+    struct timespec mtime;
+    uint64_t hash;     // content (or link target) hash, else 0
+    char* path;
+};
+
+// Streams a manifest one record at a time; rec.path points into `line`.
+struct mf_reader {
+    FILE* fp;
+    char* line;
+    size_t cap;
+    struct mf_record rec;
+    int eof;
+    long long lineno, errors;
+};
+
+#define MF_HASH    0x01 // waiting for a worker to hash it
+#define MF_MISSING 0x02 // /V: only in the manifest
+#define MF_EXPECT  0x04 // `expect` holds the manifest's record
+#define MF_ERROR   0x08 // unreadable: reported, not recorded
+
+struct mf_entry {
+    int flags;
+    struct mf_record rec;    // the tree's side
+    struct mf_record expect; // the manifest's (or with /C /Q, the previous one's); no path
+};
+
+// The walk appends entries at `tail`, workers hash them in any order, and
+// entries leave at `head` in walk order once hashed: a window of MF_WINDOW
+// slots is all that is held in memory, whatever the size of the tree.
+struct mf_job {
+    int verify, quick;
+    int root_fd;
+    dev_t skip_dev;
+    ino_t skip_ino[2];    // the manifest (and its temp file) if inside the tree
+    struct mf_reader* in; // /V: the manifest; /C /Q: the previous one, or NULL
+    FILE* out;            // /C
+    struct mf_entry* ring;
+    unsigned long head, tail, next_hash;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond, ready_cond;
+    long long files, dirs, bytes_hashed, trusted;
+    long long changed, missing, added, errors;
+};
+
+// --- PACK and UNPACK ---
+#define PACK_TAR  0
+#define PACK_CPIO 1
+#define PACK_DEFAULT_MEMORY (32LL << 20)
+#define PACK_DEFAULT_LEVEL 6
+#define PACK_MAX_BLOCK (1 << 20)      // archive bytes per gzip member
+#define PACK_MIN_BLOCK (64 * 1024)
+#define PACK_ZLIB_MEMORY (300 * 1024) // deflate state per thread, roughly
+#define PACK_MEMBER_LIMIT (64 << 20)  // UNPACK: larger members are refused
+#define PACK_GZ_HEADER 20             // gzip header with our 'TD' extra field
+#define PACK_READ_SIZE (256 * 1024)
+
+#define PACK_SLOT_FILL   0
+#define PACK_SLOT_QUEUED 1
+#define PACK_SLOT_DONE   2
+
+// One gzip member in flight. PACK fills `in` with archive bytes and a
+// worker deflates them into `out`; UNPACK reads a member into `in` and a
+// worker inflates it into `out`.
+struct pack_block {
+    unsigned char* in;
+    unsigned char* out;
+    size_t in_len, in_cap, out_len, out_cap;
+    int state;
+    int error;
+};
+
+// Blocks are filled at `tail` by the main thread, (de)compressed by the
+// workers in any order and passed to emit() in order at `head`.
+struct pack_pipe {
+    int inflate; // else deflate
+    int level;
+    struct pack_block* slots;
+    int nslots;
+    unsigned long head, tail, next;
+    int done;
+    int error; // 1: a block failed, 2: emit() did (and reported it)
+    int (*emit)(void* ctx, const unsigned char* buf, size_t len);
+    void* ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond, done_cond;
+    pthread_t threads[MAX_WORKERS];
+    int nthreads;
+};
+
+struct pack_writer {
+    int format;
+    int out_fd;
+    struct pack_pipe* pipe;  // NULL with /Z:0
+    struct pack_block* cur;  // block being filled
+    size_t block_size;
+    unsigned long ino;       // cpio inode numbers
+    dev_t skip_dev;
+    ino_t skip_ino[2];       // the archive and its temp file, if inside the tree
+    long long files, dirs, bytes_in, bytes_out;
+    int error;               // write error: stop
+};
+
+#define UNPACK_NEED 0 // collecting `need` header bytes
+#define UNPACK_DATA 1 // entry data
+#define UNPACK_SKIP 2 // padding, or data not extracted
+#define UNPACK_END  3
+
+#define UNPACK_HDR_DETECT 0
+#define UNPACK_HDR_TAR    1
+#define UNPACK_HDR_PAX    2 // pax extended header records
+#define UNPACK_HDR_LONG   3 // GNU long name ('L') or link ('K')
+#define UNPACK_HDR_CPIO   4
+#define UNPACK_HDR_NAME   5 // cpio name after the fixed header
+#define UNPACK_HDR_LINK   6 // cpio symlink target (the entry's data)
+
+// Streaming tar/cpio extractor: fed the archive in pieces of any size.
+struct unpack_state {
+    int format; // PACK_TAR or PACK_CPIO once detected, else -1
+    int list;   // /L
+    int restore_owner; // running as root
+    int dest_fd;
+    int phase, kind;
+    unsigned char* hdr;
+    size_t hdr_len, need, hdr_cap;
+    long long remaining, pad;
+    char long_type;  // 'L' or 'K' while collecting a GNU long name
+    // The current entry. pax/GNU headers set the overrides for the next one.
+    char type; // 'f' file, 'd' directory, 'l' symlink, 'h' hard link, 'c', 'b', 'p'
+    unsigned int mode;
+    unsigned int uid, gid;
+    long long mtime, size;
+    unsigned int rdev_major, rdev_minor;
+    char path[PATH_MAX_LEN], link[PATH_MAX_LEN];
+    char next_path[PATH_MAX_LEN], next_link[PATH_MAX_LEN];
+    long long next_size; // -1: none
+    int out_fd;
+    int parent_fd; // cached directory of the last entry
+    char parent_path[PATH_MAX_LEN];
+    long long files, dirs, bytes, errors;
+};
+
+// --- INDEX ---
+#define INDEX_NAME ".tdindex" // in the indexed directory
+#define INDEX_MAGIC "TDTRIGR1"
+#define INDEX_TRIGRAMS (1 << 24)
+#define INDEX_SNIFF 4096  // a NUL in the first bytes marks a file binary
+#define INDEX_BINARY 0x01 // not indexed, never a candidate
+#define INDEX_OUT_BUF_SIZE (1 << 20)
+#define INDEX_RANGE (1 << 16) // trigrams gathered at a time while writing
+
+// On disk: header, file records, names, postings, trigram records. All
+// integers are native; the file is only read on the machine it describes.
+struct index_header {
+    char magic[8];
+    uint32_t nfiles, ntrigrams;
+    uint64_t names_off, names_len, post_off, post_len, tris_off;
+};
+
+struct index_file_rec {
+    int64_t size, mtime_sec;
+    uint32_t mtime_nsec, name_off, flags, pad;
+};
+
+struct index_tri_rec {
+    uint32_t tri, count; // trigram, files containing it
+    uint64_t off;        // of its file ids in the postings, delta varints
+};
+
+struct index_map {
+    unsigned char* base; // NULL: no index
+    size_t len;
+    const struct index_header* hdr;
+    const struct index_file_rec* files;
+    const char* names;
+    const unsigned char* post;
+    const struct index_tri_rec* tris;
+};
+
+struct index_entry {
+    char* path;          // relative to the indexed directory
+    long long size, mtime_sec;
+    long mtime_nsec;
+    int old_id;          // unchanged since the old index: its id there, else -1
+    int flags;
+    uint32_t* tris;      // sorted distinct trigrams, once scanned
+    uint32_t ntris, next; // next: first trigram not yet written
+};
+
+struct index_job {
+    int root_fd;
+    struct index_entry* files;
+    size_t count, cap;
+    struct index_map old;
+    size_t old_pos;      // merge join of the walk with old.files
+    uint8_t* seen[MAX_WORKERS]; // per-worker trigram bitmaps
+    long long scanned, binary, bytes, errors;
+};
+
+struct index_task {
+    struct task base;
+    struct index_job* job;
+    struct index_entry* file;
+};
+
+struct index_seed {
+    struct task base;
+    struct index_task* tasks;
+    size_t count;
+};
+
+// --- BOOTLOG ---
+// The boot timeline init keeps in a shared 4 KiB ring (see init.c, whose
+// layout this must match). Times are CLOCK_BOOTTIME nanoseconds.
+#define BOOTLOG_PATH "/run/bootlog"
+#define BOOTLOG_MAGIC "TDBOOT1"
+#define BOOTLOG_EVENTS 63
+
+struct bootlog_event {
+    int64_t ns;
+    char what[56];
+};
+
+struct bootlog {
+    char magic[8];
+    uint32_t next;   // events ever added; the ring keeps the last BOOTLOG_EVENTS
+    uint32_t closed; // set at the first prompt, after which nothing is added
+    char pad[48];
+    struct bootlog_event events[BOOTLOG_EVENTS];
+};
+
+// --- CACHE ---
+// Written by init; must match PRELOAD_PROFILE in init.c.
+#define CACHE_PRELOAD_PROFILE "/TinyDOS/Preload.lst"
+
+struct cache_totals {
+    int recurse;
+    const char* root; // prefix for paths found by the walk
+    long long files, bytes, resident; // resident: bytes in the page cache
+};
 
 // --- Function Prototypes ---
 void normalize_path_to_linux(char* path);
@@ -35,34 +871,413 @@ void format_path_for_dos(const char* linux_path, char* dos_path_buffer);
 void show_help();
 void show_version();
 void show_about();
-void copy_file(const char* source, const char* dest);
-void do_dir(const char* path);
-void do_xcopy(const char* source, const char* dest);
+unsigned int builtin_name_hash(const char* name, unsigned int seed);
+void builtin_registry_init();
+const struct builtin* builtin_lookup(const char* name);
+int applet_args_ok(const char* spec, int argc, char** argv);
+int parse_command_line(const char* line, struct pipeline* pl);
+void pipeline_free(struct pipeline* pl);
+int redirect_open(const struct redirect* r);
+int apply_redirects(const struct stage* st, int* saved);
+void restore_redirects(int* saved);
+const struct builtin* stage_builtin(struct stage* st);
+int run_pipeline(struct pipeline* pl);
+int execute_line(const char* line);
+const struct builtin* raw_line_builtin(const char* line, const char** rest);
+void refresh_prompt();
+int run_command_string(const char* text);
+int name_list_add(struct name_list* list, const char* s, size_t n);
+int for_expand_set(const char* set, size_t len, struct name_list* items);
+void for_append_item(char** out, size_t* len, size_t* cap, const char* item, const char* mods, size_t nmods);
+char* for_substitute(const char* body, char var, const char* item);
+int for_run_body(const char* line);
+void for_job_start(struct for_job* job, const char* line);
+void for_job_emit(struct for_job* job);
+int for_parallel(const char* body, char var, const struct name_list* items, int nparallel);
+int is_batch_file(const char* name);
+const char* env_lookup(const char* name, size_t len);
+int str_append(char** buf, size_t* len, size_t* cap, const char* s, size_t n);
+char* expand_vars(const char* text, const struct batch_frame* frame);
+int batch_keyword(const char* p, const char* kw);
+const char* batch_word(const char* p, char** word, int stop_at_eq);
+int batch_compile_line(const char* line, int lineno, int quiet, struct batch_insn* in);
+void batch_insn_free(struct batch_insn* in);
+int batch_label_find(const struct batch_script* s, const char* name);
+void batch_resolve(const struct batch_script* s, struct batch_insn* in);
+struct batch_script* batch_compile(const char* path, const char* text, size_t len);
+struct batch_script* batch_load(const char* path);
+void batch_release(struct batch_script* s);
+int batch_push_frame(struct batch_run* run, int argc, char** argv, int return_pc);
+void batch_return(struct batch_run* run);
+int batch_jump_target(struct batch_run* run, struct batch_insn* in);
+int batch_exec(struct batch_run* run, struct batch_insn* in);
+int batch_run(struct batch_script* s, int argc, char** argv);
+int run_batch_file(const char* path, int argc, char** argv);
+int run_batch_stage(int argc, char** argv);
+int dirwatch_init();
+int dirwatch_add(const char* path);
+void dirwatch_poll();
+unsigned long str_hash_nocase(const char* s);
+void name_index_fill(struct name_index* ni);
+void name_index_free(struct name_index* ni);
+struct name_index* name_index_get(const char* dir);
+const char* name_index_find(const struct name_index* ni, const char* name);
+void path_index_dir_changed(int wd, int gone);
+void path_index_clear();
+const char* resolve_path(const char* path, char* buf, size_t len);
+void stage_resolve_args(const struct stage* st, const struct builtin* b, char** argv);
+void stage_args_free(const struct stage* st, char** argv);
+int has_wildcards(const char* s);
+int wildcard_compile(const char* pattern, struct wildcard* w);
+int wildcard_match_generic(const char* p, const char* n);
+int wildcard_match(const struct wildcard* w, const char* name);
+int wildcard_split(const char* arg, char* dir, size_t len, struct wildcard* w);
+int name_compare(const void* a, const void* b);
+int name_compare_exact(const void* a, const void* b);
+int wildcard_list_files(int dirfd, const struct wildcard* w, struct name_list* list);
+void name_list_free(struct name_list* list);
+int dirent_is_dir(int dirfd, const struct dirent* entry);
+int dirent_is_real_dir(int dirfd, const struct dirent* entry);
+void command_cache_clear_entries(size_t from_dir);
+void command_cache_dir_changed(int wd, int gone);
+void command_cache_sync_path();
+int command_cache_dirs_valid(size_t upto);
+const char* command_cache_lookup(const char* name);
+pid_t spawn_external(char** argv, const posix_spawn_file_actions_t* actions);
+int wait_for_child(pid_t pid);
+int run_external(char** args);
+int builtin_hash(int argc, char** argv);
+int builtin_help(int argc, char** argv);
+int builtin_about(int argc, char** argv);
+int builtin_ver(int argc, char** argv);
+int builtin_cls(int argc, char** argv);
+int builtin_echo(int argc, char** argv);
+int builtin_type(int argc, char** argv);
+int builtin_copy(int argc, char** argv);
+int builtin_xcopy(int argc, char** argv);
+int builtin_del(int argc, char** argv);
+int builtin_ren(int argc, char** argv);
+int builtin_md(int argc, char** argv);
+int builtin_rd(int argc, char** argv);
+int builtin_cd(int argc, char** argv);
+int builtin_dir(int argc, char** argv);
+int builtin_reboot(int argc, char** argv);
+int builtin_exit(int argc, char** argv);
+int builtin_set(int argc, char** argv);
+int builtin_call(int argc, char** argv);
+int builtin_timeit(int argc, char** argv);
+int builtin_for(int argc, char** argv);
+int builtin_sort(int argc, char** argv);
+int builtin_dedup(int argc, char** argv);
+int builtin_manifest(int argc, char** argv);
+int builtin_pack(int argc, char** argv);
+int builtin_unpack(int argc, char** argv);
+int builtin_index(int argc, char** argv);
+int builtin_bootlog(int argc, char** argv);
+int builtin_cache(int argc, char** argv);
+int builtin_findstr(int argc, char** argv);
+int pump_fd(int in_fd, int out_fd);
+int applet_cat(int argc, char** argv);
+void wc_print(const int* show, const long long* counts, const char* name);
+int applet_wc(int argc, char** argv);
+int applet_head(int argc, char** argv);
+int applet_true(int argc, char** argv);
+int applet_false(int argc, char** argv);
+const char* match_switch(const char* arg, const char* name);
+double elapsed_since(const struct timespec* start);
+void format_rate(double amount, double seconds, const char* unit, char* buf, size_t len);
+int copy_fallback_errno(int err);
+int copy_fd(int in_fd, int out_fd, long long* copied);
+int copy_file_at(int src_dirfd, const char* source, int dst_dirfd, const char* dest, long long* copied);
+int copy_file(const char* source, const char* dest, int flags);
+int copy_files(const char* source, const char* dest, int flags);
+int online_cpus();
+void task_deque_push(struct task_deque* dq, struct task* t);
+struct task* task_deque_take(struct task_deque* dq, int steal);
+void task_pool_push(struct task_pool* pool, int worker, struct task* t);
+struct task* task_pool_next(struct task_pool* pool, int worker);
+void* task_pool_worker(void* arg);
+void task_pool_run(int nworkers, struct task* first);
+struct walk_task* walk_task_new(void (*run)(struct task_pool*, struct task*, int), struct walk_dir* parent, const char* name);
+void walk_dir_release(struct walk_dir* d);
+void walk_file_task(struct task_pool* pool, struct task* base, int worker);
+int walk_seen_add(struct tree_walk* walk, const struct stat* st);
+void walk_dir_task(struct task_pool* pool, struct task* base, int worker);
+void tree_walk(struct tree_walk* walk, const char* root, int dst_fd, int nworkers);
+void sorted_walk_dir(struct sorted_walk* walk, int dirfd, const char* prefix);
+int write_all(int fd, const char* buf, size_t len);
+int send_file_range(int in_fd, off_t off, long long len, int out_fd);
+int do_type(const char* path, int binary);
+void out_init(struct out_buf* out);
+void out_flush(struct out_buf* out);
+void out_printf(struct out_buf* out, const char* fmt, ...);
+void out_free(struct out_buf* out);
+const char* format_dir_time(long long mtime);
+int dir_list_read(int dirfd, const struct dir_options* opts, struct dir_list* list);
+void dir_list_free(struct dir_list* list);
+int dir_entry_compare(const void* a, const void* b);
+void dir_list_dir(int dirfd, const char* dos_path, const struct dir_options* opts, struct dir_totals* totals, struct out_buf* out);
+int do_dir(const char* path, const struct dir_options* opts);
+void do_xcopy(const char* source, const char* dest, const struct wildcard* filter, struct xcopy_stats* stats);
+int xcopy_enter_dir(struct tree_walk* walk, struct walk_dir* parent, const char* name, const struct stat* st);
+void xcopy_visit_file(struct tree_walk* walk, struct walk_dir* dir, const char* name);
+void do_xcopy_parallel(const char* source, const char* dest, const struct wildcard* filter, int nworkers, struct xcopy_stats* stats);
+unsigned long str_hash(const char* s);
+void manifest_insert(struct manifest* mf, const struct manifest_entry* e);
+const struct manifest_entry* manifest_find(const struct manifest* mf, const char* path);
+void manifest_load(struct manifest* mf, int dst_fd, const char* source_id);
+void manifest_free(struct manifest* mf);
+int manifest_matches(const struct manifest_entry* e, char type, const struct stat* st);
+long manifest_record(struct xcopy_sync* sync, char type, const struct stat* st, const struct timespec* dst, const char* rel);
+long long remove_tree_at(int dirfd, const char* name);
+void xcopy_sync_file(struct xcopy_sync* sync, int src_fd, int dst_fd, const char* name, const struct stat* st, const char* rel);
+void xcopy_sync_dir(struct xcopy_sync* sync, int src_fd, int dst_fd, const char* rel);
+void do_xcopy_sync(const char* source, const char* dest, const struct wildcard* filter, int flags, struct xcopy_stats* stats);
+int xcopy_command(const char* source, const char* dest, int nworkers, int flags);
+void raise_fd_limit();
+int confirm_prompt(const char* what);
+struct rmtree_task* rmtree_task_new(struct rmtree_dir* parent, const char* name);
+void rmtree_dir_release(struct rmtree_dir* d);
+void rmtree_dir_task(struct task_pool* pool, struct task* base, int worker);
+void rmtree_parallel(const char* path, const struct wildcard* filter, int flags, struct rmtree_stats* stats);
+void rmtree_sweep(int dir_fd);
+int rmtree_background(const char* path);
+void rmtree_report(const struct rmtree_stats* stats, const struct timespec* start);
+int perf_counters_open(pid_t pid, int* fds);
+void perf_counters_read(const int* fds, double* values);
+int timeit_run(const char* command, double* sample, int* have_counters);
+int double_compare(const void* a, const void* b);
+void timeit_format(int metric, double value, char* buf, size_t len);
+int findstr_equal(const char* p, const struct findstr_pat* pat);
+const char* findstr_scalar(const char* hay, size_t n, const struct findstr_pat* pat);
+const char* findstr_sse2(const char* hay, size_t n, const struct findstr_pat* pat);
+const char* findstr_avx2(const char* hay, size_t n, const struct findstr_pat* pat);
+findstr_kernel_fn findstr_select_kernel();
+void findstr_emit(char** out, size_t* len, size_t* cap, const char* name, long long lineno, const char* line, size_t n, int flags);
+void findstr_flush(struct findstr_job* job, char** out, size_t* len);
+long long findstr_scan(struct findstr_job* job, const char* name, const char* buf, size_t n, long long lineno, char** out, size_t* olen, size_t* ocap);
+void findstr_file(struct findstr_job* job, const char* path);
+struct findstr_task* findstr_task_new(struct findstr_job* job, const char* path, const struct wildcard* pattern, int is_dir);
+void findstr_task_run(struct task_pool* pool, struct task* base, int worker);
+void findstr_seed_run(struct task_pool* pool, struct task* base, int worker);
+int findstr_add_pattern(struct findstr_job* job, const char* text, size_t len);
+void sort_fold_init();
+void sort_line_init(struct sort_line* l, const char* text, size_t len);
+int sort_compare(const struct sort_line* a, const struct sort_line* b);
+void sort_swap(struct sort_line* a, struct sort_line* b);
+void sort_sift_down(struct sort_line* a, size_t n, size_t i);
+void sort_lines(struct sort_line* a, size_t n, int depth);
+void sort_write(struct sort_writer* w, const char* s, size_t n);
+int sort_write_flush(struct sort_writer* w);
+int sort_write_lines(int fd, const struct sort_line* lines, size_t n);
+int sort_temp_file(const char* dir);
+struct sort_line* sort_chunk_index(char* buf, size_t len);
+size_t sort_read_chunk(struct sort_job* job, char** buf, size_t* cap, size_t* lines);
+void* sort_run_worker(void* arg);
+int sort_run_next(struct sort_run* r);
+void sort_heap_down(struct sort_run** heap, int n, int i);
+int sort_merge(int* fds, int n, int out_fd, size_t buf_size);
+int sort_file(int in_fd, int out_fd, const struct sort_options* opts, int nworkers);
+long long parse_size(const char* s);
+void dedup_hash_init();
+void dedup_accumulate_scalar(uint64_t* acc, const unsigned char* p, size_t stripes, const uint64_t* key);
+void dedup_accumulate_sse2(uint64_t* acc, const unsigned char* p, size_t stripes, const uint64_t* key);
+void dedup_accumulate_avx2(uint64_t* acc, const unsigned char* p, size_t stripes, const uint64_t* key);
+dedup_accumulate_fn dedup_select_kernel();
+void dedup_scramble(uint64_t* acc, const uint64_t* key);
+uint64_t dedup_mix(uint64_t a, uint64_t b);
+uint64_t dedup_hash(const unsigned char* p, size_t n, uint64_t total);
+int pread_full(int fd, char* buf, size_t len, off_t off);
+int dedup_hash_file(struct dedup_job* job, struct dedup_file* f, int full);
+void dedup_task_run(struct task_pool* pool, struct task* base, int worker);
+void dedup_seed_run(struct task_pool* pool, struct task* base, int worker);
+void dedup_hash_files(struct dedup_job* job, size_t n, int full, int nworkers);
+void dedup_visit_file(struct tree_walk* walk, struct walk_dir* dir, const char* name);
+int dedup_file_compare(const void* a, const void* b);
+size_t dedup_prune(struct dedup_job* job, size_t n);
+int dedup_same_content(const struct dedup_file* a, const struct dedup_file* b);
+int dedup_replace(const struct dedup_file* keep, const struct dedup_file* dup, int flags);
+int mf_path_compare(const char* a, const char* b);
+void mf_reader_next(struct mf_reader* r);
+int mf_reader_open(struct mf_reader* r, const char* path);
+void mf_reader_close(struct mf_reader* r);
+void mf_write_record(FILE* out, const struct mf_record* r);
+void mf_emit(struct mf_job* job, struct mf_entry* e);
+void mf_drain(struct mf_job* job);
+void mf_push(struct mf_job* job, struct mf_entry* e);
+int mf_hash_entry(struct mf_job* job, struct mf_entry* e);
+void* mf_worker(void* arg);
+void mf_join(struct mf_job* job, struct mf_entry* e);
+int mf_visit(struct sorted_walk* walk, int dirfd, const char* name, const char* path, const struct stat* st);
+int mf_run(struct mf_job* job, int nworkers);
+ssize_t read_full(int fd, void* buf, size_t len);
+void pack_put_le32(unsigned char* p, uint32_t v);
+uint32_t pack_get_le32(const unsigned char* p);
+int pack_deflate_block(z_stream* zs, struct pack_block* b);
+long pack_gzip_header_len(const unsigned char* p, size_t len);
+int pack_inflate_block(z_stream* zs, struct pack_block* b);
+void* pack_worker(void* arg);
+int pack_pipe_start(struct pack_pipe* p, int inflate, int level, int nslots, int nworkers,
+                    int (*emit)(void*, const unsigned char*, size_t), void* ctx);
+void pack_pipe_drain(struct pack_pipe* p, unsigned long max_in_flight);
+struct pack_block* pack_pipe_slot(struct pack_pipe* p, size_t size);
+void pack_pipe_submit(struct pack_pipe* p);
+int pack_pipe_finish(struct pack_pipe* p);
+void pack_plan(long long memory, size_t block_hint, int* nworkers, int* nslots, size_t* block);
+int pack_emit_write(void* ctx, const unsigned char* buf, size_t len);
+void pack_submit(struct pack_writer* w);
+void pack_put(struct pack_writer* w, const void* data, size_t n);
+void pack_pad(struct pack_writer* w, size_t n);
+int pack_put_file(struct pack_writer* w, int fd, long long size, const char* path);
+void pack_octal(char* field, size_t width, unsigned long long v);
+void pack_pax_record(char* buf, size_t* len, size_t cap, const char* key, const char* value);
+void pack_tar_header(struct pack_writer* w, const char* path, const struct stat* st, char type, const char* link, long long size);
+void pack_cpio_header(struct pack_writer* w, const char* path, const struct stat* st, long long size);
+int pack_visit(struct sorted_walk* walk, int dirfd, const char* name, const char* path, const struct stat* st);
+void pack_finish_archive(struct pack_writer* w);
+int unpack_clean_path(char* path);
+int unpack_walk(int dest_fd, const char* path, size_t dlen, int create);
+int unpack_parent(struct unpack_state* u, const char* path, const char** leaf);
+void unpack_begin_entry(struct unpack_state* u);
+void unpack_end_entry(struct unpack_state* u);
+unsigned long long unpack_number(const unsigned char* p, size_t width);
+unsigned long unpack_hex(const unsigned char* p);
+void unpack_pax(struct unpack_state* u);
+int unpack_header(struct unpack_state* u);
+int unpack_feed(void* ctx, const unsigned char* buf, size_t len);
+int unpack_archive(int in_fd, struct unpack_state* u, long long memory, int nworkers);
+int index_open(struct index_map* m, const char* path);
+void index_close(struct index_map* m);
+const struct index_tri_rec* index_lookup(const struct index_map* m, uint32_t tri);
+const unsigned char* index_varint(const unsigned char* p, const unsigned char* end, uint32_t* v);
+void index_put_varint(FILE* out, uint32_t v, uint64_t* len);
+int index_visit(struct sorted_walk* walk, int dirfd, const char* name, const char* path, const struct stat* st);
+int index_u32_compare(const void* a, const void* b);
+void index_scan_file(struct index_job* job, struct index_entry* e, int worker);
+void index_task_run(struct task_pool* pool, struct task* base, int worker);
+void index_seed_run(struct task_pool* pool, struct task* base, int worker);
+int index_write(struct index_job* job, const char* path, long long* ntrigrams, long long* written);
+int index_query(struct index_job* job, struct findstr_job* fs, const char* dir);
+void bootlog_first_prompt();
+int bootlog_event_compare(const void* a, const void* b);
+int cache_measure(int fd, long long* size, long long* resident);
+void cache_report(struct cache_totals* t, int fd, const char* path);
+int cache_visit(struct sorted_walk* walk, int dirfd, const char* name, const char* path, const struct stat* st);
+
+// --- Built-in Command Registry ---
+// Aliases are separate entries sharing a handler. Entries with an argument
+// spec are in-process applets shadowing utilities of the same name in PATH:
+// they only run when every option given is one they implement (spec uses
+// getopt syntax), otherwise the external program is used.
+const struct builtin builtins[] = {
+    { "?",        builtin_help,    NULL },
+    { "help",     builtin_help,    NULL },
+    { "about",    builtin_about,   NULL },
+    { "ver",      builtin_ver,     NULL },
+    { "cls",      builtin_cls,     NULL },
+    { "echo",     builtin_echo,    NULL },
+    { "echo.",    builtin_echo,    NULL },
+    { "set",      builtin_set,     NULL, BUILTIN_RAW_LINE },
+    { "call",     builtin_call,    NULL },
+    { "for",      builtin_for,     NULL, BUILTIN_RAW_LINE },
+    { "timeit",   builtin_timeit,  NULL, BUILTIN_RAW_LINE },
+    { "findstr",  builtin_findstr, NULL },
+    { "sort",     builtin_sort,    NULL, BUILTIN_PATHS },
+    { "dedup",    builtin_dedup,   NULL, BUILTIN_PATHS },
+    { "manifest", builtin_manifest, NULL, BUILTIN_PATHS },
+    { "pack",     builtin_pack,    NULL, BUILTIN_PATHS },
+    { "unpack",   builtin_unpack,  NULL, BUILTIN_PATHS },
+    { "index",    builtin_index,   NULL },
+    { "bootlog",  builtin_bootlog, NULL },
+    { "cache",    builtin_cache,   NULL, BUILTIN_PATHS },
+    { "type",     builtin_type,    NULL, BUILTIN_PATHS },
+    { "copy",     builtin_copy,    NULL, BUILTIN_PATHS },
+    { "xcopy",    builtin_xcopy,   NULL, BUILTIN_PATHS },
+    { "del",      builtin_del,     NULL, BUILTIN_PATHS },
+    { "erase",    builtin_del,     NULL, BUILTIN_PATHS },
+    { "ren",      builtin_ren,     NULL, BUILTIN_PATHS },
+    { "rename",   builtin_ren,     NULL, BUILTIN_PATHS },
+    { "move",     builtin_ren,     NULL, BUILTIN_PATHS },
+    { "md",       builtin_md,      NULL, BUILTIN_PATHS },
+    { "mkdir",    builtin_md,      NULL, BUILTIN_PATHS },
+    { "rd",       builtin_rd,      NULL, BUILTIN_PATHS },
+    { "rmdir",    builtin_rd,      NULL, BUILTIN_PATHS },
+    { "cd",       builtin_cd,      NULL, BUILTIN_PATHS },
+    { "chdir",    builtin_cd,      NULL, BUILTIN_PATHS },
+    { "dir",      builtin_dir,     NULL, BUILTIN_PATHS },
+    { "hash",     builtin_hash,    NULL },
+    { "reboot",   builtin_reboot,  NULL },
+    { "exit",     builtin_exit,    NULL },
+    { "shutdown", builtin_exit,    NULL },
+    { "cat",      applet_cat,      "" },
+    { "wc",       applet_wc,       "lwc" },
+    { "head",     applet_head,     "n:" },
+    { "true",     applet_true,     "" },
+    { "false",    applet_false,    "" },
+};
+#define BUILTIN_COUNT ((int)(sizeof(builtins) / sizeof(builtins[0])))
+
+// Collision-free hash table over the names above (case-folded), built once
+// at startup by searching for a seed; every lookup is one hash and one
+// strcasecmp.
+short builtin_slots[BUILTIN_SLOTS];
+unsigned int builtin_seed;
+
+int shell_exit_requested = 0;
+int shell_interactive = 0;
+int last_errorlevel = 0;
+char shell_cwd[PATH_MAX_LEN];    // refreshed by CD
+char shell_prompt[PATH_MAX_LEN]; // DOS form of shell_cwd
+
+int batch_echo = 0; // ECHO ON: show batch commands as they run
+int batch_depth = 0;
+struct batch_script* batch_cache;
 
 // --- Main Program Entry Point ---
-int main() {
+int main(int argc, char** argv) {
     char input_buf[CMD_BUF_SIZE];
-    char* args[MAX_ARGS];
-    char* token;
 
     // +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
     // +++ THE FIX: Set a default PATH environment variable for this shell. +++
     // +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
     setenv("PATH", "/usr/bin:/bin:/usr/sbin:/sbin", 1);
+    builtin_registry_init();
+    refresh_prompt();
 
+    // "cmd /C command" and "cmd script.bat [args]" run without banner or prompt.
+    if (argc > 1) {
+        const char* c = match_switch(argv[1], "C");
+        if (c && *c == '\0') {
+            size_t len = 1;
+            for (int j = 2; j < argc; j++) len += strlen(argv[j]) + 3;
+            char* text = calloc(1, len);
+            if (!text) return 1;
+            for (int j = 2; j < argc; j++) {
+                // A lone argument is the whole command line; otherwise words
+                // with blanks were quoted by the caller and get their quotes back.
+                int quote = argc > 3 && strpbrk(argv[j], " \t") != NULL;
+                if (j > 2) strcat(text, " ");
+                if (quote) strcat(text, "\"");
+                strcat(text, argv[j]);
+                if (quote) strcat(text, "\"");
+            }
+            int rc = run_command_string(text);
+            free(text);
+            return rc;
+        }
+        char script[PATH_MAX_LEN];
+        snprintf(script, sizeof(script), "%s", argv[1]);
+        normalize_path_to_linux(script);
+        return run_batch_file(resolve_path(script, input_buf, sizeof(input_buf)), argc - 1, argv + 1);
+    }
 
+    shell_interactive = 1;
     printf("\nTinyDOS v0.0.3 - (c) 2025\n\n");
 
-    while (1) {
-        char real_cwd[PATH_MAX_LEN];
-        char dos_prompt[PATH_MAX_LEN];
-
-        if (getcwd(real_cwd, sizeof(real_cwd)) == NULL) {
-            strcpy(real_cwd, "/");
-        }
-        format_path_for_dos(real_cwd, dos_prompt);
-        printf("C:%s> ", dos_prompt);
+    while (!shell_exit_requested) {
+        printf("C:%s> ", shell_prompt);
         fflush(stdout);
+        bootlog_first_prompt();
 
         if (fgets(input_buf, sizeof(input_buf), stdin) == NULL) {
             if (feof(stdin)) { // Handle Ctrl+D
@@ -75,249 +1290,7721 @@ int main() {
         input_buf[strcspn(input_buf, "\n")] = 0;
         if (strlen(input_buf) == 0) continue;
 
-        // --- Tokenize input ---
-        int i = 0;
-        token = strtok(input_buf, " ");
-        while (token != NULL && i < MAX_ARGS - 1) {
-            args[i++] = token;
-            token = strtok(NULL, " ");
-        }
-        args[i] = NULL;
-
-        if (args[0] == NULL) continue;
-        char* command = args[0];
-
-        // --- Normalize paths for arguments of built-in commands ---
-        for (int j = 1; args[j] != NULL; j++) {
-            normalize_path_to_linux(args[j]);
-        }
-
-        // --- Built-in Command Dispatcher ---
-        if (strcmp(command, "?") == 0 || strcmp(command, "help") == 0) {
-            show_help();
-        } else if (strcmp(command, "about") == 0) {
-            show_about();
-        } else if (strcmp(command, "ver") == 0) {
-            show_version();
-        } else if (strcmp(command, "cls") == 0) {
-            printf("\033[2J\033[H");
-        } else if (strcmp(command, "echo") == 0) {
-            for (int j = 1; args[j] != NULL; j++) printf("%s ", args[j]);
-            printf("\n");
-        } else if (strcmp(command, "type") == 0) {
-            if (args[1] == NULL) printf("Syntax: type [filename]\n");
-            else {
-                FILE *fp = fopen(args[1], "r");
-                if (fp) {
-                    char line[256];
-                    while (fgets(line, sizeof(line), fp)) printf("%s", line);
-                    fclose(fp);
-                } else { perror("type"); }
-            }
-        } else if (strcmp(command, "copy") == 0) {
-            if (args[1] == NULL || args[2] == NULL) printf("Syntax: copy [source] [destination]\n");
-            else copy_file(args[1], args[2]);
-        } else if (strcmp(command, "xcopy") == 0) {
-            if (args[1] == NULL || args[2] == NULL) printf("Syntax: xcopy [source] [destination]\n");
-            else do_xcopy(args[1], args[2]);
-        } else if (strcmp(command, "del") == 0 || strcmp(command, "erase") == 0) {
-            if (args[1] == NULL) printf("Syntax: del [filename]\n");
-            else if (remove(args[1]) != 0) perror("del");
-        } else if (strcmp(command, "ren") == 0 || strcmp(command, "rename") == 0 || strcmp(command, "move") == 0) {
-            if (args[1] == NULL || args[2] == NULL) printf("Syntax: ren [old_name] [new_name]\n");
-            else if (rename(args[1], args[2]) != 0) perror("ren");
-        } else if (strcmp(command, "md") == 0 || strcmp(command, "mkdir") == 0) {
-            if (args[1] == NULL) printf("Syntax: md [directory]\n");
-            else {
-                normalize_path_to_linux(args[1]);
-                if (mkdir(args[1], 0755) != 0) perror("md");
-            }
-        } else if (strcmp(command, "rd") == 0 || strcmp(command, "rmdir") == 0) {
-            if (args[1] == NULL) printf("Syntax: rd [directory]\n");
-            else {
-                normalize_path_to_linux(args[1]);
-                if (rmdir(args[1]) != 0) perror("rd");
-            }
-        } else if (strcmp(command, "cd") == 0 || strcmp(command, "chdir") == 0) {
-            if (args[1] == NULL) {
-                printf("C:%s\n", dos_prompt);
-            } else {
-                normalize_path_to_linux(args[1]);
-                if (chdir(args[1]) != 0) perror("cd");
-            }
-        } else if (strcmp(command, "dir") == 0) {
-            const char* dir_path = (args[1] == NULL) ? "." : args[1];
-            normalize_path_to_linux((char*)dir_path);
-            do_dir(dir_path);
-        } else if (strcmp(command, "reboot") == 0) {
-            printf("Rebooting system...\n");
-            sync();
-            reboot(RB_AUTOBOOT);
-        } else if (strcmp(command, "exit") == 0 || strcmp(command, "shutdown") == 0) {
-            printf("Shutting down system...\n");
-            break;
+        if (strchr(input_buf, '%')) {
+            char* line = expand_vars(input_buf, NULL);
+            last_errorlevel = line ? execute_line(line) : 1;
+            free(line);
         } else {
-            // --- External Command Execution via standard fork() and execvp() ---
-            pid_t pid = fork();
-
-            if (pid == -1) {
-                // Error: Failed to create a new process
-                perror("shell: fork");
-            } else if (pid == 0) {
-                // --- CHILD PROCESS ---
-                if (execvp(args[0], args) == -1) {
-                    fprintf(stderr, "shell: %s: command not found\n", args[0]);
-                    exit(EXIT_FAILURE);
-                }
-            } else {
-                // --- PARENT PROCESS (the shell) ---
-                wait(NULL);
-            }
+            last_errorlevel = execute_line(input_buf);
         }
     }
     return 0;
 }
 
+// --- Command Dispatch ---
 
-// --- Helper Function Implementations (UNMODIFIED) ---
+// The prompt only changes when the shell itself changes directory, so it is
+// formatted once per CD instead of calling getcwd() before every line.
+void refresh_prompt() {
+    if (getcwd(shell_cwd, sizeof(shell_cwd)) == NULL) strcpy(shell_cwd, "/");
+    format_path_for_dos(shell_cwd, shell_prompt);
+}
 
-void normalize_path_to_linux(char* path) {
-    if (path == NULL) return;
-    if ((path[0] == 'C' || path[0] == 'c') && path[1] == ':') {
-        memmove(path, path + 2, strlen(path) - 1);
+unsigned int builtin_name_hash(const char* name, unsigned int seed) {
+    unsigned int h = seed;
+    while (*name) h = (h ^ (unsigned char)tolower((unsigned char)*name++)) * 16777619u;
+    return h ^ (h >> 15);
+}
+
+void builtin_registry_init() {
+    for (builtin_seed = 2166136261u;; builtin_seed++) {
+        int ok = 1;
+        memset(builtin_slots, -1, sizeof(builtin_slots));
+        for (int i = 0; i < BUILTIN_COUNT && ok; i++) {
+            unsigned int slot = builtin_name_hash(builtins[i].name, builtin_seed) % BUILTIN_SLOTS;
+            if (builtin_slots[slot] >= 0) ok = 0;
+            else builtin_slots[slot] = (short)i;
+        }
+        if (ok) return;
     }
-    for (int i = 0; path[i] != '\0'; i++) {
-        if (path[i] == '\\') {
-            path[i] = '/';
+}
+
+const struct builtin* builtin_lookup(const char* name) {
+    int i = builtin_slots[builtin_name_hash(name, builtin_seed) % BUILTIN_SLOTS];
+    if (i >= 0 && strcasecmp(builtins[i].name, name) == 0) return &builtins[i];
+    return NULL;
+}
+
+// Checks argv against a getopt-style spec ("n:" = -n takes a value).
+int applet_args_ok(const char* spec, int argc, char** argv) {
+    for (int j = 1; j < argc; j++) {
+        const char* a = argv[j];
+        if (a[0] != '-' || a[1] == '\0') continue;
+        if (strcmp(a, "--") == 0) return 1;
+        for (const char* c = a + 1; *c; c++) {
+            const char* p = strchr(spec, *c);
+            if (p == NULL || *c == ':') return 0;
+            if (p[1] == ':') {
+                if (c[1] == '\0') j++; // value is the next argument
+                if (j >= argc) return 0;
+                break;
+            }
         }
     }
+    return 1;
 }
 
-void format_path_for_dos(const char* linux_path, char* dos_path_buffer) {
-    if(strcmp(linux_path, "/") == 0) {
-        strcpy(dos_path_buffer, "\\");
-        return;
+// --- Command-line Parser ---
+// Splits a line into pipeline stages. Words are separated by blanks;
+// "double quotes" group text (including blanks and operators) into one word.
+// Outside quotes, | separates stages and <, >, >>, 2>, 2>> and 2>&1 redirect.
+// Returns 0, or -1 after printing a syntax error.
+int parse_command_line(const char* line, struct pipeline* pl) {
+    size_t len = strlen(line);
+    char* out;
+    struct stage* st;
+
+    memset(pl, 0, sizeof(*pl));
+    pl->storage = malloc(len * 2 + 2); // worst case: every char its own word
+    if (!pl->storage) return -1;
+    out = pl->storage;
+    st = &pl->stages[0];
+    pl->nstages = 1;
+
+    const char* p = line;
+    while (1) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0') break;
+
+        if (*p == '|') {
+            if (st->argc == 0) goto syntax;
+            if (pl->nstages == MAX_STAGES) { fprintf(stderr, "shell: too many pipeline stages\n"); goto fail; }
+            st = &pl->stages[pl->nstages++];
+            p++;
+            continue;
+        }
+
+        int redir_fd = -1, redir_mode = 0;
+        if (*p == '<') { redir_fd = 0; redir_mode = REDIR_IN; p++; }
+        else if (*p == '>' || (p[0] == '2' && p[1] == '>')) {
+            redir_fd = (*p == '2') ? 2 : 1;
+            p += (*p == '2') ? 2 : 1;
+            redir_mode = REDIR_OUT;
+            if (*p == '>') { redir_mode = REDIR_APPEND; p++; }
+            else if (redir_fd == 2 && p[0] == '&' && p[1] == '1') { redir_mode = REDIR_DUP_STDOUT; p += 2; }
+        }
+        if (redir_mode != 0 && redir_mode != REDIR_DUP_STDOUT) {
+            while (*p == ' ' || *p == '\t') p++;
+        }
+
+        // Collect one word, dropping the quotes.
+        char* word = out;
+        int quoted = 0;
+        while (*p && (quoted || (*p != ' ' && *p != '\t' && *p != '|' && *p != '<' && *p != '>'))) {
+            if (*p == '"') { quoted = !quoted; p++; continue; }
+            *out++ = *p++;
+        }
+        if (quoted) { fprintf(stderr, "shell: unterminated quote\n"); goto fail; }
+        *out++ = '\0';
+
+        if (redir_mode == REDIR_DUP_STDOUT) {
+            out = word; // 2>&1 takes no word
+        } else if (redir_mode != 0 && word[0] == '\0') {
+            goto syntax;
+        }
+        if (redir_mode != 0) {
+            if (st->nredirs == MAX_REDIRS) { fprintf(stderr, "shell: too many redirections\n"); goto fail; }
+            struct redirect* r = &st->redirs[st->nredirs++];
+            r->fd = redir_fd;
+            r->mode = redir_mode;
+            r->path = redir_mode == REDIR_DUP_STDOUT ? NULL : word;
+            if (r->path) normalize_path_to_linux(r->path);
+            continue;
+        }
+        if (st->argc == MAX_ARGS - 1) { fprintf(stderr, "shell: too many arguments\n"); goto fail; }
+        // --- Normalize paths for arguments of built-in commands ---
+        if (word[0] == '/') st->switches |= 1u << st->argc;
+        if (st->argc > 0) normalize_path_to_linux(word);
+        st->argv[st->argc++] = word;
     }
-    snprintf(dos_path_buffer, PATH_MAX_LEN, "%s", linux_path);
-    for (int i = 0; dos_path_buffer[i] != '\0'; i++) {
-        if (dos_path_buffer[i] == '/') dos_path_buffer[i] = '\\';
+
+    if (pl->nstages == 1 && st->argc == 0 && st->nredirs == 0) return 0; // blank line
+    for (int i = 0; i < pl->nstages; i++) {
+        if (pl->stages[i].argc == 0) goto syntax;
     }
+    return 0;
+
+syntax:
+    fprintf(stderr, "The syntax of the command is incorrect.\n");
+fail:
+    free(pl->storage);
+    pl->storage = NULL;
+    pl->nstages = 0;
+    return -1;
 }
 
-void show_help() {
-    printf("\nTinyDOS v0.0.3 Command Reference\n");
-    printf("  ? or HELP              Shows this help message.\n");
-    printf("  ABOUT                  Shows author information.\n");
-    printf("  VER                    Shows version information.\n");
-    printf("  CLS                    Clears the screen.\n");
-    printf("  ECHO [msg]             Displays a message.\n");
-    printf("  DIR [path]             Lists directory contents.\n");
-    printf("  CD [path]              Changes or shows the current directory.\n");
-    printf("  MD/MKDIR [path]        Creates a directory.\n");
-    printf("  RD/RMDIR [path]        Removes an empty directory.\n");
-    printf("  TYPE [file]            Displays a file's content.\n");
-    printf("  COPY [src] [dst]       Copies a single file.\n");
-    printf("  XCOPY [src] [dst]      Copies files and directory trees.\n");
-    printf("  DEL/ERASE [file]       Deletes a file.\n");
-    printf("  REN/MOVE [src] [dst]   Renames or moves a file/directory.\n");
-    printf("  REBOOT                 Restarts the system.\n");
-    printf("  EXIT/SHUTDOWN          Powers off the system.\n\n");
-    printf("Any other command is executed from the system's PATH (e.g., 'ls', 'cat').\n");
+void pipeline_free(struct pipeline* pl) {
+    free(pl->storage);
+    pl->storage = NULL;
 }
 
-void show_about() {
-    printf("\nTinyDOS Shell\n");
-    printf("  Author: minhmc2007\n");
-    printf("  GitHub: https://github.com/minhmc2007\n\n");
+int redirect_open(const struct redirect* r) {
+    char buf[PATH_MAX_LEN];
+    int flags = r->mode == REDIR_IN ? O_RDONLY : O_WRONLY | O_CREAT | (r->mode == REDIR_APPEND ? O_APPEND : O_TRUNC);
+    int fd = open(resolve_path(r->path, buf, sizeof(buf)), flags | O_CLOEXEC, 0644);
+    if (fd < 0) fprintf(stderr, "shell: %s: %s\n", r->path, strerror(errno));
+    return fd;
 }
 
-void show_version() {
-    struct utsname kernel_info;
-    printf("TinyDOS Shell [Version 0.0.3 (2025)]\n");
-    if (uname(&kernel_info) == 0) {
-        printf("Running on Linux %s (%s)\n", kernel_info.release, kernel_info.machine);
+// Applies a stage's redirections to this process. With `saved`, the original
+// descriptors are kept there so restore_redirects() can undo it.
+int apply_redirects(const struct stage* st, int* saved) {
+    for (int i = 0; i < st->nredirs; i++) {
+        const struct redirect* r = &st->redirs[i];
+        int fd = r->mode == REDIR_DUP_STDOUT ? STDOUT_FILENO : redirect_open(r);
+        if (fd < 0) return -1;
+        if (saved && saved[r->fd] < 0) saved[r->fd] = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);
+        if (dup2(fd, r->fd) < 0) {
+            perror("shell: dup2");
+            if (fd != STDOUT_FILENO) close(fd);
+            return -1;
+        }
+        if (fd != STDOUT_FILENO) close(fd);
     }
+    return 0;
 }
 
-void copy_file(const char* source, const char* dest) {
-    FILE *f_source, *f_dest;
-    char buffer[FILE_BUF_SIZE];
-    size_t bytes;
-    f_source = fopen(source, "rb");
-    if (!f_source) { perror("copy: source"); return; }
-    f_dest = fopen(dest, "wb");
-    if (!f_dest) { perror("copy: destination"); fclose(f_source); return; }
-    while ((bytes = fread(buffer, 1, FILE_BUF_SIZE, f_source)) > 0) {
-        if (fwrite(buffer, 1, bytes, f_dest) != bytes) {
-            perror("copy: write error"); break;
-        }
+void restore_redirects(int* saved) {
+    for (int fd = 0; fd < 3; fd++) {
+        if (saved[fd] < 0) continue;
+        dup2(saved[fd], fd);
+        close(saved[fd]);
+        saved[fd] = -1;
     }
-    fclose(f_source); fclose(f_dest);
-    printf("  1 file(s) copied.\n");
 }
 
-void do_xcopy(const char* source, const char* dest) {
-    struct stat st;
-    if (stat(source, &st) != 0) { perror("xcopy: source"); return; }
-    if (S_ISDIR(st.st_mode)) {
-        mkdir(dest, st.st_mode);
-        DIR* dir = opendir(source);
-        if (!dir) { perror("xcopy: opendir"); return; }
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != NULL) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
-            char new_source[PATH_MAX_LEN], new_dest[PATH_MAX_LEN];
-            snprintf(new_source, sizeof(new_source), "%s/%s", source, entry->d_name);
-            snprintf(new_dest, sizeof(new_dest), "%s/%s", dest, entry->d_name);
-            do_xcopy(new_source, new_dest);
+// Finds the builtin that would handle this stage, honoring applet specs.
+const struct builtin* stage_builtin(struct stage* st) {
+    const struct builtin* b = builtin_lookup(st->argv[0]);
+    if (b && b->spec && !applet_args_ok(b->spec, st->argc, st->argv)) return NULL;
+    return b;
+}
+
+// Runs a parsed pipeline and returns the exit status of its last stage.
+// A lone builtin runs in the shell itself, redirections included, so
+// "DIR > out.txt" does not fork; so does a .BAT file. In a pipeline every
+// builtin or batch stage gets a child process of its own; external stages
+// are started with posix_spawn.
+int run_pipeline(struct pipeline* pl) {
+    if (pl->nstages == 0) return last_errorlevel;
+
+    if (pl->nstages == 1) {
+        struct stage* st = &pl->stages[0];
+        const struct builtin* b = stage_builtin(st);
+        if (b || is_batch_file(st->argv[0])) {
+            char* argv[MAX_ARGS];
+            int saved[3] = { -1, -1, -1 };
+            int status = 1;
+            fflush(stdout);
+            if (apply_redirects(st, saved) == 0) {
+                stage_resolve_args(st, b, argv);
+                status = b ? b->handler(st->argc, argv) : run_batch_stage(st->argc, argv);
+                stage_args_free(st, argv);
+                fflush(stdout);
+            }
+            restore_redirects(saved);
+            return status;
         }
-        closedir(dir);
-    } else {
-        copy_file(source, dest);
     }
-}
 
-void do_dir(const char* path) {
-    char dos_path_display[PATH_MAX_LEN];
-    char real_path[PATH_MAX_LEN];
+    pid_t pids[MAX_STAGES];
+    int prev_read = -1, status = 1;
+    for (int i = 0; i < pl->nstages; i++) pids[i] = -1;
+    fflush(stdout);
+    for (int i = 0; i < pl->nstages; i++) {
+        struct stage* st = &pl->stages[i];
+        int fds[2] = { -1, -1 };
+        int in_fd = prev_read >= 0 ? prev_read : STDIN_FILENO;
+        int out_fd = STDOUT_FILENO;
+        if (i + 1 < pl->nstages) {
+            if (pipe2(fds, O_CLOEXEC) != 0) { perror("shell: pipe"); break; }
+            out_fd = fds[1];
+        }
 
-    if(realpath(path, real_path) == NULL) {
-        perror("dir");
-        return;
+        const struct builtin* b = stage_builtin(st);
+        char* argv[MAX_ARGS];
+        stage_resolve_args(st, b, argv);
+        if (b || is_batch_file(st->argv[0])) {
+            pids[i] = fork();
+            if (pids[i] == 0) {
+                // The read end of our own output pipe must not stay open here,
+                // or a reader that quits early would never give us EPIPE.
+                if (in_fd != STDIN_FILENO) { dup2(in_fd, STDIN_FILENO); close(in_fd); }
+                if (out_fd != STDOUT_FILENO) { dup2(out_fd, STDOUT_FILENO); close(out_fd); }
+                if (fds[0] >= 0) close(fds[0]);
+                if (apply_redirects(st, NULL) != 0) _exit(1);
+                int rc = b ? b->handler(st->argc, argv) : run_batch_stage(st->argc, argv);
+                fflush(stdout);
+                _exit(rc);
+            }
+            if (pids[i] < 0) perror("shell: fork");
+        } else {
+            // Redirection targets are opened here rather than as spawn file
+            // actions so that a missing file is reported as such.
+            posix_spawn_file_actions_t fa;
+            int opened[MAX_REDIRS], nopened = 0, ok = 1;
+            posix_spawn_file_actions_init(&fa);
+            if (in_fd != STDIN_FILENO) posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+            if (out_fd != STDOUT_FILENO) posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+            for (int r = 0; r < st->nredirs && ok; r++) {
+                const struct redirect* rd = &st->redirs[r];
+                if (rd->mode == REDIR_DUP_STDOUT) {
+                    posix_spawn_file_actions_adddup2(&fa, STDOUT_FILENO, rd->fd);
+                } else if ((opened[nopened] = redirect_open(rd)) >= 0) {
+                    posix_spawn_file_actions_adddup2(&fa, opened[nopened++], rd->fd);
+                } else {
+                    ok = 0;
+                }
+            }
+            if (ok) pids[i] = spawn_external(argv, &fa);
+            posix_spawn_file_actions_destroy(&fa);
+            while (nopened > 0) close(opened[--nopened]);
+        }
+
+        stage_args_free(st, argv);
+        if (prev_read >= 0) close(prev_read);
+        if (fds[1] >= 0) close(fds[1]);
+        prev_read = fds[0];
     }
-    format_path_for_dos(real_path, dos_path_display);
+    if (prev_read >= 0) close(prev_read);
 
-    DIR* d = opendir(path);
-    if (!d) { perror("dir"); return; }
+    for (int i = 0; i < pl->nstages; i++) {
+        int rc = pids[i] > 0 ? wait_for_child(pids[i]) : 1;
+        if (i == pl->nstages - 1) status = rc;
+    }
+    return status;
+}
 
-    printf("\n Directory of C:%s\n\n", dos_path_display);
-    struct dirent* dir;
-    struct stat st;
-    char full_path[PATH_MAX_LEN];
-    char time_buf[80];
-    long long total_size = 0;
-    int file_count = 0;
-    int dir_count = 0;
+// Parses and runs one command line; returns the new ERRORLEVEL.
+int execute_line(const char* line) {
+    struct pipeline pl;
+    const char* rest;
+    const struct builtin* b = raw_line_builtin(line, &rest);
+    if (b) {
+        char* argv[3] = { (char*)b->name, (char*)rest, NULL };
+        int status = b->handler(2, argv);
+        fflush(stdout);
+        return status;
+    }
+    if (parse_command_line(line, &pl) != 0) return 1;
+    int status = run_pipeline(&pl);
+    pipeline_free(&pl);
+    return status;
+}
 
-    while ((dir = readdir(d)) != NULL) {
-        snprintf(full_path, sizeof(full_path), "%s/%s", path, dir->d_name);
-        if (stat(full_path, &st) == -1) continue;
+// Returns the builtin if the line starts with one that takes its arguments
+// unparsed (BUILTIN_RAW_LINE), with *rest pointing past the command name.
+const struct builtin* raw_line_builtin(const char* line, const char** rest) {
+    char name[16];
+    const char* p = line + strspn(line, " \t");
+    size_t n = strcspn(p, " \t");
+    if (n == 0 || n >= sizeof(name)) return NULL;
+    memcpy(name, p, n);
+    name[n] = '\0';
+    const struct builtin* b = builtin_lookup(name);
+    if (!b || !(b->flags & BUILTIN_RAW_LINE)) return NULL;
+    *rest = p + n + strspn(p + n, " \t");
+    return b;
+}
 
-        strftime(time_buf, sizeof(time_buf), "%m/%d/%Y  %I:%M %p", localtime(&st.st_mtime));
-        printf("%s   ", time_buf);
+// --- Batch files ---
+// Scripts are compiled into struct batch_insn lists (see the types above).
+// A line without % that runs a second time (a loop body) keeps its parsed
+// pipeline, so further iterations cost no re-parsing; straight-line code
+// does not pay the memory for it. With ECHO OFF (the
+// default) nothing is printed between commands.
 
-        if (S_ISDIR(st.st_mode)) {
-            printf("%-12s ", "<DIR>");
-            if (strcmp(dir->d_name, ".") != 0 && strcmp(dir->d_name, "..") != 0) dir_count++;
+int is_batch_file(const char* name) {
+    size_t len = strlen(name);
+    return len > 4 && (strcasecmp(name + len - 4, ".bat") == 0 || strcasecmp(name + len - 4, ".cmd") == 0);
+}
+
+// Environment lookup the DOS way: variable names are not case-sensitive.
+const char* env_lookup(const char* name, size_t len) {
+    extern char** environ;
+    for (char** e = environ; *e; e++) {
+        if (strncasecmp(*e, name, len) == 0 && (*e)[len] == '=') return *e + len + 1;
+    }
+    return NULL;
+}
+
+int str_append(char** buf, size_t* len, size_t* cap, const char* s, size_t n) {
+    if (*len + n + 1 > *cap) {
+        size_t ncap = (*len + n + 1) * 2;
+        char* nbuf = realloc(*buf, ncap);
+        if (!nbuf) return -1;
+        *buf = nbuf;
+        *cap = ncap;
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+    return 0;
+}
+
+// Expands %NAME%, %0-%9, %~0-%~9 (surrounding quotes removed), %* and %%.
+// In a batch file (frame != NULL) an undefined variable expands to nothing;
+// at the prompt it is left as typed, as cmd.exe does. %ERRORLEVEL% and %CD%
+// are computed on the fly. Returns a malloc'd string, or NULL.
+char* expand_vars(const char* text, const struct batch_frame* frame) {
+    size_t len = 0, cap = strlen(text) + 64;
+    char* out = malloc(cap);
+    char num[24];
+    const char* p = text;
+    if (!out) return NULL;
+    out[0] = '\0';
+
+    while (*p) {
+        const char* val = p;
+        size_t vlen = 1;
+        if (*p != '%') {
+            vlen = strcspn(p, "%");
+            p += vlen;
+        } else if (p[1] == '%') {
+            val = "%";
+            p += 2;
+        } else if (frame && p[1] == '*') {
+            for (int j = 1; j < frame->argc; j++) {
+                if (j > 1) str_append(&out, &len, &cap, " ", 1);
+                str_append(&out, &len, &cap, frame->argv[j], strlen(frame->argv[j]));
+            }
+            vlen = 0;
+            p += 2;
+        } else if (frame && (isdigit((unsigned char)p[1]) || (p[1] == '~' && isdigit((unsigned char)p[2])))) {
+            int strip = p[1] == '~';
+            int i = frame->shift + (p[1 + strip] - '0');
+            val = i < frame->argc ? frame->argv[i] : "";
+            vlen = strlen(val);
+            if (strip && vlen >= 2 && val[0] == '"' && val[vlen - 1] == '"') { val++; vlen -= 2; }
+            p += 2 + strip;
         } else {
-            printf("%12lld ", (long long)st.st_size);
-            total_size += st.st_size;
-            file_count++;
+            const char* end = strchr(p + 1, '%');
+            size_t nlen = end ? (size_t)(end - p - 1) : 0;
+            if (memchr(p + 1, ' ', nlen)) nlen = 0; // "%F IN (...) DO ECHO %F": not a name
+            const char* found = NULL;
+            if (nlen == 10 && strncasecmp(p + 1, "ERRORLEVEL", 10) == 0) {
+                snprintf(num, sizeof(num), "%d", last_errorlevel);
+                found = num;
+            } else if (nlen == 2 && strncasecmp(p + 1, "CD", 2) == 0) {
+                snprintf(num, sizeof(num), "C:");
+                str_append(&out, &len, &cap, num, 2);
+                found = shell_prompt;
+            } else if (nlen > 0) {
+                found = env_lookup(p + 1, nlen);
+            }
+            if (found) {
+                val = found;
+                vlen = strlen(found);
+                p = end + 1;
+            } else if (nlen > 0 && frame) {
+                vlen = 0;
+                p = end + 1;
+            } else {
+                p++; // a lone %, or an unknown name at the prompt: keep as typed
+            }
+        }
+        if (vlen > 0 && str_append(&out, &len, &cap, val, vlen) != 0) {
+            free(out);
+            return NULL;
         }
-        printf("%s\n", dir->d_name);
     }
-    closedir(d);
+    return out;
+}
 
-    printf("\n%15d File(s) %15lld bytes\n", file_count, total_size);
-    printf("%15d Dir(s)\n", dir_count);
+// Returns the length of keyword kw if p starts with it (any case) as a
+// whole word, or 0.
+int batch_keyword(const char* p, const char* kw) {
+    size_t n = strlen(kw);
+    if (strncasecmp(p, kw, n) != 0) return 0;
+    return (p[n] == '\0' || p[n] == ' ' || p[n] == '\t') ? (int)n : 0;
+}
+
+// Returns the end of the blank-delimited word at p; "quoted blanks" stay in
+// the word, quotes included. With stop_at_eq the word also ends at "==".
+// If word is not NULL it receives a malloc'd copy.
+const char* batch_word(const char* p, char** word, int stop_at_eq) {
+    const char* start = p;
+    int quoted = 0;
+    while (*p && (quoted || (*p != ' ' && *p != '\t'))) {
+        if (!quoted && stop_at_eq && p[0] == '=' && p[1] == '=') break;
+        if (*p == '"') quoted = !quoted;
+        p++;
+    }
+    if (word) *word = strndup(start, p - start);
+    return p;
+}
+
+// Compiles one line into *in. Returns 1 if it produced an instruction, 0 for
+// blank lines, comments and labels, or -1 on a syntax error.
+int batch_compile_line(const char* line, int lineno, int quiet, struct batch_insn* in) {
+    memset(in, 0, sizeof(*in));
+    in->line = lineno;
+    in->level = -1;
+    in->target = BATCH_DYNAMIC;
+
+    while (*line == ' ' || *line == '\t' || *line == '@') {
+        if (*line == '@') quiet = 1;
+        line++;
+    }
+    in->quiet = quiet;
+    if (*line == '\0' || *line == ':') return 0;
+
+    const char* rest = line + strcspn(line, " \t");
+    rest += strspn(rest, " \t");
+    int k;
+
+    if (batch_keyword(line, "rem")) return 0;
+
+    if (batch_keyword(line, "goto")) {
+        in->op = BOP_GOTO;
+        if (*rest == ':') rest++;
+        batch_word(rest, &in->text, 0);
+        return (in->text && in->text[0]) ? 1 : -1;
+    }
+
+    if (batch_keyword(line, "call") && *rest == ':') {
+        in->op = BOP_CALL;
+        const char* args = batch_word(rest + 1, &in->text, 0);
+        in->text2 = strdup(args + strspn(args, " \t"));
+        return (in->text && in->text[0] && in->text2) ? 1 : -1;
+    }
+    if (batch_keyword(line, "call")) {
+        if (*rest == '\0') return 0;
+        line = rest; // CALL file.bat: run like any other command
+    } else if (batch_keyword(line, "shift")) {
+        in->op = BOP_SHIFT;
+        return 1;
+    } else if (batch_keyword(line, "exit") && batch_keyword(rest, "/b")) {
+        in->op = BOP_EXIT;
+        rest += 2 + strspn(rest + 2, " \t");
+        if (*rest) in->text = strdup(rest);
+        return 1;
+    } else if (batch_keyword(line, "if")) {
+        in->op = BOP_IF;
+        const char* q = rest;
+        if ((k = batch_keyword(q, "/i")) != 0) { in->nocase = 1; q += k; q += strspn(q, " \t"); }
+        if ((k = batch_keyword(q, "not")) != 0) { in->negate = 1; q += k; q += strspn(q, " \t"); }
+        if ((k = batch_keyword(q, "errorlevel")) != 0) {
+            char* end;
+            in->cond = COND_ERRORLEVEL;
+            q += k;
+            q += strspn(q, " \t");
+            in->level = strtol(q, &end, 10);
+            if (end == q) return -1;
+            q = end;
+        } else if ((k = batch_keyword(q, "exist")) != 0 || (k = batch_keyword(q, "defined")) != 0) {
+            in->cond = (tolower((unsigned char)*q) == 'e') ? COND_EXIST : COND_DEFINED;
+            q += k;
+            q += strspn(q, " \t");
+            q = batch_word(q, &in->text, 0);
+        } else {
+            in->cond = COND_EQUAL;
+            q = batch_word(q, &in->text, 1);
+            q += strspn(q, " \t");
+            if (q[0] != '=' || q[1] != '=') return -1;
+            q += 2;
+            q += strspn(q, " \t");
+            q = batch_word(q, &in->text2, 0);
+        }
+        if (!in->text && in->cond != COND_ERRORLEVEL) return -1;
+        q += strspn(q, " \t");
+        in->then = malloc(sizeof(*in->then));
+        if (!in->then) return -1;
+        if (batch_compile_line(q, lineno, quiet, in->then) != 1) {
+            batch_insn_free(in->then);
+            free(in->then);
+            in->then = NULL;
+            return -1;
+        }
+        return 1;
+    }
+
+    in->op = BOP_EXEC;
+    in->text = strdup(line);
+    if (!in->text) return -1;
+    // Raw-line builtins (SET) never go through the parser.
+    in->dynamic = strchr(line, '%') != NULL || raw_line_builtin(line, &rest) != NULL;
+    return 1;
+}
+
+void batch_insn_free(struct batch_insn* in) {
+    free(in->text);
+    free(in->text2);
+    if (in->parsed) {
+        pipeline_free(in->parsed);
+        free(in->parsed);
+    }
+    if (in->then) {
+        batch_insn_free(in->then);
+        free(in->then);
+    }
+}
+
+// Returns the instruction index of a label (no colon, any case), or -1.
+int batch_label_find(const struct batch_script* s, const char* name) {
+    char folded[CMD_BUF_SIZE];
+    size_t n = 0;
+    if (s->nlabel_slots == 0) return -1;
+    while (name[n] && n + 1 < sizeof(folded)) { folded[n] = tolower((unsigned char)name[n]); n++; }
+    folded[n] = '\0';
+    for (size_t i = str_hash(folded) & (s->nlabel_slots - 1);; i = (i + 1) & (s->nlabel_slots - 1)) {
+        if (s->labels[i].name == NULL) return -1;
+        if (strcmp(s->labels[i].name, folded) == 0) return s->labels[i].index;
+    }
+}
+
+// Turns GOTO/CALL label names into instruction indexes. Names with % and
+// labels that do not exist stay BATCH_DYNAMIC and are looked up (and
+// reported) only if the jump is actually taken.
+void batch_resolve(const struct batch_script* s, struct batch_insn* in) {
+    if (in->then) batch_resolve(s, in->then);
+    if ((in->op != BOP_GOTO && in->op != BOP_CALL) || strchr(in->text, '%')) return;
+    if (in->op == BOP_GOTO && strcasecmp(in->text, "eof") == 0) in->target = BATCH_EOF;
+    else if ((in->target = batch_label_find(s, in->text)) < 0) in->target = BATCH_DYNAMIC;
+}
+
+struct batch_script* batch_compile(const char* path, const char* text, size_t len) {
+    struct batch_script* s = calloc(1, sizeof(*s));
+    struct batch_label* found = NULL;
+    int nfound = 0, lineno = 0, ok = 1;
+    if (!s) return NULL;
+    s->path = strdup(path);
+    s->refs = 1;
+
+    for (size_t pos = 0; pos < len && ok;) {
+        const char* nl = memchr(text + pos, '\n', len - pos);
+        size_t n = nl ? (size_t)(nl - text - pos) : len - pos;
+        char* line = strndup(text + pos, n);
+        pos += n + 1;
+        lineno++;
+        if (!line) { ok = 0; break; }
+        if (n > 0 && line[n - 1] == '\r') line[n - 1] = '\0';
+
+        char* p = line + strspn(line, " \t@");
+        if (p[0] == ':' && p[1] != ':') {
+            char* name;
+            batch_word(p + 1, &name, 0);
+            for (char* c = name; c && *c; c++) *c = tolower((unsigned char)*c);
+            struct batch_label* grown = realloc(found, (nfound + 1) * sizeof(*found));
+            if (!name || !grown) { free(name); ok = 0; }
+            else {
+                found = grown;
+                found[nfound].name = name;
+                found[nfound++].index = s->ninsns;
+            }
+        } else {
+            if (s->ninsns == s->cap) {
+                int ncap = s->cap ? s->cap * 2 : 64;
+                struct batch_insn* grown = realloc(s->insns, ncap * sizeof(*grown));
+                if (!grown) { free(line); ok = 0; break; }
+                s->insns = grown;
+                s->cap = ncap;
+            }
+            int rc = batch_compile_line(line, lineno, 0, &s->insns[s->ninsns]);
+            if (rc < 0) {
+                fprintf(stderr, "%s, line %d: The syntax of the command is incorrect.\n", path, lineno);
+                batch_insn_free(&s->insns[s->ninsns]);
+                ok = 0;
+            } else if (rc > 0) {
+                s->ninsns++;
+            } else {
+                batch_insn_free(&s->insns[s->ninsns]);
+            }
+        }
+        free(line);
+    }
+
+    // The label table: open addressing over the folded names, first one wins.
+    s->nlabel_slots = 0;
+    if (ok && nfound > 0) {
+        int cap = 8;
+        while (cap < nfound * 2) cap *= 2;
+        s->labels = calloc(cap, sizeof(*s->labels));
+        if (!s->labels) ok = 0;
+        else s->nlabel_slots = cap;
+        for (int i = 0; ok && i < nfound; i++) {
+            size_t j = str_hash(found[i].name) & (cap - 1);
+            while (s->labels[j].name && strcmp(s->labels[j].name, found[i].name) != 0) j = (j + 1) & (cap - 1);
+            if (s->labels[j].name) continue;
+            s->labels[j] = found[i];
+            found[i].name = NULL;
+        }
+    }
+    for (int i = 0; i < nfound; i++) free(found[i].name);
+    free(found);
+
+    if (!ok) {
+        batch_release(s);
+        return NULL;
+    }
+    for (int i = 0; i < s->ninsns; i++) batch_resolve(s, &s->insns[i]);
+    return s;
+}
+
+// Returns the compiled script for path, compiling it only if the file is
+// new or has changed since it was last run. The caller owns one reference.
+struct batch_script* batch_load(const char* path) {
+    struct stat st;
+    struct batch_script** link;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "shell: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+
+    int cached = 0;
+    for (link = &batch_cache; *link; cached++) {
+        struct batch_script* s = *link;
+        if (s->dev != st.st_dev || s->ino != st.st_ino) { link = &s->next; continue; }
+        if (s->size == st.st_size && s->mtime.tv_sec == st.st_mtim.tv_sec && s->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            close(fd);
+            s->refs++;
+            return s;
+        }
+        *link = s->next; // stale: drop the cache's reference
+        batch_release(s);
+        cached--;
+    }
+
+    char* text = malloc(st.st_size + 1);
+    size_t len = 0;
+    ssize_t n = 0;
+    while (text && len < (size_t)st.st_size && (n = read(fd, text + len, st.st_size - len)) > 0) len += n;
+    close(fd);
+    if (!text || n < 0) {
+        fprintf(stderr, "shell: %s: %s\n", path, strerror(text ? errno : ENOMEM));
+        free(text);
+        return NULL;
+    }
+
+    struct batch_script* s = batch_compile(path, text, len);
+    free(text);
+    if (!s) return NULL;
+    s->dev = st.st_dev;
+    s->ino = st.st_ino;
+    s->size = st.st_size;
+    s->mtime = st.st_mtim;
+
+    if (cached >= BATCH_CACHE_MAX) { // evict the oldest
+        for (link = &batch_cache; (*link)->next; link = &(*link)->next) {}
+        batch_release(*link);
+        *link = NULL;
+    }
+    s->refs++; // the cache's reference
+    s->next = batch_cache;
+    batch_cache = s;
+    return s;
+}
+
+void batch_release(struct batch_script* s) {
+    if (--s->refs > 0) return;
+    for (int i = 0; i < s->ninsns; i++) batch_insn_free(&s->insns[i]);
+    for (int i = 0; i < s->nlabel_slots; i++) free(s->labels[i].name);
+    free(s->labels);
+    free(s->insns);
+    free(s->path);
+    free(s);
+}
+
+int batch_push_frame(struct batch_run* run, int argc, char** argv, int return_pc) {
+    if (run->depth == run->cap) {
+        int ncap = run->cap ? run->cap * 2 : 8;
+        struct batch_frame* grown = realloc(run->frames, ncap * sizeof(*grown));
+        if (!grown) return -1;
+        run->frames = grown;
+        run->cap = ncap;
+    }
+    struct batch_frame* f = &run->frames[run->depth];
+    f->argv = calloc(argc + 1, sizeof(char*));
+    if (!f->argv) return -1;
+    for (int j = 0; j < argc; j++) f->argv[j] = strdup(argv[j]);
+    f->argc = argc;
+    f->shift = 0;
+    f->return_pc = return_pc;
+    run->depth++;
+    return 0;
+}
+
+// Leaves the current CALL level (GOTO :EOF, EXIT /B, or end of file).
+void batch_return(struct batch_run* run) {
+    struct batch_frame* f = &run->frames[--run->depth];
+    for (int j = 0; j < f->argc; j++) free(f->argv[j]);
+    free(f->argv);
+    run->pc = f->return_pc;
+}
+
+// Returns the instruction index a GOTO/CALL goes to, BATCH_EOF, or -2 after
+// reporting a missing label.
+int batch_jump_target(struct batch_run* run, struct batch_insn* in) {
+    if (in->target != BATCH_DYNAMIC) return in->target;
+    char* name = expand_vars(in->text, &run->frames[run->depth - 1]);
+    if (!name) return -2;
+    const char* label = name[0] == ':' ? name + 1 : name;
+    int target = batch_label_find(run->script, label);
+    if (target < 0 && in->op == BOP_GOTO && strcasecmp(label, "eof") == 0) target = BATCH_EOF;
+    else if (target < 0) {
+        fprintf(stderr, "The system cannot find the batch label specified - %s\n", label);
+        last_errorlevel = 1;
+        target = -2;
+    }
+    free(name);
+    return target;
+}
+
+// Runs one instruction. Returns non-zero when the whole batch must stop.
+int batch_exec(struct batch_run* run, struct batch_insn* in) {
+    struct batch_frame* f = &run->frames[run->depth - 1];
+    char* line;
+    int target;
+
+    switch (in->op) {
+    case BOP_EXEC:
+        if (!in->dynamic) {
+            if (batch_echo && !in->quiet) printf("C:%s>%s\n", shell_prompt, in->text);
+            if (!in->seen) {
+                in->seen = 1;
+                last_errorlevel = execute_line(in->text);
+                return 0;
+            }
+            if (!in->parsed) {
+                in->parsed = malloc(sizeof(*in->parsed));
+                if (!in->parsed || parse_command_line(in->text, in->parsed) != 0) {
+                    free(in->parsed);
+                    in->parsed = NULL;
+                    last_errorlevel = 1;
+                    return 0;
+                }
+            }
+            last_errorlevel = run_pipeline(in->parsed);
+            return 0;
+        }
+        if (!(line = expand_vars(in->text, f))) return 1;
+        if (batch_echo && !in->quiet) printf("C:%s>%s\n", shell_prompt, line);
+        last_errorlevel = execute_line(line);
+        free(line);
+        return 0;
+
+    case BOP_GOTO:
+        if ((target = batch_jump_target(run, in)) == -2) return 1;
+        if (target == BATCH_EOF) batch_return(run);
+        else run->pc = target;
+        return 0;
+
+    case BOP_CALL: {
+        char* argv[MAX_ARGS];
+        char label[CMD_BUF_SIZE];
+        int argc = 1;
+        if ((target = batch_jump_target(run, in)) == -2) return 1;
+        if (!(line = expand_vars(in->text2, f))) return 1;
+        snprintf(label, sizeof(label), ":%s", in->text); // %0 of a CALLed label
+        argv[0] = label;
+        for (const char* p = line + strspn(line, " \t"); *p && argc < MAX_ARGS; p += strspn(p, " \t")) {
+            p = batch_word(p, &argv[argc], 0);
+            if (argv[argc]) argc++;
+        }
+        int rc = batch_push_frame(run, argc, argv, run->pc);
+        while (argc > 1) free(argv[--argc]);
+        free(line);
+        if (rc != 0) return 1;
+        run->pc = target;
+        return 0;
+    }
+
+    case BOP_IF: {
+        int cond = 0;
+        if (in->cond == COND_ERRORLEVEL) {
+            cond = last_errorlevel >= in->level;
+        } else {
+            char* a = expand_vars(in->text, f);
+            char* b = in->text2 ? expand_vars(in->text2, f) : NULL;
+            if (!a || (in->text2 && !b)) { free(a); free(b); return 1; }
+            if (in->cond == COND_EQUAL) {
+                cond = (in->nocase ? strcasecmp(a, b) : strcmp(a, b)) == 0;
+            } else if (in->cond == COND_DEFINED) {
+                cond = env_lookup(a, strlen(a)) != NULL;
+            } else {
+                size_t n = strlen(a);
+                char* path = a;
+                if (n >= 2 && a[0] == '"' && a[n - 1] == '"') { a[n - 1] = '\0'; path++; }
+                char buf[PATH_MAX_LEN];
+                normalize_path_to_linux(path);
+                cond = access(resolve_path(path, buf, sizeof(buf)), F_OK) == 0;
+            }
+            free(a);
+            free(b);
+        }
+        if (cond != in->negate) return batch_exec(run, in->then);
+        return 0;
+    }
+
+    case BOP_SHIFT:
+        if (f->shift < f->argc) f->shift++;
+        return 0;
+
+    case BOP_EXIT:
+        if (in->text) {
+            if (!(line = expand_vars(in->text, f))) return 1;
+            last_errorlevel = atoi(line);
+            free(line);
+        }
+        batch_return(run);
+        return 0;
+    }
+    return 0;
+}
+
+// Runs a compiled script with %0 = argv[0]; returns the final ERRORLEVEL.
+int batch_run(struct batch_script* s, int argc, char** argv) {
+    struct batch_run run = { s, NULL, 0, 0, 0 };
+    if (batch_depth >= BATCH_MAX_DEPTH) {
+        fprintf(stderr, "Batch recursion exceeds stack limits.\n");
+        return 1;
+    }
+    batch_depth++;
+    if (batch_push_frame(&run, argc, argv, s->ninsns) != 0) {
+        batch_depth--;
+        return 1;
+    }
+    while (run.depth > 0 && !shell_exit_requested) {
+        if (run.pc >= s->ninsns) {
+            batch_return(&run);
+            continue;
+        }
+        if (batch_exec(&run, &s->insns[run.pc++]) != 0) break;
+    }
+    while (run.depth > 0) batch_return(&run);
+    free(run.frames);
+    fflush(stdout);
+    batch_depth--;
+    return last_errorlevel;
+}
+
+int run_batch_file(const char* path, int argc, char** argv) {
+    struct batch_script* s = batch_load(path);
+    if (!s) return 1;
+    int rc = batch_run(s, argc, argv);
+    batch_release(s);
+    return rc;
+}
+
+// A pipeline stage naming a .BAT file: runs it in this process.
+int run_batch_stage(int argc, char** argv) {
+    char path[PATH_MAX_LEN], buf[PATH_MAX_LEN];
+    snprintf(path, sizeof(path), "%s", argv[0]);
+    normalize_path_to_linux(path);
+    return run_batch_file(resolve_path(path, buf, sizeof(buf)), argc, argv);
+}
+
+// cmd /C: the text is compiled as a one-line script, so IF and friends work.
+int run_command_string(const char* text) {
+    char* argv[] = { "cmd", NULL };
+    struct batch_script* s = batch_compile("cmd", text, strlen(text));
+    if (!s) return 1;
+    int rc = batch_run(s, 1, argv);
+    batch_release(s);
+    return rc;
+}
+
+// --- FOR ---
+// FOR [/P[:n]] %v IN (set) DO command. The line arrives unparsed (in a batch
+// file %%v has already become %v), the set is expanded once, and the body
+// is run per item with %v and %~[fdpnx]v substituted. With /P up to n
+// iterations run at once, each in a forked copy of the shell whose stdout
+// and stderr go to memfds; output is written in item order as soon as every
+// earlier iteration is done, and ERRORLEVEL is the highest status.
+
+int name_list_add(struct name_list* list, const char* s, size_t n) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 64;
+        char** grown = realloc(list->names, cap * sizeof(*grown));
+        if (!grown) return -1;
+        list->names = grown;
+        list->cap = cap;
+    }
+    if (!(list->names[list->count] = strndup(s, n))) return -1;
+    list->count++;
+    return 0;
+}
+
+// Splits the set on blanks, ',' and ';'. A word with wildcards becomes the
+// files it matches, sorted, with its directory part kept as typed; any other
+// word is an item as it stands. Returns 0, or -1 if out of memory.
+int for_expand_set(const char* set, size_t len, struct name_list* items) {
+    const char* end = set + len;
+    memset(items, 0, sizeof(*items));
+    for (const char* p = set; p < end;) {
+        while (p < end && strchr(" \t,;", *p)) p++;
+        const char* start = p;
+        int quoted = 0;
+        while (p < end && (quoted || !strchr(" \t,;", *p))) {
+            if (*p == '"') quoted = !quoted;
+            p++;
+        }
+        size_t n = p - start;
+        if (n == 0) continue;
+        if (!memchr(start, '*', n) && !memchr(start, '?', n)) {
+            if (name_list_add(items, start, n) != 0) return -1;
+            continue;
+        }
+
+        char word[PATH_MAX_LEN], dir[PATH_MAX_LEN], buf[PATH_MAX_LEN];
+        struct wildcard w;
+        struct name_list matches;
+        snprintf(word, sizeof(word), "%.*s", (int)n, start);
+        size_t prefix = 0; // the typed directory part, separator included
+        for (size_t i = 0; word[i]; i++) {
+            if (word[i] == '\\' || word[i] == '/') prefix = i + 1;
+        }
+        char typed[PATH_MAX_LEN];
+        memcpy(typed, word, prefix);
+        normalize_path_to_linux(word);
+        if (wildcard_split(word, dir, sizeof(dir), &w) < 0) continue;
+        int fd = open(resolve_path(dir, buf, sizeof(buf)), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) continue; // like cmd.exe: a set word that matches nothing is skipped
+        if (wildcard_list_files(fd, &w, &matches) == 0) {
+            for (size_t i = 0; i < matches.count; i++) {
+                snprintf(typed + prefix, sizeof(typed) - prefix, "%s", matches.names[i]);
+                if (name_list_add(items, typed, strlen(typed)) != 0) { name_list_free(&matches); close(fd); return -1; }
+            }
+            name_list_free(&matches);
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+// Appends item as selected by the %~ modifiers: f (full path), d (drive),
+// p (directory), n (name), x (extension); none just drops surrounding quotes.
+void for_append_item(char** out, size_t* len, size_t* cap, const char* item, const char* mods, size_t nmods) {
+    char path[PATH_MAX_LEN], full[PATH_MAX_LEN * 2], dos[PATH_MAX_LEN];
+    size_t n = strlen(item);
+    if (n >= 2 && item[0] == '"' && item[n - 1] == '"') { item++; n -= 2; }
+    if (nmods == 0) { str_append(out, len, cap, item, n); return; }
+
+    snprintf(path, sizeof(path), "%.*s", (int)n, item);
+    normalize_path_to_linux(path);
+    if (path[0] == '/') snprintf(full, sizeof(full), "%s", path);
+    else snprintf(full, sizeof(full), "%s/%s", strcmp(shell_cwd, "/") == 0 ? "" : shell_cwd, path);
+    format_path_for_dos(full, dos);
+    char* base = strrchr(dos, '\\') + 1; // dos is absolute, so there is one
+    char* dot = strrchr(base, '.');
+    if (dot == base) dot = NULL; // ".profile" is a name, not an extension
+    size_t name_len = dot ? (size_t)(dot - base) : strlen(base);
+
+    if (memchr(mods, 'f', nmods)) {
+        str_append(out, len, cap, "C:", 2);
+        str_append(out, len, cap, dos, strlen(dos));
+        return;
+    }
+    if (memchr(mods, 'd', nmods)) str_append(out, len, cap, "C:", 2);
+    if (memchr(mods, 'p', nmods)) str_append(out, len, cap, dos, base - dos);
+    if (memchr(mods, 'n', nmods)) str_append(out, len, cap, base, name_len);
+    if (memchr(mods, 'x', nmods) && dot) str_append(out, len, cap, dot, strlen(dot));
+}
+
+// Returns body with %v and %~[fdpnx]v replaced by item (malloc'd), or NULL.
+char* for_substitute(const char* body, char var, const char* item) {
+    size_t len = 0, cap = strlen(body) + strlen(item) + 64;
+    char* out = malloc(cap);
+    if (!out) return NULL;
+    out[0] = '\0';
+    for (const char* p = body; *p;) {
+        const char* pct = strchr(p, '%');
+        if (!pct) { str_append(&out, &len, &cap, p, strlen(p)); break; }
+        str_append(&out, &len, &cap, p, pct - p);
+        p = pct;
+        if (p[1] == var) {
+            for_append_item(&out, &len, &cap, item, "", 0);
+            p += 2;
+            continue;
+        }
+        if (p[1] == '~') {
+            // The run of modifier letters ends with the variable itself.
+            size_t n = strspn(p + 2, "fdpnx");
+            if (p[2 + n] != var && n > 0 && p[1 + n] == var) n--;
+            if (p[2 + n] == var) {
+                for_append_item(&out, &len, &cap, item, p + 2, n);
+                p += 3 + n;
+                continue;
+            }
+        }
+        str_append(&out, &len, &cap, "%", 1);
+        p++;
+    }
+    return out;
+}
+
+// IF only exists compiled, so a body starting with IF runs as a one-line script.
+int for_run_body(const char* line) {
+    const char* p = line + strspn(line, " \t@");
+    return batch_keyword(p, "if") ? run_command_string(p) : execute_line(p);
+}
+
+// Forks one /P iteration with its output going to fresh memfds.
+void for_job_start(struct for_job* job, const char* line) {
+    job->out_fd = memfd_create("for-stdout", MFD_CLOEXEC);
+    job->err_fd = memfd_create("for-stderr", MFD_CLOEXEC);
+    job->pid = -1;
+    if (job->out_fd >= 0 && job->err_fd >= 0) job->pid = fork();
+    if (job->pid == 0) {
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd >= 0) dup2(null_fd, STDIN_FILENO);
+        dup2(job->out_fd, STDOUT_FILENO);
+        dup2(job->err_fd, STDERR_FILENO);
+        int rc = for_run_body(line);
+        fflush(stdout);
+        _exit(rc);
+    }
+    if (job->pid < 0) {
+        perror("for");
+        job->done = 1;
+        job->status = 1;
+    }
+}
+
+void for_job_emit(struct for_job* job) {
+    struct stat st;
+    if (job->out_fd >= 0) {
+        if (fstat(job->out_fd, &st) == 0 && st.st_size > 0) send_file_range(job->out_fd, 0, st.st_size, STDOUT_FILENO);
+        close(job->out_fd);
+    }
+    if (job->err_fd >= 0) {
+        if (fstat(job->err_fd, &st) == 0 && st.st_size > 0) send_file_range(job->err_fd, 0, st.st_size, STDERR_FILENO);
+        close(job->err_fd);
+    }
+}
+
+int for_parallel(const char* body, char var, const struct name_list* items, int nparallel) {
+    struct for_job* jobs = calloc(items->count, sizeof(*jobs));
+    size_t next = 0, emitted = 0, window = (size_t)nparallel * FOR_WINDOW_PER_JOB;
+    int running = 0, rc = 0;
+    if (!jobs) { perror("for"); return 1; }
+
+    fflush(stdout);
+    while (emitted < items->count) {
+        while (running < nparallel && next < items->count && next < emitted + window && !shell_exit_requested) {
+            char* line = for_substitute(body, var, items->names[next]);
+            if (line) {
+                for_job_start(&jobs[next], line);
+                if (jobs[next].pid > 0) running++;
+                free(line);
+            } else {
+                jobs[next].done = 1;
+                jobs[next].status = 1;
+            }
+            next++;
+        }
+        if (emitted < next && jobs[emitted].done) {
+            for_job_emit(&jobs[emitted]);
+            if (jobs[emitted].status > rc) rc = jobs[emitted].status;
+            emitted++;
+            continue;
+        }
+        if (running == 0) break; // nothing left to wait for (exit requested)
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            perror("for");
+            break;
+        }
+        for (size_t i = emitted; i < next; i++) {
+            if (jobs[i].pid != pid || jobs[i].done) continue;
+            jobs[i].done = 1;
+            jobs[i].status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            running--;
+            break;
+        }
+    }
+    for (; emitted < next; emitted++) for_job_emit(&jobs[emitted]);
+    free(jobs);
+    return rc;
+}
+
+int builtin_for(int argc, char** argv) {
+    const char* p = argc > 1 ? argv[1] : "";
+    const char* sw;
+    int nparallel = 0, k;
+    char* word;
+
+    while (*p == '/') {
+        const char* end = batch_word(p, &word, 0);
+        sw = word ? match_switch(word, "P") : NULL;
+        if (!sw) { free(word); goto syntax; }
+        nparallel = *sw ? atoi(sw) : online_cpus();
+        if (nparallel < 1) nparallel = 1;
+        free(word);
+        p = end + strspn(end, " \t");
+    }
+    if (p[0] != '%' || !isalpha((unsigned char)p[1]) || (p[2] != ' ' && p[2] != '\t')) goto syntax;
+    char var = p[1];
+    p += 2 + strspn(p + 2, " \t");
+    if (!(k = batch_keyword(p, "in"))) goto syntax;
+    p += k + strspn(p + k, " \t");
+    if (*p != '(') goto syntax;
+    const char* set = ++p;
+    int quoted = 0;
+    while (*p && (quoted || *p != ')')) {
+        if (*p == '"') quoted = !quoted;
+        p++;
+    }
+    if (*p != ')') goto syntax;
+    size_t set_len = p - set;
+    p++;
+    p += strspn(p, " \t");
+    if (!(k = batch_keyword(p, "do"))) goto syntax;
+    const char* body = p + k + strspn(p + k, " \t");
+    if (*body == '\0') goto syntax;
+
+    struct name_list items;
+    if (for_expand_set(set, set_len, &items) != 0) { perror("for"); name_list_free(&items); return 1; }
+    int rc = last_errorlevel;
+    if (nparallel > 0 && items.count > 1) {
+        rc = for_parallel(body, var, &items, nparallel);
+    } else {
+        for (size_t i = 0; i < items.count && !shell_exit_requested; i++) {
+            char* line = for_substitute(body, var, items.names[i]);
+            if (!line) { rc = 1; break; }
+            rc = last_errorlevel = for_run_body(line);
+            free(line);
+        }
+    }
+    name_list_free(&items);
+    return rc;
+
+syntax:
+    printf("Syntax: FOR [/P[:n]] %%v IN (set) DO command\n");
+    return 1;
+}
+
+// --- External commands: PATH lookup cache and posix_spawn ---
+// Resolved command paths are cached per PATH directory. On the full kernel
+// an inotify watch on each PATH directory drops the affected entries as soon
+// as something is added, removed or renamed there. Without inotify (tiny
+// kernel) a hit is re-validated by checking the mtimes of the PATH
+// directories up to the one the command was found in. That is one stat per
+// directory instead of an exec attempt in each.
+
+int dirwatch_init() {
+    if (dirwatch_fd == -2) dirwatch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    return dirwatch_fd;
+}
+
+int dirwatch_add(const char* path) {
+    if (dirwatch_init() < 0) return -1;
+    return inotify_add_watch(dirwatch_fd, path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                             IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+}
+
+// Drains pending inotify events and tells each cache which directory changed.
+void dirwatch_poll() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    if (dirwatch_fd < 0) return;
+    while ((n = read(dirwatch_fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + n;) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            int gone = (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) != 0;
+            command_cache_dir_changed(ev->wd, gone);
+            path_index_dir_changed(ev->wd, gone);
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+}
+
+void command_cache_clear_entries(size_t from_dir) {
+    struct command_cache* cc = &command_cache;
+    size_t kept = 0;
+    for (size_t i = 0; i < cc->cap; i++) {
+        struct hash_entry* e = &cc->slots[i];
+        if (e->name && e->dir_index >= from_dir) {
+            free(e->name);
+            free(e->path);
+            e->name = NULL;
+        }
+    }
+    // Rehash the survivors so linear probing stays valid.
+    struct hash_entry* old = cc->slots;
+    size_t cap = cc->cap;
+    cc->slots = cap ? calloc(cap, sizeof(*cc->slots)) : NULL;
+    cc->count = 0;
+    for (size_t i = 0; i < cap; i++) {
+        if (old[i].name) {
+            size_t j = str_hash(old[i].name) & (cap - 1);
+            while (cc->slots[j].name) j = (j + 1) & (cap - 1);
+            cc->slots[j] = old[i];
+            kept++;
+        }
+    }
+    cc->count = kept;
+    free(old);
+}
+
+void command_cache_dir_changed(int wd, int gone) {
+    struct command_cache* cc = &command_cache;
+    for (size_t d = 0; d < cc->ndirs; d++) {
+        if (cc->dirs[d].wd != wd) continue;
+        if (gone) cc->dirs[d].wd = -1; // fall back to mtime checks for it
+        command_cache_clear_entries(d);
+        return;
+    }
+}
+
+// (Re)builds the directory list whenever PATH differs from the cached copy.
+void command_cache_sync_path() {
+    struct command_cache* cc = &command_cache;
+    const char* path = getenv("PATH");
+    if (path == NULL) path = "";
+    if (cc->path_env && strcmp(cc->path_env, path) == 0) return;
+
+    command_cache_clear_entries(0);
+    for (size_t d = 0; d < cc->ndirs; d++) {
+        if (cc->dirs[d].wd >= 0) inotify_rm_watch(dirwatch_fd, cc->dirs[d].wd);
+        free(cc->dirs[d].path);
+    }
+    free(cc->dirs);
+    free(cc->path_env);
+    cc->path_env = strdup(path);
+    cc->dirs = NULL;
+    cc->ndirs = 0;
+
+    char* copy = strdup(path);
+    char* save = NULL;
+    for (char* dir = strtok_r(copy, ":", &save); dir; dir = strtok_r(NULL, ":", &save)) {
+        struct stat st;
+        cc->dirs = realloc(cc->dirs, (cc->ndirs + 1) * sizeof(*cc->dirs));
+        struct path_dir* pd = &cc->dirs[cc->ndirs++];
+        pd->path = strdup(dir);
+        pd->wd = dirwatch_add(dir);
+        if (stat(dir, &st) == 0) pd->mtime = st.st_mtim;
+        else memset(&pd->mtime, 0, sizeof(pd->mtime));
+    }
+    free(copy);
+}
+
+// Returns nonzero if directories 0..upto are unchanged since they were last
+// checked; otherwise drops every entry the first changed one could affect.
+int command_cache_dirs_valid(size_t upto) {
+    struct command_cache* cc = &command_cache;
+    size_t first_changed = (size_t)-1;
+    for (size_t d = 0; d <= upto && d < cc->ndirs; d++) {
+        struct path_dir* pd = &cc->dirs[d];
+        struct stat st;
+        if (pd->wd >= 0) continue; // inotify tells us instead
+        if (stat(pd->path, &st) != 0) memset(&st.st_mtim, 0, sizeof(st.st_mtim));
+        if (st.st_mtim.tv_sec != pd->mtime.tv_sec || st.st_mtim.tv_nsec != pd->mtime.tv_nsec) {
+            pd->mtime = st.st_mtim;
+            if (first_changed == (size_t)-1) first_changed = d;
+        }
+    }
+    if (first_changed == (size_t)-1) return 1;
+    command_cache_clear_entries(first_changed);
+    return 0;
+}
+
+// Resolves a command name to an executable path, through the cache.
+// Returns a pointer owned by the cache, or NULL if not found.
+const char* command_cache_lookup(const char* name) {
+    struct command_cache* cc = &command_cache;
+    command_cache_sync_path();
+    dirwatch_poll();
+
+    if (cc->cap > 0) {
+        size_t i = str_hash(name) & (cc->cap - 1);
+        while (cc->slots[i].name) {
+            struct hash_entry* e = &cc->slots[i];
+            if (strcmp(e->name, name) == 0) {
+                if (!command_cache_dirs_valid(e->dir_index)) break;
+                e->hits++;
+                return e->path;
+            }
+            i = (i + 1) & (cc->cap - 1);
+        }
+    }
+
+    // Miss: scan PATH like execvp would, and remember the answer.
+    command_cache_dirs_valid(cc->ndirs);
+    for (size_t d = 0; d < cc->ndirs; d++) {
+        char full[PATH_MAX_LEN];
+        struct stat st;
+        const char* dir = cc->dirs[d].path[0] ? cc->dirs[d].path : ".";
+        if (snprintf(full, sizeof(full), "%s/%s", dir, name) >= (int)sizeof(full)) continue;
+        if (stat(full, &st) != 0 && dir[0] == '/') {
+            // DOS habits: "LS" finds ls. Only tried when the exact name is missing.
+            struct name_index* ni = name_index_get(dir);
+            const char* real = ni ? name_index_find(ni, name) : NULL;
+            if (!real || snprintf(full, sizeof(full), "%s/%s", dir, real) >= (int)sizeof(full)) continue;
+            if (stat(full, &st) != 0) continue;
+        }
+        if (!S_ISREG(st.st_mode) || access(full, X_OK) != 0) continue;
+
+        if ((cc->count + 1) * 2 > cc->cap) {
+            size_t new_cap = cc->cap ? cc->cap * 2 : 64;
+            struct hash_entry* old = cc->slots;
+            size_t old_cap = cc->cap;
+            cc->slots = calloc(new_cap, sizeof(*cc->slots));
+            cc->cap = new_cap;
+            for (size_t k = 0; k < old_cap; k++) {
+                if (!old[k].name) continue;
+                size_t j = str_hash(old[k].name) & (new_cap - 1);
+                while (cc->slots[j].name) j = (j + 1) & (new_cap - 1);
+                cc->slots[j] = old[k];
+            }
+            free(old);
+        }
+        size_t i = str_hash(name) & (cc->cap - 1);
+        while (cc->slots[i].name) i = (i + 1) & (cc->cap - 1);
+        struct hash_entry* e = &cc->slots[i];
+        e->name = strdup(name);
+        e->path = strdup(full);
+        e->dir_index = d;
+        e->hits = 1;
+        cc->count++;
+        return e->path;
+    }
+    return NULL;
+}
+
+// Starts argv[0] with posix_spawn (vfork semantics: no page-table copy of
+// the shell). Returns the child's pid, or -1 (already reported).
+pid_t spawn_external(char** argv, const posix_spawn_file_actions_t* actions) {
+    const char* path = argv[0];
+    pid_t pid;
+    int err;
+
+    if (strchr(argv[0], '/') == NULL) {
+        path = command_cache_lookup(argv[0]);
+        if (path == NULL) {
+            fprintf(stderr, "shell: %s: command not found\n", argv[0]);
+            return -1;
+        }
+    }
+    fflush(stdout);
+    err = posix_spawn(&pid, path, actions, NULL, argv, environ);
+    if (err == ENOENT && path != argv[0]) {
+        // The cached file vanished behind our back: forget it and retry once.
+        command_cache_clear_entries(0);
+        path = command_cache_lookup(argv[0]);
+        err = path ? posix_spawn(&pid, path, actions, NULL, argv, environ) : ENOENT;
+    }
+    if (err != 0) {
+        if (err == ENOENT) fprintf(stderr, "shell: %s: command not found\n", argv[0]);
+        else fprintf(stderr, "shell: %s: %s\n", argv[0], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+int wait_for_child(pid_t pid) {
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return 1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+int run_external(char** args) {
+    pid_t pid = spawn_external(args, NULL);
+    return pid < 0 ? 1 : wait_for_child(pid);
+}
+
+int builtin_hash(int argc, char** argv) {
+    struct command_cache* cc = &command_cache;
+    for (int j = 1; j < argc; j++) {
+        if (match_switch(argv[j], "R")) {
+            command_cache_clear_entries(0);
+            printf("Command cache cleared.\n");
+            return 0;
+        }
+    }
+    dirwatch_poll();
+    if (cc->count == 0) {
+        printf("Command cache is empty.\n");
+        return 0;
+    }
+    printf("  HITS  COMMAND\n");
+    for (size_t i = 0; i < cc->cap; i++) {
+        if (cc->slots[i].name) printf("%6lu  %s\n", cc->slots[i].hits, cc->slots[i].path);
+    }
+    printf("\nInvalidation: %s\n", dirwatch_fd >= 0 ? "inotify" : "directory mtime");
+    return 0;
+}
+
+// --- Case-insensitive path resolution ---
+// DOS paths are typed in any case ("CD \TINYDOS\SYSTEM64"). When a path does
+// not exist as typed, each component is looked up in a case-folded index of
+// its parent directory. Indexes are built on first use and kept; an inotify
+// watch (or, without one, the directory's mtime) says when to rebuild.
+
+unsigned long str_hash_nocase(const char* s) {
+    unsigned long h = 1469598103934665603UL;
+    while (*s) h = (h ^ (unsigned char)tolower((unsigned char)*s++)) * 1099511628211UL;
+    return h;
+}
+
+void name_index_fill(struct name_index* ni) {
+    for (size_t i = 0; i < ni->cap; i++) free(ni->names[i]);
+    if (ni->cap) memset(ni->names, 0, ni->cap * sizeof(*ni->names));
+    ni->count = 0;
+    ni->stale = 0;
+
+    DIR* dir = opendir(ni->dir);
+    if (!dir) return;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if ((ni->count + 1) * 2 > ni->cap) {
+            size_t cap = ni->cap ? ni->cap * 2 : 64;
+            char** grown = calloc(cap, sizeof(*grown));
+            if (!grown) break;
+            for (size_t i = 0; i < ni->cap; i++) {
+                if (!ni->names[i]) continue;
+                size_t j = str_hash_nocase(ni->names[i]) & (cap - 1);
+                while (grown[j]) j = (j + 1) & (cap - 1);
+                grown[j] = ni->names[i];
+            }
+            free(ni->names);
+            ni->names = grown;
+            ni->cap = cap;
+        }
+        size_t j = str_hash_nocase(entry->d_name) & (ni->cap - 1);
+        while (ni->names[j]) j = (j + 1) & (ni->cap - 1);
+        if ((ni->names[j] = strdup(entry->d_name)) != NULL) ni->count++;
+    }
+    closedir(dir);
+}
+
+void name_index_free(struct name_index* ni) {
+    for (size_t i = 0; i < ni->cap; i++) free(ni->names[i]);
+    free(ni->names);
+    free(ni->dir);
+    free(ni);
+}
+
+// Returns the index for an absolute directory path, up to date, or NULL.
+struct name_index* name_index_get(const char* dir) {
+    struct path_index* pi = &path_index;
+    struct stat st;
+    struct name_index* ni = NULL;
+    size_t i = 0;
+
+    if (pi->cap > 0) {
+        for (i = str_hash(dir) & (pi->cap - 1); pi->slots[i]; i = (i + 1) & (pi->cap - 1)) {
+            if (strcmp(pi->slots[i]->dir, dir) == 0) { ni = pi->slots[i]; break; }
+        }
+    }
+    if (ni) {
+        if (ni->wd < 0) {
+            if (stat(dir, &st) != 0) return NULL;
+            if (st.st_mtim.tv_sec != ni->mtime.tv_sec || st.st_mtim.tv_nsec != ni->mtime.tv_nsec) {
+                ni->mtime = st.st_mtim;
+                ni->stale = 1;
+            }
+        }
+        if (ni->stale) name_index_fill(ni);
+        return ni;
+    }
+
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) return NULL;
+    if (pi->count >= PATH_INDEX_MAX_DIRS) path_index_clear();
+    if ((pi->count + 1) * 2 > pi->cap) {
+        size_t cap = pi->cap ? pi->cap * 2 : 64;
+        struct name_index** grown = calloc(cap, sizeof(*grown));
+        if (!grown) return NULL;
+        for (size_t k = 0; k < pi->cap; k++) {
+            if (!pi->slots[k]) continue;
+            size_t j = str_hash(pi->slots[k]->dir) & (cap - 1);
+            while (grown[j]) j = (j + 1) & (cap - 1);
+            grown[j] = pi->slots[k];
+        }
+        free(pi->slots);
+        pi->slots = grown;
+        pi->cap = cap;
+    }
+    if (!(ni = calloc(1, sizeof(*ni))) || !(ni->dir = strdup(dir))) {
+        free(ni);
+        return NULL;
+    }
+    ni->mtime = st.st_mtim;
+    ni->wd = dirwatch_add(dir);
+    name_index_fill(ni);
+    for (i = str_hash(dir) & (pi->cap - 1); pi->slots[i]; i = (i + 1) & (pi->cap - 1)) {}
+    pi->slots[i] = ni;
+    pi->count++;
+    return ni;
+}
+
+// Returns the real spelling of name in the directory, preferring an exact
+// match when several names differ only in case; NULL if there is none.
+const char* name_index_find(const struct name_index* ni, const char* name) {
+    const char* found = NULL;
+    if (ni->cap == 0) return NULL;
+    for (size_t i = str_hash_nocase(name) & (ni->cap - 1); ni->names[i]; i = (i + 1) & (ni->cap - 1)) {
+        if (strcmp(ni->names[i], name) == 0) return ni->names[i];
+        if (!found && strcasecmp(ni->names[i], name) == 0) found = ni->names[i];
+    }
+    return found;
+}
+
+void path_index_dir_changed(int wd, int gone) {
+    struct path_index* pi = &path_index;
+    for (size_t i = 0; i < pi->cap; i++) {
+        struct name_index* ni = pi->slots[i];
+        if (!ni || ni->wd != wd) continue;
+        ni->stale = 1;
+        if (gone) ni->wd = -1; // fall back to mtime checks for it
+    }
+}
+
+void path_index_clear() {
+    struct path_index* pi = &path_index;
+    for (size_t i = 0; i < pi->cap; i++) {
+        struct name_index* ni = pi->slots[i];
+        if (!ni) continue;
+        int shared = 0; // PATH directories keep their watch for the command cache
+        for (size_t d = 0; d < command_cache.ndirs; d++) shared |= command_cache.dirs[d].wd == ni->wd;
+        if (ni->wd >= 0 && !shared) inotify_rm_watch(dirwatch_fd, ni->wd);
+        name_index_free(ni);
+        pi->slots[i] = NULL;
+    }
+    pi->count = 0;
+}
+
+// Returns path itself if it exists as typed (or cannot be resolved at all),
+// otherwise buf holding it with the real case of every component that could
+// be found. Components from the first missing one on are kept as typed, so
+// a file about to be created still lands in the right directory.
+const char* resolve_path(const char* path, char* buf, size_t len) {
+    char dir[PATH_MAX_LEN], comp[NAME_MAX + 1];
+    size_t olen = 0, dlen;
+    const char* p = path;
+
+    if (path[0] == '\0' || faccessat(AT_FDCWD, path, F_OK, AT_SYMLINK_NOFOLLOW) == 0) return path;
+    dirwatch_poll();
+    if (*p == '/') {
+        snprintf(dir, sizeof(dir), "/");
+        buf[olen++] = '/';
+        p++;
+    } else {
+        snprintf(dir, sizeof(dir), "%s", shell_cwd);
+    }
+    dlen = strlen(dir);
+
+    while (*p) {
+        size_t n = strcspn(p, "/");
+        const char* real = comp;
+        if (n == 0) { p++; continue; }
+        if (n > NAME_MAX) break;
+        memcpy(comp, p, n);
+        comp[n] = '\0';
+        if (strcmp(comp, ".") != 0 && strcmp(comp, "..") != 0) {
+            struct name_index* ni = name_index_get(dir);
+            if (!ni || !(real = name_index_find(ni, comp))) break;
+        }
+        size_t rlen = strlen(real);
+        if (olen + rlen + 2 >= len || dlen + rlen + 2 >= sizeof(dir)) return path;
+        memcpy(buf + olen, real, rlen);
+        olen += rlen;
+        if (dir[dlen - 1] != '/') dir[dlen++] = '/';
+        memcpy(dir + dlen, real, rlen + 1);
+        dlen += rlen;
+        p += n;
+        if (*p == '/') { buf[olen++] = '/'; p++; }
+    }
+    if (olen + strlen(p) + 1 > len) return path;
+    strcpy(buf + olen, p);
+    return buf;
+}
+
+// Resolves a stage's path arguments into argv (NULL-terminated). For DOS
+// builtins that take paths, that is every argument not typed as a /switch;
+// for applets every non-option; for external programs only arguments with
+// a directory separator, so search patterns and the like are left alone.
+// Changed arguments are malloc'd copies, released by stage_args_free().
+void stage_resolve_args(const struct stage* st, const struct builtin* b, char** argv) {
+    char buf[PATH_MAX_LEN];
+    for (int j = 0; j < st->argc; j++) {
+        char* a = st->argv[j];
+        int want;
+        if (j == 0) want = !b && (strchr(a, '/') != NULL || is_batch_file(a));
+        else if (b && !b->spec) want = (b->flags & BUILTIN_PATHS) && !(st->switches & (1u << j));
+        else if (b) want = a[0] != '-';
+        else want = strchr(a, '/') != NULL;
+        const char* r = want ? resolve_path(a, buf, sizeof(buf)) : a;
+        argv[j] = (r == a) ? a : strdup(r);
+        if (!argv[j]) argv[j] = a;
+    }
+    argv[st->argc] = NULL;
+}
+
+void stage_args_free(const struct stage* st, char** argv) {
+    for (int j = 0; j < st->argc; j++) {
+        if (argv[j] != st->argv[j]) free(argv[j]);
+    }
+}
+
+// --- Wildcards ---
+// DOS pattern semantics: case-insensitive, "*.*" also matches names without
+// an extension and "*." only those, and '?' matches one character but none
+// at a '.' or the end of the name ("DATA??.LOG" takes DATA1.LOG). A pattern
+// is compiled once and then tested against bare d_name strings, so callers
+// filter directory entries before building paths or calling stat.
+
+int has_wildcards(const char* s) {
+    return strpbrk(s, "*?") != NULL;
+}
+
+int wildcard_compile(const char* pattern, struct wildcard* w) {
+    size_t len = strlen(pattern);
+    if (len > NAME_MAX) { errno = ENAMETOOLONG; return -1; }
+    for (size_t i = 0; i < len; i++) w->text[i] = tolower((unsigned char)pattern[i]);
+    w->text[len] = '\0';
+    w->len = len;
+
+    const char* wild = strpbrk(w->text, "*?");
+    if (strcmp(w->text, "*") == 0 || strcmp(w->text, "*.*") == 0) {
+        w->kind = WILD_ALL;
+    } else if (wild == NULL) {
+        w->kind = WILD_LITERAL;
+    } else if (strcmp(w->text, "*.") == 0) {
+        w->kind = WILD_NO_EXT;
+    } else if (wild == w->text && *w->text == '*' && !has_wildcards(w->text + 1)) {
+        w->kind = WILD_SUFFIX;
+        memmove(w->text, w->text + 1, len);
+        w->len = len - 1;
+    } else if (wild == w->text + len - 1 && *wild == '*' && (len < 2 || wild[-1] != '.')) {
+        w->kind = WILD_PREFIX; // "NAME.*" is left generic: it also matches NAME
+        w->text[--w->len] = '\0';
+    } else {
+        w->kind = WILD_GENERIC;
+    }
+    return 0;
+}
+
+// `p` is a folded pattern. A '*' is retried one character further on each
+// mismatch, which is linear enough for file names.
+int wildcard_match_generic(const char* p, const char* n) {
+    const char* star_p = NULL;
+    const char* star_n = NULL;
+    const char* star_from = NULL; // where the name was when the last '*' was reached
+    for (;;) {
+        if (*p == '*') {
+            star_p = ++p;
+            star_n = star_from = n;
+            continue;
+        }
+        if (*n == '\0') {
+            // Trailing wildcards match nothing, and so does a final '.' as
+            // long as no '*' has swallowed the name's own extension.
+            const char* q = p;
+            while (*q == '*' || *q == '?') q++;
+            if (*q == '.' && (!star_p || !memchr(star_from, '.', n - star_from))) {
+                q++;
+                while (*q == '*' || *q == '?') q++;
+            }
+            if (*q == '\0') return 1;
+        } else if (*p == '?') {
+            p++;
+            if (*n != '.') n++;
+            continue;
+        } else if (*p == tolower((unsigned char)*n)) {
+            p++;
+            n++;
+            continue;
+        }
+        if (!star_p || *star_n == '\0') return 0;
+        p = star_p;
+        n = ++star_n;
+    }
+}
+
+int wildcard_match(const struct wildcard* w, const char* name) {
+    size_t n;
+    switch (w->kind) {
+    case WILD_ALL: return 1;
+    case WILD_LITERAL: return strcasecmp(name, w->text) == 0;
+    case WILD_PREFIX: return strncasecmp(name, w->text, w->len) == 0;
+    case WILD_SUFFIX:
+        n = strlen(name);
+        return n >= w->len && strcasecmp(name + n - w->len, w->text) == 0;
+    case WILD_NO_EXT: return strchr(name, '.') == NULL;
+    default: return wildcard_match_generic(w->text, name);
+    }
+}
+
+// Splits `arg` into its directory ("." if none) and a compiled pattern for
+// its last component. Returns 1 if that component has wildcards, 0 if it
+// is a plain name, -1 if it is too long.
+int wildcard_split(const char* arg, char* dir, size_t len, struct wildcard* w) {
+    const char* slash = strrchr(arg, '/');
+    const char* name = slash ? slash + 1 : arg;
+    if (!slash) snprintf(dir, len, ".");
+    else snprintf(dir, len, "%.*s", slash == arg ? 1 : (int)(slash - arg), arg);
+    if (wildcard_compile(name, w) != 0) return -1;
+    return has_wildcards(name);
+}
+
+int name_compare(const void* a, const void* b) {
+    return strcasecmp(*(char* const*)a, *(char* const*)b);
+}
+
+int name_compare_exact(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Collects the names in dirfd that match `w` and are not directories,
+// sorted. Only matching entries whose d_type is unknown or a link are
+// stat'ed. Returns 0, or -1 with errno set.
+int wildcard_list_files(int dirfd, const struct wildcard* w, struct name_list* list) {
+    char* buf = malloc(DIRENT_BUF_SIZE);
+    long n;
+    memset(list, 0, sizeof(*list));
+    if (!buf) return -1;
+
+    while ((n = syscall(SYS_getdents64, dirfd, buf, DIRENT_BUF_SIZE)) > 0) {
+        for (long off = 0; off < n;) {
+            struct linux_dirent64* d = (struct linux_dirent64*)(buf + off);
+            off += d->d_reclen;
+            if (d->d_type == DT_DIR || !wildcard_match(w, d->d_name)) continue;
+            if (d->d_type == DT_UNKNOWN || d->d_type == DT_LNK) {
+                struct stat st;
+                if (fstatat(dirfd, d->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode)) continue;
+            }
+            if (name_list_add(list, d->d_name, strlen(d->d_name)) != 0) { n = -1; break; }
+        }
+        if (n < 0) break;
+    }
+    free(buf);
+    if (n < 0) { name_list_free(list); return -1; }
+    if (list->count > 1) qsort(list->names, list->count, sizeof(*list->names), name_compare);
+    return 0;
+}
+
+void name_list_free(struct name_list* list) {
+    for (size_t i = 0; i < list->count; i++) free(list->names[i]);
+    free(list->names);
+    memset(list, 0, sizeof(*list));
+}
+
+// Whether a directory entry is, or through a symlink leads to, a directory;
+// stats only when d_type does not say.
+int dirent_is_dir(int dirfd, const struct dirent* entry) {
+    struct stat st;
+    if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK) return entry->d_type == DT_DIR;
+    return fstatat(dirfd, entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Like dirent_is_dir, but a symlink to a directory is not one.
+int dirent_is_real_dir(int dirfd, const struct dirent* entry) {
+    struct stat st;
+    if (entry->d_type != DT_UNKNOWN) return entry->d_type == DT_DIR;
+    return fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+// --- Built-in Commands ---
+
+int builtin_help(int argc, char** argv) { show_help(); return 0; }
+int builtin_about(int argc, char** argv) { show_about(); return 0; }
+int builtin_ver(int argc, char** argv) { show_version(); return 0; }
+
+int builtin_cls(int argc, char** argv) {
+    printf("\033[2J\033[H");
+    return 0;
+}
+
+int builtin_echo(int argc, char** argv) {
+    if (argc == 2 && (strcasecmp(argv[1], "on") == 0 || strcasecmp(argv[1], "off") == 0)) {
+        batch_echo = strcasecmp(argv[1], "on") == 0;
+        return 0;
+    }
+    if (argc == 1 && argv[0][4] != '.') { // "ECHO." prints an empty line
+        printf("ECHO is %s.\n", batch_echo ? "on" : "off");
+        return 0;
+    }
+    for (int j = 1; j < argc; j++) printf("%s ", argv[j]);
+    printf("\n");
+    return 0;
+}
+
+int builtin_type(int argc, char** argv) {
+    const char* type_path = NULL;
+    int binary = 0;
+    for (int j = 1; j < argc; j++) {
+        if (match_switch(argv[j], "B")) binary = 1;
+        else if (!type_path) type_path = argv[j];
+    }
+    if (type_path == NULL) { printf("Syntax: type [/B] [filename]\n"); return 1; }
+    return do_type(type_path, binary) == 0 ? 0 : 1;
+}
+
+int builtin_copy(int argc, char** argv) {
+    char* copy_args[2] = { NULL, NULL };
+    int copy_flags = 0, n = 0;
+    for (int j = 1; j < argc; j++) {
+        if (match_switch(argv[j], "V")) copy_flags |= COPY_VERBOSE;
+        else if (n < 2) copy_args[n++] = argv[j];
+    }
+    if (n < 2) { printf("Syntax: copy [/V] [source] [destination]\n"); return 1; }
+    return copy_files(copy_args[0], copy_args[1], copy_flags) == 0 ? 0 : 1;
+}
+
+int builtin_xcopy(int argc, char** argv) {
+    char* xcopy_args[2] = { NULL, NULL };
+    int nworkers = 1, xcopy_flags = 0, n = 0;
+    const char* sw;
+    for (int j = 1; j < argc; j++) {
+        if ((sw = match_switch(argv[j], "J")) != NULL) nworkers = *sw ? atoi(sw) : online_cpus();
+        else if (match_switch(argv[j], "D")) xcopy_flags |= XCOPY_NEWER;
+        else if (match_switch(argv[j], "MIR")) xcopy_flags |= XCOPY_MIRROR;
+        else if (n < 2) xcopy_args[n++] = argv[j];
+    }
+    if (nworkers < 1) nworkers = 1;
+    if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+    if (n < 2) { printf("Syntax: xcopy [/J[:n]] [/D | /MIR] [source] [destination]\n"); return 1; }
+    return xcopy_command(xcopy_args[0], xcopy_args[1], nworkers, xcopy_flags) == 0 ? 0 : 1;
+}
+
+int builtin_del(int argc, char** argv) {
+    int flags = 0, rc = 0, n = 0;
+    for (int j = 1; j < argc; j++) {
+        if (match_switch(argv[j], "S")) flags |= DELETE_RECURSIVE;
+        else if (match_switch(argv[j], "Q")) flags |= DELETE_QUIET;
+        else n++;
+    }
+    if (n == 0) { printf("Syntax: del [/S] [/Q] [files...]\n"); return 1; }
+
+    for (int j = 1; j < argc; j++) {
+        if (match_switch(argv[j], "S") || match_switch(argv[j], "Q")) continue;
+        char dir[PATH_MAX_LEN];
+        struct wildcard w;
+        struct name_list matches;
+        struct stat st;
+        int wild;
+        if (stat(argv[j], &st) == 0 && S_ISDIR(st.st_mode)) {
+            // DEL on a directory means every file in it.
+            snprintf(dir, sizeof(dir), "%s", argv[j]);
+            wild = wildcard_compile("*", &w) == 0 ? 1 : -1;
+        } else {
+            wild = wildcard_split(argv[j], dir, sizeof(dir), &w);
+        }
+        if (wild < 0) { fprintf(stderr, "del: %s: %s\n", argv[j], strerror(errno)); rc = 1; continue; }
+        if (wild == 0 && !(flags & DELETE_RECURSIVE)) {
+            if (unlink(argv[j]) != 0) {
+                if (errno == ENOENT) fprintf(stderr, "Could Not Find %s\n", argv[j]);
+                else fprintf(stderr, "del: %s: %s\n", argv[j], strerror(errno));
+                rc = 1;
+            }
+            continue;
+        }
+        if (w.kind == WILD_ALL && !(flags & DELETE_QUIET) && !confirm_prompt(argv[j])) continue;
+
+        if (flags & DELETE_RECURSIVE) {
+            struct rmtree_stats stats = { 0, 0, 0 };
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            rmtree_parallel(dir, w.kind == WILD_ALL ? NULL : &w, flags, &stats);
+            if (stats.files == 0 && stats.errors == 0) fprintf(stderr, "Could Not Find %s\n", argv[j]);
+            else if (!(flags & DELETE_QUIET)) rmtree_report(&stats, &start);
+            if (stats.files == 0 || stats.errors > 0) rc = 1;
+            continue;
+        }
+
+        int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || wildcard_list_files(fd, &w, &matches) != 0) {
+            fprintf(stderr, "del: %s: %s\n", dir, strerror(errno));
+            if (fd >= 0) close(fd);
+            rc = 1;
+            continue;
+        }
+        if (matches.count == 0) { fprintf(stderr, "Could Not Find %s\n", argv[j]); rc = 1; }
+        for (size_t i = 0; i < matches.count; i++) {
+            if (unlinkat(fd, matches.names[i], 0) != 0) {
+                fprintf(stderr, "del: %s: %s\n", matches.names[i], strerror(errno));
+                rc = 1;
+            }
+        }
+        name_list_free(&matches);
+        close(fd);
+    }
+    return rc;
+}
+
+int builtin_ren(int argc, char** argv) {
+    if (argc < 3) { printf("Syntax: ren [old_name] [new_name]\n"); return 1; }
+    if (rename(argv[1], argv[2]) != 0) { perror("ren"); return 1; }
+    return 0;
+}
+
+int builtin_md(int argc, char** argv) {
+    if (argc < 2) { printf("Syntax: md [directory]\n"); return 1; }
+    if (mkdir(argv[1], 0755) != 0) { perror("md"); return 1; }
+    return 0;
+}
+
+int builtin_rd(int argc, char** argv) {
+    int flags = DELETE_DIRS, rc = 0, n = 0;
+    for (int j = 1; j < argc; j++) {
+        if (match_switch(argv[j], "S")) flags |= DELETE_RECURSIVE;
+        else if (match_switch(argv[j], "Q")) flags |= DELETE_QUIET;
+        else if (match_switch(argv[j], "BG")) flags |= DELETE_BACKGROUND;
+        else n++;
+    }
+    if (n == 0 || (flags & (DELETE_BACKGROUND | DELETE_RECURSIVE)) == DELETE_BACKGROUND) {
+        printf("Syntax: rd [/S [/Q] [/BG]] [directory...]\n");
+        return 1;
+    }
+
+    for (int j = 1; j < argc; j++) {
+        char path[PATH_MAX_LEN];
+        if (match_switch(argv[j], "S") || match_switch(argv[j], "Q") || match_switch(argv[j], "BG")) continue;
+        if (!(flags & DELETE_RECURSIVE)) {
+            if (rmdir(argv[j]) != 0) { fprintf(stderr, "rd: %s: %s\n", argv[j], strerror(errno)); rc = 1; }
+            continue;
+        }
+
+        struct stat st;
+        size_t len = strlen(argv[j]);
+        while (len > 1 && argv[j][len - 1] == '/') len--;
+        snprintf(path, sizeof(path), "%.*s", (int)len, argv[j]);
+        const char* slash = strrchr(path, '/');
+        const char* base = slash ? slash + 1 : path;
+        if (strcmp(base, ".") == 0 || strcmp(base, "..") == 0 || base[0] == '\0') {
+            fprintf(stderr, "rd: %s: refusing to remove this directory\n", path);
+            rc = 1;
+            continue;
+        }
+        if (lstat(path, &st) != 0) { fprintf(stderr, "rd: %s: %s\n", path, strerror(errno)); rc = 1; continue; }
+        if (S_ISLNK(st.st_mode)) { // the link goes, not what it points to
+            if (unlink(path) != 0) { fprintf(stderr, "rd: %s: %s\n", path, strerror(errno)); rc = 1; }
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode)) { fprintf(stderr, "rd: %s: %s\n", path, strerror(ENOTDIR)); rc = 1; continue; }
+        if (!(flags & DELETE_QUIET) && !confirm_prompt(path)) continue;
+
+        if (flags & DELETE_BACKGROUND) {
+            if (rmtree_background(path) != 0) rc = 1;
+            continue;
+        }
+        struct rmtree_stats stats = { 0, 0, 0 };
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        rmtree_parallel(path, NULL, flags, &stats);
+        if (!(flags & DELETE_QUIET)) rmtree_report(&stats, &start);
+        if (stats.errors > 0) rc = 1;
+    }
+    return rc;
+}
+
+int builtin_cd(int argc, char** argv) {
+    if (argc < 2) {
+        printf("C:%s\n", shell_prompt);
+        return 0;
+    }
+    if (chdir(argv[1]) != 0) { perror("cd"); return 1; }
+    refresh_prompt();
+    return 0;
+}
+
+int builtin_dir(int argc, char** argv) {
+    struct dir_options dir_opts = { 0, 0, 0, NULL };
+    struct wildcard filter;
+    char dir_buf[PATH_MAX_LEN];
+    struct stat st;
+    const char* dir_path = ".";
+    const char* sw;
+    for (int j = 1; j < argc; j++) {
+        if (match_switch(argv[j], "S")) {
+            dir_opts.recursive = 1;
+        } else if ((sw = match_switch(argv[j], "O")) != NULL) {
+            dir_opts.reverse = (*sw == '-');
+            if (*sw == '-') sw++;
+            dir_opts.sort_key = *sw ? (char)toupper((unsigned char)*sw) : 'N';
+            if (!strchr("NSD", dir_opts.sort_key)) dir_opts.sort_key = 'N';
+        } else {
+            dir_path = argv[j];
+        }
+    }
+    // "DIR *.TXT" or "DIR FILE.TXT": list the directory part, filtered.
+    int wild = wildcard_split(dir_path, dir_buf, sizeof(dir_buf), &filter);
+    if (wild > 0 || (wild == 0 && stat(dir_path, &st) == 0 && !S_ISDIR(st.st_mode))) {
+        dir_path = dir_buf;
+        if (filter.kind != WILD_ALL) dir_opts.filter = &filter;
+    }
+    return do_dir(dir_path, &dir_opts) == 0 ? 0 : 1;
+}
+
+int builtin_reboot(int argc, char** argv) {
+    printf("Rebooting system...\n");
+    sync();
+    reboot(RB_AUTOBOOT);
+    return 1;
+}
+
+int builtin_exit(int argc, char** argv) {
+    if (shell_interactive) printf("Shutting down system...\n");
+    shell_exit_requested = 1;
+    return argc > 1 ? atoi(argv[1]) : last_errorlevel;
+}
+
+// SET [name[=[value]]]: the rest of the line arrives unparsed in argv[1].
+int builtin_set(int argc, char** argv) {
+    extern char** environ;
+    char* arg = strdup(argc > 1 ? argv[1] : "");
+    int rc = 0;
+    if (!arg) return 1;
+    if (arg[0] == '"') { // SET "NAME=value" leaves out anything after the closing quote
+        char* q = strrchr(arg + 1, '"');
+        if (q) *q = '\0';
+        memmove(arg, arg + 1, strlen(arg));
+    }
+
+    char* eq = strchr(arg, '=');
+    if (eq == NULL) {
+        size_t n = strlen(arg);
+        int found = 0;
+        for (char** e = environ; *e; e++) {
+            if (strncasecmp(*e, arg, n) == 0) { printf("%s\n", *e); found = 1; }
+        }
+        if (!found) { printf("Environment variable %s not defined\n", arg); rc = 1; }
+    } else if (eq == arg) {
+        fprintf(stderr, "The syntax of the command is incorrect.\n");
+        rc = 1;
+    } else {
+        *eq = '\0';
+        // Reuse the existing spelling so "set path=..." updates PATH.
+        for (char** e = environ; *e; e++) {
+            if (strncasecmp(*e, arg, eq - arg) == 0 && (*e)[eq - arg] == '=') { memcpy(arg, *e, eq - arg); break; }
+        }
+        if (eq[1] ? setenv(arg, eq + 1, 1) : unsetenv(arg)) { perror("set"); rc = 1; }
+    }
+    free(arg);
+    return rc;
+}
+
+// CALL file.bat [args] at the prompt; inside a batch file CALL is compiled.
+int builtin_call(int argc, char** argv) {
+    char buf[PATH_MAX_LEN];
+    if (argc < 2) return 0;
+    if (is_batch_file(argv[1])) return run_batch_file(resolve_path(argv[1], buf, sizeof(buf)), argc - 1, argv + 1);
+    const struct builtin* b = builtin_lookup(argv[1]);
+    if (b && (!b->spec || applet_args_ok(b->spec, argc - 1, argv + 1))) return b->handler(argc - 1, argv + 1);
+    return run_external(argv + 1);
+}
+
+// --- In-process applets ---
+// Hot utilities that batch jobs call thousands of times; running them here
+// saves a fork/exec each. Output formats follow BusyBox.
+
+// Copies in_fd to out_fd until EOF, splicing when either side is a pipe.
+int pump_fd(int in_fd, int out_fd) {
+    ssize_t n;
+    while ((n = splice(in_fd, NULL, out_fd, NULL, PIPE_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0);
+    if (n == 0) return 0;
+    if (!copy_fallback_errno(errno)) return -1;
+
+    char* buf = malloc(FILE_BUF_SIZE);
+    if (!buf) return -1;
+    while ((n = read(in_fd, buf, FILE_BUF_SIZE)) > 0) {
+        if (write_all(out_fd, buf, n) != 0) { n = -1; break; }
+    }
+    free(buf);
+    return n < 0 ? -1 : 0;
+}
+
+int applet_cat(int argc, char** argv) {
+    int status = 0, files = 0;
+    fflush(stdout);
+    for (int j = 1; j < argc; j++) {
+        if (strcmp(argv[j], "--") == 0) continue;
+        files++;
+        if (strcmp(argv[j], "-") == 0) {
+            if (pump_fd(STDIN_FILENO, STDOUT_FILENO) != 0) status = 1;
+        } else if (do_type(argv[j], 1) != 0) {
+            status = 1;
+        }
+    }
+    if (files == 0 && pump_fd(STDIN_FILENO, STDOUT_FILENO) != 0) {
+        perror("cat");
+        status = 1;
+    }
+    return status;
+}
+
+void wc_print(const int* show, const long long* counts, const char* name) {
+    for (int k = 0; k < 3; k++) {
+        if (show[k]) printf("%9lld", counts[k]);
+    }
+    if (name) printf(" %s", name);
+    printf("\n");
+}
+
+int applet_wc(int argc, char** argv) {
+    int show[3] = { 0, 0, 0 }; // lines, words, bytes
+    long long total[3] = { 0, 0, 0 };
+    int files = 0, status = 0;
+    char* buf = malloc(FILE_BUF_SIZE);
+    if (!buf) return 1;
+
+    for (int j = 1; j < argc; j++) {
+        if (argv[j][0] != '-' || argv[j][1] == '\0') continue;
+        if (strchr(argv[j], 'l')) show[0] = 1;
+        if (strchr(argv[j], 'w')) show[1] = 1;
+        if (strchr(argv[j], 'c')) show[2] = 1;
+    }
+    if (!show[0] && !show[1] && !show[2]) show[0] = show[1] = show[2] = 1;
+
+    for (int j = 1; j <= argc; j++) {
+        const char* name = NULL;
+        int fd = STDIN_FILENO;
+        if (j < argc) {
+            if (argv[j][0] == '-' && argv[j][1] != '\0') continue;
+            name = argv[j];
+            files++;
+            if (strcmp(name, "-") != 0 && (fd = open(name, O_RDONLY | O_CLOEXEC)) < 0) {
+                fprintf(stderr, "wc: %s: %s\n", name, strerror(errno));
+                status = 1;
+                continue;
+            }
+        } else if (files > 0) {
+            break;
+        }
+
+        long long counts[3] = { 0, 0, 0 };
+        int in_word = 0;
+        ssize_t n;
+        while ((n = read(fd, buf, FILE_BUF_SIZE)) > 0) {
+            counts[2] += n;
+            for (ssize_t k = 0; k < n; k++) {
+                unsigned char c = buf[k];
+                if (c == '\n') counts[0]++;
+                if (isspace(c)) in_word = 0;
+                else if (!in_word) { in_word = 1; counts[1]++; }
+            }
+        }
+        if (n < 0) { fprintf(stderr, "wc: %s: %s\n", name ? name : "-", strerror(errno)); status = 1; }
+        if (fd != STDIN_FILENO) close(fd);
+        wc_print(show, counts, name);
+        for (int k = 0; k < 3; k++) total[k] += counts[k];
+    }
+    if (files > 1) wc_print(show, total, "total");
+    free(buf);
+    return status;
+}
+
+int applet_head(int argc, char** argv) {
+    long long lines = 10;
+    int files = 0, status = 0;
+    char* names[MAX_ARGS];
+
+    for (int j = 1; j < argc; j++) {
+        if (strncmp(argv[j], "-n", 2) == 0) {
+            const char* v = argv[j][2] ? argv[j] + 2 : argv[++j];
+            lines = atoll(v);
+        } else if (strcmp(argv[j], "--") != 0 && files < MAX_ARGS) {
+            names[files++] = argv[j];
+        }
+    }
+    if (files == 0) names[files++] = "-";
+
+    char* buf = malloc(FILE_BUF_SIZE);
+    if (!buf) return 1;
+    fflush(stdout);
+    for (int f = 0; f < files; f++) {
+        int fd = STDIN_FILENO;
+        if (strcmp(names[f], "-") != 0 && (fd = open(names[f], O_RDONLY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "head: %s: %s\n", names[f], strerror(errno));
+            status = 1;
+            continue;
+        }
+        if (files > 1) {
+            printf("%s==> %s <==\n", f > 0 ? "\n" : "", names[f]);
+            fflush(stdout);
+        }
+        long long left = lines;
+        ssize_t n;
+        while (left > 0 && (n = read(fd, buf, FILE_BUF_SIZE)) > 0) {
+            ssize_t end = 0;
+            while (end < n && left > 0) {
+                char* nl = memchr(buf + end, '\n', n - end);
+                end = nl ? nl - buf + 1 : n;
+                if (nl) left--;
+            }
+            if (write_all(STDOUT_FILENO, buf, end) != 0) { status = 1; break; }
+        }
+        if (fd != STDIN_FILENO) close(fd);
+    }
+    free(buf);
+    return status;
+}
+
+int applet_true(int argc, char** argv) { return 0; }
+int applet_false(int argc, char** argv) { return 1; }
+
+
+// --- Helper Function Implementations (UNMODIFIED) ---
+
+void normalize_path_to_linux(char* path) {
+    if (path == NULL) return;
+    if ((path[0] == 'C' || path[0] == 'c') && path[1] == ':') {
+        memmove(path, path + 2, strlen(path) - 1);
+    }
+    for (int i = 0; path[i] != '\0'; i++) {
+        if (path[i] == '\\') {
+            path[i] = '/';
+        }
+    }
+}
+
+void format_path_for_dos(const char* linux_path, char* dos_path_buffer) {
+    if(strcmp(linux_path, "/") == 0) {
+        strcpy(dos_path_buffer, "\\");
+        return;
+    }
+    snprintf(dos_path_buffer, PATH_MAX_LEN, "%s", linux_path);
+    for (int i = 0; dos_path_buffer[i] != '\0'; i++) {
+        if (dos_path_buffer[i] == '/') dos_path_buffer[i] = '\\';
+    }
+}
+
+void show_help() {
+    printf("\nTinyDOS v0.0.3 Command Reference\n");
+    printf("  ? or HELP              Shows this help message.\n");
+    printf("  ABOUT                  Shows author information.\n");
+    printf("  VER                    Shows version information.\n");
+    printf("  CLS                    Clears the screen.\n");
+    printf("  ECHO [msg|ON|OFF]      Displays a message, or turns batch echo on/off.\n");
+    printf("  SET [name=[value]]     Shows, sets or removes environment variables.\n");
+    printf("  DIR [/S] [/O:N|S|D] [path]\n");
+    printf("                         Lists directory contents; /S recurses, /O sorts\n");
+    printf("                         by name, size or date (/O:-x reverses).\n");
+    printf("                         [path] may end in a wildcard, e.g. *.TXT.\n");
+    printf("  CD [path]              Changes or shows the current directory.\n");
+    printf("  MD/MKDIR [path]        Creates a directory.\n");
+    printf("  RD/RMDIR [path]        Removes an empty directory.\n");
+    printf("        /S               ...or a whole tree, asking first unless /Q.\n");
+    printf("        /BG              ...moving it aside and deleting it in the background.\n");
+    printf("  TYPE [/B] [file]       Displays a file's content (/B: binary, ignores ^Z).\n");
+    printf("  COPY [/V] [src] [dst]  Copies files (/V shows the copy method).\n");
+    printf("  XCOPY [src] [dst]      Copies files and directory trees; a wildcard in\n");
+    printf("                         [src] (DIR\\*.TXT) selects the files copied.\n");
+    printf("        /J[:n]           ...using n worker threads (default: one per CPU).\n");
+    printf("        /D               ...skipping files whose size and date are unchanged.\n");
+    printf("        /MIR             ...like /D, and deletes files missing from [src].\n");
+    printf("  DEL/ERASE [/S] [/Q] [files]\n");
+    printf("                         Deletes files; /S also in all subdirectories, /Q\n");
+    printf("                         without asking first for *.* or a directory.\n");
+    printf("  REN/MOVE [src] [dst]   Renames or moves a file/directory.\n");
+    printf("  FINDSTR [/I] [/N] [/S] [/M] [/V] [/C:text] [\"words\"] [files]\n");
+    printf("                         Searches files (or input) for any of the words\n");
+    printf("                         or /C: strings; /S searches subdirectories too.\n");
+    printf("  SORT [/R] [/C] [/+n] [/M:size] [/T:dir] [/O:file] [file]\n");
+    printf("                         Sorts lines (/R reversed, /C case-sensitive, /+n\n");
+    printf("                         from column n) in at most /M of memory, spilling\n");
+    printf("                         sorted runs to /T (default %%TMP%% or /tmp).\n");
+    printf("  DEDUP [/L | /R] [/J[:n]] [path]\n");
+    printf("                         Finds identical files under [path] (which may end\n");
+    printf("                         in a wildcard); /L replaces copies with hard links,\n");
+    printf("                         /R with reflinks. /J: threads (default one per CPU).\n");
+    printf("  MANIFEST /C | /V [/Q] [/J[:n]] [dir] [file]\n");
+    printf("                         Records (/C) the paths, sizes, modes and content\n");
+    printf("                         hashes of a tree in [file], or verifies (/V) the\n");
+    printf("                         tree against it; /Q trusts files whose size and\n");
+    printf("                         date are unchanged. /J: hashing threads.\n");
+    printf("  PACK [/F:TAR|CPIO] [/Z:n] [/J[:n]] [/M:size] [dir] [archive]\n");
+    printf("                         Packs a tree into a tar (or cpio) archive,\n");
+    printf("                         gzip-compressed at level /Z (0: none, default 6\n");
+    printf("                         unless named .tar or .cpio) by /J threads\n");
+    printf("                         within /M of memory.\n");
+    printf("  UNPACK [/L] [/J[:n]] [/M:size] [archive] [dir]\n");
+    printf("                         Extracts a tar or cpio archive, plain or gzipped,\n");
+    printf("                         into [dir]; /L lists it instead.\n");
+    printf("  INDEX [/J[:n]] [dir]   Builds or updates the trigram index of the text\n");
+    printf("                         files under [dir] (in [dir]\\.tdindex).\n");
+    printf("  INDEX /Q [/I] [/N] [/M] [/C:text] [\"words\"] [dir]\n");
+    printf("                         Searches [dir] as FINDSTR /S does, reading only\n");
+    printf("                         the files the index cannot rule out.\n");
+    printf("  BOOTLOG [/R]           Shows when each boot step happened, from kernel\n");
+    printf("                         start to the first prompt (/R: raw microseconds).\n");
+    printf("  CACHE [/S] [paths] | /P\n");
+    printf("                         Shows how much of each file (in directories, /S\n");
+    printf("                         also below) is in memory, or of the files in the\n");
+    printf("                         boot preload profile (/P).\n");
+    printf("  HASH [/R]              Shows the command path cache (/R resets it).\n");
+    printf("  TIMEIT [/R:n] command  Measures a command: times, memory, faults, context\n");
+    printf("                         switches and CPU counters; /R:n runs it n times.\n");
+    printf("  REBOOT                 Restarts the system.\n");
+    printf("  CALL [file.bat] [args] Runs a batch file and returns.\n");
+    printf("  FOR [/P[:n]] %%v IN (set) DO command\n");
+    printf("                         Runs command for each item or matching file, with\n");
+    printf("                         %%v (or %%~fv, %%~dpv, %%~nxv...) replaced; /P runs n at\n");
+    printf("                         once (default: one per CPU), output kept in order.\n");
+    printf("  EXIT/SHUTDOWN          Powers off the system.\n\n");
+    printf("Batch files (.BAT/.CMD) support labels, GOTO [:EOF], CALL :label,\n");
+    printf("IF [/I] [NOT] ERRORLEVEL n|EXIST f|DEFINED v|a==b, SHIFT, EXIT /B [n],\n");
+    printf("REM and %%VAR%%/%%0-%%9/%%* expansion. 'cmd /C command' runs one\n");
+    printf("command line and 'cmd file.bat [args]' a script, without a prompt.\n");
+    printf("Use \"quotes\" around arguments with spaces. Output can be redirected\n");
+    printf("with >, >> and 2>, input with <, and commands chained with |.\n");
+    printf("Wildcards: * matches any run of characters and ? one character (none\n");
+    printf("at a '.'); *.* also matches names without an extension.\n");
+    printf("Commands and paths are not case-sensitive. CAT, WC, HEAD, TRUE and FALSE\n");
+    printf("run inside the shell when given only options they support.\n");
+    printf("Any other command is executed from the system's PATH (e.g., 'ls', 'grep').\n");
+}
+
+void show_about() {
+    printf("\nTinyDOS Shell\n");
+    printf("  Author: minhmc2007\n");
+    printf("  GitHub: https://github.com/minhmc2007\n\n");
+}
+
+void show_version() {
+    struct utsname kernel_info;
+    printf("TinyDOS Shell [Version 0.0.3 (2025)]\n");
+    if (uname(&kernel_info) == 0) {
+        printf("Running on Linux %s (%s)\n", kernel_info.release, kernel_info.machine);
+    }
+}
+
+// Returns the text after "/NAME:" ("" for a bare "/NAME"), or NULL if arg is
+// not that switch. Switch names are matched case-insensitively.
+const char* match_switch(const char* arg, const char* name) {
+    if (arg == NULL || arg[0] != '/') return NULL;
+    size_t len = strlen(name);
+    if (strncasecmp(arg + 1, name, len) != 0) return NULL;
+    if (arg[len + 1] == '\0') return arg + len + 1;
+    if (arg[len + 1] == ':') return arg + len + 2;
+    return NULL;
+}
+
+double elapsed_since(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void format_rate(double amount, double seconds, const char* unit, char* buf, size_t len) {
+    const char* prefixes[] = { "", "K", "M", "G", "T" };
+    double rate = seconds > 0 ? amount / seconds : 0;
+    int p = 0;
+    while (rate >= 1024 && p < 4) { rate /= 1024; p++; }
+    snprintf(buf, len, "%.1f %s%s/s", rate, prefixes[p], unit);
+}
+
+// Errors that mean "this method is not available here", as opposed to a real
+// I/O failure that should abort the copy.
+int copy_fallback_errno(int err) {
+    return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP ||
+           err == ENOTTY || err == EBADF || err == EPERM || err == ETXTBSY;
+}
+
+// Copies in_fd to out_fd from their current offsets. Returns the copy_method
+// that finished the job, or -1 with errno set.
+int copy_fd(int in_fd, int out_fd, long long* copied) {
+    ssize_t n;
+    *copied = 0;
+
+    // 1. Reflink: shares extents on btrfs/xfs, no data is moved at all.
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+        struct stat st;
+        if (fstat(out_fd, &st) == 0) *copied = st.st_size;
+        return COPY_REFLINK;
+    }
+
+    // 2. copy_file_range: in-kernel copy, may still reflink or offload.
+    while ((n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, 0)) > 0) *copied += n;
+    if (n == 0 && *copied > 0) return COPY_RANGE;
+    if (n < 0 && !copy_fallback_errno(errno)) return -1;
+
+    // 3. sendfile: page cache to page cache, still no user-space copy.
+    long long before = *copied;
+    while ((n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK_SIZE)) > 0) *copied += n;
+    if (n == 0 && *copied > before) return COPY_SENDFILE;
+    if (n < 0 && !copy_fallback_errno(errno)) return -1;
+
+    // 4. Plain read/write. Pseudo-files (e.g. /proc) that report a size of
+    //    0 always end up here, and so do empty files. The first read goes
+    //    to a stack buffer, so those never allocate; anything longer moves
+    //    on to one large aligned buffer owned by this call, which leaves
+    //    nothing behind in pool workers.
+    char small[4096];
+    char* buf = small;
+    size_t cap = sizeof(small);
+    while ((n = read(in_fd, buf, cap)) > 0) {
+        char* p = buf;
+        while (n > 0) {
+            ssize_t w = write(out_fd, p, n);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            p += w; n -= w; *copied += w;
+        }
+        if (n > 0) break;
+        char* big;
+        if (buf == small && posix_memalign((void**)&big, FILE_BUF_ALIGN, FILE_BUF_SIZE) == 0) {
+            buf = big;
+            cap = FILE_BUF_SIZE;
+        }
+    }
+    if (buf != small) {
+        int err = errno;
+        free(buf);
+        errno = err;
+    }
+    return n != 0 ? -1 : COPY_READWRITE;
+}
+
+// Copies one file relative to a pair of directory fds, preserving its mode
+// and modification time. Returns the copy_method used, or -1 (already reported).
+int copy_file_at(int src_dirfd, const char* source, int dst_dirfd, const char* dest, long long* copied) {
+    struct stat src_st, dst_st;
+    *copied = 0;
+
+    int in_fd = openat(src_dirfd, source, O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0 || fstat(in_fd, &src_st) != 0) {
+        fprintf(stderr, "copy: %s: %s\n", source, strerror(errno));
+        if (in_fd >= 0) close(in_fd);
+        return -1;
+    }
+    if (fstatat(dst_dirfd, dest, &dst_st, 0) == 0 && dst_st.st_dev == src_st.st_dev && dst_st.st_ino == src_st.st_ino) {
+        fprintf(stderr, "copy: %s: file cannot be copied onto itself\n", source);
+        close(in_fd);
+        return -1;
+    }
+    int out_fd = openat(dst_dirfd, dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (out_fd < 0) {
+        fprintf(stderr, "copy: %s: %s\n", dest, strerror(errno));
+        close(in_fd);
+        return -1;
+    }
+
+    int method = copy_fd(in_fd, out_fd, copied);
+    if (method < 0) fprintf(stderr, "copy: %s: write error: %s\n", dest, strerror(errno));
+
+    // A partial copy must not carry the source mtime, or XCOPY /D would
+    // later take it for an up-to-date one.
+    struct timespec times[2] = { src_st.st_atim, src_st.st_mtim };
+    fchmod(out_fd, src_st.st_mode & 07777);
+    if (method >= 0) futimens(out_fd, times);
+    close(in_fd);
+    if (close(out_fd) != 0 && method >= 0) {
+        fprintf(stderr, "copy: %s: %s\n", dest, strerror(errno));
+        method = -1;
+    }
+    return method;
+}
+
+// Copies one file and prints the DOS-style summary.
+// Returns 0 on success, -1 on failure (already reported).
+int copy_file(const char* source, const char* dest, int flags) {
+    struct timespec start;
+    long long copied = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int method = copy_file_at(AT_FDCWD, source, AT_FDCWD, dest, &copied);
+    if (method < 0) return -1;
+
+    char rate[32];
+    format_rate((double)copied, elapsed_since(&start), "B", rate, sizeof(rate));
+    printf("        1 file(s) copied, %lld bytes (%s).\n", copied, rate);
+    if (flags & COPY_VERBOSE) printf("        Method: %s\n", copy_method_names[method]);
+    return 0;
+}
+
+// COPY with a wildcard source, or into a directory: each matching file goes
+// to dest\name, listing names as it goes. A wildcard that matches a single
+// file may still be copied to a file name.
+int copy_files(const char* source, const char* dest, int flags) {
+    char src_dir[PATH_MAX_LEN];
+    struct wildcard w;
+    struct name_list matches;
+    struct stat st;
+    struct timespec start;
+
+    int wild = wildcard_split(source, src_dir, sizeof(src_dir), &w);
+    int to_dir = stat(dest, &st) == 0 && S_ISDIR(st.st_mode);
+    if (wild < 0) { fprintf(stderr, "copy: %s: %s\n", source, strerror(errno)); return -1; }
+    if (wild == 0 && !to_dir) return copy_file(source, dest, flags);
+    if (wild == 0) {
+        // A single file into a directory keeps its name.
+        char target[PATH_MAX_LEN];
+        const char* slash = strrchr(source, '/');
+        if (snprintf(target, sizeof(target), "%s/%s", dest, slash ? slash + 1 : source) >= (int)sizeof(target)) {
+            fprintf(stderr, "copy: %s: %s\n", dest, strerror(ENAMETOOLONG));
+            return -1;
+        }
+        return copy_file(source, target, flags);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int src_fd = open(src_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (src_fd < 0 || wildcard_list_files(src_fd, &w, &matches) != 0) {
+        fprintf(stderr, "copy: %s: %s\n", src_dir, strerror(errno));
+        if (src_fd >= 0) close(src_fd);
+        return -1;
+    }
+    int dst_fd = to_dir ? open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : AT_FDCWD;
+    int rc = 0;
+    if (matches.count == 0) {
+        fprintf(stderr, "File not found - %s\n", source);
+        rc = -1;
+    } else if (!to_dir && matches.count > 1) {
+        fprintf(stderr, "copy: %s: not a directory\n", dest);
+        rc = -1;
+    } else if (dst_fd < 0) {
+        fprintf(stderr, "copy: %s: %s\n", dest, strerror(errno));
+        rc = -1;
+    }
+
+    long long total = 0, files = 0;
+    for (size_t i = 0; rc == 0 && i < matches.count; i++) {
+        long long copied = 0;
+        const char* name = matches.names[i];
+        printf("%s\n", name);
+        int method = copy_file_at(src_fd, name, dst_fd, to_dir ? name : dest, &copied);
+        if (method < 0) continue; // already reported; go on with the rest
+        if (flags & COPY_VERBOSE) printf("        Method: %s\n", copy_method_names[method]);
+        files++;
+        total += copied;
+    }
+    if (rc == 0) {
+        char rate[32];
+        format_rate((double)total, elapsed_since(&start), "B", rate, sizeof(rate));
+        printf("%9lld file(s) copied, %lld bytes (%s).\n", files, total, rate);
+        if (files < (long long)matches.count) rc = -1;
+    }
+    name_list_free(&matches);
+    if (dst_fd >= 0) close(dst_fd);
+    close(src_fd);
+    return rc;
+}
+
+// --- Work-stealing task pool ---
+// Each worker owns a deque: it pushes and pops at the tail (depth-first, so
+// the directories it holds open stay few), while idle workers steal from the
+// head, which is where the largest untouched subtrees sit.
+
+int online_cpus() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+void task_deque_push(struct task_deque* dq, struct task* t) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->cap) {
+        size_t live = dq->tail - dq->head;
+        if (dq->head > 0 && live < dq->cap / 2) {
+            memmove(dq->items, dq->items + dq->head, live * sizeof(*dq->items));
+        } else {
+            dq->cap = dq->cap ? dq->cap * 2 : 64;
+            dq->items = realloc(dq->items, dq->cap * sizeof(*dq->items));
+        }
+        dq->head = 0;
+        dq->tail = live;
+    }
+    dq->items[dq->tail++] = t;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+struct task* task_deque_take(struct task_deque* dq, int steal) {
+    struct task* t = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head < dq->tail) t = steal ? dq->items[dq->head++] : dq->items[--dq->tail];
+    if (dq->head == dq->tail) dq->head = dq->tail = 0;
+    pthread_mutex_unlock(&dq->lock);
+    return t;
+}
+
+void task_pool_push(struct task_pool* pool, int worker, struct task* t) {
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    task_deque_push(&pool->deques[worker], t);
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&pool->idle_lock);
+    if (pool->sleeping > 0) pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+struct task* task_pool_next(struct task_pool* pool, int worker) {
+    struct task* t = task_deque_take(&pool->deques[worker], 0);
+    for (int i = 1; t == NULL && i < pool->nworkers; i++) {
+        t = task_deque_take(&pool->deques[(worker + i) % pool->nworkers], 1);
+    }
+    if (t) __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    return t;
+}
+
+void* task_pool_worker(void* arg) {
+    struct task_worker* self = arg;
+    struct task_pool* pool = self->pool;
+
+    while (1) {
+        struct task* t = task_pool_next(pool, self->id);
+        if (t) {
+            t->run(pool, t, self->id);
+            if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+                pthread_mutex_lock(&pool->idle_lock);
+                pthread_cond_broadcast(&pool->idle_cond);
+                pthread_mutex_unlock(&pool->idle_lock);
+            }
+            continue;
+        }
+        pthread_mutex_lock(&pool->idle_lock);
+        if (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_unlock(&pool->idle_lock);
+            break;
+        }
+        if (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0) {
+            pool->sleeping++;
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+            pool->sleeping--;
+        }
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+    return NULL;
+}
+
+// Runs `first` and everything it spawns on `nworkers` threads, returning
+// once every task has finished.
+void task_pool_run(int nworkers, struct task* first) {
+    struct task_pool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.nworkers = nworkers;
+    pool.deques = calloc(nworkers, sizeof(*pool.deques));
+    struct task_worker* workers = calloc(nworkers, sizeof(*workers));
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle_cond, NULL);
+    for (int i = 0; i < nworkers; i++) pthread_mutex_init(&pool.deques[i].lock, NULL);
+
+    task_pool_push(&pool, 0, first);
+    for (int i = 0; i < nworkers; i++) {
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        if (i > 0 && pthread_create(&workers[i].thread, NULL, task_pool_worker, &workers[i]) != 0) {
+            workers[i].pool = NULL; // run with fewer threads rather than fail
+        }
+    }
+    task_pool_worker(&workers[0]);
+    for (int i = 1; i < nworkers; i++) {
+        if (workers[i].pool) pthread_join(workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].items);
+    }
+    pthread_mutex_destroy(&pool.idle_lock);
+    pthread_cond_destroy(&pool.idle_cond);
+    free(pool.deques);
+    free(workers);
+}
+
+// --- Parallel tree walk ---
+// Directories and files are tasks on the work-stealing pool. A directory
+// task opens its directory relative to the parent's held fd, lists it, and
+// queues its subdirectories and matching files; a file task hands one name
+// to the walk's visit_file(). Used by XCOPY /J and DEDUP.
+
+struct walk_task* walk_task_new(void (*run)(struct task_pool*, struct task*, int),
+                                struct walk_dir* parent, const char* name) {
+    struct walk_task* t = malloc(sizeof(*t) + strlen(name) + 1);
+    t->base.run = run;
+    t->parent = parent;
+    strcpy(t->name, name);
+    __atomic_add_fetch(&parent->refs, 1, __ATOMIC_SEQ_CST);
+    return t;
+}
+
+void walk_dir_release(struct walk_dir* d) {
+    while (d && __atomic_sub_fetch(&d->refs, 1, __ATOMIC_SEQ_CST) == 0) {
+        struct walk_dir* parent = d->parent;
+        if (d->fd >= 0) close(d->fd);
+        if (d->dst_fd >= 0) close(d->dst_fd);
+        free(d);
+        d = parent;
+    }
+}
+
+void walk_file_task(struct task_pool* pool, struct task* base, int worker) {
+    struct walk_task* t = (struct walk_task*)base;
+    (void)pool; (void)worker;
+    t->parent->walk->visit_file(t->parent->walk, t->parent, t->name);
+    walk_dir_release(t->parent);
+    free(t);
+}
+
+// Records a directory of a physical walk; 0 if it was entered before.
+int walk_seen_add(struct tree_walk* walk, const struct stat* st) {
+    int added = 1;
+    pthread_mutex_lock(&walk->seen_lock);
+    if (2 * (walk->nseen + 1) > walk->seen_cap) {
+        size_t cap = walk->seen_cap ? walk->seen_cap * 2 : 256;
+        struct walk_seen* grown = calloc(cap, sizeof(*grown));
+        if (grown) {
+            for (size_t i = 0; i < walk->seen_cap; i++) {
+                if (walk->seen[i].ino == 0) continue;
+                size_t h = (walk->seen[i].ino * 0x9E3779B97F4A7C15ull ^ walk->seen[i].dev) & (cap - 1);
+                while (grown[h].ino != 0) h = (h + 1) & (cap - 1);
+                grown[h] = walk->seen[i];
+            }
+            free(walk->seen);
+            walk->seen = grown;
+            walk->seen_cap = cap;
+        }
+    }
+    if (walk->seen_cap > walk->nseen + 1) {
+        size_t h = (st->st_ino * 0x9E3779B97F4A7C15ull ^ st->st_dev) & (walk->seen_cap - 1);
+        while (walk->seen[h].ino != 0 && !(walk->seen[h].ino == st->st_ino && walk->seen[h].dev == st->st_dev)) {
+            h = (h + 1) & (walk->seen_cap - 1);
+        }
+        if (walk->seen[h].ino != 0) {
+            added = 0;
+        } else {
+            walk->seen[h].dev = st->st_dev;
+            walk->seen[h].ino = st->st_ino;
+            walk->nseen++;
+        }
+    }
+    pthread_mutex_unlock(&walk->seen_lock);
+    return added;
+}
+
+void walk_dir_task(struct task_pool* pool, struct task* base, int worker) {
+    struct walk_task* t = (struct walk_task*)base;
+    struct walk_dir* parent = t->parent;
+    struct tree_walk* walk = parent->walk;
+    struct stat st;
+    int dst_fd = -1;
+
+    int fd = openat(parent->fd, t->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (walk->physical ? O_NOFOLLOW : 0));
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "%s: %s: %s\n", walk->cmd, t->name, strerror(errno));
+        goto fail;
+    }
+    if (walk->physical && !walk_seen_add(walk, &st)) { // e.g. a bind mount of an ancestor
+        close(fd);
+        walk_dir_release(parent);
+        free(t);
+        return;
+    }
+    // The root task is "." relative to the root, which already has the path.
+    int is_root = strcmp(t->name, ".") == 0 && parent->parent == NULL;
+    if (!walk->physical && !is_root) {
+        // Following symlinks: one back to an ancestor would nest forever,
+        // each openat() relative to the last, so ELOOP never stops it.
+        for (struct walk_dir* a = parent; a; a = a->parent) {
+            if (a->dev == st.st_dev && a->ino == st.st_ino) {
+                fprintf(stderr, "%s: %s/%s: %s\n", walk->cmd, parent->path, t->name, strerror(ELOOP));
+                goto fail;
+            }
+        }
+    }
+    if (walk->enter_dir && (dst_fd = walk->enter_dir(walk, parent, t->name, &st)) < 0) goto fail;
+
+    size_t plen = strlen(parent->path);
+    struct walk_dir* d = malloc(sizeof(*d) + plen + strlen(t->name) + 2);
+    d->fd = fd;
+    d->dst_fd = dst_fd;
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+    d->refs = 1; // our own reference while listing
+    d->parent = parent; // inherits the reference held by this task
+    d->walk = walk;
+    if (is_root) strcpy(d->path, parent->path);
+    else sprintf(d->path, "%s%s%s", parent->path, plen > 0 && parent->path[plen - 1] == '/' ? "" : "/", t->name);
+
+    DIR* dir = fdopendir(dup(fd));
+    if (!dir) {
+        fprintf(stderr, "%s: %s: %s\n", walk->cmd, d->path, strerror(errno));
+        __atomic_add_fetch(&walk->errors, 1, __ATOMIC_RELAXED);
+    } else {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+            int match = !walk->filter || wildcard_match(walk->filter, entry->d_name);
+            if (!match && (entry->d_type == DT_REG || entry->d_type == DT_FIFO)) continue;
+            int is_dir = walk->physical ? dirent_is_real_dir(fd, entry) : dirent_is_dir(fd, entry);
+            if (!match && !is_dir) continue;
+            struct walk_task* child = walk_task_new(is_dir ? walk_dir_task : walk_file_task, d, entry->d_name);
+            task_pool_push(pool, worker, &child->base);
+        }
+        closedir(dir);
+    }
+    __atomic_add_fetch(&walk->dirs, 1, __ATOMIC_RELAXED);
+    walk_dir_release(d);
+    free(t);
+    return;
+
+fail:
+    if (fd >= 0) close(fd);
+    __atomic_add_fetch(&walk->errors, 1, __ATOMIC_RELAXED);
+    walk_dir_release(parent);
+    free(t);
+}
+
+// Walks the tree under `root` on nworkers threads. dst_fd (or -1) is the
+// destination root handed to enter_dir(); the walk closes it.
+void tree_walk(struct tree_walk* walk, const char* root, int dst_fd, int nworkers) {
+    raise_fd_limit(); // each pending directory holds up to two fds
+
+    // The top-level directory is a task like any other: "." relative to an
+    // AT_FDCWD-based root, so openat() takes the user's path unchanged.
+    struct walk_dir* top = malloc(sizeof(*top) + strlen(root) + 1);
+    top->fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    top->dst_fd = dst_fd;
+    top->refs = 1;
+    top->parent = NULL;
+    top->walk = walk;
+    strcpy(top->path, root);
+    struct stat st;
+    if (top->fd >= 0 && fstat(top->fd, &st) != 0) {
+        close(top->fd);
+        top->fd = -1;
+    }
+    if (top->fd < 0) {
+        fprintf(stderr, "%s: %s: %s\n", walk->cmd, root, strerror(errno));
+        walk->errors++;
+        walk_dir_release(top);
+        return;
+    }
+
+    top->dev = st.st_dev;
+    top->ino = st.st_ino;
+    if (walk->physical) pthread_mutex_init(&walk->seen_lock, NULL);
+    struct walk_task* first = walk_task_new(walk_dir_task, top, ".");
+    task_pool_run(nworkers, &first->base);
+    walk_dir_release(top);
+    if (walk->physical) {
+        pthread_mutex_destroy(&walk->seen_lock);
+        free(walk->seen);
+        walk->seen = NULL;
+    }
+}
+
+// Depth-first with each directory's names sorted (strcmp): a directory comes
+// right before its contents, so the output has one fixed order. `prefix`
+// is the directory's path with a trailing '/', or "" at the root.
+void sorted_walk_dir(struct sorted_walk* walk, int dirfd, const char* prefix) {
+    struct name_list names;
+    memset(&names, 0, sizeof(names));
+    DIR* dir = fdopendir(dup(dirfd));
+    if (!dir) {
+        fprintf(stderr, "%s: %s: %s\n", walk->cmd, *prefix ? prefix : ".", strerror(errno));
+        walk->errors++;
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        name_list_add(&names, entry->d_name, strlen(entry->d_name));
+    }
+    closedir(dir);
+    if (names.count > 1) qsort(names.names, names.count, sizeof(char*), name_compare_exact);
+
+    for (size_t i = 0; i < names.count; i++) {
+        const char* name = names.names[i];
+        char path[PATH_MAX_LEN];
+        struct stat st;
+        if (snprintf(path, sizeof(path), "%s%s", prefix, name) >= (int)sizeof(path) - 1) {
+            fprintf(stderr, "%s: %s%s: %s\n", walk->cmd, prefix, name, strerror(ENAMETOOLONG));
+            walk->errors++;
+            continue;
+        }
+        if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            fprintf(stderr, "%s: %s: %s\n", walk->cmd, path, strerror(errno));
+            walk->errors++;
+            continue;
+        }
+        if (!walk->visit(walk, dirfd, name, path, &st) || !S_ISDIR(st.st_mode)) continue;
+
+        int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "%s: %s: %s\n", walk->cmd, path, strerror(errno));
+            walk->errors++;
+            continue;
+        }
+        strcat(path, "/");
+        sorted_walk_dir(walk, fd, path);
+        close(fd);
+    }
+    name_list_free(&names);
+}
+
+// --- XCOPY ---
+
+// Copies source to dest; inside directories only files matching `filter`
+// (when given) are copied, while every subdirectory is descended into.
+void do_xcopy(const char* source, const char* dest, const struct wildcard* filter, struct xcopy_stats* stats) {
+    struct stat st;
+    if (stat(source, &st) != 0) { perror("xcopy: source"); stats->errors++; return; }
+    if (S_ISDIR(st.st_mode)) {
+        if (mkdir(dest, st.st_mode) != 0 && errno != EEXIST) {
+            fprintf(stderr, "xcopy: %s: %s\n", dest, strerror(errno));
+            stats->errors++;
+            return;
+        }
+        DIR* dir = opendir(source);
+        if (!dir) { perror("xcopy: opendir"); stats->errors++; return; }
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+            if (filter && !wildcard_match(filter, entry->d_name) && !dirent_is_dir(dirfd(dir), entry)) continue;
+            char new_source[PATH_MAX_LEN], new_dest[PATH_MAX_LEN];
+            snprintf(new_source, sizeof(new_source), "%s/%s", source, entry->d_name);
+            snprintf(new_dest, sizeof(new_dest), "%s/%s", dest, entry->d_name);
+            do_xcopy(new_source, new_dest, filter, stats);
+        }
+        closedir(dir);
+    } else {
+        long long copied;
+        if (copy_file_at(AT_FDCWD, source, AT_FDCWD, dest, &copied) < 0) {
+            stats->errors++;
+        } else {
+            stats->files++;
+            stats->bytes += copied;
+        }
+    }
+}
+
+int xcopy_enter_dir(struct tree_walk* walk, struct walk_dir* parent, const char* name, const struct stat* st) {
+    (void)walk;
+    if (mkdirat(parent->dst_fd, name, st->st_mode & 07777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "xcopy: %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    int dst_fd = openat(parent->dst_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dst_fd < 0) fprintf(stderr, "xcopy: %s: %s\n", name, strerror(errno));
+    return dst_fd;
+}
+
+void xcopy_visit_file(struct tree_walk* walk, struct walk_dir* dir, const char* name) {
+    struct xcopy_stats* stats = walk->ctx;
+    long long copied;
+    if (copy_file_at(dir->fd, name, dir->dst_fd, name, &copied) < 0) {
+        __atomic_add_fetch(&walk->errors, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&stats->files, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->bytes, copied, __ATOMIC_RELAXED);
+    }
+}
+
+// Parallel tree copy: tree_walk() with a destination directory created and
+// opened beside every source directory, and a copy per file.
+void do_xcopy_parallel(const char* source, const char* dest, const struct wildcard* filter, int nworkers, struct xcopy_stats* stats) {
+    struct tree_walk walk;
+    struct stat st;
+    memset(&walk, 0, sizeof(walk));
+    walk.cmd = "xcopy";
+    walk.filter = filter;
+    walk.enter_dir = xcopy_enter_dir;
+    walk.visit_file = xcopy_visit_file;
+    walk.ctx = stats;
+
+    if (stat(source, &st) != 0) { perror("xcopy: source"); stats->errors++; return; }
+    if (mkdir(dest, st.st_mode & 07777) != 0 && errno != EEXIST) { perror("xcopy: destination"); stats->errors++; return; }
+    int dst_fd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dst_fd < 0) { perror("xcopy: destination"); stats->errors++; return; }
+    tree_walk(&walk, source, dst_fd, nworkers);
+    stats->dirs += walk.dirs;
+    stats->errors += walk.errors;
+}
+// --- XCOPY /D and /MIR: incremental sync backed by a tree manifest ---
+// The manifest lives in the destination root and records, for every path
+// synced last time, the source size, mtime and inode, and a stamp of the
+// destination after the sync. A file is up to date while its source still
+// matches the record and its destination still has the recorded ctime. A
+// directory whose mtime and inode match has the same set of names as last
+// time, so if the destination directory's mtime also matches, /MIR does not
+// need to list it for extras.
+
+unsigned long str_hash(const char* s) {
+    unsigned long h = 1469598103934665603UL; // FNV-1a
+    while (*s) { h ^= (unsigned char)*s++; h *= 1099511628211UL; }
+    return h;
+}
+
+void manifest_insert(struct manifest* mf, const struct manifest_entry* e) {
+    if ((mf->count + 1) * 2 > mf->cap) {
+        size_t old_cap = mf->cap;
+        struct manifest_entry* old = mf->slots;
+        mf->cap = old_cap ? old_cap * 2 : 1024;
+        mf->slots = calloc(mf->cap, sizeof(*mf->slots));
+        mf->count = 0;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].path) manifest_insert(mf, &old[i]);
+        }
+        free(old);
+    }
+    size_t i = str_hash(e->path) & (mf->cap - 1);
+    while (mf->slots[i].path) i = (i + 1) & (mf->cap - 1);
+    mf->slots[i] = *e;
+    mf->count++;
+}
+
+const struct manifest_entry* manifest_find(const struct manifest* mf, const char* path) {
+    if (mf->cap == 0) return NULL;
+    size_t i = str_hash(path) & (mf->cap - 1);
+    while (mf->slots[i].path) {
+        if (strcmp(mf->slots[i].path, path) == 0) return &mf->slots[i];
+        i = (i + 1) & (mf->cap - 1);
+    }
+    return NULL;
+}
+
+// Loads the manifest written by the previous sync of `source_id` into this
+// destination. A missing, unreadable or foreign manifest just loads empty.
+void manifest_load(struct manifest* mf, int dst_fd, const char* source_id) {
+    int fd = openat(dst_fd, XCOPY_MANIFEST_NAME, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    FILE* fp = fdopen(fd, "r");
+    if (!fp) { close(fd); return; }
+
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len = getline(&line, &cap, fp);
+    if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+    if (len > 0 && strncmp(line, XCOPY_MANIFEST_MAGIC " ", sizeof(XCOPY_MANIFEST_MAGIC)) == 0 &&
+        strcmp(line + sizeof(XCOPY_MANIFEST_MAGIC), source_id) == 0) {
+        while ((len = getline(&line, &cap, fp)) > 0) {
+            struct manifest_entry e;
+            int off = 0;
+            if (line[len - 1] == '\n') line[--len] = '\0';
+            if (sscanf(line, "%c %lld %lld.%ld %llu %lld.%ld %n", &e.type, &e.size, &e.mtime_sec,
+                       &e.mtime_nsec, &e.ino, &e.dst_sec, &e.dst_nsec, &off) != 7 || off == 0) continue;
+            e.path = strdup(line + off);
+            manifest_insert(mf, &e);
+        }
+    }
+    free(line);
+    fclose(fp);
+}
+
+void manifest_free(struct manifest* mf) {
+    for (size_t i = 0; i < mf->cap; i++) free(mf->slots[i].path);
+    free(mf->slots);
+    memset(mf, 0, sizeof(*mf));
+}
+
+int manifest_matches(const struct manifest_entry* e, char type, const struct stat* st) {
+    return e && e->type == type && e->size == (long long)st->st_size &&
+           e->mtime_sec == (long long)st->st_mtim.tv_sec && e->mtime_nsec == st->st_mtim.tv_nsec &&
+           e->ino == (unsigned long long)st->st_ino;
+}
+
+// Writes one record. The destination stamp has a fixed width so that it can
+// be rewritten in place; returns its offset in the manifest, or -1.
+long manifest_record(struct xcopy_sync* sync, char type, const struct stat* st, const struct timespec* dst, const char* rel) {
+    if (sync->out == NULL || strchr(rel, '\n')) return -1;
+    fprintf(sync->out, "%c %lld %lld.%09ld %llu ", type, (long long)st->st_size,
+            (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec, (unsigned long long)st->st_ino);
+    long off = ftell(sync->out);
+    fprintf(sync->out, XCOPY_STAMP_FORMAT " %s\n", (long long)dst->tv_sec, dst->tv_nsec, rel);
+    return off;
+}
+
+// Recursively deletes `name` (file or directory) relative to dirfd.
+// Returns the number of files removed, or -1 if the top entry could not be.
+long long remove_tree_at(int dirfd, const char* name) {
+    if (unlinkat(dirfd, name, 0) == 0) return 1;
+    if (errno != EISDIR && errno != EPERM) return -1;
+
+    long long removed = 0;
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return -1;
+    DIR* dir = fdopendir(fd);
+    if (!dir) { close(fd); return -1; }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        long long n = remove_tree_at(fd, entry->d_name);
+        if (n > 0) removed += n;
+    }
+    closedir(dir);
+    return unlinkat(dirfd, name, AT_REMOVEDIR) == 0 ? removed : -1;
+}
+
+// The record vouches for a file only if neither side has changed since:
+// the source still matches it, and the destination still has the ctime it
+// had after the last sync (any write, rename or replacement changes that).
+// Without a usable record, the destination's size and mtime are compared
+// with the source's (COPY preserves mtime, so they are comparable).
+void xcopy_sync_file(struct xcopy_sync* sync, int src_fd, int dst_fd, const char* name,
+                     const struct stat* st, const char* rel) {
+    struct xcopy_stats* stats = sync->stats;
+    const struct manifest_entry* e = manifest_find(&sync->old, rel);
+    struct stat dst;
+    int up_to_date = 0;
+
+    if (fstatat(dst_fd, name, &dst, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(dst.st_mode) && dst.st_size == st->st_size) {
+        if (e && e->type == 'f') {
+            up_to_date = manifest_matches(e, 'f', st) && e->dst_sec == (long long)dst.st_ctim.tv_sec &&
+                         e->dst_nsec == dst.st_ctim.tv_nsec;
+        } else {
+            up_to_date = dst.st_mtim.tv_sec == st->st_mtim.tv_sec && dst.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+        }
+    }
+    if (up_to_date) {
+        stats->skipped++;
+        stats->skipped_bytes += st->st_size;
+        manifest_record(sync, 'f', st, &dst.st_ctim, rel);
+        return;
+    }
+
+    long long copied;
+    int method = copy_file_at(src_fd, name, dst_fd, name, &copied);
+    if (method < 0 && errno == EISDIR && (sync->flags & XCOPY_MIRROR)) {
+        long long n = remove_tree_at(dst_fd, name);
+        if (n >= 0) stats->deleted += n;
+        method = copy_file_at(src_fd, name, dst_fd, name, &copied);
+    }
+    if (method < 0) { stats->errors++; return; }
+    stats->files++;
+    stats->bytes += copied;
+    if (fstatat(dst_fd, name, &dst, AT_SYMLINK_NOFOLLOW) == 0) manifest_record(sync, 'f', st, &dst.st_ctim, rel);
+}
+
+// Syncs one directory pair; `rel` is its path relative to the source root
+// ("." for the root itself), which is also its key in the manifest.
+void xcopy_sync_dir(struct xcopy_sync* sync, int src_fd, int dst_fd, const char* rel) {
+    int is_root = strcmp(rel, ".") == 0;
+    struct xcopy_stats* stats = sync->stats;
+    struct stat dir_st, dst_st;
+    if (fstat(src_fd, &dir_st) != 0 || fstat(dst_fd, &dst_st) != 0) { stats->errors++; return; }
+    const struct manifest_entry* e = manifest_find(&sync->old, rel);
+    int names_unchanged = manifest_matches(e, 'd', &dir_st) && e->dst_sec == (long long)dst_st.st_mtim.tv_sec &&
+                          e->dst_nsec == dst_st.st_mtim.tv_nsec;
+    stats->dirs++;
+
+    DIR* dir = fdopendir(dup(src_fd));
+    if (!dir) { fprintf(stderr, "xcopy: %s: %s\n", rel, strerror(errno)); stats->errors++; return; }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char* name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        if (is_root && strcmp(name, XCOPY_MANIFEST_NAME) == 0) continue;
+        if (sync->filter && !wildcard_match(sync->filter, name) && !dirent_is_dir(src_fd, entry)) continue;
+
+        char child[PATH_MAX_LEN];
+        int n = (strcmp(rel, ".") == 0) ? snprintf(child, sizeof(child), "%s", name)
+                                        : snprintf(child, sizeof(child), "%s/%s", rel, name);
+        if (n >= (int)sizeof(child)) { fprintf(stderr, "xcopy: %s/%s: path too long\n", rel, name); stats->errors++; continue; }
+
+        struct stat st;
+        if (fstatat(src_fd, name, &st, 0) != 0) {
+            fprintf(stderr, "xcopy: %s: %s\n", child, strerror(errno));
+            stats->errors++;
+        } else if (S_ISDIR(st.st_mode)) {
+            if (mkdirat(dst_fd, name, st.st_mode & 07777) != 0 && errno == EEXIST && (sync->flags & XCOPY_MIRROR)) {
+                struct stat dst;
+                if (fstatat(dst_fd, name, &dst, AT_SYMLINK_NOFOLLOW) == 0 && !S_ISDIR(dst.st_mode) &&
+                    unlinkat(dst_fd, name, 0) == 0) {
+                    stats->deleted++;
+                    mkdirat(dst_fd, name, st.st_mode & 07777);
+                }
+            }
+            int child_src = openat(src_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            int child_dst = openat(dst_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (child_src < 0 || child_dst < 0) {
+                fprintf(stderr, "xcopy: %s: %s\n", child, strerror(errno));
+                stats->errors++;
+            } else {
+                xcopy_sync_dir(sync, child_src, child_dst, child);
+            }
+            if (child_src >= 0) close(child_src);
+            if (child_dst >= 0) close(child_dst);
+        } else {
+            xcopy_sync_file(sync, src_fd, dst_fd, name, &st, child);
+        }
+    }
+    closedir(dir);
+
+    // /MIR: delete whatever the destination has that the source does not,
+    // unless neither side's directory has changed since the last sync.
+    if ((sync->flags & XCOPY_MIRROR) && !names_unchanged) {
+        DIR* ddir = fdopendir(dup(dst_fd));
+        if (ddir) {
+            while ((entry = readdir(ddir)) != NULL) {
+                const char* name = entry->d_name;
+                if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+                if (is_root && strncmp(name, XCOPY_MANIFEST_NAME, strlen(XCOPY_MANIFEST_NAME)) == 0) continue;
+                if (sync->filter && !wildcard_match(sync->filter, name) && !dirent_is_dir(dst_fd, entry)) continue;
+                if (faccessat(src_fd, name, F_OK, AT_SYMLINK_NOFOLLOW) == 0) continue;
+                long long n = remove_tree_at(dst_fd, name);
+                if (n < 0) { fprintf(stderr, "xcopy: %s: %s\n", name, strerror(errno)); stats->errors++; }
+                else stats->deleted += n;
+            }
+            closedir(ddir);
+        }
+    }
+    if (fstat(dst_fd, &dst_st) == 0) {
+        long off = manifest_record(sync, 'd', &dir_st, &dst_st.st_mtim, rel);
+        if (is_root) sync->root_stamp = off;
+    }
+}
+
+void do_xcopy_sync(const char* source, const char* dest, const struct wildcard* filter, int flags, struct xcopy_stats* stats) {
+    struct xcopy_sync sync;
+    struct stat st;
+    char source_id[PATH_MAX_LEN + NAME_MAX + 2];
+    memset(&sync, 0, sizeof(sync));
+    sync.root_stamp = -1;
+    sync.flags = flags;
+    sync.stats = stats;
+    sync.filter = filter;
+
+    if (stat(source, &st) != 0 || realpath(source, source_id) == NULL) { perror("xcopy: source"); stats->errors++; return; }
+    // A filtered sync records only part of the tree: keep its manifest apart.
+    if (filter) snprintf(source_id + strlen(source_id), sizeof(source_id) - strlen(source_id), "/%s", filter->text);
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "xcopy: /D and /MIR need a source directory\n");
+        stats->errors++;
+        return;
+    }
+    if (mkdir(dest, st.st_mode & 07777) != 0 && errno != EEXIST) { perror("xcopy: destination"); stats->errors++; return; }
+    int src_fd = open(source, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int dst_fd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (src_fd < 0 || dst_fd < 0) {
+        perror("xcopy");
+        stats->errors++;
+        if (src_fd >= 0) close(src_fd);
+        if (dst_fd >= 0) close(dst_fd);
+        return;
+    }
+
+    manifest_load(&sync.old, dst_fd, source_id);
+    int out_fd = openat(dst_fd, XCOPY_MANIFEST_NAME ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out_fd >= 0) sync.out = fdopen(out_fd, "w");
+    if (sync.out) fprintf(sync.out, "%s %s\n", XCOPY_MANIFEST_MAGIC, source_id);
+
+    xcopy_sync_dir(&sync, src_fd, dst_fd, ".");
+
+    // Only a clean run may vouch for the destination next time.
+    if (sync.out) {
+        int ok = fclose(sync.out) == 0 && stats->errors == 0;
+        if (!ok || renameat(dst_fd, XCOPY_MANIFEST_NAME ".tmp", dst_fd, XCOPY_MANIFEST_NAME) != 0) {
+            unlinkat(dst_fd, XCOPY_MANIFEST_NAME ".tmp", 0);
+            if (!ok) unlinkat(dst_fd, XCOPY_MANIFEST_NAME, 0);
+        } else if (sync.root_stamp >= 0 && fstat(dst_fd, &st) == 0) {
+            // The rename itself changed the root's mtime: record that one,
+            // in place, which leaves the directory alone.
+            char stamp[32];
+            int fd = openat(dst_fd, XCOPY_MANIFEST_NAME, O_WRONLY | O_CLOEXEC);
+            int len = snprintf(stamp, sizeof(stamp), XCOPY_STAMP_FORMAT, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+            if (fd < 0 || pwrite(fd, stamp, len, sync.root_stamp) != len) unlinkat(dst_fd, XCOPY_MANIFEST_NAME, 0);
+            if (fd >= 0) close(fd);
+        }
+    }
+    manifest_free(&sync.old);
+    close(src_fd);
+    close(dst_fd);
+}
+
+int xcopy_command(const char* source, const char* dest, int nworkers, int flags) {
+    struct xcopy_stats stats;
+    struct timespec start;
+    struct stat st;
+    struct wildcard w;
+    const struct wildcard* filter = NULL;
+    char src_dir[PATH_MAX_LEN];
+    memset(&stats, 0, sizeof(stats));
+
+    // "XCOPY DIR\*.TXT DEST" copies the tree under DIR, but only *.TXT files.
+    int wild = wildcard_split(source, src_dir, sizeof(src_dir), &w);
+    if (wild < 0) { fprintf(stderr, "xcopy: %s: %s\n", source, strerror(errno)); return -1; }
+    if (wild > 0) {
+        source = src_dir;
+        if (w.kind != WILD_ALL) filter = &w;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (flags & (XCOPY_NEWER | XCOPY_MIRROR)) {
+        do_xcopy_sync(source, dest, filter, flags, &stats);
+    } else if (nworkers > 1 && stat(source, &st) == 0 && S_ISDIR(st.st_mode)) {
+        do_xcopy_parallel(source, dest, filter, nworkers, &stats);
+    } else {
+        do_xcopy(source, dest, filter, &stats);
+    }
+    double secs = elapsed_since(&start);
+
+    char byte_rate[32];
+    format_rate((double)stats.bytes, secs, "B", byte_rate, sizeof(byte_rate));
+    printf("%8lld File(s) copied, %lld bytes in %.2f s (%.0f files/s, %s).\n",
+           stats.files, stats.bytes, secs, secs > 0 ? stats.files / secs : 0.0, byte_rate);
+    if (flags & (XCOPY_NEWER | XCOPY_MIRROR)) {
+        printf("%8lld File(s) skipped, %lld bytes up to date.\n", stats.skipped, stats.skipped_bytes);
+    }
+    if (flags & XCOPY_MIRROR) printf("%8lld File(s) deleted.\n", stats.deleted);
+    if (stats.errors > 0) printf("%8lld error(s).\n", stats.errors);
+    return stats.errors > 0 ? -1 : 0;
+}
+
+// --- DEL /S and RD /S: parallel tree removal ---
+// Every directory is a task on the work-stealing pool: it unlinks its files
+// with unlinkat() relative to its own fd and queues its subdirectories, so
+// separate subtrees are emptied on separate CPUs. Symlinks are unlinked,
+// never followed.
+
+// Each directory queued or being emptied holds an fd; lift the soft limit.
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// Asks "<what>, Are you sure (Y/N)? "; anything but Y is a no.
+int confirm_prompt(const char* what) {
+    char dos_path[PATH_MAX_LEN];
+    char answer[16];
+    format_path_for_dos(what, dos_path);
+    printf("%s, Are you sure (Y/N)? ", dos_path);
+    fflush(stdout);
+    if (fgets(answer, sizeof(answer), stdin) == NULL) {
+        printf("\n");
+        return 0;
+    }
+    return toupper((unsigned char)answer[0]) == 'Y';
+}
+
+struct rmtree_task* rmtree_task_new(struct rmtree_dir* parent, const char* name) {
+    size_t len = strlen(name);
+    struct rmtree_task* t = malloc(sizeof(*t) + len + 1);
+    if (!t) return NULL;
+    t->base.run = rmtree_dir_task;
+    t->parent = parent;
+    memcpy(t->name, name, len + 1);
+    __atomic_add_fetch(&parent->refs, 1, __ATOMIC_SEQ_CST);
+    return t;
+}
+
+void rmtree_dir_release(struct rmtree_dir* d) {
+    while (d && __atomic_sub_fetch(&d->refs, 1, __ATOMIC_SEQ_CST) == 0) {
+        struct rmtree_dir* parent = d->parent;
+        if (parent) { // the root only stands for AT_FDCWD
+            close(d->fd);
+            if (d->flags & DELETE_DIRS) { // DEL /S leaves directories in place
+                if (unlinkat(parent->fd, d->name, AT_REMOVEDIR) == 0) {
+                    __atomic_add_fetch(&d->stats->dirs, 1, __ATOMIC_RELAXED);
+                } else {
+                    fprintf(stderr, "rd: %s: %s\n", d->name, strerror(errno));
+                    __atomic_add_fetch(&d->stats->errors, 1, __ATOMIC_RELAXED);
+                }
+            }
+        }
+        free(d);
+        d = parent;
+    }
+}
+
+void rmtree_dir_task(struct task_pool* pool, struct task* base, int worker) {
+    struct rmtree_task* t = (struct rmtree_task*)base;
+    struct rmtree_dir* parent = t->parent;
+    struct rmtree_stats* stats = parent->stats;
+    const char* cmd = (parent->flags & DELETE_DIRS) ? "rd" : "del";
+    size_t name_len = strlen(t->name) + 1;
+
+    int fd = openat(parent->fd, t->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    struct rmtree_dir* d = fd < 0 ? NULL : malloc(sizeof(*d) + name_len);
+    if (!d) {
+        fprintf(stderr, "%s: %s: %s\n", cmd, t->name, strerror(errno));
+        __atomic_add_fetch(&stats->errors, 1, __ATOMIC_RELAXED);
+        if (fd >= 0) close(fd);
+        rmtree_dir_release(parent);
+        free(t);
+        return;
+    }
+    d->fd = fd;
+    d->refs = 1; // our own reference while listing
+    d->flags = parent->flags;
+    d->filter = parent->filter;
+    d->parent = parent; // inherits the reference held by this task
+    d->stats = stats;
+    memcpy(d->name, t->name, name_len);
+    free(t);
+
+    char* buf = malloc(DIRENT_BUF_SIZE);
+    long n = -1;
+    long long files = 0, errors = 0;
+    while (buf && (n = syscall(SYS_getdents64, fd, buf, DIRENT_BUF_SIZE)) > 0) {
+        for (long off = 0; off < n;) {
+            struct linux_dirent64* e = (struct linux_dirent64*)(buf + off);
+            const char* name = e->d_name;
+            off += e->d_reclen;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+            int is_dir = e->d_type == DT_DIR;
+            if (e->d_type == DT_UNKNOWN) {
+                struct stat st;
+                is_dir = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+            }
+            if (is_dir) {
+                struct rmtree_task* child = rmtree_task_new(d, name);
+                if (child) task_pool_push(pool, worker, &child->base);
+                else errors++;
+            } else if (!d->filter || wildcard_match(d->filter, name)) {
+                if (unlinkat(fd, name, 0) == 0) {
+                    files++;
+                } else {
+                    fprintf(stderr, "%s: %s: %s\n", cmd, name, strerror(errno));
+                    errors++;
+                }
+            }
+        }
+    }
+    if (n < 0) {
+        fprintf(stderr, "%s: %s: %s\n", cmd, d->name, strerror(errno));
+        errors++;
+    }
+    free(buf);
+    __atomic_add_fetch(&stats->files, files, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->errors, errors, __ATOMIC_RELAXED);
+    rmtree_dir_release(d);
+}
+
+// Deletes the files under `path` that match `filter` (all when NULL); with
+// DELETE_DIRS also every directory, `path` itself included.
+void rmtree_parallel(const char* path, const struct wildcard* filter, int flags, struct rmtree_stats* stats) {
+    struct rmtree_dir* root = malloc(sizeof(*root) + 1);
+    if (!root) { perror(flags & DELETE_DIRS ? "rd" : "del"); stats->errors++; return; }
+    raise_fd_limit();
+    root->fd = AT_FDCWD;
+    root->refs = 1;
+    root->flags = flags;
+    root->filter = filter;
+    root->parent = NULL;
+    root->stats = stats;
+    root->name[0] = '\0';
+
+    struct rmtree_task* first = rmtree_task_new(root, path);
+    if (first) {
+        int nworkers = online_cpus();
+        task_pool_run(nworkers < MAX_WORKERS ? nworkers : MAX_WORKERS, &first->base);
+    } else {
+        stats->errors++;
+    }
+    rmtree_dir_release(root);
+}
+
+// Removes the ".~rd-*" trees in dir_fd that no reclaimer is working on: one
+// killed at shutdown, or whose fork failed, left its tree behind, and with
+// it the flock() it held on the tree's directory.
+void rmtree_sweep(int dir_fd) {
+    int fd = dup(dir_fd);
+    DIR* dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir) { if (fd >= 0) close(fd); return; }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, ".~rd-", 5) != 0) continue;
+        int lock_fd = openat(dir_fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (lock_fd < 0) continue;
+        if (flock(lock_fd, LOCK_EX | LOCK_NB) == 0) remove_tree_at(dir_fd, entry->d_name);
+        close(lock_fd);
+    }
+    closedir(dir);
+}
+
+// RD /S /BG: renames the tree to a hidden name beside it (same filesystem,
+// so the rename is atomic) and leaves the deleting to a detached process at
+// idle CPU and I/O priority. Returns 0 once the tree is out of the way.
+// The tree stays flock()ed until it is gone, so the reclaimer can also
+// sweep up hidden trees that earlier reclaimers did not live to finish.
+int rmtree_background(const char* path) {
+    static int serial = 0;
+    char dir[PATH_MAX_LEN];
+    char trash[NAME_MAX + 1];
+    const char* slash = strrchr(path, '/');
+    if (!slash) snprintf(dir, sizeof(dir), ".");
+    else snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    snprintf(trash, sizeof(trash), ".~rd-%d-%d", (int)getpid(), ++serial);
+
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int lock_fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir_fd < 0 || lock_fd < 0 || flock(lock_fd, LOCK_EX) != 0 || renameat(AT_FDCWD, path, dir_fd, trash) != 0) {
+        fprintf(stderr, "rd: %s: %s\n", path, strerror(errno));
+        if (lock_fd >= 0) close(lock_fd);
+        if (dir_fd >= 0) close(dir_fd);
+        return -1;
+    }
+
+    // Double fork: the reclaimer is reparented to init and never becomes a
+    // zombie of the shell, and setsid() keeps it out of reach of ^C. It
+    // inherits the lock; the middle child exits 1 if it could not fork.
+    fflush(stdout);
+    int status = 1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        pid_t reclaimer = fork();
+        if (reclaimer == 0) {
+            int null_fd = open("/dev/null", O_RDWR);
+            setsid();
+            if (null_fd >= 0) {
+                dup2(null_fd, STDIN_FILENO);
+                dup2(null_fd, STDOUT_FILENO);
+                dup2(null_fd, STDERR_FILENO);
+            }
+            setpriority(PRIO_PROCESS, 0, 19);
+            syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_IDLE_VALUE);
+            remove_tree_at(dir_fd, trash);
+            close(lock_fd);
+            rmtree_sweep(dir_fd);
+            _exit(0);
+        }
+        if (reclaimer < 0) perror("rd: fork");
+        _exit(reclaimer > 0 ? 0 : 1);
+    }
+    if (pid > 0) waitpid(pid, &status, 0);
+    else perror("rd: fork");
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        remove_tree_at(dir_fd, trash); // no background: do it now
+        close(lock_fd);
+        rmtree_sweep(dir_fd);
+    } else {
+        close(lock_fd);
+    }
+    close(dir_fd);
+    return 0;
+}
+
+void rmtree_report(const struct rmtree_stats* stats, const struct timespec* start) {
+    double secs = elapsed_since(start);
+    printf("%8lld File(s), %lld Dir(s) deleted in %.2f s (%.0f files/s).\n", stats->files, stats->dirs, secs,
+           secs > 0 ? stats->files / secs : 0.0);
+    if (stats->errors > 0) printf("%8lld error(s).\n", stats->errors);
+}
+
+// --- TYPE ---
+
+int write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Sends `len` bytes of in_fd starting at `off` to out_fd without passing
+// them through user space when the kernel allows: splice into a pipe,
+// sendfile into anything else, and pread/write as the last resort.
+int send_file_range(int in_fd, off_t off, long long len, int out_fd) {
+    struct stat out_st;
+    ssize_t n = 0;
+    loff_t pos = off;
+
+    if (fstat(out_fd, &out_st) == 0 && S_ISFIFO(out_st.st_mode)) {
+        while (len > 0 && (n = splice(in_fd, &pos, out_fd, NULL, len > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : len,
+                                      SPLICE_F_MORE)) > 0) {
+            len -= n;
+        }
+        if (len == 0 || n == 0) return 0;
+        if (!copy_fallback_errno(errno)) return -1;
+    }
+
+    off_t sf_pos = pos;
+    while (len > 0 && (n = sendfile(out_fd, in_fd, &sf_pos, len > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : len)) > 0) {
+        len -= n;
+    }
+    if (len == 0 || n == 0) return 0;
+    if (!copy_fallback_errno(errno)) return -1;
+
+    char* buf = malloc(FILE_BUF_SIZE);
+    if (!buf) return -1;
+    while (len > 0 && (n = pread(in_fd, buf, len > FILE_BUF_SIZE ? FILE_BUF_SIZE : len, sf_pos)) > 0) {
+        if (write_all(out_fd, buf, n) != 0) { n = -1; break; }
+        sf_pos += n;
+        len -= n;
+    }
+    free(buf);
+    return n < 0 ? -1 : 0;
+}
+
+// TYPE. Text mode stops at the DOS end-of-file marker (^Z); /B writes the
+// file verbatim. Both are NUL-safe. Returns 0 or -1 (already reported).
+int do_type(const char* path, int binary) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("type");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    fflush(stdout); // everything below writes to fd 1 directly
+
+    int rc = 0;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        long long len = st.st_size;
+        int to_tty = isatty(STDOUT_FILENO);
+        char* map = MAP_FAILED;
+        if (!binary || to_tty) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                if (!binary) {
+                    char* eof = memchr(map, DOS_EOF_CHAR, st.st_size);
+                    if (eof) len = eof - map;
+                }
+            }
+        }
+        if (map != MAP_FAILED && to_tty) {
+            // A terminal cannot be spliced into; large writes straight out of
+            // the mapping are the next best thing.
+            for (long long off = 0; off < len && rc == 0; off += FILE_BUF_SIZE) {
+                rc = write_all(STDOUT_FILENO, map + off, len - off > FILE_BUF_SIZE ? FILE_BUF_SIZE : len - off);
+            }
+        } else {
+            rc = send_file_range(fd, 0, len, STDOUT_FILENO);
+        }
+        if (map != MAP_FAILED) munmap(map, st.st_size);
+    } else {
+        // Pipes, devices and pseudo-files with no usable size.
+        char* buf = malloc(FILE_BUF_SIZE);
+        ssize_t n = 0;
+        while (buf && (n = read(fd, buf, FILE_BUF_SIZE)) > 0) {
+            char* eof = binary ? NULL : memchr(buf, DOS_EOF_CHAR, n);
+            if (write_all(STDOUT_FILENO, buf, eof ? eof - buf : n) != 0) { n = -1; break; }
+            if (eof) break;
+        }
+        if (!buf || n < 0) rc = -1;
+        free(buf);
+    }
+    if (rc != 0 && errno != EPIPE) perror("type");
+    close(fd);
+    return rc;
+}
+
+// --- DIR ---
+
+// Buffered writer for DIR output. On a terminal it flushes once per
+// screenful; otherwise whenever OUT_BUF_SIZE bytes have accumulated.
+void out_init(struct out_buf* out) {
+    struct winsize ws;
+    memset(out, 0, sizeof(*out));
+    out->cap = OUT_BUF_SIZE;
+    out->buf = malloc(out->cap);
+    if (isatty(STDOUT_FILENO)) {
+        out->page_lines = (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0) ? ws.ws_row : 25;
+    }
+    fflush(stdout); // keep ordering with anything already printed via stdio
+}
+
+void out_flush(struct out_buf* out) {
+    write_all(STDOUT_FILENO, out->buf, out->len);
+    out->len = 0;
+    out->lines = 0;
+}
+
+void out_printf(struct out_buf* out, const char* fmt, ...) {
+    va_list ap;
+    if (out->cap - out->len < 1024) out_flush(out);
+    va_start(ap, fmt);
+    int n = vsnprintf(out->buf + out->len, out->cap - out->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n >= out->cap - out->len) n = out->cap - out->len - 1;
+    for (int i = 0; i < n; i++) {
+        if (out->buf[out->len + i] == '\n') out->lines++;
+    }
+    out->len += n;
+    if (out->page_lines > 0 && out->lines >= out->page_lines) out_flush(out);
+}
+
+void out_free(struct out_buf* out) {
+    out_flush(out);
+    free(out->buf);
+}
+
+// strftime()/localtime() per entry dominate a large DIR; entries in the
+// same minute share one formatted string.
+const char* format_dir_time(long long mtime) {
+    static struct { long long minute; char text[32]; } cache[TIME_CACHE_SLOTS];
+    static int initialized = 0;
+    long long minute = mtime >= 0 ? mtime / 60 : (mtime - 59) / 60;
+    if (!initialized) {
+        for (int i = 0; i < TIME_CACHE_SLOTS; i++) cache[i].minute = LLONG_MIN;
+        initialized = 1;
+    }
+    int slot = (int)((unsigned long long)minute % TIME_CACHE_SLOTS);
+    if (cache[slot].minute != minute) {
+        time_t t = (time_t)(minute * 60);
+        struct tm tm;
+        cache[slot].minute = minute;
+        if (localtime_r(&t, &tm) == NULL ||
+            strftime(cache[slot].text, sizeof(cache[slot].text), "%m/%d/%Y  %I:%M %p", &tm) == 0) {
+            strcpy(cache[slot].text, "--/--/----  --:-- --");
+        }
+    }
+    return cache[slot].text;
+}
+
+// Reads the entries of dirfd with getdents64 and statx (type, size and
+// mtime only). With a filter, names that do not match are dropped before
+// statx, except that /S keeps directories as hidden entries to recurse into.
+// Returns 0, or -1 with errno set.
+int dir_list_read(int dirfd, const struct dir_options* opts, struct dir_list* list) {
+    char* buf = malloc(DIRENT_BUF_SIZE);
+    long n;
+    memset(list, 0, sizeof(*list));
+    if (!buf) return -1;
+
+    while ((n = syscall(SYS_getdents64, dirfd, buf, DIRENT_BUF_SIZE)) > 0) {
+        for (long off = 0; off < n;) {
+            struct linux_dirent64* d = (struct linux_dirent64*)(buf + off);
+            off += d->d_reclen;
+
+            int hidden = opts->filter && !wildcard_match(opts->filter, d->d_name);
+            if (hidden && !(opts->recursive && (d->d_type == DT_DIR || d->d_type == DT_UNKNOWN))) continue;
+
+            struct statx stx;
+            if (statx(dirfd, d->d_name, AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE | STATX_MTIME, &stx) != 0) continue;
+            if (hidden && !S_ISDIR(stx.stx_mode)) continue;
+
+            size_t name_len = strlen(d->d_name) + 1;
+            if (list->names_len + name_len > list->names_cap) {
+                list->names_cap = (list->names_cap + name_len) * 2;
+                list->names = realloc(list->names, list->names_cap);
+            }
+            if (list->count == list->cap) {
+                list->cap = list->cap ? list->cap * 2 : 256;
+                list->items = realloc(list->items, list->cap * sizeof(*list->items));
+            }
+            struct dir_entry* e = &list->items[list->count++];
+            e->name_off = list->names_len;
+            e->size = (long long)stx.stx_size;
+            e->mtime = (long long)stx.stx_mtime.tv_sec;
+            e->is_dir = S_ISDIR(stx.stx_mode);
+            e->is_link = d->d_type == DT_LNK;
+            e->hidden = hidden;
+            memcpy(list->names + list->names_len, d->d_name, name_len);
+            list->names_len += name_len;
+        }
+    }
+    free(buf);
+    return n < 0 ? -1 : 0;
+}
+
+void dir_list_free(struct dir_list* list) {
+    free(list->items);
+    free(list->names);
+}
+
+// qsort has no context argument, so the active order lives here.
+struct dir_sort_ctx { const char* names; char key; int reverse; } dir_sort;
+
+int dir_entry_compare(const void* a, const void* b) {
+    const struct dir_entry* x = a;
+    const struct dir_entry* y = b;
+    int r = 0;
+    if (dir_sort.key == 'S') {
+        long long xs = x->is_dir ? 0 : x->size, ys = y->is_dir ? 0 : y->size;
+        r = (xs > ys) - (xs < ys);
+    }
+    else if (dir_sort.key == 'D') r = (x->mtime > y->mtime) - (x->mtime < y->mtime);
+    if (r == 0) r = strcasecmp(dir_sort.names + x->name_off, dir_sort.names + y->name_off);
+    return dir_sort.reverse ? -r : r;
+}
+
+// Lists one directory (and, for /S, its subdirectories) into `out`.
+void dir_list_dir(int dirfd, const char* dos_path, const struct dir_options* opts,
+                  struct dir_totals* totals, struct out_buf* out) {
+    struct dir_list list;
+    if (dir_list_read(dirfd, opts, &list) != 0) {
+        fprintf(stderr, "dir: %s: %s\n", dos_path, strerror(errno));
+        return;
+    }
+    if (opts->sort_key) {
+        dir_sort.names = list.names;
+        dir_sort.key = opts->sort_key;
+        dir_sort.reverse = opts->reverse;
+        qsort(list.items, list.count, sizeof(*list.items), dir_entry_compare);
+    }
+
+    long long total_size = 0;
+    int file_count = 0, dir_count = 0;
+    size_t shown = 0;
+    for (size_t i = 0; i < list.count; i++) shown += !list.items[i].hidden;
+    // A filtered /S only reports the directories that have matches.
+    if (shown > 0 || !opts->filter) out_printf(out, "\n Directory of C:%s\n\n", dos_path);
+    for (size_t i = 0; i < list.count; i++) {
+        const struct dir_entry* e = &list.items[i];
+        const char* name = list.names + e->name_off;
+        if (e->hidden) {
+            continue;
+        } else if (e->is_dir) {
+            out_printf(out, "%s   %-12s %s\n", format_dir_time(e->mtime), "<DIR>", name);
+            if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) dir_count++;
+        } else {
+            out_printf(out, "%s   %12lld %s\n", format_dir_time(e->mtime), e->size, name);
+            total_size += e->size;
+            file_count++;
+        }
+    }
+    if (shown > 0 || !opts->filter) {
+        out_printf(out, "\n%15d File(s) %15lld bytes\n", file_count, total_size);
+        out_printf(out, "%15d Dir(s)\n", dir_count);
+    }
+    totals->shown += shown;
+    totals->files += file_count;
+    totals->dirs += dir_count;
+    totals->bytes += total_size;
+
+    if (opts->recursive) {
+        for (size_t i = 0; i < list.count; i++) {
+            const struct dir_entry* e = &list.items[i];
+            const char* name = list.names + e->name_off;
+            if (!e->is_dir || e->is_link || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+            char child_path[PATH_MAX_LEN];
+            int n = snprintf(child_path, sizeof(child_path), "%s%s%s", dos_path,
+                             strcmp(dos_path, "\\") == 0 ? "" : "\\", name);
+            if (n >= (int)sizeof(child_path)) continue;
+            int child_fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (child_fd < 0) {
+                fprintf(stderr, "dir: %s: %s\n", child_path, strerror(errno));
+                continue;
+            }
+            dir_list_dir(child_fd, child_path, opts, totals, out);
+            close(child_fd);
+        }
+    }
+    dir_list_free(&list);
+}
+
+int do_dir(const char* path, const struct dir_options* opts) {
+    char dos_path_display[PATH_MAX_LEN];
+    char real_path[PATH_MAX_LEN];
+    struct dir_totals totals = { 0, 0, 0, 0 };
+    struct out_buf out;
+
+    if (realpath(path, real_path) == NULL) {
+        perror("dir");
+        return -1;
+    }
+    format_path_for_dos(real_path, dos_path_display);
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) { perror("dir"); return -1; }
+
+    out_init(&out);
+    dir_list_dir(fd, dos_path_display, opts, &totals, &out);
+    if (opts->filter && totals.shown == 0) {
+        out_free(&out);
+        close(fd);
+        fprintf(stderr, "File Not Found\n");
+        return -1;
+    }
+    if (opts->recursive) {
+        out_printf(&out, "\n     Total Files Listed:\n");
+        out_printf(&out, "%15lld File(s) %15lld bytes\n", totals.files, totals.bytes);
+        out_printf(&out, "%15lld Dir(s)\n", totals.dirs);
+    }
+    out_free(&out);
+    close(fd);
+    return 0;
+}
+
+// --- TIMEIT ---
+// The command runs in a forked copy of the shell, so builtins are measured
+// exactly as they run at the prompt. The child waits on a pipe until the
+// counters are attached; wait4() then gives its resource usage, which
+// includes any programs it started and waited for.
+
+// Opens the hardware counters for pid (and its children) as one group.
+// Returns how many opened; 0 when the CPU or kernel has no PMU support.
+int perf_counters_open(pid_t pid, int* fds) {
+    int opened = 0;
+    for (int i = 0; i < TIMEIT_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = timeit_events[i];
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1; // allowed with perf_event_paranoid up to 2
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int group = (i == 0) ? -1 : fds[0];
+        fds[i] = (int)syscall(__NR_perf_event_open, &attr, pid, -1, group, PERF_FLAG_FD_CLOEXEC);
+        if (fds[i] >= 0) opened++;
+        else if (i == 0) break;
+    }
+    if (opened > 0) ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return opened;
+}
+
+// Reads and closes the counters, scaling for time spent multiplexed out.
+// Counters that could not be opened read as -1.
+void perf_counters_read(const int* fds, double* values) {
+    for (int i = 0; i < TIMEIT_COUNTERS; i++) {
+        unsigned long long v[3];
+        values[i] = -1;
+        if (fds[i] < 0) continue;
+        if (read(fds[i], v, sizeof(v)) == (ssize_t)sizeof(v) && v[2] > 0) {
+            values[i] = (double)v[0] * ((double)v[1] / (double)v[2]);
+        }
+        close(fds[i]);
+    }
+}
+
+// Runs the command once; fills sample[TM_*] and returns its exit status.
+int timeit_run(const char* command, double* sample, int* have_counters) {
+    int go[2], fds[TIMEIT_COUNTERS];
+    struct timespec start;
+    struct rusage ru;
+    int wstatus;
+    char c = 0;
+
+    for (int i = 0; i < TIMEIT_COUNTERS; i++) fds[i] = -1;
+    if (pipe2(go, O_CLOEXEC) != 0) { perror("timeit: pipe"); return -1; }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("timeit: fork");
+        close(go[0]);
+        close(go[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(go[1]);
+        if (read(go[0], &c, 1) != 1) _exit(127); // parent gave up
+        close(go[0]);
+        int rc = execute_line(command);
+        fflush(stdout);
+        _exit(rc);
+    }
+
+    close(go[0]);
+    *have_counters = perf_counters_open(pid, fds) > 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (write(go[1], &c, 1) != 1) perror("timeit: write");
+    close(go[1]);
+    while (wait4(pid, &wstatus, 0, &ru) < 0) {
+        if (errno != EINTR) { perror("timeit: wait4"); return -1; }
+    }
+    sample[TM_WALL] = elapsed_since(&start);
+    perf_counters_read(fds, sample + TM_FIRST_COUNTER);
+
+    sample[TM_USER] = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    sample[TM_SYS] = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    sample[TM_MAXRSS] = ru.ru_maxrss;
+    sample[TM_MINFLT] = ru.ru_minflt;
+    sample[TM_MAJFLT] = ru.ru_majflt;
+    sample[TM_VCSW] = ru.ru_nvcsw;
+    sample[TM_IVCSW] = ru.ru_nivcsw;
+    if (WIFEXITED(wstatus)) return WEXITSTATUS(wstatus);
+    return WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus) : 1;
+}
+
+int double_compare(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void timeit_format(int metric, double value, char* buf, size_t len) {
+    if (value < 0) snprintf(buf, len, "n/a");
+    else if (metric <= TM_SYS && value < 1) snprintf(buf, len, "%.3f ms", value * 1e3);
+    else if (metric <= TM_SYS) snprintf(buf, len, "%.3f s", value);
+    else if (metric == TM_MAXRSS) snprintf(buf, len, "%.0f KB", value);
+    else snprintf(buf, len, "%.0f", value);
+}
+
+// TIMEIT [/R:n] command: the rest of the line arrives unparsed in argv[1],
+// so redirections and pipes belong to the measured command.
+int builtin_timeit(int argc, char** argv) {
+    const char* command = argc > 1 ? argv[1] : "";
+    int runs = 1, status = 0, counters = 0;
+
+    while (*command == '/') {
+        char sw[32];
+        const char* v;
+        size_t n = strcspn(command, " \t");
+        snprintf(sw, sizeof(sw), "%.*s", (int)(n < sizeof(sw) ? n : sizeof(sw) - 1), command);
+        if ((v = match_switch(sw, "R")) == NULL) break; // a command such as /bin/ls
+        if ((runs = atoi(v)) < 1 || runs > TIMEIT_MAX_RUNS) {
+            printf("Syntax: TIMEIT [/R:n] command   (1 <= n <= %d)\n", TIMEIT_MAX_RUNS);
+            return 1;
+        }
+        command += n;
+        command += strspn(command, " \t");
+    }
+    if (*command == '\0') {
+        printf("Syntax: TIMEIT [/R:n] command\n");
+        return 1;
+    }
+
+    double* samples = malloc(sizeof(double) * TM_COUNT * runs);
+    if (!samples) { perror("timeit"); return 1; }
+    for (int r = 0; r < runs; r++) {
+        int have = 0;
+        status = timeit_run(command, samples + (size_t)r * TM_COUNT, &have);
+        if (status < 0) { free(samples); return 1; }
+        counters |= have;
+    }
+
+    char a[32], b[32], c[32];
+    int last = counters ? TM_COUNT : TM_FIRST_COUNTER;
+    if (runs == 1) {
+        printf("\n");
+        for (int m = 0; m < last; m++) {
+            timeit_format(m, samples[m], a, sizeof(a));
+            printf("  %-22s %14s\n", timeit_labels[m], a);
+        }
+        if (counters && samples[TM_CYCLES] > 0 && samples[TM_INSTRUCTIONS] >= 0) {
+            printf("  %-22s %14.2f\n", "Instructions/cycle", samples[TM_INSTRUCTIONS] / samples[TM_CYCLES]);
+        }
+    } else {
+        double* column = malloc(sizeof(double) * runs);
+        if (!column) { perror("timeit"); free(samples); return 1; }
+        printf("\n  %-22s %14s %14s %14s   (%d runs)\n", "", "min", "median", "max", runs);
+        for (int m = 0; m < last; m++) {
+            for (int r = 0; r < runs; r++) column[r] = samples[(size_t)r * TM_COUNT + m];
+            qsort(column, runs, sizeof(double), double_compare);
+            double median = (runs % 2) ? column[runs / 2] : (column[runs / 2 - 1] + column[runs / 2]) / 2;
+            timeit_format(m, column[0], a, sizeof(a));
+            timeit_format(m, median, b, sizeof(b));
+            timeit_format(m, column[runs - 1], c, sizeof(c));
+            printf("  %-22s %14s %14s %14s\n", timeit_labels[m], a, b, c);
+        }
+        free(column);
+    }
+    if (!counters) printf("  (CPU counters unavailable: no perf_event support)\n");
+    printf("\n");
+    free(samples);
+    return status;
+}
+
+// --- FINDSTR ---
+// Files are mmap'd and scanned as one buffer. The substring kernel looks for
+// the pattern's first and last bytes together (16 or 32 positions per
+// compare with SSE2/AVX2) and memcmp's only where both match. With several
+// strings, each pattern's next match is cached and only searched again once
+// the scan moves past it, so every pattern crosses the file at most once.
+// Files are tasks on the work-stealing pool; each builds its output in a
+// private buffer that is written out under a lock in whole lines.
+
+int findstr_equal(const char* p, const struct findstr_pat* pat) {
+    if (!pat->fold) return memcmp(p, pat->text, pat->len) == 0;
+    for (size_t i = 0; i < pat->len; i++) {
+        if (tolower((unsigned char)p[i]) != (unsigned char)pat->text[i]) return 0;
+    }
+    return 1;
+}
+
+const char* findstr_scalar(const char* hay, size_t n, const struct findstr_pat* pat) {
+    for (size_t i = 0; i + pat->len <= n; i++) {
+        unsigned char c = hay[i], l = hay[i + pat->len - 1];
+        if ((c == pat->first_lo || c == pat->first_hi) && (l == pat->last_lo || l == pat->last_hi) &&
+            findstr_equal(hay + i, pat)) return hay + i;
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+const char* findstr_sse2(const char* hay, size_t n, const struct findstr_pat* pat) {
+    size_t m = pat->len, i = 0;
+    const __m128i f1 = _mm_set1_epi8((char)pat->first_lo), f2 = _mm_set1_epi8((char)pat->first_hi);
+    const __m128i l1 = _mm_set1_epi8((char)pat->last_lo), l2 = _mm_set1_epi8((char)pat->last_hi);
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(hay + i + m - 1));
+        __m128i hit = _mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(a, f1), _mm_cmpeq_epi8(a, f2)),
+                                    _mm_or_si128(_mm_cmpeq_epi8(b, l1), _mm_cmpeq_epi8(b, l2)));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(hit);
+        while (mask) {
+            size_t at = i + __builtin_ctz(mask);
+            if (findstr_equal(hay + at, pat)) return hay + at;
+            mask &= mask - 1;
+        }
+    }
+    return findstr_scalar(hay + i, n - i, pat);
+}
+
+__attribute__((target("avx2")))
+const char* findstr_avx2(const char* hay, size_t n, const struct findstr_pat* pat) {
+    size_t m = pat->len, i = 0;
+    const __m256i f1 = _mm256_set1_epi8((char)pat->first_lo), f2 = _mm256_set1_epi8((char)pat->first_hi);
+    const __m256i l1 = _mm256_set1_epi8((char)pat->last_lo), l2 = _mm256_set1_epi8((char)pat->last_hi);
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(hay + i + m - 1));
+        __m256i hit = _mm256_and_si256(_mm256_or_si256(_mm256_cmpeq_epi8(a, f1), _mm256_cmpeq_epi8(a, f2)),
+                                       _mm256_or_si256(_mm256_cmpeq_epi8(b, l1), _mm256_cmpeq_epi8(b, l2)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(hit);
+        while (mask) {
+            size_t at = i + __builtin_ctz(mask);
+            if (findstr_equal(hay + at, pat)) return hay + at;
+            mask &= mask - 1;
+        }
+    }
+    return findstr_sse2(hay + i, n - i, pat);
+}
+#else
+const char* findstr_sse2(const char* hay, size_t n, const struct findstr_pat* pat) { return findstr_scalar(hay, n, pat); }
+const char* findstr_avx2(const char* hay, size_t n, const struct findstr_pat* pat) { return findstr_scalar(hay, n, pat); }
+#endif
+
+findstr_kernel_fn findstr_select_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return findstr_avx2;
+    if (__builtin_cpu_supports("sse2")) return findstr_sse2;
+#endif
+    return findstr_scalar;
+}
+
+void findstr_emit(char** out, size_t* len, size_t* cap, const char* name, long long lineno, const char* line, size_t n, int flags) {
+    char num[24];
+    if (flags & FINDSTR_SHOW_NAMES) {
+        str_append(out, len, cap, name, strlen(name));
+        str_append(out, len, cap, flags & FINDSTR_NAMES_ONLY ? "\n" : ":", 1);
+        if (flags & FINDSTR_NAMES_ONLY) return;
+    } else if (flags & FINDSTR_NAMES_ONLY) {
+        str_append(out, len, cap, name, strlen(name));
+        str_append(out, len, cap, "\n", 1);
+        return;
+    }
+    if (flags & FINDSTR_LINE_NUMBERS) {
+        int k = snprintf(num, sizeof(num), "%lld:", lineno);
+        str_append(out, len, cap, num, k);
+    }
+    str_append(out, len, cap, line, n);
+    str_append(out, len, cap, "\n", 1);
+}
+
+void findstr_flush(struct findstr_job* job, char** out, size_t* len) {
+    if (*len == 0) return;
+    pthread_mutex_lock(&job->out_lock);
+    write_all(STDOUT_FILENO, *out, *len);
+    pthread_mutex_unlock(&job->out_lock);
+    *len = 0;
+}
+
+// Scans one buffer, whose first line is number lineno, and appends the
+// output to *out, flushing whole lines when it grows past OUT_BUF_SIZE.
+// Returns the number of lines selected.
+long long findstr_scan(struct findstr_job* job, const char* name, const char* buf, size_t n, long long lineno, char** out, size_t* olen, size_t* ocap) {
+    const char** next = malloc(job->npats * sizeof(*next));
+    const char* pos = buf;
+    const char* end = buf + n;
+    long long selected = 0;
+    int flags = job->flags;
+    if (!next) return 0;
+    for (int i = 0; i < job->npats; i++) next[i] = job->find(buf, n, &job->pats[i]);
+
+    while (pos < end) {
+        // Earliest match at or after pos, over all patterns.
+        const char* m = end;
+        for (int i = 0; i < job->npats; i++) {
+            if (next[i] && next[i] < pos) next[i] = job->find(pos, end - pos, &job->pats[i]);
+            if (next[i] && next[i] < m) m = next[i];
+        }
+
+        const char* ls = pos;
+        const char* le;
+        if (flags & FINDSTR_INVERT) {
+            le = memchr(pos, '\n', end - pos);
+            if (!le) le = end;
+            if (m >= le) {
+                selected++;
+                findstr_emit(out, olen, ocap, name, lineno, ls, le - ls, flags);
+            }
+        } else {
+            if (m == end) break;
+            const char* nl = memrchr(pos, '\n', m - pos);
+            if (nl) ls = nl + 1;
+            if (flags & FINDSTR_LINE_NUMBERS) {
+                for (const char* c = pos; c < ls && (c = memchr(c, '\n', ls - c)) != NULL; c++) lineno++;
+            }
+            le = memchr(m, '\n', end - m);
+            if (!le) le = end;
+            selected++;
+            findstr_emit(out, olen, ocap, name, lineno, ls, le - ls, flags);
+        }
+        if (selected > 0 && (flags & FINDSTR_NAMES_ONLY)) break;
+        if (*olen >= OUT_BUF_SIZE) findstr_flush(job, out, olen);
+        pos = le + 1;
+        lineno++;
+    }
+    free(next);
+    return selected;
+}
+
+void findstr_file(struct findstr_job* job, const char* path) {
+    char name[PATH_MAX_LEN];
+    char* out = NULL;
+    size_t olen = 0, ocap = 0;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "findstr: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "findstr: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    format_path_for_dos(strncmp(path, "./", 2) == 0 ? path + 2 : path, name);
+
+    if (findstr_scan(job, name, map, st.st_size, 1, &out, &olen, &ocap) > 0) {
+        __atomic_add_fetch(&job->matched_files, 1, __ATOMIC_RELAXED);
+    }
+    findstr_flush(job, &out, &olen);
+    free(out);
+    munmap(map, st.st_size);
+}
+
+struct findstr_task* findstr_task_new(struct findstr_job* job, const char* path, const struct wildcard* pattern, int is_dir) {
+    size_t len = strlen(path);
+    struct findstr_task* t = malloc(sizeof(*t) + len + 1);
+    if (!t) return NULL;
+    t->base.run = findstr_task_run;
+    t->job = job;
+    t->pattern = pattern;
+    t->is_dir = is_dir;
+    memcpy(t->path, path, len + 1);
+    return t;
+}
+
+// A file task scans its file. A directory task queues the entries matching
+// its wildcard, and with /S every subdirectory as another directory task.
+void findstr_task_run(struct task_pool* pool, struct task* base, int worker) {
+    struct findstr_task* t = (struct findstr_task*)base;
+    if (!t->is_dir) {
+        findstr_file(t->job, t->path);
+        free(t);
+        return;
+    }
+
+    DIR* dir = opendir(t->path);
+    if (!dir) {
+        fprintf(stderr, "findstr: %s: %s\n", t->path, strerror(errno));
+        free(t);
+        return;
+    }
+    struct dirent* entry;
+    char child[PATH_MAX_LEN];
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat est;
+            is_dir = fstatat(dirfd(dir), entry->d_name, &est, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(est.st_mode);
+        }
+        if (!is_dir && !wildcard_match(t->pattern, entry->d_name)) continue;
+        if (is_dir && !(t->job->flags & FINDSTR_RECURSIVE)) continue;
+        if (snprintf(child, sizeof(child), "%s/%s", t->path, entry->d_name) >= (int)sizeof(child)) continue;
+        struct findstr_task* c = findstr_task_new(t->job, child, t->pattern, is_dir);
+        if (c) task_pool_push(pool, worker, &c->base);
+    }
+    closedir(dir);
+    free(t);
+}
+
+// The first task: queues one task per file argument. A wildcard (or /S)
+// turns the argument into a directory task over its directory part.
+void findstr_seed_run(struct task_pool* pool, struct task* base, int worker) {
+    struct findstr_seed* seed = (struct findstr_seed*)base;
+    for (int j = 0; j < seed->nargs; j++) {
+        char dir[PATH_MAX_LEN];
+        char buf[PATH_MAX_LEN];
+        const char* arg = resolve_path(seed->args[j], buf, sizeof(buf));
+        const char* slash = strrchr(arg, '/');
+        const char* name = slash ? slash + 1 : arg;
+        struct findstr_task* t;
+        if (!(seed->job->flags & FINDSTR_RECURSIVE) && !has_wildcards(name)) {
+            t = findstr_task_new(seed->job, arg, NULL, 0);
+        } else {
+            if (wildcard_split(arg, dir, sizeof(dir), &seed->patterns[j]) < 0) {
+                fprintf(stderr, "findstr: %s: %s\n", seed->args[j], strerror(errno));
+                continue;
+            }
+            t = findstr_task_new(seed->job, dir, &seed->patterns[j], 1);
+        }
+        if (t) task_pool_push(pool, worker, &t->base);
+    }
+}
+
+int findstr_add_pattern(struct findstr_job* job, const char* text, size_t len) {
+    if (len == 0) return 0;
+    struct findstr_pat* grown = realloc(job->pats, (job->npats + 1) * sizeof(*grown));
+    if (!grown) return -1;
+    job->pats = grown;
+    struct findstr_pat* p = &job->pats[job->npats];
+    if (!(p->text = strndup(text, len))) return -1;
+    p->len = len;
+    p->fold = 0;
+    if (job->flags & FINDSTR_IGNORE_CASE) {
+        for (size_t i = 0; i < len; i++) {
+            p->text[i] = tolower((unsigned char)p->text[i]);
+            if (toupper((unsigned char)p->text[i]) != (unsigned char)p->text[i]) p->fold = 1;
+        }
+    }
+    unsigned char f = p->text[0], l = p->text[len - 1];
+    int fold = p->fold;
+    p->first_lo = f;
+    p->first_hi = fold ? toupper(f) : f;
+    p->last_lo = l;
+    p->last_hi = fold ? toupper(l) : l;
+    job->npats++;
+    return 0;
+}
+
+int builtin_findstr(int argc, char** argv) {
+    struct findstr_job job;
+    const char* words = NULL;
+    const char* sw;
+    int first_file = argc, literal = 0, nfiles;
+
+    memset(&job, 0, sizeof(job));
+    for (int j = 1; j < argc; j++) {
+        if (match_switch(argv[j], "I")) job.flags |= FINDSTR_IGNORE_CASE;
+        else if (match_switch(argv[j], "N")) job.flags |= FINDSTR_LINE_NUMBERS;
+        else if (match_switch(argv[j], "S")) job.flags |= FINDSTR_RECURSIVE;
+        else if (match_switch(argv[j], "M")) job.flags |= FINDSTR_NAMES_ONLY;
+        else if (match_switch(argv[j], "V")) job.flags |= FINDSTR_INVERT;
+        else if ((sw = match_switch(argv[j], "C")) != NULL && *sw) literal = 1;
+        else if (argv[j][0] == '/') { printf("Syntax: FINDSTR [/I] [/N] [/S] [/M] [/V] [/C:text] [\"words\"] [files]\n"); return 1; }
+        else if (!literal && !words) words = argv[j];
+        else { first_file = j; break; }
+    }
+    // Switches are parsed before patterns are folded: /I may come last.
+    for (int j = 1; j < first_file; j++) {
+        if ((sw = match_switch(argv[j], "C")) != NULL && *sw) findstr_add_pattern(&job, sw, strlen(sw));
+    }
+    for (const char* w = words; w && *w;) {
+        w += strspn(w, " \t");
+        size_t n = strcspn(w, " \t");
+        findstr_add_pattern(&job, w, n);
+        w += n;
+    }
+    if (job.npats == 0) {
+        printf("Syntax: FINDSTR [/I] [/N] [/S] [/M] [/V] [/C:text] [\"words\"] [files]\n");
+        free(job.pats);
+        return 1;
+    }
+    job.find = findstr_select_kernel();
+    pthread_mutex_init(&job.out_lock, NULL);
+    nfiles = argc - first_file;
+    fflush(stdout);
+
+    if (nfiles == 0) {
+        // No files: search standard input a chunk at a time. Each read is
+        // scanned up to its last newline and the unfinished line is kept
+        // for the next one; only a line longer than the buffer grows it.
+        size_t len = 0, cap = PIPE_CHUNK_SIZE;
+        char* data = malloc(cap);
+        char* out = NULL;
+        size_t olen = 0, ocap = 0;
+        long long lineno = 1, selected = 0;
+        ssize_t n = 1;
+        if (!data) perror("findstr");
+        while (data && n > 0 && !(selected > 0 && (job.flags & FINDSTR_NAMES_ONLY))) {
+            if (len == cap) {
+                char* grown = realloc(data, cap * 2);
+                if (!grown) {
+                    perror("findstr");
+                    break;
+                }
+                data = grown;
+                cap *= 2;
+            }
+            if ((n = read(STDIN_FILENO, data + len, cap - len)) > 0) len += n;
+            size_t done = len; // at end of input, the last line needs no newline
+            if (n > 0) {
+                const char* nl = memrchr(data, '\n', len);
+                done = nl ? (size_t)(nl + 1 - data) : 0;
+            }
+            if (done == 0) continue;
+            selected += findstr_scan(&job, "(stdin)", data, done, lineno, &out, &olen, &ocap);
+            if (job.flags & FINDSTR_LINE_NUMBERS) {
+                for (const char* c = data; (c = memchr(c, '\n', data + done - c)) != NULL; c++) lineno++;
+            }
+            memmove(data, data + done, len - done);
+            len -= done;
+        }
+        if (n < 0) perror("findstr");
+        if (selected > 0) job.matched_files++;
+        findstr_flush(&job, &out, &olen);
+        free(out);
+        free(data);
+    } else {
+        if (nfiles > 1 || (job.flags & FINDSTR_RECURSIVE) || strpbrk(argv[first_file], "*?")) job.flags |= FINDSTR_SHOW_NAMES;
+        struct findstr_seed seed = { { findstr_seed_run }, &job, argv + first_file, nfiles, calloc(nfiles, sizeof(struct wildcard)) };
+        int nworkers = online_cpus();
+        if (seed.patterns) task_pool_run(nworkers < MAX_WORKERS ? nworkers : MAX_WORKERS, &seed.base);
+        else perror("findstr");
+        free(seed.patterns);
+    }
+
+    pthread_mutex_destroy(&job.out_lock);
+    for (int i = 0; i < job.npats; i++) free(job.pats[i].text);
+    free(job.pats);
+    return job.matched_files > 0 ? 0 : 1;
+}
+
+// --- SORT ---
+// SORT [/R] [/C] [/+n] [/M:size] [/T:dir] [/O:file] [file] sorts lines in
+// at most /M bytes. The input is cut into chunks that fit the budget; each
+// is sorted in memory and spilled as a run to an unnamed (O_TMPFILE) file,
+// and the runs are merged with a heap. On SMP every thread owns one chunk
+// buffer and sorts it while the next thread reads. Input that fits in one
+// chunk never touches the disk.
+
+// The key options live here rather than in every comparison's arguments;
+// they do not change while a sort runs.
+struct sort_options sort_keys;
+
+unsigned char sort_fold[256];
+
+void sort_fold_init() {
+    for (int c = 0; c < 256; c++) {
+        sort_fold[c] = sort_keys.case_sensitive ? (unsigned char)c : (unsigned char)toupper(c);
+    }
+}
+
+void sort_line_init(struct sort_line* l, const char* text, size_t len) {
+    const unsigned char* key = (const unsigned char*)text + (sort_keys.column < len ? sort_keys.column : len);
+    size_t key_len = len - (key - (const unsigned char*)text);
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < 8; i++) prefix = (prefix << 8) | (i < key_len ? sort_fold[key[i]] : 0);
+    l->prefix = prefix;
+    l->text = text;
+    l->len = len;
+}
+
+int sort_compare(const struct sort_line* a, const struct sort_line* b) {
+    int r;
+    if (a->prefix != b->prefix) {
+        r = a->prefix < b->prefix ? -1 : 1;
+    } else {
+        size_t ao = sort_keys.column < a->len ? sort_keys.column : a->len;
+        size_t bo = sort_keys.column < b->len ? sort_keys.column : b->len;
+        const unsigned char* x = (const unsigned char*)a->text + ao;
+        const unsigned char* y = (const unsigned char*)b->text + bo;
+        size_t xn = a->len - ao, yn = b->len - bo, n = xn < yn ? xn : yn;
+        size_t i = n < 8 ? n : 8; // the prefix already matched
+        if (sort_keys.case_sensitive) {
+            r = memcmp(x + i, y + i, n - i);
+        } else {
+            r = 0;
+            for (; i < n && (r = sort_fold[x[i]] - sort_fold[y[i]]) == 0; i++) {}
+        }
+        if (r == 0) r = (xn > yn) - (xn < yn);
+    }
+    return sort_keys.reverse ? -r : r;
+}
+
+void sort_swap(struct sort_line* a, struct sort_line* b) {
+    struct sort_line t = *a;
+    *a = *b;
+    *b = t;
+}
+
+void sort_sift_down(struct sort_line* a, size_t n, size_t i) {
+    for (;;) {
+        size_t l = 2 * i + 1, m = i;
+        if (l < n && sort_compare(&a[l], &a[m]) > 0) m = l;
+        if (l + 1 < n && sort_compare(&a[l + 1], &a[m]) > 0) m = l + 1;
+        if (m == i) return;
+        sort_swap(&a[i], &a[m]);
+        i = m;
+    }
+}
+
+// Sorts a chunk's index in place (introsort: quicksort on a median of
+// three, heapsort once `depth` runs out, insertion sort for short ranges).
+// qsort would allocate a copy of the whole index, outside the /M budget.
+void sort_lines(struct sort_line* a, size_t n, int depth) {
+    while (n > 16) {
+        if (depth-- == 0) {
+            for (size_t i = n / 2; i-- > 0;) sort_sift_down(a, n, i);
+            for (size_t i = n - 1; i > 0; i--) {
+                sort_swap(&a[0], &a[i]);
+                sort_sift_down(a, i, 0);
+            }
+            return;
+        }
+        size_t mid = n / 2, i = 0, j = n;
+        if (sort_compare(&a[mid], &a[0]) < 0) sort_swap(&a[mid], &a[0]);
+        if (sort_compare(&a[n - 1], &a[0]) < 0) sort_swap(&a[n - 1], &a[0]);
+        if (sort_compare(&a[n - 1], &a[mid]) < 0) sort_swap(&a[n - 1], &a[mid]);
+        sort_swap(&a[0], &a[mid]); // the median is the pivot, at a[0]
+        for (;;) {
+            while (++i < n && sort_compare(&a[i], &a[0]) < 0) {}
+            while (sort_compare(&a[--j], &a[0]) > 0) {}
+            if (i >= j) break;
+            sort_swap(&a[i], &a[j]);
+        }
+        sort_swap(&a[0], &a[j]);
+        // Recurse into the smaller side so the stack stays O(log n).
+        if (j < n - j - 1) {
+            sort_lines(a, j, depth);
+            a += j + 1;
+            n -= j + 1;
+        } else {
+            sort_lines(a + j + 1, n - j - 1, depth);
+            n = j;
+        }
+    }
+    for (size_t i = 1; i < n; i++) {
+        for (size_t k = i; k > 0 && sort_compare(&a[k], &a[k - 1]) < 0; k--) sort_swap(&a[k], &a[k - 1]);
+    }
+}
+
+void sort_write(struct sort_writer* w, const char* s, size_t n) {
+    if (w->len + n > SORT_OUT_BUF_SIZE) {
+        if (write_all(w->fd, w->buf, w->len) != 0) w->error = errno;
+        w->len = 0;
+        if (n > SORT_OUT_BUF_SIZE) {
+            if (write_all(w->fd, s, n) != 0) w->error = errno;
+            return;
+        }
+    }
+    memcpy(w->buf + w->len, s, n);
+    w->len += n;
+}
+
+int sort_write_flush(struct sort_writer* w) {
+    if (w->len > 0 && write_all(w->fd, w->buf, w->len) != 0) w->error = errno;
+    w->len = 0;
+    if (w->error) errno = w->error;
+    return w->error ? -1 : 0;
+}
+
+int sort_write_lines(int fd, const struct sort_line* lines, size_t n) {
+    struct sort_writer w = { fd, malloc(SORT_OUT_BUF_SIZE), 0, 0 };
+    if (!w.buf) return -1;
+    for (size_t i = 0; i < n; i++) {
+        sort_write(&w, lines[i].text, lines[i].len);
+        sort_write(&w, "\n", 1);
+    }
+    int rc = sort_write_flush(&w);
+    free(w.buf);
+    return rc;
+}
+
+// An unnamed file in the temp directory; it disappears with its last fd.
+int sort_temp_file(const char* dir) {
+    char path[PATH_MAX_LEN];
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) return fd;
+    snprintf(path, sizeof(path), "%s/sortXXXXXX", dir); // no O_TMPFILE here
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd >= 0) unlink(path);
+    return fd;
+}
+
+// Where a chunk's line index starts: right after its text, in the same buffer.
+struct sort_line* sort_chunk_index(char* buf, size_t len) {
+    return (struct sort_line*)(buf + ((len + 15) & ~(size_t)15));
+}
+
+// Fills buf with the next chunk: the carried-over partial line, then input
+// for as long as the text and its line index are sure to fit in *cap bytes
+// together. Called with the job lock held. Returns the chunk length; *lines
+// gets its line count.
+size_t sort_read_chunk(struct sort_job* job, char** buf, size_t* cap, size_t* lines) {
+    size_t len = 0, nl = 0;
+    size_t need = job->carry_len + 16 + sizeof(struct sort_line);
+    if (need > *cap) {
+        char* grown = realloc(*buf, need * 2);
+        if (!grown) { job->error = ENOMEM; return 0; }
+        *buf = grown;
+        *cap = need * 2;
+    }
+    if (job->carry_len > 0) memcpy(*buf, job->carry, job->carry_len);
+    len = job->carry_len;
+    job->carry_len = 0;
+
+    while (!job->eof) {
+        // Worst case every byte read is a newline: each needs an index slot.
+        size_t used = len + 16 + (nl + 1) * sizeof(struct sort_line);
+        size_t room = used < *cap ? (*cap - used) / (1 + sizeof(struct sort_line)) : 0;
+        if (room > SORT_READ_CHUNK) room = SORT_READ_CHUNK;
+        if (room < 4096) {
+            if (nl > 0) break;
+            // One line longer than the chunk: it has to fit, budget or not.
+            char* grown = realloc(*buf, *cap * 2);
+            if (!grown) { job->error = ENOMEM; break; }
+            *buf = grown;
+            *cap *= 2;
+            continue;
+        }
+        ssize_t n = read(job->in_fd, *buf + len, room);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n < 0) job->error = errno;
+            job->eof = 1;
+            break;
+        }
+        for (char* p = *buf + len; (p = memchr(p, '\n', *buf + len + n - p)) != NULL; p++) nl++;
+        len += n;
+    }
+
+    // Keep whole lines; the tail waits for the next chunk.
+    if (!job->eof) {
+        char* last = memrchr(*buf, '\n', len);
+        size_t keep = last ? (size_t)(last - *buf) + 1 : 0;
+        size_t tail = len - keep;
+        if (tail > job->carry_cap) {
+            char* grown = realloc(job->carry, tail);
+            if (!grown) { job->error = ENOMEM; return 0; }
+            job->carry = grown;
+            job->carry_cap = tail;
+        }
+        memcpy(job->carry, *buf + keep, tail);
+        job->carry_len = tail;
+        len = keep;
+    } else if (len > 0 && (*buf)[len - 1] != '\n') {
+        nl++; // a last line without a newline
+    }
+    *lines = nl;
+    return len;
+}
+
+void* sort_run_worker(void* arg) {
+    struct sort_job* job = arg;
+    size_t cap = job->chunk_size;
+    char* buf = malloc(cap);
+    if (!buf) { job->error = ENOMEM; return NULL; }
+
+    for (;;) {
+        size_t nl;
+        pthread_mutex_lock(&job->lock);
+        if ((job->eof && job->carry_len == 0) || job->error) { pthread_mutex_unlock(&job->lock); break; }
+        int seq = job->chunks++;
+        size_t len = sort_read_chunk(job, &buf, &cap, &nl);
+        int last = job->eof && job->carry_len == 0;
+        pthread_mutex_unlock(&job->lock);
+        if (len == 0) continue;
+
+        struct sort_line* lines = sort_chunk_index(buf, len);
+        size_t n = 0;
+        for (char* p = buf; p < buf + len;) {
+            char* end = memchr(p, '\n', buf + len - p);
+            if (!end) end = buf + len;
+            sort_line_init(&lines[n++], p, end - p);
+            p = end + 1;
+        }
+        int depth = 0;
+        for (size_t m = n; m > 1; m >>= 1) depth += 2;
+        sort_lines(lines, n, depth);
+
+        // The only chunk there will ever be goes straight to the output.
+        int fd = (seq == 0 && last) ? job->out_fd : sort_temp_file(job->opts->temp_dir);
+        if (fd < 0 || sort_write_lines(fd, lines, n) != 0) {
+            fprintf(stderr, "sort: %s: %s\n", fd == job->out_fd ? "output" : job->opts->temp_dir, strerror(errno));
+            job->error = errno ? errno : EIO;
+            if (fd >= 0 && fd != job->out_fd) close(fd);
+            break;
+        }
+        if (fd == job->out_fd) continue;
+        pthread_mutex_lock(&job->lock);
+        if (job->nruns == job->runs_cap) {
+            int ncap = job->runs_cap ? job->runs_cap * 2 : 16;
+            int* grown = realloc(job->runs, ncap * sizeof(*grown));
+            if (grown) { job->runs = grown; job->runs_cap = ncap; }
+        }
+        if (job->nruns < job->runs_cap) job->runs[job->nruns++] = fd;
+        else { close(fd); job->error = ENOMEM; }
+        pthread_mutex_unlock(&job->lock);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Moves a run to its next line. Returns 0 at the end of the run.
+int sort_run_next(struct sort_run* r) {
+    for (;;) {
+        char* nl = r->pos < r->len ? memchr(r->buf + r->pos, '\n', r->len - r->pos) : NULL;
+        if (nl) {
+            sort_line_init(&r->line, r->buf + r->pos, nl - (r->buf + r->pos));
+            r->pos = nl - r->buf + 1;
+            return 1;
+        }
+        if (r->eof) return 0; // runs always end in a newline
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+        if (r->len == r->cap) {
+            char* grown = realloc(r->buf, r->cap * 2);
+            if (!grown) return 0;
+            r->buf = grown;
+            r->cap *= 2;
+        }
+        ssize_t n = read(r->fd, r->buf + r->len, r->cap - r->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) r->eof = 1;
+        else r->len += n;
+    }
+}
+
+void sort_heap_down(struct sort_run** heap, int n, int i) {
+    for (;;) {
+        int l = 2 * i + 1, m = i;
+        if (l < n && sort_compare(&heap[l]->line, &heap[m]->line) < 0) m = l;
+        if (l + 1 < n && sort_compare(&heap[l + 1]->line, &heap[m]->line) < 0) m = l + 1;
+        if (m == i) return;
+        struct sort_run* t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+// Merges runs fds[0..n) into out_fd with a binary heap, closing the runs.
+int sort_merge(int* fds, int n, int out_fd, size_t buf_size) {
+    struct sort_run* runs = calloc(n, sizeof(*runs));
+    struct sort_run** heap = calloc(n, sizeof(*heap));
+    struct sort_writer w = { out_fd, malloc(SORT_OUT_BUF_SIZE), 0, 0 };
+    int live = 0, rc = -1;
+    if (!runs || !heap || !w.buf) goto done;
+
+    for (int i = 0; i < n; i++) {
+        runs[i].fd = fds[i];
+        runs[i].cap = buf_size;
+        if (!(runs[i].buf = malloc(buf_size))) goto done;
+        if (lseek(fds[i], 0, SEEK_SET) != 0) goto done;
+        if (sort_run_next(&runs[i])) heap[live++] = &runs[i];
+    }
+    for (int i = live / 2 - 1; i >= 0; i--) sort_heap_down(heap, live, i);
+    while (live > 0) {
+        struct sort_run* r = heap[0];
+        sort_write(&w, r->line.text, r->line.len);
+        sort_write(&w, "\n", 1);
+        if (!sort_run_next(r)) heap[0] = heap[--live];
+        sort_heap_down(heap, live, 0);
+    }
+    rc = sort_write_flush(&w);
+
+done:
+    if (rc != 0 && errno == 0) errno = ENOMEM;
+    for (int i = 0; i < n; i++) {
+        if (runs) free(runs[i].buf);
+        close(fds[i]);
+    }
+    free(runs);
+    free(heap);
+    free(w.buf);
+    return rc;
+}
+
+// Sorts in_fd into out_fd within opts->memory bytes. Returns 0 or -1.
+int sort_file(int in_fd, int out_fd, const struct sort_options* opts, int nworkers) {
+    struct sort_job job;
+    pthread_t threads[MAX_WORKERS];
+    memset(&job, 0, sizeof(job));
+    job.opts = opts;
+    job.in_fd = in_fd;
+    job.out_fd = out_fd;
+    // Every thread holds one chunk; keep each at least a few MB.
+    while (nworkers > 1 && opts->memory / nworkers < 4 * SORT_MIN_MEMORY) nworkers--;
+    job.chunk_size = opts->memory / nworkers;
+    pthread_mutex_init(&job.lock, NULL);
+
+    int started = 1;
+    for (int i = 1; i < nworkers; i++) {
+        if (pthread_create(&threads[i], NULL, sort_run_worker, &job) != 0) break;
+        started++;
+    }
+    sort_run_worker(&job);
+    for (int i = 1; i < started; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&job.lock);
+    free(job.carry);
+
+    int rc = 0;
+    if (job.error) {
+        fprintf(stderr, "sort: %s\n", strerror(job.error));
+        rc = -1;
+    }
+
+    // Merge passes: at most `fan_in` runs at a time, each with its own
+    // read buffer, until one pass can write the output.
+    int fan_in = (int)(opts->memory / (2 * SORT_RUN_BUF_SIZE));
+    if (fan_in < 2) fan_in = 2;
+    int first = 0;
+    while (rc == 0 && job.nruns - first > 0) {
+        int n = job.nruns - first;
+        int final = n <= fan_in;
+        if (!final) n = fan_in;
+        int fd = final ? out_fd : sort_temp_file(opts->temp_dir);
+        if (fd < 0 || sort_merge(job.runs + first, n, fd, (size_t)(opts->memory / (n + 1)) < SORT_RUN_BUF_SIZE ?
+                                 SORT_RUN_BUF_SIZE : (size_t)(opts->memory / (n + 1))) != 0) {
+            fprintf(stderr, "sort: %s\n", strerror(errno));
+            if (fd >= 0 && fd != out_fd) close(fd);
+            first += fd < 0 ? 0 : n;
+            rc = -1;
+            break;
+        }
+        first += n;
+        if (final) break;
+        job.runs[--first] = fd; // the merged run takes the last merged slot
+    }
+    for (int i = first; i < job.nruns; i++) close(job.runs[i]);
+    free(job.runs);
+    return rc;
+}
+
+// "/M:64M": bytes with an optional K, M or G suffix; a bare number is in
+// kilobytes, as in DOS. Returns -1 if it is not a size.
+long long parse_size(const char* s) {
+    char* end;
+    long long n = strtoll(s, &end, 10);
+    if (end == s || n < 0) return -1;
+    switch (toupper((unsigned char)*end)) {
+    case '\0': return n << 10;
+    case 'K': n <<= 10; break;
+    case 'M': n <<= 20; break;
+    case 'G': n <<= 30; break;
+    case 'B': break;
+    default: return -1;
+    }
+    return (end[1] == '\0' || ((end[1] == 'B' || end[1] == 'b') && end[2] == '\0')) ? n : -1;
+}
+
+int builtin_sort(int argc, char** argv) {
+    struct sort_options opts = { 0, 0, 0, SORT_DEFAULT_MEMORY, NULL };
+    const char* input = NULL;
+    const char* output = NULL;
+    const char* sw;
+    for (int j = 1; j < argc; j++) {
+        // Unix-style options belong to the sort in PATH.
+        if (argv[j][0] == '-' && argv[j][1]) return run_external(argv);
+    }
+    for (int j = 1; j < argc; j++) {
+        if (match_switch(argv[j], "R")) opts.reverse = 1;
+        else if (match_switch(argv[j], "C")) opts.case_sensitive = 1;
+        else if ((sw = match_switch(argv[j], "M")) != NULL && (opts.memory = parse_size(sw)) >= 0) {}
+        else if ((sw = match_switch(argv[j], "T")) != NULL && *sw) opts.temp_dir = sw;
+        else if ((sw = match_switch(argv[j], "O")) != NULL && *sw) output = sw;
+        else if (argv[j][0] == '/' && argv[j][1] == '+' && isdigit((unsigned char)argv[j][2])) {
+            long col = atol(argv[j] + 2);
+            opts.column = col > 1 ? (size_t)(col - 1) : 0;
+        } else if (!input && argv[j][0] != '/') input = argv[j];
+        else if (!input && access(argv[j], F_OK) == 0) input = argv[j]; // an absolute path
+        else {
+            printf("Syntax: sort [/R] [/C] [/+n] [/M:size] [/T:dir] [/O:file] [file]\n");
+            return 1;
+        }
+    }
+    if (opts.memory < SORT_MIN_MEMORY) opts.memory = SORT_MIN_MEMORY;
+    if (!opts.temp_dir) opts.temp_dir = getenv("TMP") ? getenv("TMP") : "/tmp";
+
+    int in_fd = STDIN_FILENO, out_fd = STDOUT_FILENO;
+    if (input && (in_fd = open(input, O_RDONLY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "sort: %s: %s\n", input, strerror(errno));
+        return 1;
+    }
+    if (output) {
+        // Written to a temp name first, so /O may name the input file.
+        char tmp[PATH_MAX_LEN];
+        snprintf(tmp, sizeof(tmp), "%s.sort-tmp", output);
+        if ((out_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+            fprintf(stderr, "sort: %s: %s\n", output, strerror(errno));
+            if (in_fd != STDIN_FILENO) close(in_fd);
+            return 1;
+        }
+    }
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    sort_keys = opts;
+    sort_fold_init();
+    fflush(stdout);
+    int nworkers = online_cpus();
+    int rc = sort_file(in_fd, out_fd, &opts, nworkers < MAX_WORKERS ? nworkers : MAX_WORKERS);
+
+    if (in_fd != STDIN_FILENO) close(in_fd);
+    if (output) {
+        char tmp[PATH_MAX_LEN];
+        snprintf(tmp, sizeof(tmp), "%s.sort-tmp", output);
+        if (close(out_fd) != 0 && rc == 0) { fprintf(stderr, "sort: %s: %s\n", output, strerror(errno)); rc = -1; }
+        if (rc == 0 && rename(tmp, output) != 0) { fprintf(stderr, "sort: %s: %s\n", output, strerror(errno)); rc = -1; }
+        if (rc != 0) unlink(tmp);
+    }
+    return rc == 0 ? 0 : 1;
+}
+
+// --- DEDUP ---
+// Files are grouped by size, then by a hash of their first and last 4 KiB,
+// then by a hash of their whole content; every pass only reads files that
+// still share a group with another inode, so most unique files are never
+// opened. The hash is built like XXH3: eight 64-bit lanes take a 64-byte
+// stripe at a time (key xor'ed in, 32x32-bit multiply, data added to the
+// neighbouring lane), which maps onto SSE2/AVX2 multiplies, and the lanes are
+// scrambled every 1 KiB and folded together at the end. It only has to agree
+// with itself within one run: duplicates are byte-compared before /L or /R
+// replace anything.
+
+uint64_t dedup_secret[DEDUP_SECRET_WORDS];
+dedup_accumulate_fn dedup_accumulate;
+
+void dedup_hash_init() {
+    uint64_t x = DEDUP_PRIME64_1;
+    for (int i = 0; i < DEDUP_SECRET_WORDS; i++) { // splitmix64
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        dedup_secret[i] = z ^ (z >> 31);
+    }
+    dedup_accumulate = dedup_select_kernel();
+}
+
+// Stripe s uses key words s..s+7, so a block reads key[0..DEDUP_BLOCK_STRIPES+7).
+void dedup_accumulate_scalar(uint64_t* acc, const unsigned char* p, size_t stripes, const uint64_t* key) {
+    for (size_t s = 0; s < stripes; s++, p += DEDUP_STRIPE) {
+        for (int i = 0; i < 8; i++) {
+            uint64_t v, k;
+            memcpy(&v, p + 8 * i, 8);
+            k = v ^ key[s + i];
+            acc[i ^ 1] += v;
+            acc[i] += (k & 0xFFFFFFFFULL) * (k >> 32);
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void dedup_accumulate_sse2(uint64_t* acc, const unsigned char* p, size_t stripes, const uint64_t* key) {
+    __m128i a[4];
+    for (int i = 0; i < 4; i++) a[i] = _mm_loadu_si128((const __m128i*)(acc + 2 * i));
+    for (size_t s = 0; s < stripes; s++, p += DEDUP_STRIPE) {
+        for (int i = 0; i < 4; i++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(p + 16 * i));
+            __m128i k = _mm_xor_si128(v, _mm_loadu_si128((const __m128i*)(key + s + 2 * i)));
+            __m128i prod = _mm_mul_epu32(k, _mm_srli_epi64(k, 32));
+            a[i] = _mm_add_epi64(a[i], _mm_add_epi64(prod, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2))));
+        }
+    }
+    for (int i = 0; i < 4; i++) _mm_storeu_si128((__m128i*)(acc + 2 * i), a[i]);
+}
+
+__attribute__((target("avx2")))
+void dedup_accumulate_avx2(uint64_t* acc, const unsigned char* p, size_t stripes, const uint64_t* key) {
+    __m256i a[2];
+    for (int i = 0; i < 2; i++) a[i] = _mm256_loadu_si256((const __m256i*)(acc + 4 * i));
+    for (size_t s = 0; s < stripes; s++, p += DEDUP_STRIPE) {
+        for (int i = 0; i < 2; i++) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(p + 32 * i));
+            __m256i k = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i*)(key + s + 4 * i)));
+            __m256i prod = _mm256_mul_epu32(k, _mm256_srli_epi64(k, 32));
+            a[i] = _mm256_add_epi64(a[i], _mm256_add_epi64(prod, _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2))));
+        }
+    }
+    for (int i = 0; i < 2; i++) _mm256_storeu_si256((__m256i*)(acc + 4 * i), a[i]);
+}
+#else
+void dedup_accumulate_sse2(uint64_t* acc, const unsigned char* p, size_t stripes, const uint64_t* key) { dedup_accumulate_scalar(acc, p, stripes, key); }
+void dedup_accumulate_avx2(uint64_t* acc, const unsigned char* p, size_t stripes, const uint64_t* key) { dedup_accumulate_scalar(acc, p, stripes, key); }
+#endif
+
+dedup_accumulate_fn dedup_select_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return dedup_accumulate_avx2;
+    if (__builtin_cpu_supports("sse2")) return dedup_accumulate_sse2;
+#endif
+    return dedup_accumulate_scalar;
+}
+
+void dedup_scramble(uint64_t* acc, const uint64_t* key) {
+    for (int i = 0; i < 8; i++) {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= key[i];
+        acc[i] *= DEDUP_PRIME32_1;
+    }
+}
+
+uint64_t dedup_mix(uint64_t a, uint64_t b) {
+    unsigned __int128 m = (unsigned __int128)a * b;
+    return (uint64_t)m ^ (uint64_t)(m >> 64);
+}
+
+// Hashes n bytes at p; `total` is the size of the file they came from.
+uint64_t dedup_hash(const unsigned char* p, size_t n, uint64_t total) {
+    uint64_t acc[8] = { DEDUP_PRIME32_3, DEDUP_PRIME64_1, DEDUP_PRIME64_2, DEDUP_PRIME64_3,
+                        DEDUP_PRIME64_4, DEDUP_PRIME32_2, DEDUP_PRIME64_5, DEDUP_PRIME32_1 };
+    const size_t block = DEDUP_STRIPE * DEDUP_BLOCK_STRIPES;
+    for (; n >= block; p += block, n -= block) {
+        dedup_accumulate(acc, p, DEDUP_BLOCK_STRIPES, dedup_secret);
+        dedup_scramble(acc, dedup_secret + DEDUP_BLOCK_STRIPES);
+    }
+    size_t stripes = n / DEDUP_STRIPE;
+    dedup_accumulate(acc, p, stripes, dedup_secret);
+    p += stripes * DEDUP_STRIPE;
+    n -= stripes * DEDUP_STRIPE;
+    if (n > 0) {
+        unsigned char last[DEDUP_STRIPE];
+        memset(last, 0, sizeof(last));
+        memcpy(last, p, n);
+        dedup_accumulate(acc, last, 1, dedup_secret + 1);
+    }
+
+    uint64_t h = total * DEDUP_PRIME64_1;
+    for (int i = 0; i < 4; i++) {
+        h += dedup_mix(acc[2 * i] ^ dedup_secret[24 + 2 * i], acc[2 * i + 1] ^ dedup_secret[25 + 2 * i]);
+    }
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+
+int pread_full(int fd, char* buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO; // truncated under us
+            return -1;
+        }
+        buf += n; len -= n; off += n;
+    }
+    return 0;
+}
+
+// Sample pass (full == 0): files up to 2 * DEDUP_SAMPLE are hashed whole,
+// larger ones by their two ends. Full pass: the whole of a larger file.
+int dedup_hash_file(struct dedup_job* job, struct dedup_file* f, int full) {
+    struct stat st;
+    int rc = -1;
+    int fd = open(f->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) goto out;
+    if (st.st_size != f->size || st.st_ino != f->ino) { errno = EAGAIN; goto out; } // replaced since the walk
+
+    if (!full) {
+        char buf[2 * DEDUP_SAMPLE];
+        size_t n = f->size <= 2 * DEDUP_SAMPLE ? (size_t)f->size : 2 * DEDUP_SAMPLE;
+        if (n == (size_t)f->size) {
+            if (pread_full(fd, buf, n, 0) != 0) goto out;
+        } else if (pread_full(fd, buf, DEDUP_SAMPLE, 0) != 0 ||
+                   pread_full(fd, buf + DEDUP_SAMPLE, DEDUP_SAMPLE, f->size - DEDUP_SAMPLE) != 0) {
+            goto out;
+        }
+        f->hash = dedup_hash((const unsigned char*)buf, n, f->size);
+        __atomic_add_fetch(&job->bytes_read, n, __ATOMIC_RELAXED);
+    } else {
+        void* map = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) goto out;
+        madvise(map, f->size, MADV_SEQUENTIAL);
+        f->hash = dedup_hash(map, f->size, f->size);
+        munmap(map, f->size);
+        __atomic_add_fetch(&job->bytes_read, f->size, __ATOMIC_RELAXED);
+    }
+    rc = 0;
+out:
+    if (rc != 0) {
+        fprintf(stderr, "dedup: %s: %s\n", f->path, errno == EAGAIN ? "changed during the scan" : strerror(errno));
+        __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+        f->skip = 1;
+    }
+    if (fd >= 0) close(fd);
+    return rc;
+}
+
+void dedup_task_run(struct task_pool* pool, struct task* base, int worker) {
+    struct dedup_task* t = (struct dedup_task*)base;
+    (void)pool; (void)worker;
+    dedup_hash_file(t->job, t->file, t->full);
+}
+
+void dedup_seed_run(struct task_pool* pool, struct task* base, int worker) {
+    struct dedup_seed* seed = (struct dedup_seed*)base;
+    for (size_t i = 0; i < seed->count; i++) task_pool_push(pool, worker, &seed->tasks[i].base);
+}
+
+// Hashes the first n files on the pool: all of them in the sample pass, and
+// in the full pass only those the sample did not already cover whole.
+void dedup_hash_files(struct dedup_job* job, size_t n, int full, int nworkers) {
+    struct dedup_task* tasks = malloc((n ? n : 1) * sizeof(*tasks));
+    struct dedup_seed seed;
+    seed.base.run = dedup_seed_run;
+    seed.tasks = tasks;
+    seed.count = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (full && job->files[i].size <= 2 * DEDUP_SAMPLE) continue;
+        struct dedup_task* t = &tasks[seed.count++];
+        t->base.run = dedup_task_run;
+        t->job = job;
+        t->file = &job->files[i];
+        t->full = full;
+    }
+    if (seed.count > 0) task_pool_run(nworkers, &seed.base);
+    free(tasks);
+}
+
+void dedup_visit_file(struct tree_walk* walk, struct walk_dir* dir, const char* name) {
+    struct dedup_job* job = walk->ctx;
+    struct stat st;
+    if (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        fprintf(stderr, "dedup: %s/%s: %s\n", dir->path, name, strerror(errno));
+        __atomic_add_fetch(&walk->errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) return;
+
+    size_t plen = strlen(dir->path);
+    char* path = malloc(plen + strlen(name) + 2);
+    sprintf(path, "%s%s%s", dir->path, plen > 0 && dir->path[plen - 1] == '/' ? "" : "/", name);
+
+    pthread_mutex_lock(&job->lock);
+    if (job->count == job->cap) {
+        size_t cap = job->cap ? job->cap * 2 : 1024;
+        struct dedup_file* grown = realloc(job->files, cap * sizeof(*grown));
+        if (!grown) {
+            pthread_mutex_unlock(&job->lock);
+            fprintf(stderr, "dedup: %s: %s\n", path, strerror(ENOMEM));
+            __atomic_add_fetch(&walk->errors, 1, __ATOMIC_RELAXED);
+            free(path);
+            return;
+        }
+        job->files = grown;
+        job->cap = cap;
+    }
+    struct dedup_file* f = &job->files[job->count++];
+    f->size = st.st_size;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->mtime = st.st_mtim;
+    f->hash = 0;
+    f->skip = 0;
+    f->path = path;
+    job->bytes += st.st_size;
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Live files first, largest first, then by hash and inode.
+int dedup_file_compare(const void* a, const void* b) {
+    const struct dedup_file* x = a;
+    const struct dedup_file* y = b;
+    if (x->skip != y->skip) return x->skip - y->skip;
+    if (x->size != y->size) return x->size > y->size ? -1 : 1;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+// Sorts the first n files into (size, hash) groups and drops those that can
+// no longer have a duplicate: further names of an inode already in the group
+// (they share its storage) and groups left with a single inode. Returns the
+// number of live files, which are sorted to the front.
+size_t dedup_prune(struct dedup_job* job, size_t n) {
+    struct dedup_file* files = job->files;
+    if (n > 1) qsort(files, n, sizeof(*files), dedup_file_compare);
+    size_t i = 0;
+    while (i < n && !files[i].skip) {
+        size_t j = i + 1, inodes = 1;
+        for (; j < n && !files[j].skip && files[j].size == files[i].size && files[j].hash == files[i].hash; j++) {
+            if (files[j].dev == files[j - 1].dev && files[j].ino == files[j - 1].ino) files[j].skip = 1;
+            else inodes++;
+        }
+        if (inodes < 2) {
+            for (size_t k = i; k < j; k++) files[k].skip = 1;
+        }
+        i = j;
+    }
+    if (n > 1) qsort(files, n, sizeof(*files), dedup_file_compare);
+    size_t live = 0;
+    while (live < n && !files[live].skip) live++;
+    return live;
+}
+
+// 1 if both files are unchanged since the walk and byte-for-byte equal, 0 if
+// not, -1 on an error (errno set).
+int dedup_same_content(const struct dedup_file* a, const struct dedup_file* b) {
+    const struct dedup_file* f[2] = { a, b };
+    int fd[2] = { -1, -1 };
+    void* map[2] = { MAP_FAILED, MAP_FAILED };
+    int rc = -1;
+    for (int i = 0; i < 2; i++) {
+        struct stat st;
+        fd[i] = open(f[i]->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd[i] < 0 || fstat(fd[i], &st) != 0) goto out;
+        if (st.st_ino != f[i]->ino || st.st_size != f[i]->size ||
+            st.st_mtim.tv_sec != f[i]->mtime.tv_sec || st.st_mtim.tv_nsec != f[i]->mtime.tv_nsec) {
+            rc = 0;
+            goto out;
+        }
+        map[i] = mmap(NULL, a->size, PROT_READ, MAP_PRIVATE, fd[i], 0);
+        if (map[i] == MAP_FAILED) goto out;
+        madvise(map[i], a->size, MADV_SEQUENTIAL);
+    }
+    rc = memcmp(map[0], map[1], a->size) == 0;
+out:
+    for (int i = 0; i < 2; i++) {
+        if (map[i] != MAP_FAILED) munmap(map[i], a->size);
+        if (fd[i] >= 0) close(fd[i]);
+    }
+    return rc;
+}
+
+// Replaces dup with a hard link to keep (/L) or a reflinked copy of it (/R).
+// The new name is made beside dup and renamed over it, so dup never goes
+// missing. A hard link takes keep's owner, mode and date; a reflink keeps
+// dup's. Returns 0, or -1 with errno set.
+int dedup_replace(const struct dedup_file* keep, const struct dedup_file* dup, int flags) {
+    char tmp[PATH_MAX_LEN];
+    const char* slash = strrchr(dup->path, '/');
+    int dlen = slash ? (int)(slash - dup->path + 1) : 0;
+    if (snprintf(tmp, sizeof(tmp), "%.*s.~dedup-%d", dlen, dup->path, (int)getpid()) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if (flags & DEDUP_LINK) {
+        if (link(keep->path, tmp) != 0) return -1;
+    } else {
+        struct stat st;
+        int in_fd = open(keep->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (in_fd < 0) return -1;
+        int out_fd = stat(dup->path, &st) == 0 ? open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600) : -1;
+        if (out_fd < 0) {
+            int err = errno;
+            close(in_fd);
+            errno = err;
+            return -1;
+        }
+        int ok = ioctl(out_fd, FICLONE, in_fd) == 0;
+        int err = errno;
+        if (ok) {
+            struct timespec times[2] = { st.st_atim, st.st_mtim };
+            if (fchown(out_fd, st.st_uid, st.st_gid) != 0) {} // best effort without root
+            fchmod(out_fd, st.st_mode & 07777);
+            futimens(out_fd, times);
+        }
+        close(in_fd);
+        if (close(out_fd) != 0 && ok) { ok = 0; err = errno; }
+        if (!ok) {
+            unlink(tmp);
+            errno = err;
+            return -1;
+        }
+    }
+    if (rename(tmp, dup->path) != 0) {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int builtin_dedup(int argc, char** argv) {
+    struct dedup_job job;
+    struct tree_walk walk;
+    struct wildcard w;
+    struct timespec start;
+    struct stat st;
+    char root_dir[PATH_MAX_LEN];
+    const char* root = NULL;
+    const char* sw;
+    int flags = 0, nworkers = online_cpus();
+
+    for (int j = 1; j < argc; j++) {
+        if (match_switch(argv[j], "L")) flags |= DEDUP_LINK;
+        else if (match_switch(argv[j], "R")) flags |= DEDUP_REFLINK;
+        else if ((sw = match_switch(argv[j], "J")) != NULL) nworkers = *sw ? atoi(sw) : online_cpus();
+        else if (!root && (argv[j][0] != '/' || access(argv[j], F_OK) == 0)) root = argv[j];
+        else flags = -1;
+    }
+    if (flags < 0 || flags == (DEDUP_LINK | DEDUP_REFLINK)) {
+        printf("Syntax: dedup [/L | /R] [/J[:n]] [path]\n");
+        return 1;
+    }
+    if (nworkers < 1) nworkers = 1;
+    if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+
+    memset(&walk, 0, sizeof(walk));
+    walk.cmd = "dedup";
+    walk.physical = 1;
+    walk.visit_file = dedup_visit_file;
+    walk.ctx = &job;
+    // "DEDUP DIR\*.ISO" only looks at *.ISO files, in DIR and below.
+    if (!root) root = ".";
+    int wild = wildcard_split(root, root_dir, sizeof(root_dir), &w);
+    if (wild < 0) { fprintf(stderr, "dedup: %s: %s\n", root, strerror(errno)); return 1; }
+    if (wild > 0) {
+        root = root_dir;
+        if (w.kind != WILD_ALL) walk.filter = &w;
+    }
+    int err = stat(root, &st) != 0 ? errno : S_ISDIR(st.st_mode) ? 0 : ENOTDIR;
+    if (err) { fprintf(stderr, "dedup: %s: %s\n", root, strerror(err)); return 1; }
+
+    memset(&job, 0, sizeof(job));
+    pthread_mutex_init(&job.lock, NULL);
+    dedup_hash_init();
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    tree_walk(&walk, root, -1, nworkers);
+    job.errors += walk.errors;
+    size_t live = dedup_prune(&job, job.count); // same size
+    dedup_hash_files(&job, live, 0, nworkers);
+    live = dedup_prune(&job, live);             // same ends
+    dedup_hash_files(&job, live, 1, nworkers);
+    live = dedup_prune(&job, live);             // same content
+    double secs = elapsed_since(&start);
+
+    long long groups = 0, dups = 0, dup_bytes = 0, replaced = 0;
+    char name[PATH_MAX_LEN];
+    for (size_t i = 0; i < live;) {
+        size_t j = i + 1;
+        while (j < live && job.files[j].size == job.files[i].size && job.files[j].hash == job.files[i].hash) j++;
+        const struct dedup_file* keep = &job.files[i];
+        printf("%lld x %lld bytes:\n", (long long)(j - i), keep->size);
+        format_path_for_dos(strncmp(keep->path, "./", 2) == 0 ? keep->path + 2 : keep->path, name);
+        printf("    %s\n", name);
+        for (size_t k = i + 1; k < j; k++) {
+            const struct dedup_file* dup = &job.files[k];
+            format_path_for_dos(strncmp(dup->path, "./", 2) == 0 ? dup->path + 2 : dup->path, name);
+            printf("    %s\n", name);
+            if (!flags) continue;
+            fflush(stdout);
+            int same = dedup_same_content(keep, dup);
+            if (same <= 0 || dedup_replace(keep, dup, flags) != 0) {
+                fprintf(stderr, "dedup: %s: %s\n", dup->path, same == 0 ? "contents differ or changed, skipped" : strerror(errno));
+                job.errors++;
+            } else {
+                replaced++;
+            }
+        }
+        groups++;
+        dups += j - i - 1;
+        dup_bytes += (long long)(j - i - 1) * keep->size;
+        i = j;
+    }
+
+    printf("%8lld File(s) scanned, %lld bytes; %lld bytes read to compare them in %.2f s.\n",
+           (long long)job.count, job.bytes, job.bytes_read, secs);
+    printf("%8lld duplicate(s) in %lld group(s), %lld bytes.\n", dups, groups, dup_bytes);
+    if (flags) printf("%8lld File(s) replaced by %s.\n", replaced, (flags & DEDUP_LINK) ? "hard links" : "reflinks");
+    if (job.errors > 0) printf("%8lld error(s).\n", job.errors);
+
+    for (size_t i = 0; i < job.count; i++) free(job.files[i].path);
+    free(job.files);
+    pthread_mutex_destroy(&job.lock);
+    return job.errors > 0 ? 1 : 0;
+}
+
+// --- MANIFEST ---
+// MANIFEST /C walks the tree depth-first with every directory's names
+// sorted, so the manifest comes out sorted without ever being held in
+// memory, and MANIFEST /V walks it the same way while reading the manifest
+// alongside: a merge join that finds changed, missing and new entries in
+// one pass. Files are hashed (mmap'd, DEDUP's hash with its fixed key) by
+// worker threads inside a bounded window; output stays in walk order. /Q
+// takes the recorded hash of a file whose size and mtime are unchanged.
+
+// Walk order: byte order, except that '/' sorts before every other byte,
+// so "a", "a/x" and "a-b" come out in the order the walk visits them.
+int mf_path_compare(const char* a, const char* b) {
+    while (*a && *a == *b) { a++; b++; }
+    int x = *a == '/' ? 1 : *a ? (unsigned char)*a + 1 : 0;
+    int y = *b == '/' ? 1 : *b ? (unsigned char)*b + 1 : 0;
+    return x - y;
+}
+
+// Reads the next record, skipping (and counting) malformed lines; sets eof
+// at the end of the file.
+void mf_reader_next(struct mf_reader* r) {
+    ssize_t len;
+    while (!r->eof && (len = getline(&r->line, &r->cap, r->fp)) > 0) {
+        char type;
+        unsigned int mode;
+        long long size, sec;
+        long nsec;
+        unsigned long long hash;
+        int off = 0;
+        r->lineno++;
+        if (r->line[len - 1] == '\n') r->line[--len] = '\0';
+        if (len == 0 || r->line[0] == '#') continue;
+        if (sscanf(r->line, "%c %o %lld %lld.%ld %llx %n", &type, &mode, &size, &sec, &nsec, &hash, &off) != 6 ||
+            off == 0 || r->line[off] == '\0') {
+            fprintf(stderr, "manifest: line %lld: not a manifest record\n", r->lineno);
+            r->errors++;
+            continue;
+        }
+        // Undo the escapes added by mf_write_record(), in place.
+        char* d = r->line + off;
+        r->rec.path = d;
+        for (const char* p = d; *p; p++) {
+            if (*p == '\\' && p[1]) { p++; *d++ = *p == 'n' ? '\n' : *p; }
+            else *d++ = *p;
+        }
+        *d = '\0';
+        r->rec.type = type;
+        r->rec.mode = mode;
+        r->rec.size = size;
+        r->rec.mtime.tv_sec = sec;
+        r->rec.mtime.tv_nsec = nsec;
+        r->rec.hash = hash;
+        return;
+    }
+    r->eof = 1;
+}
+
+// Opens a manifest and reads its first record. Returns 0, or -1 with errno
+// set (EINVAL: not a manifest).
+int mf_reader_open(struct mf_reader* r, const char* path) {
+    memset(r, 0, sizeof(*r));
+    if (!(r->fp = fopen(path, "re"))) return -1;
+    ssize_t len = getline(&r->line, &r->cap, r->fp);
+    if (len <= 0 || strncmp(r->line, MF_MAGIC "\n", len) != 0) {
+        mf_reader_close(r);
+        errno = EINVAL;
+        return -1;
+    }
+    r->lineno = 1;
+    mf_reader_next(r);
+    return 0;
+}
+
+void mf_reader_close(struct mf_reader* r) {
+    if (r->fp) fclose(r->fp);
+    free(r->line);
+    memset(r, 0, sizeof(*r));
+}
+
+// Backslashes and newlines in the path are escaped, so a record is a line.
+void mf_write_record(FILE* out, const struct mf_record* r) {
+    fprintf(out, "%c %04o %lld %lld.%09ld %016llx ", r->type, r->mode, r->size,
+            (long long)r->mtime.tv_sec, r->mtime.tv_nsec, (unsigned long long)r->hash);
+    if (!strpbrk(r->path, "\\\n")) {
+        fputs(r->path, out);
+    } else {
+        for (const char* p = r->path; *p; p++) {
+            if (*p == '\\' || *p == '\n') putc('\\', out);
+            putc(*p == '\n' ? 'n' : *p, out);
+        }
+    }
+    putc('\n', out);
+}
+
+// Writes (/C) or checks (/V) one entry, in walk order. Called under the lock.
+void mf_emit(struct mf_job* job, struct mf_entry* e) {
+    char name[PATH_MAX_LEN];
+    const char* what = NULL;
+    if (e->flags & MF_ERROR) {
+        job->errors++;
+        return;
+    }
+    if (!(e->flags & MF_MISSING)) {
+        if (e->rec.type == 'd') job->dirs++;
+        else job->files++;
+    }
+    if (!job->verify) {
+        mf_write_record(job->out, &e->rec);
+        return;
+    }
+
+    if (e->flags & MF_MISSING) { what = "Missing"; job->missing++; }
+    else if (!(e->flags & MF_EXPECT)) { what = "New"; job->added++; }
+    else if (e->rec.type != e->expect.type) what = "Changed (type)";
+    else if (e->rec.size != e->expect.size) what = "Changed (size)";
+    else if (e->rec.hash != e->expect.hash) what = "Changed (content)";
+    else if (e->rec.mode != e->expect.mode) what = "Changed (mode)";
+    if (what && what[0] == 'C') job->changed++;
+    if (what) {
+        format_path_for_dos(e->rec.path, name);
+        printf("%-18s %s\n", what, name);
+    }
+}
+
+void mf_drain(struct mf_job* job) {
+    while (job->head < job->tail && !(job->ring[job->head % MF_WINDOW].flags & MF_HASH)) {
+        struct mf_entry* e = &job->ring[job->head % MF_WINDOW];
+        mf_emit(job, e);
+        free(e->rec.path);
+        job->head++;
+    }
+}
+
+// Adds an entry at the tail of the window, first emitting whatever is ready
+// and waiting for the workers while the window is full.
+void mf_push(struct mf_job* job, struct mf_entry* e) {
+    pthread_mutex_lock(&job->lock);
+    mf_drain(job);
+    while (job->tail - job->head == MF_WINDOW) {
+        pthread_cond_wait(&job->ready_cond, &job->lock);
+        mf_drain(job);
+    }
+    job->ring[job->tail % MF_WINDOW] = *e;
+    job->tail++;
+    if (e->flags & MF_HASH) pthread_cond_signal(&job->work_cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+int mf_hash_entry(struct mf_job* job, struct mf_entry* e) {
+    struct stat st;
+    int rc = -1;
+    int fd = openat(job->root_fd, e->rec.path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) goto out;
+    if (st.st_size != e->rec.size) { errno = EAGAIN; goto out; }
+    if (st.st_size == 0) {
+        e->rec.hash = dedup_hash((const unsigned char*)"", 0, 0);
+    } else {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) goto out;
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        e->rec.hash = dedup_hash(map, st.st_size, st.st_size);
+        munmap(map, st.st_size);
+        __atomic_add_fetch(&job->bytes_hashed, st.st_size, __ATOMIC_RELAXED);
+    }
+    rc = 0;
+out:
+    if (rc != 0) fprintf(stderr, "manifest: %s: %s\n", e->rec.path, errno == EAGAIN ? "changed during the scan" : strerror(errno));
+    if (fd >= 0) close(fd);
+    return rc;
+}
+
+void* mf_worker(void* arg) {
+    struct mf_job* job = arg;
+    pthread_mutex_lock(&job->lock);
+    for (;;) {
+        // Slots behind head have been emitted and may already hold newer entries.
+        if (job->next_hash < job->head) job->next_hash = job->head;
+        while (job->next_hash < job->tail && !(job->ring[job->next_hash % MF_WINDOW].flags & MF_HASH)) job->next_hash++;
+        if (job->next_hash == job->tail) {
+            if (job->done) break;
+            pthread_cond_wait(&job->work_cond, &job->lock);
+            continue;
+        }
+        unsigned long idx = job->next_hash++;
+        struct mf_entry* e = &job->ring[idx % MF_WINDOW];
+        pthread_mutex_unlock(&job->lock);
+        int rc = mf_hash_entry(job, e);
+        pthread_mutex_lock(&job->lock);
+        e->flags = (e->flags & ~MF_HASH) | (rc != 0 ? MF_ERROR : 0);
+        if (idx == job->head) pthread_cond_signal(&job->ready_cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+// Moves the manifest reader up to e's path (or with e NULL, to the end):
+// records it passes are missing from the tree (/V), and a record for the
+// same path becomes e's `expect`.
+void mf_join(struct mf_job* job, struct mf_entry* e) {
+    struct mf_reader* r = job->in;
+    if (!r) return;
+    while (!r->eof && (!e || mf_path_compare(r->rec.path, e->rec.path) < 0)) {
+        if (job->verify) {
+            struct mf_entry missing;
+            memset(&missing, 0, sizeof(missing));
+            missing.flags = MF_MISSING;
+            missing.rec = r->rec;
+            missing.rec.path = strdup(r->rec.path);
+            mf_push(job, &missing);
+        }
+        mf_reader_next(r);
+    }
+    if (e && !r->eof && strcmp(r->rec.path, e->rec.path) == 0) {
+        e->flags |= MF_EXPECT;
+        e->expect = r->rec;
+        e->expect.path = NULL;
+        if (job->quick && e->rec.type == 'f' && e->expect.type == 'f' && e->rec.size == e->expect.size &&
+            e->rec.mtime.tv_sec == e->expect.mtime.tv_sec && e->rec.mtime.tv_nsec == e->expect.mtime.tv_nsec) {
+            e->rec.hash = e->expect.hash;
+            e->flags &= ~MF_HASH;
+            job->trusted++;
+        }
+        mf_reader_next(r);
+    }
+}
+
+// One tree entry for the manifest; 1 descends into a directory.
+int mf_visit(struct sorted_walk* walk, int dirfd, const char* name, const char* path, const struct stat* st) {
+    struct mf_job* job = walk->ctx;
+    if (st->st_dev == job->skip_dev && (st->st_ino == job->skip_ino[0] || st->st_ino == job->skip_ino[1])) return 0;
+
+    struct mf_entry e;
+    memset(&e, 0, sizeof(e));
+    e.rec.type = S_ISREG(st->st_mode) ? 'f' : S_ISDIR(st->st_mode) ? 'd' : S_ISLNK(st->st_mode) ? 'l' : 'o';
+    e.rec.mode = st->st_mode & 07777;
+    e.rec.size = S_ISREG(st->st_mode) || S_ISLNK(st->st_mode) ? (long long)st->st_size : 0;
+    e.rec.mtime = st->st_mtim;
+    e.rec.path = strdup(path);
+    if (S_ISREG(st->st_mode)) e.flags |= MF_HASH;
+    if (S_ISLNK(st->st_mode)) {
+        char target[PATH_MAX_LEN];
+        ssize_t n = readlinkat(dirfd, name, target, sizeof(target));
+        if (n < 0) {
+            fprintf(stderr, "manifest: %s: %s\n", path, strerror(errno));
+            e.flags |= MF_ERROR;
+        } else {
+            e.rec.size = n;
+            e.rec.hash = dedup_hash((const unsigned char*)target, n, n);
+        }
+    }
+    mf_join(job, &e);
+    mf_push(job, &e);
+    return S_ISDIR(st->st_mode);
+}
+
+// Walks the tree with nworkers hashing threads; the caller has set up the
+// root, the reader and the output.
+int mf_run(struct mf_job* job, int nworkers) {
+    pthread_t threads[MAX_WORKERS];
+    int started = 0;
+    job->ring = calloc(MF_WINDOW, sizeof(*job->ring));
+    if (!job->ring) return -1;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->work_cond, NULL);
+    pthread_cond_init(&job->ready_cond, NULL);
+    for (int i = 0; i < nworkers; i++) {
+        if (pthread_create(&threads[i], NULL, mf_worker, job) == 0) started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "manifest: %s\n", strerror(EAGAIN));
+        free(job->ring);
+        return -1;
+    }
+
+    struct sorted_walk walk = { "manifest", mf_visit, job, 0 };
+    sorted_walk_dir(&walk, job->root_fd, "");
+    job->errors += walk.errors;
+    mf_join(job, NULL);
+
+    pthread_mutex_lock(&job->lock);
+    for (;;) {
+        mf_drain(job);
+        if (job->head == job->tail) break;
+        pthread_cond_wait(&job->ready_cond, &job->lock);
+    }
+    job->done = 1;
+    pthread_cond_broadcast(&job->work_cond);
+    pthread_mutex_unlock(&job->lock);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->work_cond);
+    pthread_cond_destroy(&job->ready_cond);
+    free(job->ring);
+    return 0;
+}
+
+int builtin_manifest(int argc, char** argv) {
+    struct mf_job job;
+    struct mf_reader reader;
+    struct timespec start;
+    struct stat st;
+    char* args[2] = { NULL, NULL };
+    char tmp[PATH_MAX_LEN];
+    const char* sw;
+    int create = 0, verify = 0, quick = 0, n = 0, nworkers = online_cpus();
+
+    for (int j = 1; j < argc; j++) {
+        if (match_switch(argv[j], "C")) create = 1;
+        else if (match_switch(argv[j], "V")) verify = 1;
+        else if (match_switch(argv[j], "Q")) quick = 1;
+        else if ((sw = match_switch(argv[j], "J")) != NULL) nworkers = *sw ? atoi(sw) : online_cpus();
+        else if (n < 2) args[n++] = argv[j];
+        else n = 3;
+    }
+    if (create == verify || n != 2) {
+        printf("Syntax: manifest /C | /V [/Q] [/J[:n]] [dir] [file]\n");
+        return 1;
+    }
+    if (nworkers < 1) nworkers = 1;
+    if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+
+    memset(&job, 0, sizeof(job));
+    job.verify = verify;
+    job.quick = quick;
+    job.root_fd = open(args[0], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (job.root_fd < 0) { fprintf(stderr, "manifest: %s: %s\n", args[0], strerror(errno)); return 1; }
+    if (fstat(job.root_fd, &st) == 0) job.skip_dev = st.st_dev;
+    dedup_hash_init();
+
+    // /V reads the manifest; /C /Q reads the previous one, if any, for the
+    // hashes of unchanged files, while writing the new one beside it.
+    if (verify || quick) {
+        if (mf_reader_open(&reader, args[1]) == 0) {
+            job.in = &reader;
+            if (fstat(fileno(reader.fp), &st) == 0 && st.st_dev == job.skip_dev) job.skip_ino[0] = st.st_ino;
+        } else if (verify || errno != ENOENT) {
+            fprintf(stderr, "manifest: %s: %s\n", args[1], errno == EINVAL ? "not a tree manifest" : strerror(errno));
+            if (verify) { close(job.root_fd); return 1; }
+        }
+    }
+    if (create) {
+        snprintf(tmp, sizeof(tmp), "%s.tmp", args[1]);
+        if (!(job.out = fopen(tmp, "we"))) {
+            fprintf(stderr, "manifest: %s: %s\n", args[1], strerror(errno));
+            if (job.in) mf_reader_close(&reader);
+            close(job.root_fd);
+            return 1;
+        }
+        setvbuf(job.out, NULL, _IOFBF, MF_OUT_BUF_SIZE);
+        if (fstat(fileno(job.out), &st) == 0 && st.st_dev == job.skip_dev) job.skip_ino[1] = st.st_ino;
+        if (stat(args[1], &st) == 0 && st.st_dev == job.skip_dev) job.skip_ino[0] = st.st_ino;
+        fprintf(job.out, "%s\n", MF_MAGIC);
+    }
+
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int rc = mf_run(&job, nworkers);
+    double secs = elapsed_since(&start);
+    if (job.in) {
+        job.errors += reader.errors;
+        mf_reader_close(&reader);
+    }
+    close(job.root_fd);
+
+    if (create) {
+        int ok = rc == 0 && fflush(job.out) == 0 && !ferror(job.out);
+        if (fclose(job.out) != 0) ok = 0;
+        if (!ok || rename(tmp, args[1]) != 0) {
+            fprintf(stderr, "manifest: %s: %s\n", args[1], strerror(errno));
+            unlink(tmp);
+            return 1;
+        }
+    }
+
+    char rate[32];
+    format_rate((double)job.bytes_hashed, secs, "B", rate, sizeof(rate));
+    printf("%8lld File(s), %lld dir(s) %s; %lld bytes hashed in %.2f s (%s).\n",
+           job.files, job.dirs, create ? "recorded" : "checked", job.bytes_hashed, secs, rate);
+    if (quick) printf("%8lld File(s) taken as unchanged by size and date.\n", job.trusted);
+    if (verify) {
+        printf("%8lld changed, %lld missing, %lld new.\n", job.changed, job.missing, job.added);
+    }
+    if (job.errors > 0) printf("%8lld error(s).\n", job.errors);
+    if (rc != 0 || job.errors > 0) return 1;
+    return verify && (job.changed || job.missing || job.added) ? 1 : 0;
+}
+
+// --- PACK and UNPACK ---
+// The archive (ustar with pax headers for long names, or newc cpio) is cut
+// into blocks of up to 1 MiB, each compressed on a worker thread into a
+// gzip member of its own; concatenated members are one valid .gz file.
+// Every member carries its total length in a 'TD' extra field (as BGZF
+// does), so UNPACK can split an archive it wrote back into members without
+// inflating anything and decompress them on all workers too. Any other gzip
+// stream (or an uncompressed archive) is unpacked serially. /M bounds the
+// blocks in flight plus the per-thread zlib state.
+
+ssize_t read_full(int fd, void* buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, (char*)buf + got, len - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        got += n;
+    }
+    return got;
+}
+
+void pack_put_le32(unsigned char* p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+uint32_t pack_get_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int pack_deflate_block(z_stream* zs, struct pack_block* b) {
+    size_t need = PACK_GZ_HEADER + deflateBound(zs, b->in_len) + 8;
+    if (b->out_cap < need) {
+        unsigned char* grown = realloc(b->out, need);
+        if (!grown) return -1;
+        b->out = grown;
+        b->out_cap = need;
+    }
+    if (deflateReset(zs) != Z_OK) return -1;
+    zs->next_in = b->in;
+    zs->avail_in = b->in_len;
+    zs->next_out = b->out + PACK_GZ_HEADER;
+    zs->avail_out = b->out_cap - PACK_GZ_HEADER - 8;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) return -1;
+
+    size_t total = PACK_GZ_HEADER + zs->total_out + 8;
+    unsigned char* h = b->out;
+    static const unsigned char head[16] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 3, 8, 0, 'T', 'D', 4, 0 };
+    memcpy(h, head, sizeof(head)); // FEXTRA, unix; XLEN 8: subfield "TD", 4 bytes
+    pack_put_le32(h + 16, total);
+    pack_put_le32(h + total - 8, crc32(0, b->in, b->in_len));
+    pack_put_le32(h + total - 4, b->in_len);
+    b->out_len = total;
+    return 0;
+}
+
+// Length of the gzip member header at p, or -1 if it is not one.
+long pack_gzip_header_len(const unsigned char* p, size_t len) {
+    size_t off = 10;
+    if (len < 10 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8) return -1;
+    if (p[3] & 4) {
+        if (len < 12) return -1;
+        off = 12 + (p[10] | (p[11] << 8));
+    }
+    for (int flag = 8; flag <= 16; flag <<= 1) { // FNAME, FCOMMENT
+        if (!(p[3] & flag)) continue;
+        while (off < len && p[off]) off++;
+        off++;
+    }
+    if (p[3] & 2) off += 2; // FHCRC
+    return off <= len ? (long)off : -1;
+}
+
+int pack_inflate_block(z_stream* zs, struct pack_block* b) {
+    long hlen = pack_gzip_header_len(b->in, b->in_len);
+    if (hlen < 0 || b->in_len < (size_t)hlen + 8) return -1;
+    uint32_t crc = pack_get_le32(b->in + b->in_len - 8);
+    size_t size = pack_get_le32(b->in + b->in_len - 4);
+    if (size > PACK_MEMBER_LIMIT) return -1;
+    if (b->out_cap < size + 1) {
+        unsigned char* grown = realloc(b->out, size + 1);
+        if (!grown) return -1;
+        b->out = grown;
+        b->out_cap = size + 1;
+    }
+    if (inflateReset(zs) != Z_OK) return -1;
+    zs->next_in = b->in + hlen;
+    zs->avail_in = b->in_len - hlen - 8;
+    zs->next_out = b->out;
+    zs->avail_out = b->out_cap;
+    if (inflate(zs, Z_FINISH) != Z_STREAM_END || zs->total_out != size) return -1;
+    if (crc32(0, b->out, size) != crc) return -1;
+    b->out_len = size;
+    return 0;
+}
+
+void* pack_worker(void* arg) {
+    struct pack_pipe* p = arg;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    int ok = (p->inflate ? inflateInit2(&zs, -15) : deflateInit2(&zs, p->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)) == Z_OK;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        if (p->next == p->tail) {
+            if (p->done) break;
+            pthread_cond_wait(&p->work_cond, &p->lock);
+            continue;
+        }
+        struct pack_block* b = &p->slots[p->next++ % p->nslots];
+        pthread_mutex_unlock(&p->lock);
+        b->error = !ok || (p->inflate ? pack_inflate_block(&zs, b) : pack_deflate_block(&zs, b)) != 0;
+        pthread_mutex_lock(&p->lock);
+        b->state = PACK_SLOT_DONE;
+        pthread_cond_signal(&p->done_cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    if (ok) {
+        if (p->inflate) inflateEnd(&zs);
+        else deflateEnd(&zs);
+    }
+    return NULL;
+}
+
+int pack_pipe_start(struct pack_pipe* p, int inflate, int level, int nslots, int nworkers,
+                    int (*emit)(void*, const unsigned char*, size_t), void* ctx) {
+    memset(p, 0, sizeof(*p));
+    p->inflate = inflate;
+    p->level = level;
+    p->nslots = nslots;
+    p->emit = emit;
+    p->ctx = ctx;
+    if (!(p->slots = calloc(nslots, sizeof(*p->slots)))) return -1;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work_cond, NULL);
+    pthread_cond_init(&p->done_cond, NULL);
+    for (int i = 0; i < nworkers; i++) {
+        if (pthread_create(&p->threads[p->nthreads], NULL, pack_worker, p) == 0) p->nthreads++;
+    }
+    if (p->nthreads == 0) {
+        pack_pipe_finish(p);
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+// Emits finished blocks at the head in order, waiting until at most
+// max_in_flight blocks are left queued or being worked on.
+void pack_pipe_drain(struct pack_pipe* p, unsigned long max_in_flight) {
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->head < p->tail && p->slots[p->head % p->nslots].state == PACK_SLOT_DONE) {
+            struct pack_block* b = &p->slots[p->head % p->nslots];
+            pthread_mutex_unlock(&p->lock);
+            if (b->error && !p->error) p->error = 1;
+            else if (!p->error && p->emit(p->ctx, b->out, b->out_len) != 0) p->error = 2;
+            pthread_mutex_lock(&p->lock);
+            b->state = PACK_SLOT_FILL;
+            p->head++;
+        }
+        if (p->tail - p->head <= max_in_flight) break;
+        pthread_cond_wait(&p->done_cond, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+// The next block to fill, with room for `size` input bytes.
+struct pack_block* pack_pipe_slot(struct pack_pipe* p, size_t size) {
+    pack_pipe_drain(p, p->nslots - 1);
+    struct pack_block* b = &p->slots[p->tail % p->nslots];
+    b->in_len = 0;
+    if (b->in_cap < size) {
+        unsigned char* grown = realloc(b->in, size);
+        if (!grown) return NULL;
+        b->in = grown;
+        b->in_cap = size;
+    }
+    return b;
+}
+
+void pack_pipe_submit(struct pack_pipe* p) {
+    pthread_mutex_lock(&p->lock);
+    p->slots[p->tail % p->nslots].state = PACK_SLOT_QUEUED;
+    p->tail++;
+    pthread_cond_signal(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Emits everything still queued, then stops the workers. Returns 0, or -1
+// if a block failed or emit() did (see `error`).
+int pack_pipe_finish(struct pack_pipe* p) {
+    if (p->nthreads > 0) pack_pipe_drain(p, 0);
+    pthread_mutex_lock(&p->lock);
+    p->done = 1;
+    pthread_cond_broadcast(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->nthreads; i++) pthread_join(p->threads[i], NULL);
+    for (int i = 0; i < p->nslots; i++) {
+        free(p->slots[i].in);
+        free(p->slots[i].out);
+    }
+    free(p->slots);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work_cond);
+    pthread_cond_destroy(&p->done_cond);
+    return p->error ? -1 : 0;
+}
+
+// Splits the /M budget between zlib state (per thread) and blocks in flight
+// (each an input block plus its output), keeping at least two blocks.
+void pack_plan(long long memory, size_t block_hint, int* nworkers, int* nslots, size_t* block) {
+    int threads = *nworkers;
+    while (threads > 1 && memory - (long long)threads * PACK_ZLIB_MEMORY < 4LL * PACK_MIN_BLOCK) threads--;
+    long long avail = memory - (long long)threads * PACK_ZLIB_MEMORY;
+    size_t b = block_hint;
+    while (b > PACK_MIN_BLOCK && avail / (2LL * b) < 2) b /= 2;
+    long long slots = avail / (2LL * b);
+    if (slots > 2 * threads + 2) slots = 2 * threads + 2;
+    if (slots < 2) slots = 2;
+    *nworkers = threads;
+    *nslots = slots;
+    *block = b;
+}
+
+int pack_emit_write(void* ctx, const unsigned char* buf, size_t len) {
+    struct pack_writer* w = ctx;
+    if (write_all(w->out_fd, (const char*)buf, len) != 0) return -1;
+    w->bytes_out += len;
+    return 0;
+}
+
+// Hands the filled block to the workers (or with /Z:0 writes it out) and
+// starts the next one.
+void pack_submit(struct pack_writer* w) {
+    if (w->cur->in_len == 0 || w->error) return;
+    if (!w->pipe) {
+        if (pack_emit_write(w, w->cur->in, w->cur->in_len) != 0) w->error = 1;
+        w->cur->in_len = 0;
+        return;
+    }
+    pack_pipe_submit(w->pipe);
+    if (w->pipe->error || !(w->cur = pack_pipe_slot(w->pipe, w->block_size))) w->error = 1;
+}
+
+void pack_put(struct pack_writer* w, const void* data, size_t n) {
+    const char* p = data;
+    while (n > 0 && !w->error) {
+        size_t room = w->block_size - w->cur->in_len;
+        size_t take = n < room ? n : room;
+        memcpy(w->cur->in + w->cur->in_len, p, take);
+        w->cur->in_len += take;
+        p += take;
+        n -= take;
+        if (w->cur->in_len == w->block_size) pack_submit(w);
+    }
+}
+
+void pack_pad(struct pack_writer* w, size_t n) {
+    static const char zeros[512];
+    while (n > 0) {
+        size_t take = n < sizeof(zeros) ? n : sizeof(zeros);
+        pack_put(w, zeros, take);
+        n -= take;
+    }
+}
+
+// Reads `size` bytes of the file straight into the blocks. A file that
+// shrank since its header was written is padded with zeros (and reported).
+int pack_put_file(struct pack_writer* w, int fd, long long size, const char* path) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (size > 0 && !w->error) {
+        size_t room = w->block_size - w->cur->in_len;
+        ssize_t n = read(fd, w->cur->in + w->cur->in_len, (long long)room < size ? room : (size_t)size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "pack: %s: %s\n", path, n < 0 ? strerror(errno) : "file shrank while being packed");
+            pack_pad(w, size);
+            return -1;
+        }
+        w->cur->in_len += n;
+        w->bytes_in += n;
+        size -= n;
+        if (w->cur->in_len == w->block_size) pack_submit(w);
+    }
+    return 0;
+}
+
+// Zero-padded octal in a NUL-terminated field; callers keep v in range.
+void pack_octal(char* field, size_t width, unsigned long long v) {
+    field[width - 1] = '\0';
+    for (size_t i = width - 1; i-- > 0; v >>= 3) field[i] = '0' + (v & 7);
+}
+
+// Appends "len key=value\n", where len counts the whole record.
+void pack_pax_record(char* buf, size_t* len, size_t cap, const char* key, const char* value) {
+    size_t body = strlen(key) + strlen(value) + 3, total = body + 1;
+    while (total != body + (size_t)snprintf(NULL, 0, "%zu", total)) total = body + snprintf(NULL, 0, "%zu", total);
+    if (*len + total < cap) *len += snprintf(buf + *len, cap - *len, "%zu %s=%s\n", total, key, value);
+}
+
+// Writes a ustar header, preceded by a pax header when the path, link
+// target or size do not fit its fixed fields.
+void pack_tar_header(struct pack_writer* w, const char* path, const struct stat* st, char type, const char* link, long long size) {
+    char h[512], name[PATH_MAX_LEN + 1];
+    char pax[3 * PATH_MAX_LEN];
+    size_t pax_len = 0, nlen, split = 0;
+
+    snprintf(name, sizeof(name), "%s%s", path, type == '5' ? "/" : "");
+    nlen = strlen(name);
+    if (nlen > 100) {
+        // ustar: prefix (155) + '/' + name (100), split at a slash.
+        for (size_t i = nlen - 1; i > 0 && !split; i--) {
+            if (name[i] == '/' && i <= 155 && nlen - i - 1 <= 100 && nlen - i - 1 > 0) split = i;
+        }
+        if (!split) pack_pax_record(pax, &pax_len, sizeof(pax), "path", name);
+    }
+    if (link && strlen(link) > 100) pack_pax_record(pax, &pax_len, sizeof(pax), "linkpath", link);
+    if (size >= 077777777777LL) {
+        char num[24];
+        snprintf(num, sizeof(num), "%lld", size);
+        pack_pax_record(pax, &pax_len, sizeof(pax), "size", num);
+    }
+    if (pax_len > 0) {
+        struct stat xst;
+        memset(&xst, 0, sizeof(xst));
+        xst.st_mode = 0644;
+        xst.st_mtime = st->st_mtime;
+        pack_tar_header(w, "././@PaxHeader", &xst, 'x', NULL, pax_len);
+        pack_put(w, pax, pax_len);
+        pack_pad(w, (512 - pax_len % 512) % 512);
+    }
+
+    memset(h, 0, sizeof(h));
+    if (split) {
+        memcpy(h + 345, name, split);
+        memcpy(h, name + split + 1, nlen - split - 1);
+    } else {
+        memcpy(h, name, nlen < 100 ? nlen : 100);
+    }
+    pack_octal(h + 100, 8, st->st_mode & 07777);
+    pack_octal(h + 108, 8, st->st_uid <= 07777777 ? st->st_uid : 0);
+    pack_octal(h + 116, 8, st->st_gid <= 07777777 ? st->st_gid : 0);
+    pack_octal(h + 124, 12, size < 077777777777LL ? size : 0);
+    pack_octal(h + 136, 12, st->st_mtime > 0 ? st->st_mtime : 0);
+    h[156] = type;
+    if (link) memcpy(h + 157, link, strlen(link) < 100 ? strlen(link) : 100);
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    if (type == '3' || type == '4') {
+        pack_octal(h + 329, 8, major(st->st_rdev));
+        pack_octal(h + 337, 8, minor(st->st_rdev));
+    }
+    memset(h + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < 512; i++) sum += (unsigned char)h[i];
+    snprintf(h + 148, 8, "%06o", sum);
+    pack_put(w, h, sizeof(h));
+}
+
+// newc header and name; the caller writes `size` bytes of data and pads it
+// to 4 bytes.
+void pack_cpio_header(struct pack_writer* w, const char* path, const struct stat* st, long long size) {
+    char h[111];
+    size_t namesize = strlen(path) + 1;
+    // newc fields are 32 bits; pack_visit() keeps larger files out.
+    snprintf(h, sizeof(h), "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+             (unsigned int)++w->ino, (unsigned int)st->st_mode, (unsigned int)st->st_uid, (unsigned int)st->st_gid,
+             S_ISDIR(st->st_mode) ? 2 : 1, (unsigned int)(st->st_mtime > 0 ? st->st_mtime : 0),
+             (unsigned int)size, 0, 0, (unsigned int)major(st->st_rdev), (unsigned int)minor(st->st_rdev),
+             (unsigned int)namesize, 0);
+    pack_put(w, h, 110);
+    pack_put(w, path, namesize);
+    pack_pad(w, (4 - (110 + namesize) % 4) % 4);
+}
+
+int pack_visit(struct sorted_walk* walk, int dirfd, const char* name, const char* path, const struct stat* st) {
+    struct pack_writer* w = walk->ctx;
+    char target[PATH_MAX_LEN];
+    if (w->error) return 0;
+    if (st->st_dev == w->skip_dev && (st->st_ino == w->skip_ino[0] || st->st_ino == w->skip_ino[1])) return 0;
+
+    if (S_ISREG(st->st_mode)) {
+        int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "pack: %s: %s\n", path, strerror(errno));
+            walk->errors++;
+            return 0;
+        }
+        if (w->format == PACK_CPIO && st->st_size > 0xFFFFFFFFLL) {
+            fprintf(stderr, "pack: %s: too large for cpio\n", path);
+            walk->errors++;
+            close(fd);
+            return 0;
+        }
+        if (w->format == PACK_CPIO) pack_cpio_header(w, path, st, st->st_size);
+        else pack_tar_header(w, path, st, '0', NULL, st->st_size);
+        if (pack_put_file(w, fd, st->st_size, path) != 0) walk->errors++;
+        pack_pad(w, w->format == PACK_CPIO ? (4 - st->st_size % 4) % 4 : (512 - st->st_size % 512) % 512);
+        close(fd);
+        w->files++;
+        return 0;
+    }
+    if (S_ISLNK(st->st_mode)) {
+        ssize_t n = readlinkat(dirfd, name, target, sizeof(target) - 1);
+        if (n < 0) {
+            fprintf(stderr, "pack: %s: %s\n", path, strerror(errno));
+            walk->errors++;
+            return 0;
+        }
+        target[n] = '\0';
+        if (w->format == PACK_CPIO) {
+            pack_cpio_header(w, path, st, n);
+            pack_put(w, target, n);
+            pack_pad(w, (4 - n % 4) % 4);
+        } else {
+            pack_tar_header(w, path, st, '2', target, 0);
+        }
+        w->files++;
+        return 0;
+    }
+    if (S_ISSOCK(st->st_mode)) return 0; // as tar does, sockets are not archived
+    char type = S_ISDIR(st->st_mode) ? '5' : S_ISCHR(st->st_mode) ? '3' : S_ISBLK(st->st_mode) ? '4' : '6';
+    if (w->format == PACK_CPIO) pack_cpio_header(w, path, st, 0);
+    else pack_tar_header(w, path, st, type, NULL, 0);
+    if (S_ISDIR(st->st_mode)) w->dirs++;
+    else w->files++;
+    return S_ISDIR(st->st_mode);
+}
+
+void pack_finish_archive(struct pack_writer* w) {
+    if (w->format == PACK_CPIO) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        w->ino = (unsigned long)-1; // "TRAILER!!!" has inode 0
+        pack_cpio_header(w, "TRAILER!!!", &st, 0);
+    } else {
+        pack_pad(w, 1024);
+    }
+    pack_submit(w);
+}
+
+// Makes an archive path relative: strips leading "/" and "./" and trailing
+// slashes. Returns -1 for paths with a ".." component.
+int unpack_clean_path(char* path) {
+    char* p = path;
+    for (;;) {
+        if (*p == '/') p++;
+        else if (p[0] == '.' && p[1] == '/') p += 2;
+        else break;
+    }
+    memmove(path, p, strlen(p) + 1);
+    size_t n = strlen(path);
+    while (n > 0 && path[n - 1] == '/') path[--n] = '\0';
+    if (strcmp(path, ".") == 0) path[0] = '\0';
+    for (const char* c = path; *c;) {
+        size_t len = strcspn(c, "/");
+        if (len == 2 && c[0] == '.' && c[1] == '.') return -1;
+        c += len;
+        if (*c) c++;
+    }
+    return 0;
+}
+
+// Opens the first dlen bytes of path, a directory below dest_fd, one
+// component at a time without following symlinks (so nothing it names lies
+// outside the destination), creating what is missing if asked to. Returns
+// an fd the caller closes unless it is dest_fd, or -1.
+int unpack_walk(int dest_fd, const char* path, size_t dlen, int create) {
+    int fd = dest_fd;
+    char comp[PATH_MAX_LEN];
+    for (const char* c = path; c < path + dlen;) {
+        size_t len = strcspn(c, "/");
+        memcpy(comp, c, len);
+        comp[len] = '\0';
+        c += len + 1;
+        if (len == 0) continue;
+        int next = openat(fd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (next < 0 && errno == ENOENT && create && mkdirat(fd, comp, 0755) == 0) {
+            next = openat(fd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        if (fd != dest_fd) close(fd);
+        if (next < 0) return -1;
+        fd = next;
+    }
+    return fd;
+}
+
+// Opens the directory part of path below the destination (unpack_walk),
+// creating what is missing. Consecutive entries usually share a directory,
+// so the last one stays open. *leaf is set to the last component.
+int unpack_parent(struct unpack_state* u, const char* path, const char** leaf) {
+    const char* slash = strrchr(path, '/');
+    size_t dlen = slash ? (size_t)(slash - path) : 0;
+    *leaf = slash ? slash + 1 : path;
+    if (u->parent_fd >= 0 && strlen(u->parent_path) == dlen && strncmp(u->parent_path, path, dlen) == 0) return u->parent_fd;
+    if (u->parent_fd >= 0 && u->parent_fd != u->dest_fd) close(u->parent_fd);
+    u->parent_fd = -1;
+
+    int fd = unpack_walk(u->dest_fd, path, dlen, 1);
+    if (fd < 0) return -1;
+    u->parent_fd = fd;
+    snprintf(u->parent_path, sizeof(u->parent_path), "%.*s", (int)dlen, path);
+    return fd;
+}
+
+// Creates the entry just parsed from a header. Regular files are left open
+// in out_fd for their data; everything else is complete on return.
+void unpack_begin_entry(struct unpack_state* u) {
+    char name[PATH_MAX_LEN];
+    const char* leaf;
+    u->out_fd = -1;
+    if (unpack_clean_path(u->path) != 0) {
+        fprintf(stderr, "unpack: %s: path leads outside the destination, skipped\n", u->path);
+        u->errors++;
+        return;
+    }
+    if (!u->path[0]) return; // the root itself
+    if (u->list) {
+        format_path_for_dos(u->path, name);
+        if (u->type == 'd') printf("    <DIR>          %s\n", name);
+        else printf("%14lld     %s\n", u->type == 'f' ? u->size : 0LL, name);
+        if (u->type == 'd') u->dirs++;
+        else u->files++;
+        if (u->type == 'f') u->bytes += u->size;
+        return;
+    }
+
+    int dir = unpack_parent(u, u->path, &leaf);
+    if (dir < 0) goto fail;
+    if (u->type == 'd') {
+        if (mkdirat(dir, leaf, 0700) != 0 && errno != EEXIST) goto fail;
+        int fd = openat(dir, leaf, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) goto fail;
+        if (u->restore_owner && fchown(fd, u->uid, u->gid) != 0) {}
+        fchmod(fd, u->restore_owner ? u->mode : u->mode | 0700); // keep filling it
+        close(fd);
+        u->dirs++;
+        return;
+    }
+    // Whatever is there is replaced, never written through.
+    if (unlinkat(dir, leaf, 0) != 0 && errno != ENOENT) goto fail;
+    if (u->type == 'f') {
+        if ((u->out_fd = openat(dir, leaf, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600)) < 0) goto fail;
+        return; // finished by unpack_end_entry()
+    }
+    if (u->type == 'l') {
+        if (symlinkat(u->link, dir, leaf) != 0) goto fail;
+    } else if (u->type == 'h') {
+        // The target is looked up the same way as the entry, and may not be
+        // a symlink itself: a hard link never reaches outside the destination.
+        struct stat tst;
+        snprintf(name, sizeof(name), "%s", u->link);
+        if (unpack_clean_path(name) != 0 || !name[0]) { errno = EINVAL; goto fail; }
+        const char* slash = strrchr(name, '/');
+        const char* tleaf = slash ? slash + 1 : name;
+        int tdir = unpack_walk(u->dest_fd, name, slash ? (size_t)(slash - name) : 0, 0);
+        if (tdir < 0) goto fail;
+        int rc = -1;
+        if (fstatat(tdir, tleaf, &tst, AT_SYMLINK_NOFOLLOW) == 0) {
+            if (S_ISLNK(tst.st_mode)) errno = ELOOP;
+            else rc = linkat(tdir, tleaf, dir, leaf, 0);
+        }
+        int err = errno;
+        if (tdir != u->dest_fd) close(tdir);
+        errno = err;
+        if (rc != 0) goto fail;
+    } else {
+        mode_t kind = u->type == 'c' ? S_IFCHR : u->type == 'b' ? S_IFBLK : S_IFIFO;
+        if (mknodat(dir, leaf, kind | u->mode, makedev(u->rdev_major, u->rdev_minor)) != 0) goto fail;
+    }
+    if (u->type != 'h') {
+        struct timespec times[2] = { { u->mtime, 0 }, { u->mtime, 0 } };
+        if (u->restore_owner && fchownat(dir, leaf, u->uid, u->gid, AT_SYMLINK_NOFOLLOW) != 0) {}
+        utimensat(dir, leaf, times, AT_SYMLINK_NOFOLLOW);
+    }
+    u->files++;
+    return;
+
+fail:
+    fprintf(stderr, "unpack: %s: %s\n", u->path, strerror(errno));
+    u->errors++;
+}
+
+void unpack_end_entry(struct unpack_state* u) {
+    if (u->out_fd < 0) return;
+    struct timespec times[2] = { { u->mtime, 0 }, { u->mtime, 0 } };
+    if (u->restore_owner && fchown(u->out_fd, u->uid, u->gid) != 0) {}
+    fchmod(u->out_fd, u->mode);
+    futimens(u->out_fd, times);
+    if (close(u->out_fd) != 0) {
+        fprintf(stderr, "unpack: %s: %s\n", u->path, strerror(errno));
+        u->errors++;
+    } else {
+        u->files++;
+        u->bytes += u->size;
+    }
+    u->out_fd = -1;
+}
+
+// A tar number field: octal, or base-256 when the top bit is set.
+unsigned long long unpack_number(const unsigned char* p, size_t width) {
+    unsigned long long v = 0;
+    if (p[0] & 0x80) {
+        v = p[0] & 0x7f;
+        for (size_t i = 1; i < width; i++) v = (v << 8) | p[i];
+        return v;
+    }
+    size_t i = 0;
+    while (i < width && p[i] == ' ') i++;
+    for (; i < width && p[i] >= '0' && p[i] <= '7'; i++) v = (v << 3) | (p[i] - '0');
+    return v;
+}
+
+unsigned long unpack_hex(const unsigned char* p) {
+    char num[9];
+    memcpy(num, p, 8);
+    num[8] = '\0';
+    return strtoul(num, NULL, 16);
+}
+
+// pax extended header: "len key=value\n" records for the next entry.
+void unpack_pax(struct unpack_state* u) {
+    const char* p = (const char*)u->hdr;
+    const char* end = p + u->hdr_len;
+    while (p < end) {
+        char* q;
+        long len = strtol(p, &q, 10);
+        if (len <= 0 || p + len > end || *q != ' ') break;
+        const char* key = q + 1;
+        const char* eq = memchr(key, '=', p + len - key);
+        if (eq) {
+            int vlen = (int)(p + len - eq - 2); // without '=' and '\n'
+            if (strncmp(key, "path=", 5) == 0) snprintf(u->next_path, sizeof(u->next_path), "%.*s", vlen, eq + 1);
+            else if (strncmp(key, "linkpath=", 9) == 0) snprintf(u->next_link, sizeof(u->next_link), "%.*s", vlen, eq + 1);
+            else if (strncmp(key, "size=", 5) == 0) u->next_size = atoll(eq + 1);
+        }
+        p += len;
+    }
+}
+
+// Called when `need` header bytes are in. Sets up what comes next: more
+// header bytes, an entry's data, or padding. Returns -1 if the input is not
+// an archive.
+int unpack_header(struct unpack_state* u) {
+    const unsigned char* h = u->hdr;
+    switch (u->kind) {
+    case UNPACK_HDR_DETECT:
+        if (memcmp(h, "07070", 5) == 0 && (h[5] == '1' || h[5] == '2')) {
+            u->format = PACK_CPIO;
+            u->kind = UNPACK_HDR_CPIO;
+            u->need = 110;
+        } else {
+            u->format = PACK_TAR;
+            u->kind = UNPACK_HDR_TAR;
+            u->need = 512;
+        }
+        return 0;
+
+    case UNPACK_HDR_TAR: {
+        unsigned int sum = 0;
+        int zero = 1;
+        for (int i = 0; i < 512; i++) {
+            sum += (i >= 148 && i < 156) ? ' ' : h[i];
+            if (h[i]) zero = 0;
+        }
+        if (zero) { u->phase = UNPACK_END; return 0; }
+        if (sum != unpack_number(h + 148, 8)) {
+            fprintf(stderr, "unpack: not a tar or cpio archive (bad header checksum)\n");
+            return -1;
+        }
+        long long size = u->next_size >= 0 ? u->next_size : (long long)unpack_number(h + 124, 12);
+        char type = h[156];
+        u->pad = (512 - size % 512) % 512;
+        u->remaining = 0;
+        if (type == 'x' || type == 'L' || type == 'K') {
+            if (size >= (type == 'x' ? (1 << 20) : PATH_MAX_LEN)) {
+                fprintf(stderr, "unpack: oversized extended header\n");
+                return -1;
+            }
+            if (u->hdr_cap < (size_t)size + 1) {
+                unsigned char* grown = realloc(u->hdr, size + 1);
+                if (!grown) return -1;
+                u->hdr = grown;
+                u->hdr_cap = size + 1;
+            }
+            u->kind = type == 'x' ? UNPACK_HDR_PAX : UNPACK_HDR_LONG;
+            u->long_type = type;
+            u->hdr_len = 0;
+            u->need = size;
+            if (size > 0) return 0;
+            u->phase = UNPACK_SKIP;
+            return 0;
+        }
+        if (type == 'g') { // global pax header: not used
+            u->pad += size;
+            u->phase = UNPACK_SKIP;
+            return 0;
+        }
+        if (u->next_path[0]) {
+            snprintf(u->path, sizeof(u->path), "%s", u->next_path);
+        } else if (h[345]) {
+            snprintf(u->path, sizeof(u->path), "%.155s/%.100s", (const char*)h + 345, (const char*)h);
+        } else {
+            snprintf(u->path, sizeof(u->path), "%.100s", (const char*)h);
+        }
+        if (u->next_link[0]) snprintf(u->link, sizeof(u->link), "%s", u->next_link);
+        else snprintf(u->link, sizeof(u->link), "%.100s", (const char*)h + 157);
+        u->next_path[0] = u->next_link[0] = '\0';
+        u->next_size = -1;
+
+        u->mode = unpack_number(h + 100, 8) & 07777;
+        u->uid = unpack_number(h + 108, 8);
+        u->gid = unpack_number(h + 116, 8);
+        u->mtime = unpack_number(h + 136, 12);
+        u->rdev_major = unpack_number(h + 329, 8);
+        u->rdev_minor = unpack_number(h + 337, 8);
+        u->size = size;
+        u->type = type == '5' ? 'd' : type == '2' ? 'l' : type == '1' ? 'h' : type == '3' ? 'c' :
+                  type == '4' ? 'b' : type == '6' ? 'p' : 'f';
+        if (type != '0' && type != '\0' && type != '7' && u->type == 'f') {
+            fprintf(stderr, "unpack: %s: unsupported entry type '%c', skipped\n", u->path, type);
+            u->errors++;
+            u->pad += size;
+            u->phase = UNPACK_SKIP;
+            return 0;
+        }
+        unpack_begin_entry(u);
+        u->remaining = size; // data of anything but a file is skipped
+        u->phase = UNPACK_DATA;
+        return 0;
+    }
+
+    case UNPACK_HDR_PAX:
+        unpack_pax(u);
+        u->phase = UNPACK_SKIP;
+        return 0;
+
+    case UNPACK_HDR_LONG: {
+        char* dst = u->long_type == 'L' ? u->next_path : u->next_link;
+        snprintf(dst, PATH_MAX_LEN, "%.*s", (int)u->hdr_len, (const char*)h);
+        u->phase = UNPACK_SKIP;
+        return 0;
+    }
+
+    case UNPACK_HDR_CPIO: {
+        if (memcmp(h, "07070", 5) != 0 || (h[5] != '1' && h[5] != '2')) {
+            fprintf(stderr, "unpack: bad cpio header\n");
+            return -1;
+        }
+        size_t namesize = unpack_hex(h + 94);
+        if (namesize == 0 || namesize >= PATH_MAX_LEN) {
+            fprintf(stderr, "unpack: bad cpio header\n");
+            return -1;
+        }
+        size_t total = (110 + namesize + 3) & ~(size_t)3;
+        if (u->hdr_cap < total) {
+            unsigned char* grown = realloc(u->hdr, total);
+            if (!grown) return -1;
+            u->hdr = grown;
+            u->hdr_cap = total;
+        }
+        u->kind = UNPACK_HDR_NAME;
+        u->need = total;
+        return 0;
+    }
+
+    case UNPACK_HDR_NAME: {
+        size_t namesize = unpack_hex(h + 94);
+        snprintf(u->path, sizeof(u->path), "%.*s", (int)namesize - 1, (const char*)h + 110);
+        if (strcmp(u->path, "TRAILER!!!") == 0) { u->phase = UNPACK_END; return 0; }
+        unsigned long mode = unpack_hex(h + 14);
+        u->mode = mode & 07777;
+        u->uid = unpack_hex(h + 22);
+        u->gid = unpack_hex(h + 30);
+        u->mtime = unpack_hex(h + 46);
+        u->size = unpack_hex(h + 54);
+        u->rdev_major = unpack_hex(h + 78);
+        u->rdev_minor = unpack_hex(h + 86);
+        u->type = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISCHR(mode) ? 'c' : S_ISBLK(mode) ? 'b' :
+                  S_ISFIFO(mode) ? 'p' : 'f';
+        u->pad = (4 - u->size % 4) % 4;
+        u->remaining = 0;
+        if (u->type != 'l') {
+            unpack_begin_entry(u);
+            u->remaining = u->size;
+            u->phase = UNPACK_DATA;
+            return 0;
+        }
+        if (u->size == 0 || u->size >= PATH_MAX_LEN) {
+            fprintf(stderr, "unpack: %s: bad link target\n", u->path);
+            return -1;
+        }
+        u->kind = UNPACK_HDR_LINK; // the target is the entry's data
+        u->hdr_len = 0;
+        u->need = u->size;
+        return 0;
+    }
+
+    case UNPACK_HDR_LINK:
+        snprintf(u->link, sizeof(u->link), "%.*s", (int)u->hdr_len, (const char*)h);
+        unpack_begin_entry(u);
+        u->phase = UNPACK_SKIP;
+        return 0;
+    }
+    return -1;
+}
+
+// Takes the next piece of the (uncompressed) archive.
+int unpack_feed(void* ctx, const unsigned char* buf, size_t len) {
+    struct unpack_state* u = ctx;
+    while (len > 0 && u->phase != UNPACK_END) {
+        size_t take;
+        if (u->phase == UNPACK_NEED) {
+            take = u->need - u->hdr_len < len ? u->need - u->hdr_len : len;
+            memcpy(u->hdr + u->hdr_len, buf, take);
+            u->hdr_len += take;
+        } else if (u->phase == UNPACK_DATA) {
+            take = (long long)len < u->remaining ? len : (size_t)u->remaining;
+            if (u->out_fd >= 0 && write_all(u->out_fd, (const char*)buf, take) != 0) {
+                fprintf(stderr, "unpack: %s: %s\n", u->path, strerror(errno));
+                u->errors++;
+                close(u->out_fd);
+                u->out_fd = -1;
+            }
+            u->remaining -= take;
+        } else {
+            take = (long long)len < u->pad ? len : (size_t)u->pad;
+            u->pad -= take;
+        }
+        buf += take;
+        len -= take;
+
+        if (u->phase == UNPACK_NEED && u->hdr_len == u->need && unpack_header(u) != 0) return -1;
+        if (u->phase == UNPACK_DATA && u->remaining == 0) {
+            unpack_end_entry(u);
+            u->phase = UNPACK_SKIP;
+        }
+        if (u->phase == UNPACK_SKIP && u->pad == 0) {
+            u->phase = UNPACK_NEED;
+            u->kind = u->format == PACK_CPIO ? UNPACK_HDR_CPIO : UNPACK_HDR_TAR;
+            u->need = u->format == PACK_CPIO ? 110 : 512;
+            u->hdr_len = 0;
+        }
+    }
+    return 0;
+}
+
+// Reads the archive from in_fd: PACK's own members in parallel, any other
+// gzip stream or a plain archive serially.
+int unpack_archive(int in_fd, struct unpack_state* u, long long memory, int nworkers) {
+    unsigned char head[PACK_GZ_HEADER];
+    static const unsigned char td[16] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 3, 8, 0, 'T', 'D', 4, 0 };
+    ssize_t n = read_full(in_fd, head, sizeof(head));
+    int rc = 0;
+    if (n < 0) { perror("unpack"); return -1; }
+
+    if (n == PACK_GZ_HEADER && memcmp(head, td, 4) == 0 && memcmp(head + 10, td + 10, 6) == 0) {
+        struct pack_pipe pipe;
+        int nslots;
+        size_t block;
+        pack_plan(memory, PACK_MAX_BLOCK, &nworkers, &nslots, &block);
+        if (pack_pipe_start(&pipe, 1, 0, nslots, nworkers, unpack_feed, u) != 0) { perror("unpack"); return -1; }
+        for (int have = 1; !pipe.error; have = 0) {
+            if (!have && (n = read_full(in_fd, head, sizeof(head))) == 0) break;
+            uint32_t total = pack_get_le32(head + 16);
+            if (n != PACK_GZ_HEADER || memcmp(head, td, 4) != 0 || memcmp(head + 10, td + 10, 6) != 0 ||
+                total < PACK_GZ_HEADER + 8 || total > PACK_MEMBER_LIMIT) {
+                fprintf(stderr, "unpack: truncated or mixed compressed data\n");
+                rc = -1;
+                break;
+            }
+            struct pack_block* b = pack_pipe_slot(&pipe, total);
+            if (!b) { perror("unpack"); rc = -1; break; }
+            memcpy(b->in, head, sizeof(head));
+            if (read_full(in_fd, b->in + sizeof(head), total - sizeof(head)) != (ssize_t)(total - sizeof(head))) {
+                fprintf(stderr, "unpack: truncated compressed data\n");
+                rc = -1;
+                break;
+            }
+            b->in_len = total;
+            pack_pipe_submit(&pipe);
+        }
+        if (pack_pipe_finish(&pipe) != 0) {
+            if (pipe.error == 1) fprintf(stderr, "unpack: corrupt compressed data\n");
+            rc = -1;
+        }
+        return rc;
+    }
+
+    unsigned char* in = malloc(PACK_READ_SIZE);
+    unsigned char* out = malloc(PACK_READ_SIZE);
+    if (!in || !out) { free(in); free(out); perror("unpack"); return -1; }
+    memcpy(in, head, n);
+    if (n >= 2 && head[0] == 0x1f && head[1] == 0x8b) {
+        z_stream zs;
+        int ended = 0;
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, 15 + 16) != Z_OK) { free(in); free(out); return -1; }
+        zs.next_in = in;
+        zs.avail_in = n;
+        for (;;) {
+            if (zs.avail_in == 0) {
+                ssize_t got = read(in_fd, in, PACK_READ_SIZE);
+                if (got < 0 && errno == EINTR) continue;
+                if (got <= 0) {
+                    if (got < 0) perror("unpack");
+                    else if (!ended) fprintf(stderr, "unpack: truncated compressed data\n");
+                    rc = got < 0 || !ended ? -1 : 0;
+                    break;
+                }
+                zs.next_in = in;
+                zs.avail_in = got;
+            }
+            if (ended) { // another member, or padding after the last
+                if (zs.next_in[0] != 0x1f) break;
+                inflateReset(&zs);
+                ended = 0;
+            }
+            zs.next_out = out;
+            zs.avail_out = PACK_READ_SIZE;
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            size_t produced = PACK_READ_SIZE - zs.avail_out;
+            if (produced > 0 && unpack_feed(u, out, produced) != 0) { rc = -1; break; }
+            if (ret == Z_STREAM_END) ended = 1;
+            else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                fprintf(stderr, "unpack: corrupt compressed data\n");
+                rc = -1;
+                break;
+            }
+        }
+        inflateEnd(&zs);
+    } else {
+        ssize_t got = n;
+        while (got > 0 && (rc = unpack_feed(u, in, got)) == 0) {
+            got = read_full(in_fd, in, PACK_READ_SIZE);
+        }
+        if (got < 0) { perror("unpack"); rc = -1; }
+    }
+    free(in);
+    free(out);
+    return rc;
+}
+
+int builtin_pack(int argc, char** argv) {
+    struct pack_writer w;
+    struct pack_pipe pipe;
+    struct pack_block plain;
+    struct sorted_walk walk;
+    struct timespec start;
+    struct stat st;
+    char* args[2] = { NULL, NULL };
+    char tmp[PATH_MAX_LEN];
+    const char* sw;
+    long long memory = PACK_DEFAULT_MEMORY;
+    int format = -1, level = -1, n = 0, nworkers = online_cpus(), nslots, bad = 0;
+
+    for (int j = 1; j < argc; j++) {
+        if ((sw = match_switch(argv[j], "F")) != NULL) {
+            if (strcasecmp(sw, "TAR") == 0) format = PACK_TAR;
+            else if (strcasecmp(sw, "CPIO") == 0) format = PACK_CPIO;
+            else bad = 1;
+        } else if ((sw = match_switch(argv[j], "Z")) != NULL) {
+            level = *sw >= '0' && *sw <= '9' && !sw[1] ? *sw - '0' : (bad = 1);
+        } else if ((sw = match_switch(argv[j], "J")) != NULL) nworkers = *sw ? atoi(sw) : online_cpus();
+        else if ((sw = match_switch(argv[j], "M")) != NULL) {
+            if ((memory = parse_size(sw)) < 0) bad = 1;
+        } else if (n < 2) args[n++] = argv[j];
+        else n = 3;
+    }
+    if (bad || n != 2) {
+        printf("Syntax: pack [/F:TAR|CPIO] [/Z:0-9] [/J[:n]] [/M:size] [dir] [archive]\n");
+        return 1;
+    }
+    if (format < 0) format = strcasestr(args[1], ".cpio") ? PACK_CPIO : PACK_TAR;
+    if (level < 0) { // plain for "x.tar" and "x.cpio", gzipped otherwise
+        size_t len = strlen(args[1]);
+        int plain_name = (len > 4 && strcasecmp(args[1] + len - 4, ".tar") == 0) ||
+                         (len > 5 && strcasecmp(args[1] + len - 5, ".cpio") == 0);
+        level = plain_name ? 0 : PACK_DEFAULT_LEVEL;
+    }
+    if (nworkers < 1) nworkers = 1;
+    if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+
+    memset(&w, 0, sizeof(w));
+    w.format = format;
+    int root_fd = open(args[0], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) { fprintf(stderr, "pack: %s: %s\n", args[0], strerror(errno)); return 1; }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", args[1]);
+    if ((w.out_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        fprintf(stderr, "pack: %s: %s\n", args[1], strerror(errno));
+        close(root_fd);
+        return 1;
+    }
+    if (fstat(w.out_fd, &st) == 0) { w.skip_dev = st.st_dev; w.skip_ino[0] = st.st_ino; }
+    if (stat(args[1], &st) == 0 && st.st_dev == w.skip_dev) w.skip_ino[1] = st.st_ino;
+
+    pack_plan(memory, PACK_MAX_BLOCK, &nworkers, &nslots, &w.block_size);
+    memset(&plain, 0, sizeof(plain));
+    if (level > 0) {
+        if (pack_pipe_start(&pipe, 0, level, nslots, nworkers, pack_emit_write, &w) == 0) {
+            w.pipe = &pipe;
+            if (!(w.cur = pack_pipe_slot(&pipe, w.block_size))) w.error = 1;
+        } else {
+            w.error = 1;
+        }
+    } else if ((plain.in = malloc(w.block_size)) != NULL) {
+        plain.in_cap = w.block_size;
+        w.cur = &plain;
+    } else {
+        w.error = 1;
+    }
+    if (w.error) {
+        perror("pack");
+        if (w.pipe) pack_pipe_finish(&pipe);
+        close(w.out_fd);
+        unlink(tmp);
+        close(root_fd);
+        return 1;
+    }
+
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(&walk, 0, sizeof(walk));
+    walk.cmd = "pack";
+    walk.visit = pack_visit;
+    walk.ctx = &w;
+    sorted_walk_dir(&walk, root_fd, "");
+    pack_finish_archive(&w);
+    if (w.pipe && pack_pipe_finish(&pipe) != 0) w.error = 1;
+    free(plain.in);
+    close(root_fd);
+    if (close(w.out_fd) != 0) w.error = 1;
+    if (w.error || rename(tmp, args[1]) != 0) {
+        fprintf(stderr, "pack: %s: %s\n", args[1], w.pipe && pipe.error == 1 ? "compression failed" : strerror(errno));
+        unlink(tmp);
+        return 1;
+    }
+    double secs = elapsed_since(&start);
+
+    char rate[32];
+    format_rate((double)w.bytes_in, secs, "B", rate, sizeof(rate));
+    printf("%8lld File(s), %lld dir(s), %lld bytes packed into %lld bytes in %.2f s (%s).\n",
+           w.files, w.dirs, w.bytes_in, w.bytes_out, secs, rate);
+    if (walk.errors > 0) printf("%8lld error(s).\n", walk.errors);
+    return walk.errors > 0 ? 1 : 0;
+}
+
+int builtin_unpack(int argc, char** argv) {
+    struct unpack_state u;
+    struct timespec start;
+    char* args[2] = { NULL, "." };
+    const char* sw;
+    long long memory = PACK_DEFAULT_MEMORY;
+    int n = 0, list = 0, nworkers = online_cpus(), bad = 0;
+
+    for (int j = 1; j < argc; j++) {
+        if (match_switch(argv[j], "L")) list = 1;
+        else if ((sw = match_switch(argv[j], "J")) != NULL) nworkers = *sw ? atoi(sw) : online_cpus();
+        else if ((sw = match_switch(argv[j], "M")) != NULL) {
+            if ((memory = parse_size(sw)) < 0) bad = 1;
+        } else if (n < 2) args[n++] = argv[j];
+        else n = 3;
+    }
+    if (bad || n < 1 || n > 2) {
+        printf("Syntax: unpack [/L] [/J[:n]] [/M:size] [archive] [dir]\n");
+        return 1;
+    }
+    if (nworkers < 1) nworkers = 1;
+    if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+
+    memset(&u, 0, sizeof(u));
+    u.format = -1;
+    u.list = list;
+    u.restore_owner = geteuid() == 0;
+    u.phase = UNPACK_NEED;
+    u.kind = UNPACK_HDR_DETECT;
+    u.need = 6;
+    u.next_size = -1;
+    u.out_fd = u.parent_fd = u.dest_fd = -1;
+    int in_fd = open(args[0], O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0) { fprintf(stderr, "unpack: %s: %s\n", args[0], strerror(errno)); return 1; }
+    if (!list) {
+        if (mkdir(args[1], 0755) != 0 && errno != EEXIST) {}
+        if ((u.dest_fd = open(args[1], O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "unpack: %s: %s\n", args[1], strerror(errno));
+            close(in_fd);
+            return 1;
+        }
+    }
+    if (!(u.hdr = malloc(512))) { perror("unpack"); close(in_fd); if (u.dest_fd >= 0) close(u.dest_fd); return 1; }
+    u.hdr_cap = 512;
+
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int rc = unpack_archive(in_fd, &u, memory, nworkers);
+    if (u.out_fd >= 0) { // cut short in the middle of a file
+        close(u.out_fd);
+        u.errors++;
+    }
+    if (rc == 0 && u.phase != UNPACK_END && !(u.phase == UNPACK_NEED && u.hdr_len == 0 && u.format >= 0)) {
+        fprintf(stderr, "unpack: %s: %s\n", args[0], u.format < 0 ? "empty archive" : "unexpected end of archive");
+        rc = -1;
+    }
+    double secs = elapsed_since(&start);
+    if (u.parent_fd >= 0 && u.parent_fd != u.dest_fd) close(u.parent_fd);
+    if (u.dest_fd >= 0) close(u.dest_fd);
+    close(in_fd);
+    free(u.hdr);
+
+    char rate[32];
+    format_rate((double)u.bytes, secs, "B", rate, sizeof(rate));
+    printf("%8lld File(s), %lld dir(s), %lld bytes %s in %.2f s (%s).\n",
+           u.files, u.dirs, u.bytes, list ? "listed" : "unpacked", secs, rate);
+    if (u.errors > 0) printf("%8lld error(s).\n", u.errors);
+    return rc != 0 || u.errors > 0 ? 1 : 0;
+}
+
+// --- INDEX ---
+// INDEX [dir] writes dir\.tdindex: for every trigram (three bytes, ASCII
+// case folded, not spanning a line) the ids of the files containing it, as
+// delta varints, with a sorted trigram table to look them up in the mapped
+// file. Files are listed in walk order, the same order MANIFEST uses, so
+// an update is a merge join of the walk with the old index: only files
+// whose size or date changed are read again (in parallel, one trigram
+// bitmap per worker), and the old postings are renumbered and merged with
+// theirs in one pass. INDEX /Q runs FINDSTR on the files that contain every
+// trigram of a pattern, plus any file added or changed since the index was
+// written, so answers match a full FINDSTR /S over the text files.
+
+// Maps an index and checks that its parts lie inside the file. Returns -1
+// with errno set (EINVAL: not a valid index).
+int index_open(struct index_map* m, const char* path) {
+    struct stat st;
+    memset(m, 0, sizeof(*m));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0) { close(fd); return -1; }
+    if ((size_t)st.st_size < sizeof(struct index_header)) { close(fd); errno = EINVAL; return -1; }
+    unsigned char* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+
+    const struct index_header* h = (const struct index_header*)base;
+    uint64_t len = st.st_size;
+    int ok = memcmp(h->magic, INDEX_MAGIC, 8) == 0 &&
+             h->names_off <= len && h->names_len <= len - h->names_off &&
+             (h->names_off - sizeof(*h)) / sizeof(struct index_file_rec) >= h->nfiles &&
+             h->names_off >= sizeof(*h) && h->names_off % 8 == 0 &&
+             (h->names_len == 0 ? h->nfiles == 0 : base[h->names_off + h->names_len - 1] == '\0') &&
+             h->post_off <= len && h->post_len <= len - h->post_off &&
+             h->tris_off <= len && h->tris_off % 8 == 0 &&
+             (len - h->tris_off) / sizeof(struct index_tri_rec) >= h->ntrigrams;
+    m->files = (const struct index_file_rec*)(base + sizeof(*h));
+    for (uint32_t i = 0; ok && i < h->nfiles; i++) ok = m->files[i].name_off < h->names_len;
+    if (!ok) {
+        munmap(base, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    m->base = base;
+    m->len = st.st_size;
+    m->hdr = h;
+    m->names = (const char*)base + h->names_off;
+    m->post = base + h->post_off;
+    m->tris = (const struct index_tri_rec*)(base + h->tris_off);
+    return 0;
+}
+
+void index_close(struct index_map* m) {
+    if (m->base) munmap(m->base, m->len);
+    m->base = NULL;
+}
+
+const struct index_tri_rec* index_lookup(const struct index_map* m, uint32_t tri) {
+    size_t lo = 0, hi = m->hdr->ntrigrams;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (m->tris[mid].tri < tri) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < m->hdr->ntrigrams && m->tris[lo].tri == tri ? &m->tris[lo] : NULL;
+}
+
+// Decodes one varint; NULL if it runs past end or does not fit.
+const unsigned char* index_varint(const unsigned char* p, const unsigned char* end, uint32_t* v) {
+    uint32_t x = 0;
+    for (int shift = 0; p < end && shift < 32; shift += 7) {
+        unsigned char c = *p++;
+        x |= (uint32_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *v = x;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+void index_put_varint(FILE* out, uint32_t v, uint64_t* len) {
+    while (v >= 0x80) {
+        putc_unlocked((v & 0x7f) | 0x80, out);
+        v >>= 7;
+        (*len)++;
+    }
+    putc_unlocked(v, out);
+    (*len)++;
+}
+
+// Lists the tree's regular files, and joins each with its record in the
+// old index: both are in walk order, so it is at or after old_pos.
+int index_visit(struct sorted_walk* walk, int dirfd, const char* name, const char* path, const struct stat* st) {
+    struct index_job* job = walk->ctx;
+    const struct index_map* m = &job->old;
+    (void)dirfd; (void)name;
+    if (S_ISDIR(st->st_mode)) return 1;
+    if (!S_ISREG(st->st_mode) || strcmp(path, INDEX_NAME) == 0 || strcmp(path, INDEX_NAME ".tmp") == 0) return 0;
+
+    if (job->count == job->cap) {
+        size_t cap = job->cap ? job->cap * 2 : 1024;
+        struct index_entry* grown = realloc(job->files, cap * sizeof(*grown));
+        if (!grown) {
+            fprintf(stderr, "index: %s: %s\n", path, strerror(ENOMEM));
+            walk->errors++;
+            return 0;
+        }
+        job->files = grown;
+        job->cap = cap;
+    }
+    struct index_entry* e = &job->files[job->count];
+    memset(e, 0, sizeof(*e));
+    if (!(e->path = strdup(path))) {
+        fprintf(stderr, "index: %s: %s\n", path, strerror(ENOMEM));
+        walk->errors++;
+        return 0;
+    }
+    e->size = st->st_size;
+    e->mtime_sec = st->st_mtim.tv_sec;
+    e->mtime_nsec = st->st_mtim.tv_nsec;
+    e->old_id = -1;
+    job->count++;
+
+    if (!m->base) return 0;
+    while (job->old_pos < m->hdr->nfiles && mf_path_compare(m->names + m->files[job->old_pos].name_off, path) < 0) job->old_pos++;
+    if (job->old_pos < m->hdr->nfiles) {
+        const struct index_file_rec* r = &m->files[job->old_pos];
+        if (strcmp(m->names + r->name_off, path) == 0 && r->size == e->size &&
+            r->mtime_sec == e->mtime_sec && r->mtime_nsec == (uint32_t)e->mtime_nsec) {
+            e->old_id = job->old_pos;
+            e->flags = r->flags;
+        }
+    }
+    return 0;
+}
+
+int index_u32_compare(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Collects the distinct trigrams of one file. A file that cannot be read
+// gets an impossible date, so every query scans it and the next INDEX
+// tries it again.
+void index_scan_file(struct index_job* job, struct index_entry* e, int worker) {
+    uint8_t* seen = job->seen[worker];
+    uint32_t* list = NULL;
+    size_t n = 0, cap = 0;
+    int err = 0;
+    if (!seen && !(seen = job->seen[worker] = calloc(INDEX_TRIGRAMS / 8, 1))) {
+        err = ENOMEM;
+        goto fail;
+    }
+    int fd = openat(job->root_fd, e->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        err = errno;
+        goto fail;
+    }
+    if (e->size == 0) {
+        close(fd);
+        __atomic_add_fetch(&job->scanned, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    const unsigned char* map = mmap(NULL, e->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        err = errno;
+        goto fail;
+    }
+    madvise((void*)map, e->size, MADV_SEQUENTIAL);
+    if (memchr(map, 0, e->size < INDEX_SNIFF ? e->size : INDEX_SNIFF)) {
+        e->flags |= INDEX_BINARY;
+        __atomic_add_fetch(&job->binary, 1, __ATOMIC_RELAXED);
+        munmap((void*)map, e->size);
+        return;
+    }
+
+    uint32_t t = 0;
+    int run = 0;
+    for (long long i = 0; i < e->size; i++) {
+        unsigned char c = map[i];
+        if (c == '\n') { run = 0; continue; }
+        t = ((t << 8) | (c >= 'A' && c <= 'Z' ? c + 32 : c)) & (INDEX_TRIGRAMS - 1);
+        if (run < 2) { run++; continue; }
+        if (seen[t >> 3] & (1 << (t & 7))) continue;
+        if (n == cap) {
+            uint32_t* grown = realloc(list, (cap = cap ? cap * 2 : 1024) * sizeof(*grown));
+            if (!grown) { err = ENOMEM; break; }
+            list = grown;
+        }
+        seen[t >> 3] |= 1 << (t & 7);
+        list[n++] = t;
+    }
+    munmap((void*)map, e->size);
+    for (size_t i = 0; i < n; i++) seen[list[i] >> 3] = 0;
+    if (err) goto fail;
+    if (n > 0) qsort(list, n, sizeof(*list), index_u32_compare);
+    e->tris = list;
+    e->ntris = n;
+    __atomic_add_fetch(&job->scanned, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&job->bytes, e->size, __ATOMIC_RELAXED);
+    return;
+
+fail:
+    fprintf(stderr, "index: %s: %s\n", e->path, strerror(err));
+    __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+    free(list);
+    e->mtime_sec = -1;
+}
+
+void index_task_run(struct task_pool* pool, struct task* base, int worker) {
+    struct index_task* t = (struct index_task*)base;
+    (void)pool;
+    index_scan_file(t->job, t->file, worker);
+}
+
+void index_seed_run(struct task_pool* pool, struct task* base, int worker) {
+    struct index_seed* seed = (struct index_seed*)base;
+    for (size_t i = 0; i < seed->count; i++) task_pool_push(pool, worker, &seed->tasks[i].base);
+}
+
+// Writes the new index to path. Trigrams are taken in ranges of
+// INDEX_RANGE: a counting sort gathers, per trigram, the scanned files
+// holding it (in id order, as the files are visited in order), and those
+// are merged with the old index's postings for it, renumbered (and still
+// ascending, as both indexes are in walk order). Returns 0, -1 on a write
+// error, or -2 if the old index turns out to be damaged.
+int index_write(struct index_job* job, const char* path, long long* ntrigrams, long long* written) {
+    const struct index_map* old = &job->old;
+    uint32_t old_n = old->base ? old->hdr->nfiles : 0;
+    uint32_t old_tris = old->base ? old->hdr->ntrigrams : 0;
+    struct index_header h;
+    struct index_tri_rec* tris = NULL;
+    size_t ntris = 0, tris_cap = 0, oi = 0, nscanned = 0;
+    uint32_t *ids = NULL, *fresh = NULL;
+    size_t ids_cap = 0, fresh_cap = 0;
+    uint64_t post_len = 0;
+    int rc = 0;
+
+    int32_t* remap = malloc((old_n ? old_n : 1) * sizeof(*remap));
+    uint32_t* scanned = malloc((job->count ? job->count : 1) * sizeof(*scanned));
+    uint32_t* bucket = malloc((INDEX_RANGE + 1) * sizeof(*bucket));
+    FILE* out = fopen(path, "we");
+    if (!remap || !scanned || !bucket || !out) {
+        if (out) fclose(out);
+        free(remap);
+        free(scanned);
+        free(bucket);
+        return -1;
+    }
+    setvbuf(out, NULL, _IOFBF, INDEX_OUT_BUF_SIZE);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, 8);
+    h.nfiles = job->count;
+    h.names_off = (sizeof(h) + job->count * sizeof(struct index_file_rec) + 7) & ~(uint64_t)7;
+    fwrite(&h, sizeof(h), 1, out);
+    for (size_t i = 0; i < job->count; i++) {
+        const struct index_entry* e = &job->files[i];
+        struct index_file_rec r = { e->size, e->mtime_sec, e->mtime_nsec, h.names_len, e->flags, 0 };
+        fwrite(&r, sizeof(r), 1, out);
+        h.names_len += strlen(e->path) + 1;
+    }
+    for (uint64_t pos = sizeof(h) + job->count * sizeof(struct index_file_rec); pos < h.names_off; pos++) putc(0, out);
+    for (size_t i = 0; i < job->count; i++) fwrite(job->files[i].path, strlen(job->files[i].path) + 1, 1, out);
+    h.post_off = h.names_off + h.names_len;
+
+    for (uint32_t i = 0; i < old_n; i++) remap[i] = -1;
+    for (size_t i = 0; i < job->count; i++) {
+        struct index_entry* e = &job->files[i];
+        if (e->old_id >= 0) remap[e->old_id] = i;
+        e->next = 0;
+        if (e->ntris > 0) scanned[nscanned++] = i;
+    }
+
+    for (uint32_t lo = 0; lo < INDEX_TRIGRAMS && rc == 0; lo += INDEX_RANGE) {
+        uint32_t hi = lo + INDEX_RANGE;
+        // Count, then place the scanned files' trigrams in the range.
+        memset(bucket, 0, (INDEX_RANGE + 1) * sizeof(*bucket));
+        for (size_t s = 0; s < nscanned; s++) {
+            const struct index_entry* e = &job->files[scanned[s]];
+            for (uint32_t j = e->next; j < e->ntris && e->tris[j] < hi; j++) bucket[e->tris[j] - lo + 1]++;
+        }
+        for (uint32_t t = 0; t < INDEX_RANGE; t++) bucket[t + 1] += bucket[t];
+        if (fresh_cap < bucket[INDEX_RANGE]) {
+            free(fresh);
+            if (!(fresh = malloc((fresh_cap = bucket[INDEX_RANGE]) * sizeof(*fresh)))) { rc = -1; break; }
+        }
+        for (size_t s = 0; s < nscanned; s++) {
+            struct index_entry* e = &job->files[scanned[s]];
+            for (; e->next < e->ntris && e->tris[e->next] < hi; e->next++) fresh[bucket[e->tris[e->next] - lo]++] = scanned[s];
+        }
+        // Now bucket[t] ends trigram lo + t's files, which start where
+        // the previous one's end.
+
+        for (uint32_t t = 0; t < INDEX_RANGE; t++) {
+            uint32_t tri = lo + t, count = 0, prev = 0;
+            size_t k = t > 0 ? bucket[t - 1] : 0, kend = bucket[t], nold = 0, o = 0;
+            if (oi < old_tris && old->tris[oi].tri == tri) {
+                const struct index_tri_rec* r = &old->tris[oi++];
+                const unsigned char* p = old->post + (r->off <= old->hdr->post_len ? r->off : old->hdr->post_len);
+                const unsigned char* end = old->post + old->hdr->post_len;
+                uint32_t id = 0;
+                if (r->count > old_n) { rc = -2; break; }
+                if (ids_cap < r->count) {
+                    free(ids);
+                    if (!(ids = malloc((ids_cap = r->count) * sizeof(*ids)))) { rc = -1; break; }
+                }
+                for (uint32_t j = 0; j < r->count && p; j++) {
+                    uint32_t v;
+                    if ((p = index_varint(p, end, &v)) == NULL || (id += v) >= old_n) break;
+                    if (remap[id] >= 0) ids[nold++] = remap[id];
+                }
+                if (!p || id >= old_n) { rc = -2; break; }
+            } else if (oi < old_tris && old->tris[oi].tri < tri) {
+                rc = -2; // not sorted
+                break;
+            }
+            if (k == kend && nold == 0) continue; // absent, or only in files that are gone
+
+            uint64_t off = post_len;
+            while (k < kend || o < nold) {
+                uint32_t id = o == nold || (k < kend && fresh[k] < ids[o]) ? fresh[k++] : ids[o++];
+                index_put_varint(out, count == 0 ? id : id - prev, &post_len);
+                prev = id;
+                count++;
+            }
+            if (ntris == tris_cap) {
+                struct index_tri_rec* grown = realloc(tris, (tris_cap = tris_cap ? tris_cap * 2 : 4096) * sizeof(*grown));
+                if (!grown) { rc = -1; break; }
+                tris = grown;
+            }
+            tris[ntris].tri = tri;
+            tris[ntris].count = count;
+            tris[ntris].off = off;
+            ntris++;
+        }
+    }
+
+    if (rc == 0) {
+        h.post_len = post_len;
+        h.tris_off = (h.post_off + post_len + 7) & ~(uint64_t)7;
+        for (uint64_t pos = h.post_off + post_len; pos < h.tris_off; pos++) putc(0, out);
+        h.ntrigrams = ntris;
+        fwrite(tris, sizeof(*tris), ntris, out);
+        if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, out) != 1 || fflush(out) != 0 || ferror(out)) rc = -1;
+        *ntrigrams = ntris;
+        *written = h.tris_off + ntris * sizeof(*tris);
+    }
+    if (fclose(out) != 0 && rc == 0) rc = -1;
+    free(tris);
+    free(ids);
+    free(fresh);
+    free(bucket);
+    free(scanned);
+    free(remap);
+    return rc;
+}
+
+// Runs FINDSTR over the files the index cannot rule out: those holding
+// every trigram of some pattern, and those added or changed since the index
+// was written. Binary files are left out.
+int index_query(struct index_job* job, struct findstr_job* fs, const char* dir) {
+    const struct index_map* m = &job->old;
+    uint32_t n = m->hdr->nfiles;
+    const unsigned char* end = m->post + m->hdr->post_len;
+    unsigned char* cand = calloc(n ? n : 1, 1);
+    uint32_t* hits = malloc((n ? n : 1) * sizeof(*hits));
+    char** paths = malloc((job->count ? job->count : 1) * sizeof(*paths));
+    size_t npaths = 0;
+    if (!cand || !hits || !paths) {
+        free(cand);
+        free(hits);
+        free(paths);
+        return -1;
+    }
+
+    for (int i = 0; i < fs->npats; i++) {
+        const struct findstr_pat* pat = &fs->pats[i];
+        uint32_t* tris = malloc(pat->len * sizeof(*tris));
+        size_t nt = 0;
+        uint32_t t = 0;
+        if (!tris) continue;
+        for (size_t j = 0; j < pat->len; j++) {
+            unsigned char c = pat->text[j];
+            t = ((t << 8) | (c >= 'A' && c <= 'Z' ? c + 32 : c)) & (INDEX_TRIGRAMS - 1);
+            if (j >= 2) tris[nt++] = t;
+        }
+        qsort(tris, nt, sizeof(*tris), index_u32_compare);
+        size_t uniq = 0;
+        for (size_t j = 0; j < nt; j++) {
+            if (uniq == 0 || tris[uniq - 1] != tris[j]) tris[uniq++] = tris[j];
+        }
+        if (uniq == 0) { // shorter than a trigram: no help
+            memset(cand, 1, n);
+            free(tris);
+            continue;
+        }
+        memset(hits, 0, n * sizeof(*hits));
+        size_t j;
+        for (j = 0; j < uniq; j++) {
+            const struct index_tri_rec* r = index_lookup(m, tris[j]);
+            if (!r || r->off > m->hdr->post_len) break;
+            const unsigned char* p = m->post + r->off;
+            uint32_t id = 0;
+            for (uint32_t k = 0; k < r->count; k++) {
+                uint32_t v;
+                if ((p = index_varint(p, end, &v)) == NULL || (id += v) >= n) break;
+                hits[id]++;
+            }
+        }
+        if (j == uniq) {
+            for (uint32_t id = 0; id < n; id++) {
+                if (hits[id] == uniq) cand[id] = 1;
+            }
+        }
+        free(tris);
+    }
+
+    for (size_t i = 0; i < job->count; i++) {
+        const struct index_entry* e = &job->files[i];
+        if (e->old_id >= 0 && ((e->flags & INDEX_BINARY) || !cand[e->old_id])) continue;
+        size_t len = strlen(dir) + strlen(e->path) + 2;
+        if (!(paths[npaths] = malloc(len))) continue;
+        snprintf(paths[npaths++], len, "%s/%s", dir, e->path);
+    }
+    free(cand);
+    free(hits);
+
+    fs->flags |= FINDSTR_SHOW_NAMES;
+    fs->find = findstr_select_kernel();
+    pthread_mutex_init(&fs->out_lock, NULL);
+    struct findstr_seed seed = { { findstr_seed_run }, fs, paths, npaths, calloc(npaths ? npaths : 1, sizeof(struct wildcard)) };
+    int nworkers = online_cpus();
+    if (npaths > 0 && seed.patterns) task_pool_run(nworkers < MAX_WORKERS ? nworkers : MAX_WORKERS, &seed.base);
+    free(seed.patterns);
+    pthread_mutex_destroy(&fs->out_lock);
+    for (size_t i = 0; i < npaths; i++) free(paths[i]);
+    free(paths);
+    return 0;
+}
+
+int builtin_index(int argc, char** argv) {
+    struct index_job job;
+    struct findstr_job fs;
+    struct sorted_walk walk;
+    struct timespec start;
+    char dir_buf[PATH_MAX_LEN], path[PATH_MAX_LEN], tmp[PATH_MAX_LEN + 8];
+    const char* words = NULL;
+    const char* dir = NULL;
+    const char* sw;
+    int query = 0, literal = 0, bad = 0, nworkers = online_cpus(), rc = 0;
+
+    memset(&job, 0, sizeof(job));
+    memset(&fs, 0, sizeof(fs));
+    for (int j = 1; j < argc; j++) {
+        if (match_switch(argv[j], "Q")) query = 1;
+        else if (match_switch(argv[j], "I")) fs.flags |= FINDSTR_IGNORE_CASE;
+        else if (match_switch(argv[j], "N")) fs.flags |= FINDSTR_LINE_NUMBERS;
+        else if (match_switch(argv[j], "M")) fs.flags |= FINDSTR_NAMES_ONLY;
+        else if ((sw = match_switch(argv[j], "C")) != NULL && *sw) literal = 1;
+        else if ((sw = match_switch(argv[j], "J")) != NULL) nworkers = *sw ? atoi(sw) : online_cpus();
+        else if (argv[j][0] == '/') bad = 1;
+        else if (query && !literal && !words) words = argv[j];
+        else if (!dir) dir = argv[j];
+        else bad = 1;
+    }
+    // As in FINDSTR, /I may follow the strings it applies to.
+    for (int j = 1; j < argc && query; j++) {
+        if ((sw = match_switch(argv[j], "C")) != NULL && *sw) findstr_add_pattern(&fs, sw, strlen(sw));
+    }
+    for (const char* w = words; w && *w;) {
+        w += strspn(w, " \t");
+        size_t n = strcspn(w, " \t");
+        findstr_add_pattern(&fs, w, n);
+        w += n;
+    }
+    if (bad || (query && fs.npats == 0) || (!query && (fs.flags || literal))) {
+        printf("Syntax: INDEX [/J[:n]] [dir]\n");
+        printf("        INDEX /Q [/I] [/N] [/M] [/C:text] [\"words\"] [dir]\n");
+        for (int i = 0; i < fs.npats; i++) free(fs.pats[i].text);
+        free(fs.pats);
+        return 1;
+    }
+    if (nworkers < 1) nworkers = 1;
+    if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+    dir = resolve_path(dir ? dir : ".", dir_buf, sizeof(dir_buf));
+    snprintf(path, sizeof(path), "%s/%s", dir, INDEX_NAME);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    if ((job.root_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "index: %s: %s\n", dir, strerror(errno));
+        rc = 1;
+        goto out;
+    }
+    if (index_open(&job.old, path) != 0 && (query || errno != ENOENT)) {
+        int err = errno;
+        fprintf(stderr, "index: %s: %s\n", path, err == ENOENT ? "no index; run INDEX first" :
+                err == EINVAL ? "not a valid index" : strerror(err));
+        if (query || err != EINVAL) { rc = 1; goto out; }
+    }
+
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(&walk, 0, sizeof(walk));
+    walk.cmd = "index";
+    walk.visit = index_visit;
+    walk.ctx = &job;
+    sorted_walk_dir(&walk, job.root_fd, "");
+    job.errors += walk.errors;
+
+    if (query) {
+        if (index_query(&job, &fs, dir) != 0) perror("index");
+        rc = fs.matched_files > 0 ? 0 : 1;
+        goto out;
+    }
+
+    size_t unchanged = 0;
+    for (size_t i = 0; i < job.count; i++) unchanged += job.files[i].old_id >= 0;
+    if (job.old.base && unchanged == job.count && unchanged == job.old.hdr->nfiles && walk.errors == 0) {
+        printf("%8zu File(s); the index is up to date.\n", job.count);
+        goto out;
+    }
+    long long ntrigrams = 0, written = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        struct index_seed seed;
+        struct index_task* tasks = malloc((job.count ? job.count : 1) * sizeof(*tasks));
+        if (!tasks) { rc = -1; break; }
+        seed.base.run = index_seed_run;
+        seed.tasks = tasks;
+        seed.count = 0;
+        for (size_t i = 0; i < job.count; i++) {
+            if (job.files[i].old_id >= 0) continue;
+            struct index_task* t = &tasks[seed.count++];
+            t->base.run = index_task_run;
+            t->job = &job;
+            t->file = &job.files[i];
+        }
+        if (seed.count > 0) task_pool_run(nworkers, &seed.base);
+        free(tasks);
+        if ((rc = index_write(&job, tmp, &ntrigrams, &written)) != -2) break;
+        // The old postings do not decode: read everything instead.
+        fprintf(stderr, "index: %s: not a valid index\n", path);
+        index_close(&job.old);
+        for (size_t i = 0; i < job.count; i++) job.files[i].old_id = -1;
+    }
+    if (rc != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "index: %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        rc = 1;
+        goto out;
+    }
+    double secs = elapsed_since(&start);
+    char rate[32];
+    format_rate((double)job.bytes, secs, "B", rate, sizeof(rate));
+    printf("%8zu File(s), %lld read (%lld bytes, %lld binary) in %.2f s (%s).\n",
+           job.count, job.scanned + job.binary, job.bytes, job.binary, secs, rate);
+    printf("%8lld trigrams, %lld bytes of index.\n", ntrigrams, written);
+    if (job.errors > 0) {
+        printf("%8lld error(s).\n", job.errors);
+        rc = 1;
+    }
+
+out:
+    if (job.root_fd >= 0) close(job.root_fd);
+    index_close(&job.old);
+    for (size_t i = 0; i < job.count; i++) {
+        free(job.files[i].path);
+        free(job.files[i].tris);
+    }
+    free(job.files);
+    for (int i = 0; i < MAX_WORKERS; i++) free(job.seen[i]);
+    for (int i = 0; i < fs.npats; i++) free(fs.pats[i].text);
+    free(fs.pats);
+    return rc;
+}
+
+// --- BOOTLOG ---
+
+// Ends the boot timeline: the first interactive prompt since boot is its
+// last event. Later shells find the log closed.
+void bootlog_first_prompt() {
+    static int done;
+    struct timespec ts;
+    if (done) return;
+    done = 1;
+    int fd = open(BOOTLOG_PATH, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return;
+    struct bootlog* log = mmap(NULL, sizeof(*log), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (log == MAP_FAILED) return;
+    if (memcmp(log->magic, BOOTLOG_MAGIC, sizeof(log->magic)) == 0 &&
+        __atomic_exchange_n(&log->closed, 1, __ATOMIC_ACQ_REL) == 0) {
+        clock_gettime(CLOCK_BOOTTIME, &ts);
+        uint32_t i = __atomic_fetch_add(&log->next, 1, __ATOMIC_ACQ_REL) % BOOTLOG_EVENTS;
+        log->events[i].ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        snprintf(log->events[i].what, sizeof(log->events[i].what), "cmd: first prompt");
+    }
+    munmap(log, sizeof(*log));
+}
+
+int bootlog_event_compare(const void* a, const void* b) {
+    int64_t x = ((const struct bootlog_event*)a)->ns, y = ((const struct bootlog_event*)b)->ns;
+    return x < y ? -1 : x > y;
+}
+
+// BOOTLOG [/R]: the timeline in milliseconds since the kernel started, with
+// the gap to the previous event; /R prints "microseconds event" lines for
+// scripts.
+int builtin_bootlog(int argc, char** argv) {
+    struct bootlog_event events[BOOTLOG_EVENTS];
+    int raw = 0;
+    for (int j = 1; j < argc; j++) {
+        if (match_switch(argv[j], "R")) raw = 1;
+        else {
+            printf("Syntax: BOOTLOG [/R]\n");
+            return 1;
+        }
+    }
+    int fd = open(BOOTLOG_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "bootlog: %s: %s\n", BOOTLOG_PATH, strerror(errno));
+        return 1;
+    }
+    struct bootlog* log = mmap(NULL, sizeof(*log), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (log == MAP_FAILED || memcmp(log->magic, BOOTLOG_MAGIC, sizeof(log->magic)) != 0) {
+        fprintf(stderr, "bootlog: %s is not a boot timeline\n", BOOTLOG_PATH);
+        if (log != MAP_FAILED) munmap(log, sizeof(*log));
+        return 1;
+    }
+    uint32_t total = __atomic_load_n(&log->next, __ATOMIC_ACQUIRE);
+    int count = total < BOOTLOG_EVENTS ? (int)total : BOOTLOG_EVENTS;
+    memcpy(events, log->events, sizeof(events));
+    int closed = log->closed;
+    munmap(log, sizeof(*log));
+    // Slots are claimed in order but stamped by different processes, and
+    // the kernel's milestones are added after init's start: order by time.
+    qsort(events, count, sizeof(events[0]), bootlog_event_compare);
+
+    if (!raw) {
+        printf("\n   Time (ms)      Delta  Event\n");
+        if (total > BOOTLOG_EVENTS) printf("  (%u earliest events overwritten)\n", total - BOOTLOG_EVENTS);
+    }
+    int64_t prev = 0;
+    for (int i = 0; i < count; i++) {
+        events[i].what[sizeof(events[i].what) - 1] = '\0';
+        if (raw) printf("%lld %s\n", (long long)(events[i].ns / 1000), events[i].what);
+        else printf("%12.3f %+10.3f  %s\n", events[i].ns / 1e6, (events[i].ns - prev) / 1e6, events[i].what);
+        prev = events[i].ns;
+    }
+    if (!raw && !closed) printf("  (still booting: no prompt yet)\n");
+    return 0;
+}
+
+// --- CACHE ---
+
+// Counts the pages of an open file that are in the page cache (mincore on
+// a mapping that is never touched, so nothing is read in).
+int cache_measure(int fd, long long* size, long long* resident) {
+    struct stat st;
+    long page = sysconf(_SC_PAGESIZE);
+    *size = *resident = 0;
+    if (fstat(fd, &st) != 0) return -1;
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) return 0;
+    size_t pages = (st.st_size + page - 1) / page;
+    unsigned char* vec = malloc(pages);
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    int rc = vec && map != MAP_FAILED && mincore(map, st.st_size, vec) == 0 ? 0 : -1;
+    if (rc == 0) {
+        long long n = 0;
+        for (size_t i = 0; i < pages; i++) n += vec[i] & 1;
+        *size = st.st_size;
+        *resident = n * page < st.st_size ? n * page : st.st_size; // the last page is partial
+    }
+    if (map != MAP_FAILED) munmap(map, st.st_size);
+    free(vec);
+    return rc;
+}
+
+void cache_report(struct cache_totals* t, int fd, const char* path) {
+    long long size, resident;
+    if (cache_measure(fd, &size, &resident) != 0) {
+        fprintf(stderr, "cache: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    printf("%10lld KB %10lld KB %6.1f%%  %s\n", resident / 1024, size / 1024,
+           size ? resident * 100.0 / size : 0.0, path);
+    t->files++;
+    t->bytes += size;
+    t->resident += resident;
+}
+
+int cache_visit(struct sorted_walk* walk, int dirfd, const char* name, const char* path, const struct stat* st) {
+    struct cache_totals* t = walk->ctx;
+    char full[PATH_MAX_LEN];
+    if (S_ISDIR(st->st_mode)) return t->recurse;
+    if (!S_ISREG(st->st_mode)) return 0;
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    snprintf(full, sizeof(full), "%s/%s", t->root, path);
+    if (fd < 0) {
+        fprintf(stderr, "cache: %s: %s\n", full, strerror(errno));
+        walk->errors++;
+        return 0;
+    }
+    cache_report(t, fd, full);
+    close(fd);
+    return 0;
+}
+
+// CACHE [/S] [paths] | /P: page-cache residency of files, of the files in
+// directories (/S: whole trees), or of the boot preload profile's files.
+int builtin_cache(int argc, char** argv) {
+    struct cache_totals t;
+    struct sorted_walk walk;
+    char buf[PATH_MAX_LEN], line[PATH_MAX_LEN + 64], last[sizeof(line)] = "";
+    int profile = 0, npaths = 0, bad = 0, rc = 0;
+    const char** paths = calloc(argc + 1, sizeof(*paths));
+
+    if (!paths) return 1;
+    memset(&t, 0, sizeof(t));
+    for (int j = 1; j < argc; j++) {
+        if (match_switch(argv[j], "S")) t.recurse = 1;
+        else if (match_switch(argv[j], "P")) profile = 1;
+        else if (argv[j][0] != '/' || access(argv[j], F_OK) == 0) paths[npaths++] = argv[j];
+        else bad = 1;
+    }
+    if (bad || (profile && npaths > 0)) {
+        printf("Syntax: CACHE [/S] [paths]\n");
+        printf("        CACHE /P\n");
+        free(paths);
+        return 1;
+    }
+    if (!profile && npaths == 0) paths[npaths++] = ".";
+
+    // "offset length path" lines, a file's ranges together.
+    FILE* in = profile ? fopen(CACHE_PRELOAD_PROFILE, "re") : NULL;
+    if (profile && !in) {
+        fprintf(stderr, "cache: %s: %s\n", CACHE_PRELOAD_PROFILE, strerror(errno));
+        free(paths);
+        return 1;
+    }
+    printf("\n%13s %13s %7s  %s\n", "Cached", "Size", "%", "File");
+    if (in) {
+        while (fgets(line, sizeof(line), in)) {
+            char* path = line;
+            line[strcspn(line, "\n")] = '\0';
+            if (line[0] == '#') continue;
+            for (int field = 0; field < 2 && path; field++) {
+                path = strchr(path, ' ');
+                if (path) path++;
+            }
+            if (!path || strcmp(path, last) == 0) continue;
+            memcpy(last, path, strlen(path) + 1); // a tail of line, so it fits
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                fprintf(stderr, "cache: %s: %s\n", path, strerror(errno));
+                rc = 1;
+                continue;
+            }
+            cache_report(&t, fd, path);
+            close(fd);
+        }
+        fclose(in);
+    }
+    for (int i = 0; i < npaths; i++) {
+        const char* path = resolve_path(paths[i], buf, sizeof(buf));
+        struct stat st;
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            fprintf(stderr, "cache: %s: %s\n", paths[i], strerror(errno));
+            if (fd >= 0) close(fd);
+            rc = 1;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            memset(&walk, 0, sizeof(walk));
+            walk.cmd = "cache";
+            walk.visit = cache_visit;
+            walk.ctx = &t;
+            t.root = path;
+            sorted_walk_dir(&walk, fd, "");
+            if (walk.errors) rc = 1;
+        } else {
+            cache_report(&t, fd, path);
+        }
+        close(fd);
+    }
+    printf("%10lld KB %10lld KB %6.1f%%  %lld file(s)\n", t.resident / 1024, t.bytes / 1024,
+           t.bytes ? t.resident * 100.0 / t.bytes : 0.0, t.files);
+    free(paths);
+    return rc;
 }
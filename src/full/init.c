@@ -1,14 +1,900 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/klog.h>
+#include <sys/fanotify.h>
+#include <sys/ioctl.h>
+#include <termios.h>
 #include <sys/reboot.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <signal.h>
 
 const char* SHELL_PATH = "/bin/cmd";
+const char* SERVICE_DIR = "/TinyDOS/Services";
+const char* CONSOLES_DEFAULT = "console";
+const char* PRELOAD_PROFILE = "/TinyDOS/Preload.lst"; // also read by cmd.c's CACHE /P
 
-void handle_shutdown_signal(int sig) {
-    printf("\nInit: Shutdown signal received. Powering off.\n");
+#define RESPAWN_STABLE_MS 5000     // a process that lived this long is respawned at once
+#define RESPAWN_MIN_DELAY_MS 250   // then doubling per quick exit...
+#define RESPAWN_MAX_DELAY_MS 16000 // ...up to this
+#define FORK_RETRY_MS 1000
+#define SHUTDOWN_GRACE_MS 3000     // between SIGTERM and SIGKILL to everything
+
+// Init is a single event loop: SIGCHLD, SIGTERM and SIGINT are blocked and
+// read from a signalfd, so nothing runs in signal context. Every child that
+// dies is reaped as it does (orphans are reparented here), and the shell is
+// started again right away unless it keeps exiting within seconds.
+//
+// "tinydos.consoles=console,tty2,ttyS0,hvc0" on the kernel command line runs
+// a shell on each of those ttys, each in its own session with the tty as
+// its controlling terminal. "console" is init's own stdin/stdout, where
+// the shell starts at once, as it always has; on the others it starts at
+// the first keypress, so idle consoles cost nothing. A shell that exits
+// leaves its tty waiting for a key again.
+//
+// Services are the SERVICE_DIR\*.svc files, one "Key=Value" per line:
+//   Exec=/bin/klogd -n       command line (no shell; "quotes" group words)
+//   After=syslog             start once these are ready, if they exist
+//   Requires=syslog          the same, but do not start if one failed
+//   Restart=on-failure       or no, always
+//   Ready=started            or notify (the service writes a byte to the fd
+//                            named by $READY_FD), exit (it has exited with 0)
+//   StopTimeout=5            seconds from SIGTERM to SIGKILL at shutdown
+// Everything whose dependencies are ready starts at once, alongside the
+// shell, so independent services come up in parallel. At shutdown each
+// service is stopped as soon as nothing running depends on it.
+//
+// Boot preload: with "tinydos.preload=record[:seconds]" init notes every
+// file opened during the first seconds of boot (fanotify), then writes the
+// parts of them that are in the page cache (mincore) to PRELOAD_PROFILE.
+// On later boots a few children read those ranges ahead while services
+// and shells start, so cold binaries come off the disk in parallel rather
+// than a page fault at a time. "tinydos.preload=off" does neither.
+
+// Boot timeline: init and cmd add events to a 4 KiB ring in BOOTLOG_PATH,
+// on the tmpfs init mounts at /run, and cmd's BOOTLOG prints it. Times are
+// CLOCK_BOOTTIME, so they count from the kernel's start like its log does.
+// cmd closes the log at its first prompt. The layout is repeated in cmd.c.
+#define BOOTLOG_PATH "/run/bootlog"
+#define BOOTLOG_MAGIC "TDBOOT1"
+#define BOOTLOG_EVENTS 63
+
+struct bootlog_event {
+    int64_t ns;
+    char what[56];
+};
+
+struct bootlog {
+    char magic[8];
+    uint32_t next;   // events ever added; the ring keeps the last BOOTLOG_EVENTS
+    uint32_t closed; // set by cmd at its first prompt
+    char pad[48];
+    struct bootlog_event events[BOOTLOG_EVENTS];
+};
+
+#define MAX_SERVICES 64
+#define MAX_DEPS 8
+#define MAX_ARGS 32
+#define SERVICE_NAME_LEN 32
+
+#define SVC_WAITING  0 // for its dependencies
+#define SVC_STARTING 1 // running, not ready yet
+#define SVC_READY    2
+#define SVC_RESTART  3 // exited; starts again at `deadline`
+#define SVC_STOPPING 4 // SIGTERM sent; SIGKILL at `deadline`
+#define SVC_DONE     5 // exited and stays down; counts as ready
+#define SVC_FAILED   6
+
+#define RESTART_NO 0
+#define RESTART_ON_FAILURE 1
+#define RESTART_ALWAYS 2
+
+#define READY_STARTED 0
+#define READY_NOTIFY 1
+#define READY_EXIT 2
+
+#define EV_SIGNALS 0xffffffffu // epoll data for the signalfd; services use their index
+#define EV_FANOTIFY 0xfffffffeu
+
+struct service {
+    char name[SERVICE_NAME_LEN];
+    char exec[256];
+    char* argv[MAX_ARGS + 1]; // into exec
+    char dep_names[MAX_DEPS][SERVICE_NAME_LEN];
+    int dep_required[MAX_DEPS];
+    int deps[MAX_DEPS]; // indexes, -1 for a service that does not exist
+    int ndeps;
+    int restart, ready, stop_timeout_ms;
+    int state;
+    pid_t pid;
+    int ready_fd;       // read end while a Ready=notify service starts
+    long long started, deadline;
+    int quick_exits;
+};
+
+struct service services[MAX_SERVICES];
+int nservices;
+
+#define MAX_CONSOLES 16
+#define EV_CONSOLE 0x10000u // epoll data for console i: EV_CONSOLE + i
+
+struct console {
+    char name[32];        // under /dev; "console" for init's own stdio
+    int lazy;             // waits for a key before starting the shell
+    int fd;               // the tty while waiting for that key, else -1
+    int disabled;         // the tty could not be opened
+    struct termios saved; // its settings, restored before the shell starts
+    pid_t pid;            // its shell, or -1
+    long long started;    // ms, CLOCK_MONOTONIC
+    long long respawn_at; // when to start (or wait for a key) again
+    int quick_exits;      // consecutive exits before RESPAWN_STABLE_MS
+};
+
+struct console consoles[MAX_CONSOLES];
+int nconsoles;
+int shutting_down;
+int epfd = -1;
+struct bootlog* boot_log; // NULL if /run could not hold it
+
+#define PRELOAD_RECORD_SECS 30
+#define PRELOAD_MAX_FILES 2048
+#define PRELOAD_WORKERS 4
+
+struct preload_file {
+    dev_t dev;
+    ino_t ino;
+    char* path;
+};
+
+int fan_fd = -1;             // recording the profile
+long long record_until;      // ms, CLOCK_MONOTONIC
+struct preload_file* recorded; // in order of first open
+int nrecorded;
+
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+long long boottime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void say(const char* msg) {
+    size_t len = strlen(msg);
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, msg, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        msg += n;
+        len -= n;
+    }
+}
+
+// Delay before restarting a process that exited after `lived` ms: none,
+// unless it keeps exiting quickly.
+long long respawn_delay(int* quick, long long lived) {
+    long long delay = 0;
+    if (lived >= RESPAWN_STABLE_MS) *quick = 0;
+    if (*quick > 0) {
+        delay = (long long)RESPAWN_MIN_DELAY_MS << (*quick < 7 ? *quick - 1 : 6);
+        if (delay > RESPAWN_MAX_DELAY_MS) delay = RESPAWN_MAX_DELAY_MS;
+    }
+    (*quick)++;
+    return delay;
+}
+
+// --- Boot timeline ---
+
+void bootlog_add(long long ns, const char* what) {
+    if (!boot_log || __atomic_load_n(&boot_log->closed, __ATOMIC_ACQUIRE)) return;
+    uint32_t i = __atomic_fetch_add(&boot_log->next, 1, __ATOMIC_ACQ_REL) % BOOTLOG_EVENTS;
+    boot_log->events[i].ns = ns;
+    snprintf(boot_log->events[i].what, sizeof(boot_log->events[i].what), "%s", what);
+}
+
+// Picks the initramfs and handoff milestones out of the kernel log, whose
+// "[seconds.micros]" stamps share CLOCK_BOOTTIME's origin.
+void bootlog_kernel() {
+    static const char* const marks[][2] = {
+        { "Trying to unpack rootfs image", "kernel: unpacking initramfs" },
+        { "Unpacking initramfs", "kernel: unpacking initramfs" },
+        { "Freeing initrd memory", "kernel: initramfs unpacked" },
+        { " as init process", "kernel: starting init" },
+    };
+    int size = klogctl(10, NULL, 0); // SYSLOG_ACTION_SIZE_BUFFER
+    if (size <= 0) return;
+    char* buf = malloc(size + 1);
+    if (!buf) return;
+    int len = klogctl(3, buf, size); // SYSLOG_ACTION_READ_ALL
+    buf[len > 0 ? len : 0] = '\0';
+    for (char* line = buf; line && *line; ) {
+        char* end = strchr(line, '\n');
+        if (end) *end = '\0';
+        char* stamp = strchr(line, '[');
+        char* text = stamp ? strchr(stamp, ']') : NULL;
+        if (text) {
+            char* dot;
+            long long sec = strtoll(stamp + 1, &dot, 10);
+            long long usec = *dot == '.' ? strtoll(dot + 1, NULL, 10) : 0;
+            for (size_t m = 0; m < sizeof(marks) / sizeof(marks[0]); m++) {
+                if (strstr(text, marks[m][0])) bootlog_add(sec * 1000000000LL + usec * 1000, marks[m][1]);
+            }
+        }
+        line = end ? end + 1 : NULL;
+    }
+    free(buf);
+}
+
+// Mounts the pseudo filesystems and starts the timeline with the kernel's
+// milestones and `entered`, the uptime at which init began.
+void boot_setup(long long entered) {
+    struct stat root, dev;
+    // The initramfs only has a few static device nodes; devtmpfs has every
+    // tty the consoles may name.
+    if (stat("/", &root) == 0 && stat("/dev", &dev) == 0 && root.st_dev == dev.st_dev) {
+        mount("devtmpfs", "/dev", "devtmpfs", MS_NOSUID, "mode=0755");
+    }
+    mkdir("/proc", 0555);
+    mkdir("/sys", 0555);
+    mkdir("/run", 0755);
+    mount("proc", "/proc", "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL);
+    mount("sysfs", "/sys", "sysfs", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL);
+    mount("tmpfs", "/run", "tmpfs", MS_NOSUID | MS_NODEV, "mode=0755,size=1m");
+    long long mounted = boottime_ns();
+
+    int fd = open(BOOTLOG_PATH, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    if (ftruncate(fd, sizeof(struct bootlog)) == 0) {
+        void* p = mmap(NULL, sizeof(struct bootlog), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            boot_log = p;
+            memcpy(boot_log->magic, BOOTLOG_MAGIC, sizeof(boot_log->magic));
+        }
+    }
+    close(fd);
+    bootlog_kernel();
+    bootlog_add(entered, "init: started");
+    bootlog_add(mounted, "init: /proc, /sys and /run mounted");
+}
+
+// Value of "key=value" on the kernel command line (the last one), or NULL.
+const char* cmdline_value(const char* key, char* buf, size_t len) {
+    const char* value = NULL;
+    size_t key_len = strlen(key);
+    int fd = open("/proc/cmdline", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    ssize_t n = read(fd, buf, len - 1);
+    close(fd);
+    buf[n > 0 ? n : 0] = '\0';
+    for (char* arg = strtok(buf, " \t\n"); arg; arg = strtok(NULL, " \t\n")) {
+        if (strncmp(arg, key, key_len) == 0 && arg[key_len] == '=') value = arg + key_len + 1;
+    }
+    return value;
+}
+
+// --- Boot preload ---
+
+void preload_record_start(int seconds) {
+    char msg[96];
+    fan_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+    if (fan_fd >= 0 && fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN, AT_FDCWD, "/") == 0) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = EV_FANOTIFY;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fan_fd, &ev) == 0) {
+            recorded = calloc(PRELOAD_MAX_FILES, sizeof(*recorded));
+            record_until = now_ms() + seconds * 1000LL;
+            snprintf(msg, sizeof(msg), "Init: recording the boot preload profile for %d s.\n", seconds);
+            say(msg);
+            return;
+        }
+    }
+    snprintf(msg, sizeof(msg), "Init: cannot record a preload profile: %s.\n", strerror(errno));
+    say(msg);
+    if (fan_fd >= 0) close(fan_fd);
+    fan_fd = -1;
+}
+
+// Notes the regular files opened since the last call, once each.
+void preload_record_events() {
+    char buf[8192], link[64], path[4096];
+    ssize_t len;
+    while ((len = read(fan_fd, buf, sizeof(buf))) > 0) {
+        struct fanotify_event_metadata* md = (struct fanotify_event_metadata*)buf;
+        for (; FAN_EVENT_OK(md, len); md = FAN_EVENT_NEXT(md, len)) {
+            if (md->fd < 0) continue; // queue overflow
+            struct stat st;
+            int known = md->pid == getpid() || !recorded || nrecorded == PRELOAD_MAX_FILES ||
+                        fstat(md->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0;
+            for (int i = 0; i < nrecorded && !known; i++) {
+                if (recorded[i].ino == st.st_ino && recorded[i].dev == st.st_dev) known = 1;
+            }
+            snprintf(link, sizeof(link), "/proc/self/fd/%d", md->fd);
+            ssize_t n = known ? -1 : readlink(link, path, sizeof(path) - 1);
+            if (n > 0) {
+                path[n] = '\0';
+                recorded[nrecorded].dev = st.st_dev;
+                recorded[nrecorded].ino = st.st_ino;
+                if ((recorded[nrecorded].path = strdup(path)) != NULL) nrecorded++;
+            }
+            close(md->fd);
+        }
+    }
+}
+
+// Ends the recording: writes "offset length path" for every run of pages
+// of the recorded files now in the page cache, in order of first open.
+void preload_record_finish() {
+    char tmp[256], msg[384];
+    long page = sysconf(_SC_PAGESIZE);
+    long long total = 0;
+    preload_record_events();
+    close(fan_fd);
+    fan_fd = -1;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", PRELOAD_PROFILE);
+    FILE* out = fopen(tmp, "we");
+    if (!out) {
+        snprintf(msg, sizeof(msg), "Init: %s: %s.\n", tmp, strerror(errno));
+        say(msg);
+    } else {
+        fprintf(out, "# TinyDOS boot preload profile: offset length path, in order of first use\n");
+    }
+    for (int i = 0; i < nrecorded; i++) {
+        int fd = out ? open(recorded[i].path, O_RDONLY | O_CLOEXEC) : -1;
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+            size_t pages = (st.st_size + page - 1) / page;
+            unsigned char* vec = malloc(pages);
+            void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (vec && map != MAP_FAILED && mincore(map, st.st_size, vec) == 0) {
+                for (size_t p = 0; p < pages;) {
+                    if (!(vec[p] & 1)) { p++; continue; }
+                    size_t run = p;
+                    while (run < pages && (vec[run] & 1)) run++;
+                    fprintf(out, "%lld %lld %s\n", (long long)p * page, (long long)(run - p) * page, recorded[i].path);
+                    total += (long long)(run - p) * page;
+                    p = run;
+                }
+            }
+            if (map != MAP_FAILED) munmap(map, st.st_size);
+            free(vec);
+        }
+        if (fd >= 0) close(fd);
+        free(recorded[i].path);
+    }
+    free(recorded);
+    recorded = NULL;
+    if (!out) return;
+    if (fclose(out) != 0 || rename(tmp, PRELOAD_PROFILE) != 0) {
+        snprintf(msg, sizeof(msg), "Init: %s: %s.\n", PRELOAD_PROFILE, strerror(errno));
+        unlink(tmp);
+    } else {
+        snprintf(msg, sizeof(msg), "Init: boot preload profile written: %d files, %lld KB.\n", nrecorded, total / 1024);
+    }
+    say(msg);
+    nrecorded = 0;
+}
+
+// Reads the profile's ranges ahead from PRELOAD_WORKERS children, each
+// taking every PRELOAD_WORKERS-th line, and returns without waiting.
+void preload_run(const sigset_t* blocked) {
+    if (access(PRELOAD_PROFILE, R_OK) != 0) return;
+    bootlog_add(boottime_ns(), "init: preload started");
+    for (int w = 0; w < PRELOAD_WORKERS; w++) {
+        if (fork() != 0) continue; // reaped like any other child
+        sigprocmask(SIG_UNBLOCK, blocked, NULL); // or SIGTERM at shutdown waits for SIGKILL
+        char line[4200], path[4096];
+        long long offset, length;
+        FILE* in = fopen(PRELOAD_PROFILE, "re");
+        for (int i = 0; in && fgets(line, sizeof(line), in); i++) {
+            if (i % PRELOAD_WORKERS != w || sscanf(line, "%lld %lld %4095[^\n]", &offset, &length, path) != 3) continue;
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) continue;
+            if (readahead(fd, offset, length) != 0) posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+        _exit(0);
+    }
+}
+
+void preload_start(const sigset_t* blocked) {
+    char cmdline[4096];
+    const char* mode = cmdline_value("tinydos.preload", cmdline, sizeof(cmdline));
+    if (mode && strcmp(mode, "off") == 0) return;
+    if (mode && strncmp(mode, "record", 6) == 0) {
+        // Cold: what the boot reads, not what an old profile read for it.
+        int seconds = mode[6] == ':' ? atoi(mode + 7) : PRELOAD_RECORD_SECS;
+        preload_record_start(seconds > 0 ? seconds : PRELOAD_RECORD_SECS);
+        return;
+    }
+    preload_run(blocked);
+}
+
+// --- Shell ---
+
+void spawn_shell(struct console* c, const sigset_t* blocked) {
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/%s", c->name);
+    pid_t pid = fork();
+    if (pid < 0) {
+        c->respawn_at = now_ms() + FORK_RETRY_MS;
+        return;
+    }
+    if (pid == 0) {
+        char* const args[] = {(char*)SHELL_PATH, NULL};
+        char* const envp[] = { "PATH=/TinyDOS/system32", NULL };
+        sigprocmask(SIG_UNBLOCK, blocked, NULL); // the mask survives execve
+        if (c->lazy) {
+            // A session of its own, owning the tty; a hung shell elsewhere
+            // cannot hold it.
+            setsid();
+            int fd = open(path, O_RDWR | O_NOCTTY);
+            if (fd < 0 || ioctl(fd, TIOCSCTTY, 1) != 0) _exit(1);
+            for (int i = 0; i < 3; i++) dup2(fd, i);
+            if (fd > 2) close(fd);
+        }
+        execve(SHELL_PATH, args, envp);
+        _exit(1);
+    }
+    c->pid = pid;
+    c->started = now_ms();
+    snprintf(path, sizeof(path), "init: shell started on %s", c->name);
+    bootlog_add(boottime_ns(), path);
+}
+
+// Puts a lazy console in wait for a key: raw mode, so one key is enough,
+// and watched by epoll.
+void console_arm(struct console* c, int index) {
+    char path[64], msg[128];
+    snprintf(path, sizeof(path), "/dev/%s", c->name);
+    c->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (c->fd < 0) {
+        snprintf(msg, sizeof(msg), "Init: %s: %s; no shell there.\n", path, strerror(errno));
+        say(msg);
+        c->disabled = 1;
+        return;
+    }
+    struct termios raw;
+    if (tcgetattr(c->fd, &c->saved) == 0) {
+        raw = c->saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(c->fd, TCSANOW, &raw);
+    }
+    tcflush(c->fd, TCIFLUSH);
+    snprintf(msg, sizeof(msg), "\nPress any key to start TinyDOS on %s.\n", c->name);
+    if (write(c->fd, msg, strlen(msg)) < 0) {} // best effort
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = EV_CONSOLE + index;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) != 0) {
+        close(c->fd);
+        c->fd = -1;
+        c->disabled = 1;
+    }
+}
+
+// A key on a waiting console: it is dropped and the shell started.
+void console_woken(struct console* c, const sigset_t* blocked) {
+    if (c->fd < 0) return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    tcflush(c->fd, TCIFLUSH);
+    tcsetattr(c->fd, TCSANOW, &c->saved);
+    spawn_shell(c, blocked); // then close, so the tty is never left unopened
+    close(c->fd);
+    c->fd = -1;
+}
+
+// Reads the console list from the kernel command line.
+void consoles_load() {
+    char cmdline[4096], list[4096];
+    const char* spec = cmdline_value("tinydos.consoles", cmdline, sizeof(cmdline));
+    snprintf(list, sizeof(list), "%s", spec ? spec : CONSOLES_DEFAULT);
+    for (char* name = strtok(list, ","); name && nconsoles < MAX_CONSOLES; name = strtok(NULL, ",")) {
+        if (strncmp(name, "/dev/", 5) == 0) name += 5;
+        if (!*name || strlen(name) >= sizeof(consoles[0].name)) continue;
+        struct console* c = &consoles[nconsoles++];
+        memset(c, 0, sizeof(*c));
+        snprintf(c->name, sizeof(c->name), "%s", name);
+        c->lazy = strcmp(name, "console") != 0;
+        c->fd = -1;
+        c->pid = -1;
+    }
+}
+
+// --- Services ---
+
+void service_add_deps(struct service* s, char* list, int required) {
+    for (char* name = strtok(list, " \t,"); name; name = strtok(NULL, " \t,")) {
+        if (s->ndeps == MAX_DEPS) break;
+        snprintf(s->dep_names[s->ndeps], SERVICE_NAME_LEN, "%s", name);
+        s->dep_required[s->ndeps++] = required;
+    }
+}
+
+// Splits exec into argv in place: words separated by blanks, "..." kept whole.
+int service_split_exec(struct service* s) {
+    int argc = 0;
+    char* p = s->exec;
+    char* out = s->exec;
+    while (*p && argc < MAX_ARGS) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (!*p) break;
+        s->argv[argc++] = out;
+        int quoted = 0;
+        while (*p && (quoted || (*p != ' ' && *p != '\t'))) {
+            if (*p == '"') quoted = !quoted;
+            else *out++ = *p;
+            p++;
+        }
+        if (*p) p++;
+        *out++ = '\0';
+    }
+    s->argv[argc] = NULL;
+    return argc;
+}
+
+int service_load(struct service* s, const char* path) {
+    char line[512];
+    FILE* fp = fopen(path, "re");
+    if (!fp) return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        char* key = line;
+        while (isspace((unsigned char)*key)) key++;
+        if (!*key || *key == ';' || *key == '#' || *key == '[') continue;
+        char* value = strchr(key, '=');
+        if (!value) continue;
+        char* end = value;
+        while (end > key && isspace((unsigned char)end[-1])) end--;
+        *end = '\0';
+        value++;
+        while (isspace((unsigned char)*value)) value++;
+        end = value + strlen(value);
+        while (end > value && isspace((unsigned char)end[-1])) end--;
+        *end = '\0';
+
+        if (strcasecmp(key, "Exec") == 0) snprintf(s->exec, sizeof(s->exec), "%s", value);
+        else if (strcasecmp(key, "After") == 0) service_add_deps(s, value, 0);
+        else if (strcasecmp(key, "Requires") == 0) service_add_deps(s, value, 1);
+        else if (strcasecmp(key, "Restart") == 0) {
+            s->restart = strcasecmp(value, "no") == 0 ? RESTART_NO :
+                         strcasecmp(value, "always") == 0 ? RESTART_ALWAYS : RESTART_ON_FAILURE;
+        } else if (strcasecmp(key, "Ready") == 0) {
+            s->ready = strcasecmp(value, "notify") == 0 ? READY_NOTIFY :
+                       strcasecmp(value, "exit") == 0 ? READY_EXIT : READY_STARTED;
+        } else if (strcasecmp(key, "StopTimeout") == 0) {
+            s->stop_timeout_ms = (int)(atof(value) * 1000);
+        }
+    }
+    fclose(fp);
+    return s->exec[0] ? 0 : -1;
+}
+
+int service_compare(const void* a, const void* b) {
+    return strcasecmp(((const struct service*)a)->name, ((const struct service*)b)->name);
+}
+
+int service_find(const char* name) {
+    for (int i = 0; i < nservices; i++) {
+        if (strcasecmp(services[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Fails the services on a dependency cycle. mark: 0 new, 1 on the current
+// path, 2 done. Returns the service the cycle closes on, or -1.
+int service_check_cycle(int i, char* mark) {
+    if (mark[i] == 1) return i;
+    if (mark[i] == 2) return -1;
+    mark[i] = 1;
+    int head = -1;
+    for (int d = 0; d < services[i].ndeps; d++) {
+        int h = services[i].deps[d] >= 0 ? service_check_cycle(services[i].deps[d], mark) : -1;
+        if (head < 0) head = h;
+    }
+    mark[i] = 2;
+    if (head < 0) return -1;
+    char msg[96];
+    snprintf(msg, sizeof(msg), "Init: service %.31s is on a dependency cycle.\n", services[i].name);
+    say(msg);
+    services[i].state = SVC_FAILED;
+    return head == i ? -1 : head;
+}
+
+void services_load() {
+    DIR* dir = opendir(SERVICE_DIR);
+    struct dirent* entry;
+    char path[512], msg[576];
+    if (!dir) return;
+    while ((entry = readdir(dir)) != NULL && nservices < MAX_SERVICES) {
+        size_t len = strlen(entry->d_name);
+        if (len <= 4 || len - 4 >= SERVICE_NAME_LEN || strcasecmp(entry->d_name + len - 4, ".svc") != 0) continue;
+        struct service* s = &services[nservices];
+        memset(s, 0, sizeof(*s));
+        snprintf(s->name, sizeof(s->name), "%.*s", (int)(len - 4), entry->d_name);
+        s->restart = RESTART_ON_FAILURE;
+        s->stop_timeout_ms = 5000;
+        s->pid = -1;
+        s->ready_fd = -1;
+        snprintf(path, sizeof(path), "%s/%s", SERVICE_DIR, entry->d_name);
+        if (service_load(s, path) != 0) {
+            snprintf(msg, sizeof(msg), "Init: %s: no Exec= line, ignored.\n", path);
+            say(msg);
+            continue;
+        }
+        nservices++;
+    }
+    closedir(dir);
+    qsort(services, nservices, sizeof(services[0]), service_compare);
+
+    for (int i = 0; i < nservices; i++) {
+        struct service* s = &services[i];
+        service_split_exec(s); // argv points into the struct, so not before the sort
+        for (int d = 0; d < s->ndeps; d++) {
+            s->deps[d] = service_find(s->dep_names[d]);
+            if (s->deps[d] < 0 && s->dep_required[d]) {
+                snprintf(msg, sizeof(msg), "Init: service %.31s requires %.31s, which does not exist.\n", s->name, s->dep_names[d]);
+                say(msg);
+                s->state = SVC_FAILED;
+            }
+        }
+    }
+    char mark[MAX_SERVICES] = { 0 };
+    for (int i = 0; i < nservices; i++) service_check_cycle(i, mark);
+}
+
+void bootlog_service(const struct service* s, const char* what) {
+    char event[64];
+    snprintf(event, sizeof(event), "service %.31s %s", s->name, what);
+    bootlog_add(boottime_ns(), event);
+}
+
+void service_start(int i, const sigset_t* blocked) {
+    struct service* s = &services[i];
+    int pipefd[2] = { -1, -1 };
+    if (s->ready == READY_NOTIFY && pipe2(pipefd, O_CLOEXEC) != 0) pipefd[0] = pipefd[1] = -1;
+    pid_t pid = fork();
+    if (pid < 0) {
+        if (pipefd[0] >= 0) { close(pipefd[0]); close(pipefd[1]); }
+        s->state = SVC_RESTART;
+        s->deadline = now_ms() + FORK_RETRY_MS;
+        return;
+    }
+    if (pid == 0) {
+        char* envp[] = { "PATH=/TinyDOS/system32", NULL, NULL };
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd > 0) { dup2(null_fd, STDIN_FILENO); close(null_fd); }
+        if (pipefd[1] >= 0) {
+            if (pipefd[1] == 3) fcntl(3, F_SETFD, 0);
+            else dup2(pipefd[1], 3); // without O_CLOEXEC
+            envp[1] = "READY_FD=3";
+        }
+        setsid();
+        sigprocmask(SIG_UNBLOCK, blocked, NULL);
+        execve(s->argv[0], s->argv, envp);
+        _exit(127);
+    }
+    s->pid = pid;
+    s->started = now_ms();
+    s->state = s->ready == READY_STARTED ? SVC_READY : SVC_STARTING;
+    bootlog_service(s, "started");
+    if (pipefd[0] >= 0) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        close(pipefd[1]);
+        s->ready_fd = pipefd[0];
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->ready_fd, &ev) != 0) {
+            close(s->ready_fd);
+            s->ready_fd = -1;
+            s->state = SVC_READY;
+        }
+    }
+}
+
+// A Ready=notify service wrote to (or closed) its READY_FD.
+void service_notified(int i) {
+    struct service* s = &services[i];
+    char buf[64];
+    if (s->ready_fd < 0) return; // reaped earlier in the same batch
+    ssize_t n = read(s->ready_fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return;
+    close(s->ready_fd);
+    s->ready_fd = -1;
+    if (s->state != SVC_STARTING) return;
+    if (n > 0) {
+        s->state = SVC_READY;
+        bootlog_service(s, "ready");
+    } else if (s->pid > 0) {
+        char msg[96];
+        snprintf(msg, sizeof(msg), "Init: service %.31s closed READY_FD without signalling.\n", s->name);
+        say(msg);
+        kill(s->pid, SIGKILL); // restarted as a failure
+    }
+}
+
+void service_exited(struct service* s, int status) {
+    char msg[128];
+    long long now = now_ms();
+    int failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    if (s->state == SVC_STARTING && s->ready == READY_NOTIFY) failed = 1; // never said it was ready
+    if (s->ready_fd >= 0) {
+        close(s->ready_fd);
+        s->ready_fd = -1;
+    }
+    s->pid = -1;
+    if (shutting_down || s->state == SVC_STOPPING) {
+        s->state = SVC_DONE;
+        return;
+    }
+    if (s->restart == RESTART_ALWAYS || (s->restart == RESTART_ON_FAILURE && failed)) {
+        long long delay = respawn_delay(&s->quick_exits, now - s->started);
+        if (delay > 0) {
+            snprintf(msg, sizeof(msg), "Init: service %.31s keeps exiting; restarting it in %lld ms.\n", s->name, delay);
+            say(msg);
+        }
+        s->state = SVC_RESTART;
+        s->deadline = now + delay;
+        return;
+    }
+    s->state = failed ? SVC_FAILED : SVC_DONE;
+    if (!failed && s->ready == READY_EXIT) bootlog_service(s, "done");
+    if (failed) {
+        if (WIFEXITED(status)) snprintf(msg, sizeof(msg), "Init: service %.31s failed (exit code %d).\n", s->name, WEXITSTATUS(status));
+        else snprintf(msg, sizeof(msg), "Init: service %.31s failed (signal %d).\n", s->name, WTERMSIG(status));
+        say(msg);
+    }
+}
+
+// 1 if s may start, 0 if it must wait, -1 if a required service failed.
+int service_deps_ready(const struct service* s) {
+    int ready = 1;
+    for (int d = 0; d < s->ndeps; d++) {
+        if (s->deps[d] < 0) continue;
+        const struct service* dep = &services[s->deps[d]];
+        if (dep->state == SVC_READY || dep->state == SVC_DONE) continue;
+        if (dep->state == SVC_FAILED) {
+            if (s->dep_required[d]) return -1;
+            continue; // After= only orders
+        }
+        ready = 0;
+    }
+    return ready;
+}
+
+// Starts what can start, restarts what is due, and at shutdown stops each
+// service once nothing running depends on it. Returns the next deadline,
+// or -1 for none.
+long long services_step(const sigset_t* blocked) {
+    long long now = now_ms(), next = -1;
+    int changed = 1;
+    char msg[128];
+    while (changed) {
+        changed = 0;
+        for (int i = 0; i < nservices; i++) {
+            struct service* s = &services[i];
+            if (shutting_down) {
+                if (s->pid <= 0) {
+                    if (s->state != SVC_FAILED) s->state = SVC_DONE;
+                    continue;
+                }
+                if (s->state == SVC_STOPPING) {
+                    if (now >= s->deadline) {
+                        kill(s->pid, SIGKILL);
+                        s->deadline = now + SHUTDOWN_GRACE_MS;
+                    }
+                    continue;
+                }
+                int needed = 0;
+                for (int j = 0; j < nservices && !needed; j++) {
+                    if (services[j].pid <= 0) continue;
+                    for (int d = 0; d < services[j].ndeps; d++) {
+                        if (services[j].deps[d] == i) needed = 1;
+                    }
+                }
+                if (!needed) {
+                    kill(s->pid, SIGTERM);
+                    s->state = SVC_STOPPING;
+                    s->deadline = now + s->stop_timeout_ms;
+                }
+                continue;
+            }
+            if (s->state == SVC_WAITING) {
+                int ready = service_deps_ready(s);
+                if (ready < 0) {
+                    snprintf(msg, sizeof(msg), "Init: service %.31s not started: a required service failed.\n", s->name);
+                    say(msg);
+                    s->state = SVC_FAILED;
+                    changed = 1;
+                } else if (ready) {
+                    service_start(i, blocked);
+                    changed = 1;
+                }
+            } else if (s->state == SVC_RESTART && now >= s->deadline) {
+                service_start(i, blocked);
+                changed = 1;
+            }
+        }
+    }
+    for (int i = 0; i < nservices; i++) {
+        const struct service* s = &services[i];
+        if ((s->state == SVC_RESTART || s->state == SVC_STOPPING) && (next < 0 || s->deadline < next)) next = s->deadline;
+    }
+    return next;
+}
+
+int services_running() {
+    for (int i = 0; i < nservices; i++) {
+        if (services[i].pid > 0) return 1;
+    }
+    return 0;
+}
+
+void reap_children() {
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        struct console* c = NULL;
+        for (int i = 0; i < nconsoles; i++) {
+            if (consoles[i].pid == pid) c = &consoles[i];
+        }
+        if (c) {
+            long long now = now_ms();
+            long long delay = respawn_delay(&c->quick_exits, now - c->started);
+            c->pid = -1;
+            c->respawn_at = now + delay;
+            if (delay > 0 && !shutting_down) {
+                char msg[112];
+                snprintf(msg, sizeof(msg), "Init: %s on %s keeps exiting; restarting it in %lld ms.\n", SHELL_PATH, c->name, delay);
+                say(msg);
+            }
+            continue;
+        }
+        for (int i = 0; i < nservices; i++) {
+            if (services[i].pid == pid) {
+                service_exited(&services[i], status);
+                break;
+            }
+        }
+    }
+}
+
+// Runs once every service has stopped: the rest get SIGTERM, then SIGKILL.
+void shutdown_system() {
+    kill(-1, SIGTERM);
+    long long deadline = now_ms() + SHUTDOWN_GRACE_MS;
+    while (now_ms() < deadline) {
+        pid_t pid;
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {}
+        if (pid < 0 && errno == ECHILD) break;
+        struct timespec pause = { 0, 50 * 1000000 };
+        nanosleep(&pause, NULL);
+    }
+    kill(-1, SIGKILL);
     sync();
     reboot(RB_POWER_OFF);
 }
@@ -17,27 +903,83 @@ int main(int argc, char* argv[]) {
     if (getpid() != 1) {
         return 1;
     }
+    boot_setup(boottime_ns());
 
-    signal(SIGTERM, handle_shutdown_signal);
-    signal(SIGINT, handle_shutdown_signal);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
 
-    while (1) {
-        pid_t pid = fork();
+    int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = EV_SIGNALS;
+    if (sfd < 0 || epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev) != 0) {
+        // PID 1 must not exit: keep a shell running the plain way.
+        say("Init: no signalfd/epoll; services and shutdown signals are disabled.\n");
+        struct console* c = &consoles[0];
+        snprintf(c->name, sizeof(c->name), "console");
+        c->pid = -1;
+        while (1) {
+            if (c->pid < 0) spawn_shell(c, &mask);
+            if (c->pid < 0) sleep(FORK_RETRY_MS / 1000);
+            else if (waitpid(-1, NULL, 0) == c->pid) c->pid = -1;
+        }
+    }
+    preload_start(&mask);
+    services_load();
+    consoles_load();
 
-        if (pid < 0) {
-            sleep(5);
-            continue;
+    while (1) {
+        long long deadline = services_step(&mask);
+        if (shutting_down && !services_running()) shutdown_system();
+        long long now = now_ms();
+        for (int i = 0; i < nconsoles && !shutting_down; i++) {
+            struct console* c = &consoles[i];
+            if (c->pid >= 0 || c->fd >= 0 || c->disabled) continue;
+            if (now >= c->respawn_at) {
+                if (c->lazy) console_arm(c, i);
+                else spawn_shell(c, &mask);
+            }
+            if (c->pid < 0 && c->fd < 0 && !c->disabled && (deadline < 0 || c->respawn_at < deadline)) deadline = c->respawn_at;
+        }
+        if (fan_fd >= 0) {
+            if (now >= record_until) preload_record_finish();
+            else if (deadline < 0 || record_until < deadline) deadline = record_until;
         }
+        int timeout = deadline < 0 ? -1 : deadline > now ? (int)(deadline - now) : 0;
 
-        if (pid == 0) {
-            char* const args[] = {(char*)SHELL_PATH, NULL};
-            char* const envp[] = { "PATH=/TinyDOS/system32", NULL };
-            execve(SHELL_PATH, args, envp);
-            exit(1); 
-        } else {
-            waitpid(pid, NULL, 0);
-            while(waitpid(-1, NULL, WNOHANG) > 0);
-            sleep(2);
+        struct epoll_event events[16];
+        int n = epoll_wait(epfd, events, 16, timeout);
+        for (int i = 0; i < n; i++) {
+            uint32_t what = events[i].data.u32;
+            if (what >= EV_CONSOLE && what < EV_CONSOLE + MAX_CONSOLES) {
+                console_woken(&consoles[what - EV_CONSOLE], &mask);
+                continue;
+            }
+            if (what == EV_FANOTIFY) {
+                if (fan_fd >= 0) preload_record_events();
+                continue;
+            }
+            if (what != EV_SIGNALS) {
+                service_notified(what);
+                continue;
+            }
+            struct signalfd_siginfo si;
+            int child = 0;
+            while (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+                if ((si.ssi_signo == SIGTERM || si.ssi_signo == SIGINT) && !shutting_down) {
+                    say("\nInit: Shutdown signal received. Powering off.\n");
+                    shutting_down = 1;
+                }
+                if (si.ssi_signo == SIGCHLD) child = 1;
+            }
+            // SIGCHLDs coalesce: one may stand for many children.
+            if (child) reap_children();
         }
     }
     return 0;
@@ -11,6 +11,7 @@
  * gcc -static -o cmd cmd.c
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,12 +26,37 @@
 #include <time.h>
 #include <errno.h>
 #include <sys/utsname.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
 
 // --- Definitions ---
 #define CMD_BUF_SIZE 256
 #define MAX_ARGS 32
 #define PATH_MAX_LEN 1024
-#define FILE_BUF_SIZE 4096
+#define FILE_BUF_SIZE (1024 * 1024)
+#define FILE_BUF_ALIGN 4096
+#define COPY_CHUNK_SIZE (64 * 1024 * 1024)
+#define PACK_BUF_SIZE (64 * 1024)
+
+// --- Copy engine ---
+// Methods are tried in this order; each one picks up at the current file
+// offsets if the previous one gave up part-way through.
+enum copy_method { COPY_REFLINK, COPY_RANGE, COPY_SENDFILE, COPY_READWRITE };
+const char* copy_method_names[] = { "reflink (FICLONE)", "copy_file_range", "sendfile", "read/write" };
+
+#define COPY_VERBOSE 0x01
+
+// --- PACK and UNPACK ---
+// Plain ustar (pax headers for long names), one entry at a time: memory is
+// a header plus PACK_BUF_SIZE of file data, whatever the size of the tree.
+struct pack_state {
+    int out_fd;
+    dev_t skip_dev; // the archive being written, and the one it replaces
+    ino_t skip_ino[2];
+    long long files, dirs, bytes_in, bytes_out, errors;
+    int write_error;
+};
 
 /* STACK DEFINITIONS - REMOVED */
 
@@ -41,9 +67,27 @@ void format_path_for_dos(const char* linux_path, char* dos_path_buffer);
 void show_help();
 void show_version();
 void show_about();
-void copy_file(const char* source, const char* dest);
+const char* match_switch(const char* arg, const char* name);
+double elapsed_since(const struct timespec* start);
+void format_rate(double amount, double seconds, const char* unit, char* buf, size_t len);
+int copy_fallback_errno(int err);
+int copy_fd(int in_fd, int out_fd, long long* copied);
+int copy_file(const char* source, const char* dest, int flags);
 void do_dir(const char* path);
 void do_xcopy(const char* source, const char* dest);
+ssize_t read_full(int fd, void* buf, size_t len);
+void pack_write(struct pack_state* p, const void* buf, size_t len);
+void pack_octal(char* field, size_t width, unsigned long long v);
+void pack_pax_record(char* buf, size_t* len, size_t cap, const char* key, const char* value);
+void pack_header(struct pack_state* p, const char* name, const struct stat* st, char type, const char* link, long long size);
+void pack_tree(struct pack_state* p, const char* path, const char* name);
+int do_pack(const char* source, const char* archive);
+int unpack_clean_path(char* path);
+unsigned long long unpack_number(const unsigned char* p, size_t width);
+int unpack_parent(int dest_fd, const char* path, const char** leaf);
+int unpack_skip(int fd, long long len);
+int unpack_entry(int dest_fd, int in_fd, const char* path, const char* link, const unsigned char* h, long long size, long long* left);
+int do_unpack(const char* archive, const char* dest, int list);
 
 // --- Main Program Entry Point ---
 int main() {
@@ -119,8 +163,14 @@ int main() {
                 } else { perror("type"); }
             }
         } else if (strcmp(command, "copy") == 0) {
-            if (args[1] == NULL || args[2] == NULL) printf("Syntax: copy [source] [destination]\n");
-            else copy_file(args[1], args[2]);
+            char* copy_args[2] = { NULL, NULL };
+            int copy_flags = 0, n = 0;
+            for (int j = 1; args[j] != NULL; j++) {
+                if (match_switch(args[j], "V")) copy_flags |= COPY_VERBOSE;
+                else if (n < 2) copy_args[n++] = args[j];
+            }
+            if (n < 2) printf("Syntax: copy [/V] [source] [destination]\n");
+            else copy_file(copy_args[0], copy_args[1], copy_flags);
         } else if (strcmp(command, "xcopy") == 0) {
             if (args[1] == NULL || args[2] == NULL) printf("Syntax: xcopy [source] [destination]\n");
             else do_xcopy(args[1], args[2]);
@@ -142,6 +192,18 @@ int main() {
             } else if (chdir(args[1]) != 0) {
                 perror("cd");
             }
+        } else if (strcmp(command, "pack") == 0) {
+            if (args[1] == NULL || args[2] == NULL) printf("Syntax: pack [dir] [archive]\n");
+            else do_pack(args[1], args[2]);
+        } else if (strcmp(command, "unpack") == 0) {
+            char* unpack_args[2] = { NULL, "." };
+            int list = 0, n = 0;
+            for (int j = 1; args[j] != NULL; j++) {
+                if (match_switch(args[j], "L")) list = 1;
+                else if (n < 2) unpack_args[n++] = args[j];
+            }
+            if (n < 1) printf("Syntax: unpack [/L] [archive] [dir]\n");
+            else do_unpack(unpack_args[0], unpack_args[1], list);
         } else if (strcmp(command, "dir") == 0) {
             do_dir(args[1] == NULL ? "." : args[1]);
         } else if (strcmp(command, "reboot") == 0) {
@@ -216,8 +278,10 @@ void show_help() {
     printf("  MD/MKDIR [path]        Creates a directory.\n");
     printf("  RD/RMDIR [path]        Removes an empty directory.\n");
     printf("  TYPE [file]            Displays a file's content.\n");
-    printf("  COPY [src] [dst]       Copies a single file.\n");
+    printf("  COPY [/V] [src] [dst]  Copies a single file (/V shows the copy method).\n");
     printf("  XCOPY [src] [dst]      Copies files and directory trees.\n");
+    printf("  PACK [dir] [arc]       Packs a directory tree into a tar archive.\n");
+    printf("  UNPACK [arc] [dir]     Unpacks a tar archive (/L lists it).\n");
     printf("  DEL/ERASE [file]       Deletes a file.\n");
     printf("  REN/MOVE [src] [dst]   Renames or moves a file/directory.\n");
     printf("  REBOOT                 Restarts the system.\n");
@@ -239,21 +303,118 @@ void show_version() {
     }
 }
 
-void copy_file(const char* source, const char* dest) {
-    FILE *f_source, *f_dest;
-    char buffer[FILE_BUF_SIZE];
-    size_t bytes;
-    f_source = fopen(source, "rb");
-    if (!f_source) { perror("copy: source"); return; }
-    f_dest = fopen(dest, "wb");
-    if (!f_dest) { perror("copy: destination"); fclose(f_source); return; }
-    while ((bytes = fread(buffer, 1, FILE_BUF_SIZE, f_source)) > 0) {
-        if (fwrite(buffer, 1, bytes, f_dest) != bytes) {
-            perror("copy: write error"); break;
+// Returns the text after "/NAME:" ("" for a bare "/NAME"), or NULL if arg is
+// not that switch. Switch names are matched case-insensitively.
+const char* match_switch(const char* arg, const char* name) {
+    if (arg == NULL || arg[0] != '/') return NULL;
+    size_t len = strlen(name);
+    if (strncasecmp(arg + 1, name, len) != 0) return NULL;
+    if (arg[len + 1] == '\0') return arg + len + 1;
+    if (arg[len + 1] == ':') return arg + len + 2;
+    return NULL;
+}
+
+double elapsed_since(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void format_rate(double amount, double seconds, const char* unit, char* buf, size_t len) {
+    const char* prefixes[] = { "", "K", "M", "G", "T" };
+    double rate = seconds > 0 ? amount / seconds : 0;
+    int p = 0;
+    while (rate >= 1024 && p < 4) { rate /= 1024; p++; }
+    snprintf(buf, len, "%.1f %s%s/s", rate, prefixes[p], unit);
+}
+
+// Errors that mean "this method is not available here", as opposed to a real
+// I/O failure that should abort the copy.
+int copy_fallback_errno(int err) {
+    return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP ||
+           err == ENOTTY || err == EBADF || err == EPERM || err == ETXTBSY;
+}
+
+// Copies in_fd to out_fd from their current offsets. Returns the copy_method
+// that finished the job, or -1 with errno set.
+int copy_fd(int in_fd, int out_fd, long long* copied) {
+    static char* rw_buf = NULL;
+    ssize_t n;
+    *copied = 0;
+
+    // 1. Reflink: shares extents on btrfs/xfs, no data is moved at all.
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+        struct stat st;
+        if (fstat(out_fd, &st) == 0) *copied = st.st_size;
+        return COPY_REFLINK;
+    }
+
+    // 2. copy_file_range: in-kernel copy, may still reflink or offload.
+    while ((n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, 0)) > 0) *copied += n;
+    if (n == 0 && *copied > 0) return COPY_RANGE;
+    if (n < 0 && !copy_fallback_errno(errno)) return -1;
+
+    // 3. sendfile: page cache to page cache, still no user-space copy.
+    long long before = *copied;
+    while ((n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK_SIZE)) > 0) *copied += n;
+    if (n == 0 && *copied > before) return COPY_SENDFILE;
+    if (n < 0 && !copy_fallback_errno(errno)) return -1;
+
+    // 4. Plain read/write through one large aligned buffer. Pseudo-files
+    //    (e.g. /proc) that report a size of 0 always end up here.
+    if (rw_buf == NULL && posix_memalign((void**)&rw_buf, FILE_BUF_ALIGN, FILE_BUF_SIZE) != 0) {
+        rw_buf = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+    while ((n = read(in_fd, rw_buf, FILE_BUF_SIZE)) > 0) {
+        char* p = rw_buf;
+        while (n > 0) {
+            ssize_t w = write(out_fd, p, n);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            p += w; n -= w; *copied += w;
         }
     }
-    fclose(f_source); fclose(f_dest);
-    printf("  1 file(s) copied.\n");
+    return n < 0 ? -1 : COPY_READWRITE;
+}
+
+// Copies one file, preserving its mode and modification time.
+// Returns 0 on success, -1 on failure (already reported).
+int copy_file(const char* source, const char* dest, int flags) {
+    struct stat src_st, dst_st;
+    struct timespec start;
+    long long copied = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int in_fd = open(source, O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0) { perror("copy: source"); return -1; }
+    if (fstat(in_fd, &src_st) != 0) { perror("copy: source"); close(in_fd); return -1; }
+    if (stat(dest, &dst_st) == 0 && dst_st.st_dev == src_st.st_dev && dst_st.st_ino == src_st.st_ino) {
+        fprintf(stderr, "copy: %s: file cannot be copied onto itself\n", source);
+        close(in_fd);
+        return -1;
+    }
+    int out_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (out_fd < 0) { perror("copy: destination"); close(in_fd); return -1; }
+
+    int method = copy_fd(in_fd, out_fd, &copied);
+    if (method < 0) perror("copy: write error");
+
+    struct timespec times[2] = { src_st.st_atim, src_st.st_mtim };
+    fchmod(out_fd, src_st.st_mode & 07777);
+    futimens(out_fd, times);
+    close(in_fd);
+    if (close(out_fd) != 0 && method >= 0) { perror("copy: destination"); method = -1; }
+    if (method < 0) return -1;
+
+    char rate[32];
+    format_rate((double)copied, elapsed_since(&start), "B", rate, sizeof(rate));
+    printf("        1 file(s) copied, %lld bytes (%s).\n", copied, rate);
+    if (flags & COPY_VERBOSE) printf("        Method: %s\n", copy_method_names[method]);
+    return 0;
 }
 
 void do_xcopy(const char* source, const char* dest) {
@@ -273,7 +434,7 @@ void do_xcopy(const char* source, const char* dest) {
         }
         closedir(dir);
     } else {
-        copy_file(source, dest);
+        copy_file(source, dest, 0);
     }
 }
 
@@ -322,3 +483,471 @@ void do_dir(const char* path) {
     printf("\n%15d File(s) %15lld bytes\n", file_count, total_size);
     printf("%15d Dir(s)\n", dir_count);
 }
+
+// --- PACK and UNPACK ---
+// The tiny build has neither zlib nor threads, so PACK writes a plain
+// ustar archive and UNPACK reads one; the full build's PACK writes the same
+// format for a "x.tar" name. Entries are streamed through one static
+// buffer, so memory does not grow with the tree or the files in it.
+
+char pack_buf[PACK_BUF_SIZE];
+
+ssize_t read_full(int fd, void* buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, (char*)buf + got, len - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        got += n;
+    }
+    return got;
+}
+
+void pack_write(struct pack_state* p, const void* buf, size_t len) {
+    const char* c = buf;
+    while (len > 0 && !p->write_error) {
+        ssize_t w = write(p->out_fd, c, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) { p->write_error = errno; return; }
+        c += w; len -= w; p->bytes_out += w;
+    }
+}
+
+void pack_octal(char* field, size_t width, unsigned long long v) {
+    field[width - 1] = '\0';
+    for (size_t i = width - 1; i-- > 0; v >>= 3) field[i] = '0' + (v & 7);
+}
+
+// Appends "len key=value\n", where len counts the whole record.
+void pack_pax_record(char* buf, size_t* len, size_t cap, const char* key, const char* value) {
+    size_t body = strlen(key) + strlen(value) + 3, total = body + 1;
+    while (total != body + (size_t)snprintf(NULL, 0, "%zu", total)) total = body + snprintf(NULL, 0, "%zu", total);
+    if (*len + total < cap) *len += snprintf(buf + *len, cap - *len, "%zu %s=%s\n", total, key, value);
+}
+
+// Writes a ustar header, preceded by a pax header when the path, link
+// target or size do not fit its fixed fields.
+void pack_header(struct pack_state* p, const char* name, const struct stat* st, char type, const char* link, long long size) {
+    char h[512], full[PATH_MAX_LEN + 1];
+    char pax[3 * PATH_MAX_LEN];
+    size_t pax_len = 0, nlen, split = 0;
+
+    snprintf(full, sizeof(full), "%s%s", name, type == '5' ? "/" : "");
+    nlen = strlen(full);
+    if (nlen > 100) {
+        // prefix (155) + '/' + name (100), split at a slash.
+        for (size_t i = nlen - 1; i > 0 && !split; i--) {
+            if (full[i] == '/' && i <= 155 && nlen - i - 1 <= 100 && nlen - i - 1 > 0) split = i;
+        }
+        if (!split) pack_pax_record(pax, &pax_len, sizeof(pax), "path", full);
+    }
+    if (link && strlen(link) > 100) pack_pax_record(pax, &pax_len, sizeof(pax), "linkpath", link);
+    if (size >= 077777777777LL) {
+        char num[24];
+        snprintf(num, sizeof(num), "%lld", size);
+        pack_pax_record(pax, &pax_len, sizeof(pax), "size", num);
+    }
+    if (pax_len > 0) {
+        struct stat xst;
+        memset(&xst, 0, sizeof(xst));
+        xst.st_mode = 0644;
+        xst.st_mtime = st->st_mtime;
+        pack_header(p, "././@PaxHeader", &xst, 'x', NULL, pax_len);
+        memset(pax + pax_len, 0, (512 - pax_len % 512) % 512);
+        pack_write(p, pax, pax_len + (512 - pax_len % 512) % 512);
+    }
+
+    memset(h, 0, sizeof(h));
+    if (split) {
+        memcpy(h + 345, full, split);
+        memcpy(h, full + split + 1, nlen - split - 1);
+    } else {
+        memcpy(h, full, nlen < 100 ? nlen : 100);
+    }
+    pack_octal(h + 100, 8, st->st_mode & 07777);
+    pack_octal(h + 108, 8, st->st_uid <= 07777777 ? st->st_uid : 0);
+    pack_octal(h + 116, 8, st->st_gid <= 07777777 ? st->st_gid : 0);
+    pack_octal(h + 124, 12, size < 077777777777LL ? size : 0);
+    pack_octal(h + 136, 12, st->st_mtime > 0 ? st->st_mtime : 0);
+    h[156] = type;
+    if (link) memcpy(h + 157, link, strlen(link) < 100 ? strlen(link) : 100);
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memset(h + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < 512; i++) sum += (unsigned char)h[i];
+    snprintf(h + 148, 8, "%06o", sum);
+    pack_write(p, h, sizeof(h));
+}
+
+// Adds path to the archive as name ("" for the root, which gets no entry
+// of its own). Directories are read in sorted order so that archives of
+// the same tree are identical.
+void pack_tree(struct pack_state* p, const char* path, const char* name) {
+    struct stat st;
+    char link[PATH_MAX_LEN];
+
+    if (p->write_error) return;
+    if (lstat(path, &st) != 0) {
+        fprintf(stderr, "pack: %s: %s\n", path, strerror(errno));
+        p->errors++;
+        return;
+    }
+    if (st.st_dev == p->skip_dev && (st.st_ino == p->skip_ino[0] || st.st_ino == p->skip_ino[1])) return;
+
+    if (S_ISDIR(st.st_mode)) {
+        struct dirent** names;
+        if (name[0]) {
+            pack_header(p, name, &st, '5', NULL, 0);
+            p->dirs++;
+        }
+        int n = scandir(path, &names, NULL, alphasort);
+        if (n < 0) {
+            fprintf(stderr, "pack: %s: %s\n", path, strerror(errno));
+            p->errors++;
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            const char* d = names[i]->d_name;
+            char child_path[PATH_MAX_LEN], child_name[PATH_MAX_LEN];
+            if (strcmp(d, ".") != 0 && strcmp(d, "..") != 0 &&
+                snprintf(child_path, sizeof(child_path), "%s/%s", path, d) < (int)sizeof(child_path) &&
+                snprintf(child_name, sizeof(child_name), "%s%s%s", name, name[0] ? "/" : "", d) < (int)sizeof(child_name)) {
+                pack_tree(p, child_path, child_name);
+            }
+            free(names[i]);
+        }
+        free(names);
+    } else if (S_ISLNK(st.st_mode)) {
+        ssize_t n = readlink(path, link, sizeof(link) - 1);
+        if (n < 0) {
+            fprintf(stderr, "pack: %s: %s\n", path, strerror(errno));
+            p->errors++;
+            return;
+        }
+        link[n] = '\0';
+        pack_header(p, name, &st, '2', link, 0);
+        p->files++;
+    } else if (S_ISREG(st.st_mode)) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "pack: %s: %s\n", path, strerror(errno));
+            p->errors++;
+            return;
+        }
+        // The header promises st_size bytes: a file that shrinks while it
+        // is read is padded with zeros, one that grows is cut.
+        pack_header(p, name, &st, '0', NULL, st.st_size);
+        long long left = st.st_size;
+        while (left > 0 && !p->write_error) {
+            ssize_t n = read_full(fd, pack_buf, left < PACK_BUF_SIZE ? left : PACK_BUF_SIZE);
+            if (n <= 0) {
+                fprintf(stderr, "pack: %s: %s\n", path, n < 0 ? strerror(errno) : "file shrank while packing");
+                p->errors++;
+                memset(pack_buf, 0, PACK_BUF_SIZE);
+                while (left > 0) {
+                    size_t z = left < PACK_BUF_SIZE ? left : PACK_BUF_SIZE;
+                    pack_write(p, pack_buf, z);
+                    left -= z;
+                }
+                break;
+            }
+            pack_write(p, pack_buf, n);
+            left -= n;
+        }
+        memset(pack_buf, 0, 512);
+        pack_write(p, pack_buf, (512 - st.st_size % 512) % 512);
+        p->files++;
+        p->bytes_in += st.st_size;
+        close(fd);
+    } else {
+        fprintf(stderr, "pack: %s: not a file, directory or link, skipped\n", path);
+        p->errors++;
+    }
+}
+
+// Packs the tree under source into archive, via "archive.tmp" so that a
+// failed run leaves no partial archive behind. Returns 0 on success.
+int do_pack(const char* source, const char* archive) {
+    struct pack_state p;
+    struct timespec start;
+    struct stat st;
+    char tmp[PATH_MAX_LEN];
+
+    if (stat(source, &st) != 0) { fprintf(stderr, "pack: %s: %s\n", source, strerror(errno)); return -1; }
+    if (!S_ISDIR(st.st_mode)) { fprintf(stderr, "pack: %s: not a directory\n", source); return -1; }
+    memset(&p, 0, sizeof(p));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", archive);
+    if ((p.out_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        fprintf(stderr, "pack: %s: %s\n", archive, strerror(errno));
+        return -1;
+    }
+    if (fstat(p.out_fd, &st) == 0) { p.skip_dev = st.st_dev; p.skip_ino[0] = st.st_ino; }
+    if (stat(archive, &st) == 0 && st.st_dev == p.skip_dev) p.skip_ino[1] = st.st_ino;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pack_tree(&p, source, "");
+    memset(pack_buf, 0, 1024);
+    pack_write(&p, pack_buf, 1024); // end of archive: two zero blocks
+    if (close(p.out_fd) != 0 && !p.write_error) p.write_error = errno;
+    if (p.write_error || rename(tmp, archive) != 0) {
+        fprintf(stderr, "pack: %s: %s\n", archive, strerror(p.write_error ? p.write_error : errno));
+        unlink(tmp);
+        return -1;
+    }
+    double secs = elapsed_since(&start);
+
+    char rate[32];
+    format_rate((double)p.bytes_in, secs, "B", rate, sizeof(rate));
+    printf("%8lld File(s), %lld dir(s), %lld bytes packed into %lld bytes in %.2f s (%s).\n",
+           p.files, p.dirs, p.bytes_in, p.bytes_out, secs, rate);
+    if (p.errors > 0) printf("%8lld error(s).\n", p.errors);
+    return p.errors > 0 ? -1 : 0;
+}
+
+// Makes an archive path relative: strips leading "/" and "./" and trailing
+// slashes. Returns -1 for paths with a ".." component.
+int unpack_clean_path(char* path) {
+    char* p = path;
+    for (;;) {
+        if (*p == '/') p++;
+        else if (p[0] == '.' && p[1] == '/') p += 2;
+        else break;
+    }
+    memmove(path, p, strlen(p) + 1);
+    size_t n = strlen(path);
+    while (n > 0 && path[n - 1] == '/') path[--n] = '\0';
+    if (strcmp(path, ".") == 0) path[0] = '\0';
+    for (const char* c = path; *c;) {
+        size_t len = strcspn(c, "/");
+        if (len == 2 && c[0] == '.' && c[1] == '.') return -1;
+        c += len;
+        if (*c) c++;
+    }
+    return 0;
+}
+
+// A tar number field: octal, or base-256 when the top bit is set.
+unsigned long long unpack_number(const unsigned char* p, size_t width) {
+    unsigned long long v = 0;
+    if (p[0] & 0x80) {
+        v = p[0] & 0x7f;
+        for (size_t i = 1; i < width; i++) v = (v << 8) | p[i];
+        return v;
+    }
+    size_t i = 0;
+    while (i < width && p[i] == ' ') i++;
+    for (; i < width && p[i] >= '0' && p[i] <= '7'; i++) v = (v << 3) | (p[i] - '0');
+    return v;
+}
+
+// Opens the directory part of path below dest_fd one component at a time,
+// without following symlinks (so no entry lands outside the destination)
+// and creating what is missing. *leaf is set to the last component; the
+// caller closes the result unless it is dest_fd.
+int unpack_parent(int dest_fd, const char* path, const char** leaf) {
+    const char* slash = strrchr(path, '/');
+    const char* end = slash ? slash : path;
+    char comp[PATH_MAX_LEN];
+    int fd = dest_fd;
+
+    *leaf = slash ? slash + 1 : path;
+    for (const char* c = path; c < end;) {
+        size_t len = strcspn(c, "/");
+        memcpy(comp, c, len);
+        comp[len] = '\0';
+        c += len + 1;
+        if (len == 0) continue;
+        int next = openat(fd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (next < 0 && errno == ENOENT && mkdirat(fd, comp, 0755) == 0) {
+            next = openat(fd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        if (fd != dest_fd) close(fd);
+        if (next < 0) return -1;
+        fd = next;
+    }
+    return fd;
+}
+
+int unpack_skip(int fd, long long len) {
+    while (len > 0) {
+        ssize_t n = read_full(fd, pack_buf, len < PACK_BUF_SIZE ? len : PACK_BUF_SIZE);
+        if (n <= 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// Creates one entry below dest_fd. A regular file's data is read from
+// in_fd; *left is set to how much of it was not. Returns 0, or -1 with
+// errno set.
+int unpack_entry(int dest_fd, int in_fd, const char* path, const char* link, const unsigned char* h, long long size, long long* left) {
+    const char* leaf;
+    char type = h[156];
+    mode_t mode = unpack_number(h + 100, 8) & 07777;
+    time_t mtime = unpack_number(h + 136, 12);
+    struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+    int rc = -1;
+
+    *left = size;
+    int dir = unpack_parent(dest_fd, path, &leaf);
+    if (dir < 0) return -1;
+    if (type == '5') {
+        if ((mkdirat(dir, leaf, 0700) == 0 || errno == EEXIST) && fchmodat(dir, leaf, mode | 0700, 0) == 0) rc = 0; // keep filling it
+    } else if (unlinkat(dir, leaf, 0) == 0 || errno == ENOENT) { // replaced, never written through
+        if (type == '2') {
+            if (symlinkat(link, dir, leaf) == 0) {
+                utimensat(dir, leaf, times, AT_SYMLINK_NOFOLLOW);
+                rc = 0;
+            }
+        } else {
+            int out_fd = openat(dir, leaf, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+            if (out_fd >= 0) {
+                rc = 0;
+                while (*left > 0 && rc == 0) {
+                    ssize_t n = read_full(in_fd, pack_buf, *left < PACK_BUF_SIZE ? *left : PACK_BUF_SIZE);
+                    if (n <= 0) break; // the caller finds the archive cut short
+                    for (ssize_t w = 0, m; w < n && rc == 0; w += m) {
+                        while ((m = write(out_fd, pack_buf + w, n - w)) < 0 && errno == EINTR) {}
+                        if (m < 0) rc = -1;
+                    }
+                    *left -= n;
+                }
+                int err = errno;
+                fchmod(out_fd, mode);
+                futimens(out_fd, times);
+                if (close(out_fd) != 0 && rc == 0) rc = -1;
+                else errno = err;
+            }
+        }
+    }
+    if (dir != dest_fd) {
+        int err = errno;
+        close(dir);
+        errno = err;
+    }
+    return rc;
+}
+
+// Unpacks (or with list, lists) a ustar archive into dest. pax and GNU
+// headers for long names and sizes are honoured; compressed archives need the full
+// build. Returns 0 on success.
+int do_unpack(const char* archive, const char* dest, int list) {
+    unsigned char h[512];
+    char path[PATH_MAX_LEN], link[PATH_MAX_LEN], name[PATH_MAX_LEN];
+    char next_path[PATH_MAX_LEN] = "", next_link[PATH_MAX_LEN] = "";
+    long long next_size = -1, headers = 0, files = 0, dirs = 0, bytes = 0, errors = 0;
+    const char* bad = NULL; // why the archive could not be read to its end
+    struct timespec start;
+    int dest_fd = -1;
+    ssize_t n;
+
+    int in_fd = open(archive, O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0) { fprintf(stderr, "unpack: %s: %s\n", archive, strerror(errno)); return -1; }
+    if (!list) {
+        if (mkdir(dest, 0755) != 0 && errno != EEXIST) {}
+        if ((dest_fd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "unpack: %s: %s\n", dest, strerror(errno));
+            close(in_fd);
+            return -1;
+        }
+    }
+
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!bad) {
+        if ((n = read_full(in_fd, h, sizeof(h))) != (ssize_t)sizeof(h)) {
+            bad = n < 0 ? strerror(errno) : n == 0 && headers == 0 ? "empty archive" : "unexpected end of archive";
+            break;
+        }
+        unsigned int sum = 0;
+        int zero = 1;
+        for (int i = 0; i < 512; i++) {
+            sum += (i >= 148 && i < 156) ? ' ' : h[i];
+            if (h[i]) zero = 0;
+        }
+        if (zero) break; // end of archive
+        if (h[0] == 0x1f && h[1] == 0x8b) { bad = "compressed archives need the full build"; break; }
+        if (sum != unpack_number(h + 148, 8)) { bad = "not a tar archive (bad header checksum)"; break; }
+        headers++;
+        long long size = next_size >= 0 ? next_size : (long long)unpack_number(h + 124, 12);
+        long long pad = (512 - size % 512) % 512, left = size;
+        char type = h[156];
+
+        if (type == 'x') { // pax header: "len key=value\n" records for the next entry
+            if (size >= PACK_BUF_SIZE) { bad = "oversized extended header"; break; }
+            if (read_full(in_fd, pack_buf, size + pad) != size + pad) { bad = "unexpected end of archive"; break; }
+            for (const char* p = pack_buf; p < pack_buf + size;) {
+                char* q;
+                long len = strtol(p, &q, 10);
+                if (len <= 0 || p + len > pack_buf + size || *q != ' ') break;
+                const char* key = q + 1;
+                const char* eq = memchr(key, '=', p + len - key);
+                if (eq) {
+                    int vlen = (int)(p + len - eq - 2); // without '=' and '\n'
+                    if (strncmp(key, "path=", 5) == 0) snprintf(next_path, sizeof(next_path), "%.*s", vlen, eq + 1);
+                    else if (strncmp(key, "linkpath=", 9) == 0) snprintf(next_link, sizeof(next_link), "%.*s", vlen, eq + 1);
+                    else if (strncmp(key, "size=", 5) == 0) next_size = atoll(eq + 1);
+                }
+                p += len;
+            }
+            continue;
+        }
+        if (type == 'L' || type == 'K') { // GNU long name or link target for the next entry
+            if (size >= PATH_MAX_LEN) { bad = "oversized extended header"; break; }
+            if (read_full(in_fd, pack_buf, size + pad) != size + pad) { bad = "unexpected end of archive"; break; }
+            snprintf(type == 'L' ? next_path : next_link, PATH_MAX_LEN, "%.*s", (int)size, pack_buf);
+            continue;
+        }
+        if (next_path[0]) snprintf(path, sizeof(path), "%s", next_path);
+        else if (h[345]) snprintf(path, sizeof(path), "%.155s/%.100s", (const char*)h + 345, (const char*)h);
+        else snprintf(path, sizeof(path), "%.100s", (const char*)h);
+        if (next_link[0]) snprintf(link, sizeof(link), "%s", next_link);
+        else snprintf(link, sizeof(link), "%.100s", (const char*)h + 157);
+        next_path[0] = next_link[0] = '\0';
+        next_size = -1;
+
+        int is_file = type == '0' || type == '\0' || type == '7';
+        if (type == 'g') { // global pax header: not used
+        } else if (type != '5' && type != '2' && !is_file) {
+            fprintf(stderr, "unpack: %s: unsupported entry type '%c', skipped\n", path, type);
+            errors++;
+        } else if (unpack_clean_path(path) != 0) {
+            fprintf(stderr, "unpack: %s: path leads outside the destination, skipped\n", path);
+            errors++;
+        } else if (!path[0]) { // the root itself
+        } else if (list) {
+            format_path_for_dos(path, name);
+            if (type == '5') printf("    <DIR>          %s\n", name);
+            else printf("%14lld     %s\n", is_file ? size : 0LL, name);
+            if (type == '5') dirs++;
+            else files++;
+            if (is_file) bytes += size;
+        } else if (unpack_entry(dest_fd, in_fd, path, link, h, is_file ? size : 0, &left) != 0) {
+            fprintf(stderr, "unpack: %s: %s\n", path, strerror(errno));
+            errors++;
+        } else if (left > 0) {
+            bad = "unexpected end of archive";
+            break;
+        } else if (type == '5') {
+            dirs++;
+        } else {
+            files++;
+            if (is_file) bytes += size;
+        }
+        if (!is_file) left = size; // data of anything but a file is skipped
+        if (unpack_skip(in_fd, left + pad) != 0) bad = "unexpected end of archive";
+    }
+    if (bad) fprintf(stderr, "unpack: %s: %s\n", archive, bad);
+    double secs = elapsed_since(&start);
+    if (dest_fd >= 0) close(dest_fd);
+    close(in_fd);
+
+    char rate[32];
+    format_rate((double)bytes, secs, "B", rate, sizeof(rate));
+    printf("%8lld File(s), %lld dir(s), %lld bytes %s in %.2f s (%s).\n",
+           files, dirs, bytes, list ? "listed" : "unpacked", secs, rate);
+    if (errors > 0) printf("%8lld error(s).\n", errors);
+    return bad || errors > 0 ? -1 : 0;
+}